@@ -1,12 +1,17 @@
-#include <QLabel>
 #include <QKeyEvent>
+#include <QPainter>
 #include <QDebug>
+#include <cmath>
+#include <algorithm>
 #include "ImageViewControls.h"
+#include "TiledImage.h"
 
 ImageViewControls::ImageViewControls(QWidget *parent) :
-	QLabel(parent) {
+	QWidget(parent), tiles(0), scale(1), offset(0, 0), dragging(false) {
 
 	this->setFocusPolicy(Qt::ClickFocus);
+	this->setAttribute(Qt::WA_OpaquePaintEvent);
+	this->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
 
 }
 
@@ -14,6 +19,150 @@ ImageViewControls::~ImageViewControls() {
 
 }
 
+void ImageViewControls::setImage(const QImage &image) {
+	setImage(image, image.rect());
+}
+
+void ImageViewControls::setImage(const QImage &image, const QRect &dirty) {
+	bool resized = image.size() != img.size();
+	if (image.format() == QImage::Format_RGB32 ||
+			image.format() == QImage::Format_ARGB32_Premultiplied) {
+		img = image;
+	} else {
+		img = image.convertToFormat(QImage::Format_RGB32);
+	}
+	if (resized) {
+		updateGeometry();
+		update();
+	} else {
+		update(imageToWidget(dirty));
+	}
+}
+
+const QImage &ImageViewControls::image() const {
+	return img;
+}
+
+void ImageViewControls::setTiledImage(TiledImage *tiles) {
+	this->tiles = tiles;
+	offset = QPoint(0, 0);
+	scale = 1;
+	if (tiles && tiles->isValid()) {
+		// Start zoomed out to fit the widget
+		QSize full = tiles->size();
+		scale = std::min(1.0, std::min((double) width() / full.width(),
+									   (double) height() / full.height()));
+	}
+	update();
+}
+
+QSize ImageViewControls::sizeHint() const {
+	if (tiles) { return QSize(512, 512); }
+	return img.size();
+}
+
+void ImageViewControls::resetView() {
+	scale = 1;
+	offset = QPoint(0, 0);
+	update();
+}
+
+QRect ImageViewControls::imageToWidget(const QRect &r) const {
+	int x0 = (int) std::floor(r.left() * scale) + offset.x();
+	int y0 = (int) std::floor(r.top() * scale) + offset.y();
+	int x1 = (int) std::ceil((r.right() + 1) * scale) + offset.x();
+	int y1 = (int) std::ceil((r.bottom() + 1) * scale) + offset.y();
+	return QRect(x0, y0, x1 - x0, y1 - y0);
+}
+
+void ImageViewControls::paintEvent(QPaintEvent *ev) {
+	QPainter painter(this);
+	QRect area = ev->rect();
+	painter.fillRect(area, Qt::darkGray);
+	if (tiles) {
+		paintTiles(painter, area);
+		return;
+	}
+	if (img.isNull()) { return; }
+
+	// Map the exposed area back into image space and draw just that part.
+	// With no smoothing hint the raster engine samples the source directly.
+	QRect target = imageToWidget(img.rect()).intersected(area);
+	if (target.isEmpty()) { return; }
+	QRectF source((target.left() - offset.x()) / scale,
+				  (target.top() - offset.y()) / scale,
+				  target.width() / scale,
+				  target.height() / scale);
+	painter.drawImage(QRectF(target), img, source);
+}
+
+void ImageViewControls::paintTiles(QPainter &painter, const QRect &area) {
+	if (!tiles->isValid()) { return; }
+	const int T = TiledImage::TILE_SIZE;
+	int level = tiles->levelForScale(scale);
+	double level_scale = scale * (1 << level);
+	QSize ls = tiles->levelSize(level);
+
+	// Range of tiles overlapping the exposed area
+	int tx0 = std::max(0, (int) std::floor((area.left() - offset.x()) / level_scale / T));
+	int ty0 = std::max(0, (int) std::floor((area.top() - offset.y()) / level_scale / T));
+	int tx1 = std::min((ls.width() - 1) / T,
+					   (int) std::floor((area.right() + 1 - offset.x()) / level_scale / T));
+	int ty1 = std::min((ls.height() - 1) / T,
+					   (int) std::floor((area.bottom() + 1 - offset.y()) / level_scale / T));
+
+	for (int ty = ty0; ty <= ty1; ++ty) {
+		for (int tx = tx0; tx <= tx1; ++tx) {
+			QImage t = tiles->tile(level, tx, ty);
+			if (t.isNull()) { continue; }
+			QRectF target(offset.x() + tx * T * level_scale,
+						  offset.y() + ty * T * level_scale,
+						  t.width() * level_scale, t.height() * level_scale);
+			painter.drawImage(target, t, QRectF(t.rect()));
+		}
+	}
+}
+
+void ImageViewControls::wheelEvent(QWheelEvent *ev) {
+	if (img.isNull() && !tiles) { return; }
+	double steps = ev->angleDelta().y() / 120.0;
+	double new_scale = scale * std::pow(1.25, steps);
+	if (new_scale < 1.0 / 64) { new_scale = 1.0 / 64; }
+	if (new_scale > 64) { new_scale = 64; }
+
+	// Keep the image point under the cursor fixed
+	QPoint cursor = ev->position().toPoint();
+	double ix = (cursor.x() - offset.x()) / scale;
+	double iy = (cursor.y() - offset.y()) / scale;
+	offset = QPoint((int) std::floor(cursor.x() - ix * new_scale),
+					(int) std::floor(cursor.y() - iy * new_scale));
+	scale = new_scale;
+	update();
+	ev->accept();
+}
+
+void ImageViewControls::mousePressEvent(QMouseEvent *ev) {
+	if (ev->button() == Qt::LeftButton) {
+		dragging = true;
+		lastDragPos = ev->pos();
+	}
+	QWidget::mousePressEvent(ev);
+}
+
+void ImageViewControls::mouseMoveEvent(QMouseEvent *ev) {
+	if (dragging) {
+		offset += ev->pos() - lastDragPos;
+		lastDragPos = ev->pos();
+		update();
+	}
+}
+
+void ImageViewControls::mouseReleaseEvent(QMouseEvent *ev) {
+	if (ev->button() == Qt::LeftButton) {
+		dragging = false;
+	}
+}
+
 void ImageViewControls::keyPressEvent(QKeyEvent *ev) {
 	if (ev->key() == Qt::Key_Left) {
 
@@ -40,7 +189,9 @@ void ImageViewControls::keyPressEvent(QKeyEvent *ev) {
 		emit zoomIn();
 	} else if (ev->key() == Qt::Key_S) {
 		emit zoomOut();
+	} else if (ev->key() == Qt::Key_0) {
+		resetView();
 	} else {
-		QLabel::keyPressEvent(ev);
+		QWidget::keyPressEvent(ev);
 	}
-}
\ No newline at end of file
+}
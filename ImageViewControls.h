@@ -1,10 +1,30 @@
 #ifndef __IMAGE_VIEW_CONTROLS_H__
 #define __IMAGE_VIEW_CONTROLS_H__
 
-#include <QLabel>
+#include <QWidget>
+#include <QImage>
+#include <QPoint>
+#include <QRect>
 #include <QKeyEvent>
+#include <QMouseEvent>
+#include <QWheelEvent>
+#include <QPaintEvent>
+#include <QPainter>
 
-class ImageViewControls : public QLabel {
+class TiledImage;
+
+/*
+ * Displays a QImage by painting it straight from its buffer. The image is
+ * kept in Format_RGB32 so the raster paint engine can blit it without any
+ * intermediate QPixmap conversion, and only dirty regions are repainted.
+ * The mouse wheel zooms about the cursor, dragging pans, and 0 resets the
+ * view; zooming never rescales the source image.
+ *
+ * Images too large to hold in memory are shown through a TiledImage
+ * instead, in which case only the tiles of the pyramid level matching the
+ * current zoom that intersect the exposed area are decoded.
+ */
+class ImageViewControls : public QWidget {
 	Q_OBJECT
 
 public:
@@ -12,6 +32,25 @@ public:
 
 	virtual ~ImageViewControls();
 
+	/// Shows image, converting it to Format_RGB32 only if needed.
+	/// The image is shared, not copied.
+	void setImage(const QImage &image);
+
+	/// As setImage(), but only the region dirty (in image coordinates)
+	/// has changed since the last call.
+	void setImage(const QImage &image, const QRect &dirty);
+
+	const QImage &image() const;
+
+	/// Shows tiles instead of the image set with setImage(). The widget
+	/// does not take ownership; pass 0 to go back to the plain image.
+	void setTiledImage(TiledImage *tiles);
+
+	virtual QSize sizeHint() const;
+
+public slots:
+	void resetView();
+
 signals:
 	void rotateLeft();
 	void rotateRight();
@@ -28,7 +67,22 @@ signals:
 
 protected:
 	virtual void keyPressEvent(QKeyEvent *ev);
+	virtual void paintEvent(QPaintEvent *ev);
+	virtual void wheelEvent(QWheelEvent *ev);
+	virtual void mousePressEvent(QMouseEvent *ev);
+	virtual void mouseMoveEvent(QMouseEvent *ev);
+	virtual void mouseReleaseEvent(QMouseEvent *ev);
+
+private:
+	QRect imageToWidget(const QRect &r) const;
+	void paintTiles(QPainter &painter, const QRect &area);
 
+	QImage img;
+	TiledImage *tiles;
+	double scale;
+	QPoint offset;
+	QPoint lastDragPos;
+	bool dragging;
 };
 
-#endif // __IMAGE_VIEW_CONTROLS_H__
\ No newline at end of file
+#endif // __IMAGE_VIEW_CONTROLS_H__
@@ -0,0 +1,203 @@
+#include <QImage>
+#include <QImageReader>
+#include <QImageIOHandler>
+#include <QFileInfo>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "TiledImage.h"
+#include "ppm.h"
+
+TiledImage::TiledImage(const QString &filename, int cache_mb) :
+	filename(filename), num_levels(0), clip_supported(false),
+	scale_supported(false), ppm(0), filter_margin(0) {
+
+	QString suffix = QFileInfo(filename).suffix().toLower();
+	if (suffix == "ppm" || suffix == "pgm" || suffix == "pnm") {
+		ppm = ppm_map(filename.toLocal8Bit().constData());
+	}
+
+	if (ppm) {
+		full = QSize(ppm->hdr.w, ppm->hdr.h);
+		clip_supported = true;
+	} else {
+		QImageReader reader(filename);
+		full = reader.size();
+		clip_supported = reader.supportsOption(QImageIOHandler::ClipRect);
+		scale_supported = clip_supported &&
+			reader.supportsOption(QImageIOHandler::ScaledClipRect);
+	}
+
+	if (full.isValid()) {
+		num_levels = 1;
+		while (levelSize(num_levels - 1).width() > TILE_SIZE ||
+				levelSize(num_levels - 1).height() > TILE_SIZE) {
+			++num_levels;
+		}
+	}
+
+	setCacheLimit(cache_mb);
+}
+
+TiledImage::~TiledImage() {
+	ppm_unmap(&ppm);
+}
+
+bool TiledImage::isValid() const {
+	return num_levels > 0;
+}
+
+QSize TiledImage::size() const {
+	return full;
+}
+
+int TiledImage::levels() const {
+	return num_levels;
+}
+
+QSize TiledImage::levelSize(int level) const {
+	int d = 1 << level;
+	return QSize((full.width() + d - 1) / d, (full.height() + d - 1) / d);
+}
+
+int TiledImage::levelForScale(double scale) const {
+	int level = 0;
+	while (level + 1 < num_levels && 1.0 / (1 << (level + 1)) >= scale) {
+		++level;
+	}
+	return level;
+}
+
+QRect TiledImage::tileRect(int level, int tx, int ty) const {
+	QSize ls = levelSize(level);
+	return QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE)
+			.intersected(QRect(0, 0, ls.width(), ls.height()));
+}
+
+QImage TiledImage::tile(int level, int tx, int ty) {
+	quint64 key = ((quint64) level << 48) | ((quint64) ty << 24) | (quint64) tx;
+	QImage *cached = cache.object(key);
+	if (cached) { return *cached; }
+
+	QRect r = tileRect(level, tx, ty);
+	if (r.isEmpty()) { return QImage(); }
+
+	QImage t;
+	if (level == 0) {
+		t = decodeTile(r);
+	} else if (scale_supported && filters.empty()) {
+		// Let the decoder skip the detail we would throw away
+		QImageReader reader(filename);
+		int d = 1 << level;
+		reader.setClipRect(QRect(r.x() * d, r.y() * d, r.width() * d, r.height() * d)
+						   .intersected(QRect(QPoint(0, 0), full)));
+		reader.setScaledSize(r.size());
+		t = reader.read().convertToFormat(QImage::Format_RGB32);
+	} else {
+		t = downsampleTile(level, tx, ty);
+	}
+
+	cache.insert(key, new QImage(t), std::max(1, t.bytesPerLine() * t.height() / 1024));
+	return t;
+}
+
+QImage TiledImage::readRegion(const QRect &r) {
+	if (ppm) {
+		QImage out(r.size(), QImage::Format_RGB32);
+		std::vector<pixel_t> row(r.width());
+		for (int y = 0; y < r.height(); ++y) {
+			ppm_map_row_rgb(ppm, r.y() + y, r.x(), r.width(), &row[0]);
+			QRgb *dst = (QRgb *) out.scanLine(y);
+			for (int x = 0; x < r.width(); ++x) {
+				dst[x] = qRgb(row[x].r, row[x].g, row[x].b);
+			}
+		}
+		return out;
+	}
+	if (clip_supported) {
+		QImageReader reader(filename);
+		reader.setClipRect(r);
+		QImage out = reader.read();
+		if (out.isNull()) {
+			fprintf(stderr, "error: cannot decode %s: %s\n",
+					filename.toStdString().c_str(),
+					reader.errorString().toStdString().c_str());
+		}
+		return out.convertToFormat(QImage::Format_RGB32);
+	}
+	// The format has no region decoding, so the whole image has to be
+	// resident; tiles are then only a view onto it.
+	if (whole.isNull()) {
+		whole = QImageReader(filename).read().convertToFormat(QImage::Format_RGB32);
+	}
+	return whole.copy(r);
+}
+
+QImage TiledImage::decodeTile(const QRect &r) {
+	if (filters.empty()) {
+		return readRegion(r);
+	}
+
+	QRect bounds(QPoint(0, 0), full);
+	QRect padded = r.adjusted(-filter_margin, -filter_margin,
+							  filter_margin, filter_margin).intersected(bounds);
+	QImage t = readRegion(padded);
+	for (size_t i = 0; i < filters.size(); ++i) {
+		t = filters[i](&t);
+	}
+	return t.copy(r.translated(-padded.x(), -padded.y()));
+}
+
+QImage TiledImage::downsampleTile(int level, int tx, int ty) {
+	// Gather the (up to) four finer tiles covering this one
+	QRect r = tileRect(level, tx, ty);
+	QSize fine_size = levelSize(level - 1);
+	QRect fine = QRect(r.x() * 2, r.y() * 2, r.width() * 2, r.height() * 2)
+			.intersected(QRect(QPoint(0, 0), fine_size));
+	QImage src(fine.size(), QImage::Format_RGB32);
+	for (int j = 0; j < 2; ++j) {
+		for (int i = 0; i < 2; ++i) {
+			QImage part = tile(level - 1, tx * 2 + i, ty * 2 + j);
+			if (part.isNull()) { continue; }
+			for (int y = 0; y < part.height(); ++y) {
+				const QRgb *in = (const QRgb *) part.constScanLine(y);
+				QRgb *out = (QRgb *) src.scanLine(j * TILE_SIZE + y) + i * TILE_SIZE;
+				std::copy(in, in + part.width(), out);
+			}
+		}
+	}
+
+	QImage out(r.size(), QImage::Format_RGB32);
+	for (int y = 0; y < out.height(); ++y) {
+		const QRgb *row0 = (const QRgb *) src.constScanLine(2 * y);
+		const QRgb *row1 = (const QRgb *) src.constScanLine(
+				std::min(2 * y + 1, src.height() - 1));
+		QRgb *dst = (QRgb *) out.scanLine(y);
+		for (int x = 0; x < out.width(); ++x) {
+			int x0 = 2 * x;
+			int x1 = std::min(2 * x + 1, src.width() - 1);
+			int r = qRed(row0[x0]) + qRed(row0[x1]) + qRed(row1[x0]) + qRed(row1[x1]);
+			int g = qGreen(row0[x0]) + qGreen(row0[x1]) + qGreen(row1[x0]) + qGreen(row1[x1]);
+			int b = qBlue(row0[x0]) + qBlue(row0[x1]) + qBlue(row1[x0]) + qBlue(row1[x1]);
+			dst[x] = qRgb((r + 2) / 4, (g + 2) / 4, (b + 2) / 4);
+		}
+	}
+	return out;
+}
+
+void TiledImage::addFilter(const tile_filter_t &filter, int margin) {
+	filters.push_back(filter);
+	filter_margin += margin;
+	cache.clear();
+}
+
+void TiledImage::clearFilters() {
+	filters.clear();
+	filter_margin = 0;
+	cache.clear();
+}
+
+void TiledImage::setCacheLimit(int mb) {
+	cache.setMaxCost(mb * 1024);
+}
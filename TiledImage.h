@@ -0,0 +1,82 @@
+#ifndef __TILED_IMAGE_H__
+#define __TILED_IMAGE_H__
+
+#include <QImage>
+#include <QString>
+#include <QSize>
+#include <QRect>
+#include <QCache>
+#include <vector>
+#include <functional>
+
+struct ppm_map_t;
+
+/*
+ * An image that is never fully resident. Pixels are decoded from the file
+ * one TILE_SIZE square at a time and kept in an LRU pool with a memory cap.
+ * Level 0 is full resolution and each further level halves both dimensions.
+ * Coarse levels are built lazily, either by a scaled decode when the image
+ * format supports one or by downsampling the four tiles of the finer level.
+ * PPM/PGM files are memory-mapped and tiles are converted straight from
+ * the mapping.
+ *
+ * Filters added with addFilter() run on each level 0 tile as it is decoded.
+ * The tile is read with an apron of `margin` pixels so neighbourhood
+ * filters see real data across tile seams.
+ */
+class TiledImage {
+public:
+	static const int TILE_SIZE = 256;
+
+	typedef std::function<QImage(QImage *)> tile_filter_t;
+
+	explicit TiledImage(const QString &filename, int cache_mb = 512);
+	~TiledImage();
+
+	/// False if the file could not be opened or has no size
+	bool isValid() const;
+
+	QSize size() const;
+	int levels() const;
+	QSize levelSize(int level) const;
+
+	/// The coarsest level that still has at least one pixel per screen
+	/// pixel when drawn at the given scale (screen pixels per image pixel)
+	int levelForScale(double scale) const;
+
+	/// Returns the tile at column tx, row ty of level, decoding or
+	/// generating it if it is not cached. Edge tiles may be smaller.
+	QImage tile(int level, int tx, int ty);
+
+	void addFilter(const tile_filter_t &filter, int margin);
+	void clearFilters();
+
+	void setCacheLimit(int mb);
+
+private:
+	TiledImage(const TiledImage &);
+	TiledImage &operator=(const TiledImage &);
+
+	QRect tileRect(int level, int tx, int ty) const;
+	QImage readRegion(const QRect &r);
+	QImage decodeTile(const QRect &r);
+	QImage downsampleTile(int level, int tx, int ty);
+
+	QString filename;
+	QSize full;
+	int num_levels;
+	bool clip_supported;
+	bool scale_supported;
+
+	// Only used when the format cannot decode a sub-rectangle
+	QImage whole;
+
+	ppm_map_t *ppm;
+
+	std::vector<tile_filter_t> filters;
+	int filter_margin;
+
+	QCache<quint64, QImage> cache;
+};
+
+#endif // __TILED_IMAGE_H__
@@ -0,0 +1,706 @@
+// Microbenchmarks for the image filters, PPM I/O, OBJ loading and the
+// rasterizer. Results are written as JSON in Google Benchmark's layout,
+// so its compare.py and other tools that read that format can diff two
+// runs.
+//
+//   bench [--benchmark_filter=REGEX] [--benchmark_min_time=SECONDS]
+//         [--benchmark_out=FILE] [--benchmark_list_tests]
+//         [--root=DIR]
+//
+// --root is the source tree holding obj/ and camera/ (default ".."). The
+// rasterizer reads materials from "../obj/", so the benchmark runs from
+// inside obj/.
+//
+// --trace_out=FILE records a timeline of the whole run (see trace.h).
+//
+// Built with PROFILE_STATS (bench.pro defines it), each benchmark also
+// reports profile.h's stage times and counters, averaged per iteration,
+// as extra fields such as "raster_ms" and "z_pass".
+//
+// The same cases double as a golden-image regression check. Every filter
+// case at GOLDEN_SIZE, and every shader on every obj seen from its golden
+// camera (golden_camera()), renders one GOLDEN_SIZE image, which is
+// compared with <dir>/<case>.png instead of being timed:
+//
+//   bench --golden_dir=DIR [--golden_update] [--golden_max_diff=N]
+//         [--golden_min_psnr=DB] [--benchmark_filter=REGEX]
+//
+// --golden_update writes the goldens, e.g. from a known-good commit. A
+// case fails if any channel differs by more than --golden_max_diff
+// (default 1) or the PSNR falls below --golden_min_psnr (default 48 dB).
+// Failures leave <case>.actual.png and <case>.diff.png next to the golden,
+// and the exit status is 1.
+//
+// The goldens are checked in under golden/ in the source tree, and
+// "make check" (bench.pro) runs this mode against them.
+
+#include <QImage>
+#include <QDir>
+#include <QFileInfo>
+#include <QStringList>
+#include <QString>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../im_op.h"
+#include "../ppm.h"
+#include "../rasterize.h"
+#include "../tiny_obj_loader.h"
+#include "../meshopt.h"
+#include "../profile.h"
+#include "../trace.h"
+
+typedef struct {
+    std::string name;
+    std::function<void()> fn;
+    // Items (pixels, triangles, ...) one call processes, for items_per_second
+    double items;
+    // The image checked against the golden, for cases that make one
+    std::function<QImage()> output;
+} bench_t;
+
+typedef struct {
+    std::string name;
+    long iterations;
+    double real_ns;     // per iteration
+    double cpu_ns;
+    double items;
+    profile_t prof;     // totals over all iterations
+} result_t;
+
+// Goldens are made at this size only. They are checked in, and larger
+// ones add nothing but repository size.
+const int GOLDEN_SIZE = 128;
+
+// RANDOM shading seed, so its renders can be compared
+const unsigned GOLDEN_SEED = 1;
+
+// Stores results where the compiler cannot prove them unused
+static volatile unsigned sink;
+
+static void keep(const QImage &img) {
+    if (!img.isNull()) { sink = sink + img.constBits()[0]; }
+}
+
+// A deterministic RGB32 image with smooth gradients and some noise, so
+// the median filter does not see runs of equal pixels
+static QImage test_image(int w, int h) {
+    QImage img(w, h, QImage::Format_RGB32);
+    unsigned seed = 12345;
+    for (int y = 0; y < h; y++) {
+        QRgb *row = (QRgb *) img.scanLine(y);
+        for (int x = 0; x < w; x++) {
+            seed = seed * 1664525u + 1013904223u;
+            int n = (seed >> 24) & 31;
+            row[x] = qRgb((x * 255 / w + n) & 255,
+                          (y * 255 / h + n) & 255,
+                          ((x + y) * 127 / (w + h) + n) & 255);
+        }
+    }
+    return img;
+}
+
+static img_t *to_img_t(const QImage &in) {
+    QImage src = in;
+    if (src.format() != QImage::Format_RGB32) {
+        src = src.convertToFormat(QImage::Format_RGB32);
+    }
+    int w = src.width();
+    int h = src.height();
+    img_t *img = img_init(w, h);
+    if (!img) { return NULL; }
+    for (int y = 0; y < h; y++) {
+        const QRgb *row = (const QRgb *) src.constScanLine(y);
+        for (int x = 0; x < w; x++) {
+            pixel_t &p = (*img)(y, x);
+            p.r = qRed(row[x]);
+            p.g = qGreen(row[x]);
+            p.b = qBlue(row[x]);
+        }
+    }
+    return img;
+}
+
+static QImage from_img_t(const img_t *img) {
+    QImage out(img->w, img->h, QImage::Format_RGB32);
+    for (int y = 0; y < img->h; y++) {
+        QRgb *row = (QRgb *) out.scanLine(y);
+        for (int x = 0; x < img->w; x++) {
+            pixel_t p = (*img)(y, x);
+            row[x] = qRgb(p.r, p.g, p.b);
+        }
+    }
+    return out;
+}
+
+static img_t *test_img_t(int w, int h) {
+    return to_img_t(test_image(w, h));
+}
+
+static std::string size_name(int s) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", s);
+    return buf;
+}
+
+// Filter benchmarks share one source image per size, built on first use
+static const QImage &source(int size) {
+    static std::vector<std::pair<int, QImage> > images;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (images[i].first == size) { return images[i].second; }
+    }
+    images.push_back(std::make_pair(size, test_image(size, size)));
+    return images.back().second;
+}
+
+typedef std::function<QImage(QImage *)> filter_fn;
+
+// Adds a case running op on the s by s test image. op returns its result,
+// which for the in-place filters is *in. Timing reuses one working copy,
+// so every iteration does the same work without paying for a copy; the
+// golden output filters a fresh copy.
+static void add_filter(std::vector<bench_t> &benches, const std::string &name,
+                       int s, filter_fn op) {
+    std::shared_ptr<QImage> work(new QImage);
+    bench_t b;
+    b.name = name;
+    b.items = (double) s * s;
+    b.fn = [s, op, work]() {
+        if (work->isNull()) { *work = source(s).copy(); }
+        keep(op(work.get()));
+    };
+    if (s == GOLDEN_SIZE) {
+        b.output = [s, op]() {
+            QImage in = source(s).copy();
+            return op(&in);
+        };
+    }
+    benches.push_back(b);
+}
+
+static void add_filter_benchmarks(std::vector<bench_t> &benches) {
+    const int sizes[] = { GOLDEN_SIZE, 512, 2048, 8192 };
+    const int radii[] = { 1, 4, 16 };
+    // The median filter sorts (2r+1)^2 samples per channel, so it only
+    // gets the smaller radii
+    const int median_radii[] = { 1, 3 };
+
+    for (int s : sizes) {
+        std::string sz = size_name(s);
+
+        add_filter(benches, "grayscale/" + sz, s, [](QImage *in) -> QImage {
+            grayscale(in);
+            return *in;
+        });
+        // Brightness, contrast, gamma and invert, composed into one table
+        add_filter(benches, "applyLut/" + sz, s, [](QImage *in) -> QImage {
+            lut_t lut = composeLut(brightnessContrastLut(10, 1.2f), gammaLut(1.8f));
+            applyLut(in, composeLut(lut, invertLut()));
+            return *in;
+        });
+        add_filter(benches, "histogram/" + sz, s, [](QImage *in) -> QImage {
+            histogram(in);
+            return *in;
+        });
+        add_filter(benches, "flip/" + sz, s, [](QImage *in) -> QImage {
+            flip(in);
+            return *in;
+        });
+        add_filter(benches, "flop/" + sz, s, [](QImage *in) -> QImage {
+            flop(in);
+            return *in;
+        });
+        add_filter(benches, "transpose/" + sz, s, [](QImage *in) {
+            return transpose(in);
+        });
+        add_filter(benches, "sobel/" + sz, s, [](QImage *in) {
+            return sobel(in);
+        });
+        add_filter(benches, "canny/" + sz, s, [](QImage *in) {
+            return canny(in, 1.4f, 40, 100);
+        });
+        // One kernel per spatial convolve() path: fixed point, separable
+        // float and general float
+        add_filter(benches, "convolve/" + sz + "/sharpen", s, [](QImage *in) {
+            return convolve(in, sharpenKernel());
+        });
+        add_filter(benches, "convolve/" + sz + "/binomial5", s, [](QImage *in) {
+            const float b[] = { 1, 4, 6, 4, 1 };
+            float w[25];
+            for (int i = 0; i < 25; i++) { w[i] = b[i / 5] * b[i % 5] / 256; }
+            return convolve(in, makeKernel(5, 5, w));
+        });
+        add_filter(benches, "convolve/" + sz + "/emboss_scaled", s, [](QImage *in) {
+            kernel_t k = embossKernel();
+            for (size_t i = 0; i < k.weights.size(); i++) { k.weights[i] *= 0.7f; }
+            return convolve(in, k, BORDER_REFLECT, qRgb(0, 0, 0), 128);
+        });
+        // Large enough for the FFT path
+        add_filter(benches, "convolve/" + sz + "/gaussian16", s, [](QImage *in) {
+            return convolve(in, gaussianKernel(16));
+        });
+        add_filter(benches, "bilateralFilter/" + sz, s, [](QImage *in) {
+            return bilateralFilter(in, 16, 25);
+        });
+        // Radius 4 fits at full size, 16 on an image shrunk by 4
+        add_filter(benches, "guidedFilter/" + sz + "/4", s, [](QImage *in) {
+            return guidedFilter(in, 4, 625);
+        });
+        add_filter(benches, "guidedFilter/" + sz + "/16", s, [](QImage *in) {
+            return guidedFilter(in, 16, 625);
+        });
+        add_filter(benches, "summedAreaTable/" + sz, s, [](QImage *in) -> QImage {
+            clearSummedAreaTableCache();
+            summedAreaTable(in);
+            return *in;
+        });
+        for (int r : radii) {
+            std::string rn = "/" + size_name(r);
+            // The working copy never changes, so each iteration drops the
+            // kept summed-area table and pays for a build as a first call
+            // on a fresh image would
+            add_filter(benches, "boxBlur/" + sz + rn, s, [r](QImage *in) {
+                clearSummedAreaTableCache();
+                return boxBlur(in, r);
+            });
+            add_filter(benches, "gaussianBlur/" + sz + rn, s, [r](QImage *in) {
+                return gaussianBlur(in, r, r / 2.0f + 0.5f);
+            });
+            add_filter(benches, "localMean/" + sz + rn, s, [r](QImage *in) {
+                clearSummedAreaTableCache();
+                return localMean(in, r);
+            });
+            add_filter(benches, "localStdDev/" + sz + rn, s, [r](QImage *in) {
+                clearSummedAreaTableCache();
+                return localStdDev(in, r);
+            });
+            add_filter(benches, "adaptiveThreshold/" + sz + rn, s, [r](QImage *in) {
+                clearSummedAreaTableCache();
+                return adaptiveThreshold(in, r, 5);
+            });
+        }
+        for (int r : median_radii) {
+            add_filter(benches, "medianFilter/" + sz + "/" + size_name(r), s,
+                       [r](QImage *in) {
+                return medianFilter(in, r);
+            });
+        }
+    }
+}
+
+// Writes the s by s test image to file unless an earlier call did
+static void ensure_ppm(const std::string &file, int s) {
+    static std::vector<std::string> written;
+    for (size_t i = 0; i < written.size(); i++) {
+        if (written[i] == file) { return; }
+    }
+    img_t *img = test_img_t(s, s);
+    if (!img) { return; }
+    write_ppm(img, file.c_str());
+    img_destroy(&img);
+    written.push_back(file);
+}
+
+static void add_ppm_benchmarks(std::vector<bench_t> &benches) {
+    const int sizes[] = { 512, 2048, 8192 };
+    std::string dir = QDir::tempPath().toStdString();
+
+    for (int s : sizes) {
+        std::string sz = size_name(s);
+        std::string file = dir + "/img_viewer_bench_" + sz + ".ppm";
+        double px = (double) s * s;
+
+        benches.push_back({ "write_ppm/" + sz, [s, file]() {
+            static img_t *img = NULL;
+            static int img_size = 0;
+            if (img_size != s) {
+                if (img) { img_destroy(&img); }
+                img = test_img_t(s, s);
+                img_size = s;
+            }
+            sink = sink + write_ppm(img, file.c_str());
+        }, px, nullptr });
+        benches.push_back({ "read_ppm/" + sz, [s, file]() {
+            ensure_ppm(file, s);
+            img_t *img = read_ppm(file.c_str());
+            if (img) {
+                sink = sink + img->data[0].r;
+                img_destroy(&img);
+            }
+        }, px, nullptr });
+    }
+}
+
+static QStringList entries(const QString &dir, const QString &pattern) {
+    return QDir(dir).entryList(QStringList() << pattern, QDir::Files, QDir::Name);
+}
+
+// The one camera each obj's goldens are rendered from:
+// camera_<obj>.txt if there is one, otherwise camera_angled.txt, which
+// sees three faces of the unit-sized meshes
+static QString golden_camera(const QStringList &cams, const QString &obj) {
+    QString own = "camera_" + QFileInfo(obj).completeBaseName() + ".txt";
+    return cams.contains(own) ? own : QString("camera_angled.txt");
+}
+
+static void add_mesh_benchmarks(std::vector<bench_t> &benches, const QString &root) {
+    QStringList objs = entries(root + "/obj", "*.obj");
+    QStringList cams = entries(root + "/camera", "*.txt");
+
+    for (const QString &obj : objs) {
+        std::string path = (root + "/obj/" + obj).toStdString();
+        std::string name = QFileInfo(obj).completeBaseName().toStdString();
+        benches.push_back({ "LoadObj/" + name, [path]() {
+            std::vector<tinyobj::shape_t> shapes;
+            std::vector<tinyobj::material_t> materials;
+            std::string err = tinyobj::LoadObj(shapes, materials, path.c_str(), "../obj/");
+            sink = sink + shapes.size() + err.size();
+        }, 1, nullptr });
+    }
+
+    // TEXTURE has no shader yet, so it is left out
+    static const struct { e_shader shader; const char *name; } shaders[] = {
+        { NONE, "none" }, { WHITE, "white" }, { RANDOM, "random" },
+        { NORM_FLAT, "flat" }, { NORM_GOURAUD, "gouraud" },
+        { NORM_GOURAUD_Z, "gouraud_z" }, { NORM_BARY, "bary" },
+        { NORM_BARY_Z, "bary_z" }, { BLINN_PHONG, "blinn_phong" },
+    };
+    const int size = 512;
+
+    for (const QString &cam : cams) {
+        camera_mat_t camera;
+        camera_init(&camera);
+        load_camera((root + "/camera/" + cam).toStdString().c_str(), &camera);
+        std::string cam_name = QFileInfo(cam).completeBaseName().toStdString();
+
+        for (const QString &obj : objs) {
+            std::string path = (root + "/obj/" + obj).toStdString();
+            std::string obj_name = QFileInfo(obj).completeBaseName().toStdString();
+            for (const auto &s : shaders) {
+                e_shader shader = s.shader;
+                bench_t b;
+                b.name = std::string("rasterize/") + s.name + "/" + obj_name + "/" + cam_name;
+                b.items = (double) size * size;
+                std::function<QImage(int)> render = [path, camera, shader](int s) {
+                    camera_mat_t c = camera;
+                    return rasterize(path.c_str(), &c, s, s, shader,
+                                     MESH_OPT_ALL, NULL, GOLDEN_SEED);
+                };
+                b.fn = [render, size]() { keep(render(size)); };
+                if (cam == golden_camera(cams, obj)) {
+                    b.output = [render]() { return render(GOLDEN_SIZE); };
+                }
+                benches.push_back(b);
+            }
+        }
+    }
+}
+
+static double cpu_seconds() {
+    return (double) std::clock() / CLOCKS_PER_SEC;
+}
+
+// Runs b once to warm caches (and the .meshbin files), then repeatedly
+// until min_time seconds have passed
+static result_t run(const bench_t &b, double min_time) {
+    typedef std::chrono::steady_clock clock;
+    b.fn();
+
+    long iterations = 0;
+    profile_reset();
+    double cpu0 = cpu_seconds();
+    clock::time_point t0 = clock::now();
+    double elapsed = 0;
+    do {
+        b.fn();
+        iterations++;
+        elapsed = std::chrono::duration<double>(clock::now() - t0).count();
+    } while (elapsed < min_time);
+    double cpu = cpu_seconds() - cpu0;
+
+    result_t r;
+    profile_get(&r.prof);
+    r.name = b.name;
+    r.iterations = iterations;
+    r.real_ns = elapsed * 1e9 / iterations;
+    r.cpu_ns = cpu * 1e9 / iterations;
+    r.items = b.items;
+    return r;
+}
+
+// Compares img with golden. max_diff is the largest difference in any
+// channel and psnr is over all channels (infinite when they match). diff
+// gets the differences, scaled up to be visible. Returns 0 if the sizes
+// differ.
+static int compare(const img_t *img, const img_t *golden, img_t *diff,
+                   int *max_diff, double *psnr) {
+    if (img->w != golden->w || img->h != golden->h) { return 0; }
+    size_t n = (size_t) img->w * img->h;
+    double sq = 0;
+    int worst = 0;
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char *a = &img->data[i].r;
+        const unsigned char *b = &golden->data[i].r;
+        unsigned char *d = &diff->data[i].r;
+        for (int c = 0; c < 3; c++) {
+            int e = abs((int) a[c] - (int) b[c]);
+            worst = std::max(worst, e);
+            sq += (double) e * e;
+            d[c] = (unsigned char) std::min(255, e * 16);
+        }
+    }
+    *max_diff = worst;
+    double mse = sq / (3.0 * n);
+    *psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+    return 1;
+}
+
+static std::string golden_file(const std::string &dir, const std::string &name,
+                               const char *suffix) {
+    std::string file = name;
+    for (char &c : file) {
+        if (c == '/') { c = '_'; }
+    }
+    return dir + "/" + file + suffix;
+}
+
+// Writes (update) or checks the golden for b. Returns false on failure.
+static bool golden(const bench_t &b, const std::string &dir, bool update,
+                   int max_diff, double min_psnr) {
+    img_t *img = to_img_t(b.output());
+    if (!img) {
+        fprintf(stderr, "error: %s produced no image\n", b.name.c_str());
+        return false;
+    }
+    std::string file = golden_file(dir, b.name, ".png");
+    if (update) {
+        bool ok = from_img_t(img).save(QString::fromStdString(file), "PNG");
+        img_destroy(&img);
+        printf("%-48s %s\n", b.name.c_str(), ok ? "written" : "WRITE FAILED");
+        return ok;
+    }
+
+    QImage ref_img;
+    img_t *ref = NULL;
+    if (ref_img.load(QString::fromStdString(file), "PNG")) { ref = to_img_t(ref_img); }
+    if (!ref) {
+        img_destroy(&img);
+        printf("%-48s FAIL no golden %s\n", b.name.c_str(), file.c_str());
+        return false;
+    }
+    img_t *diff = img_init(img->w, img->h);
+    int worst = 0;
+    double psnr = 0;
+    bool ok = diff && compare(img, ref, diff, &worst, &psnr);
+    if (!ok) {
+        printf("%-48s FAIL %dx%d, golden is %dx%d\n", b.name.c_str(),
+               img->w, img->h, ref->w, ref->h);
+    } else {
+        ok = worst <= max_diff && psnr >= min_psnr;
+        printf("%-48s %s max diff %d, PSNR %.2f dB\n", b.name.c_str(),
+               ok ? "ok  " : "FAIL", worst, psnr);
+    }
+    if (!ok) {
+        from_img_t(img).save(QString::fromStdString(golden_file(dir, b.name, ".actual.png")), "PNG");
+        if (diff) {
+            from_img_t(diff).save(QString::fromStdString(golden_file(dir, b.name, ".diff.png")), "PNG");
+        }
+    }
+    img_destroy(&img);
+    img_destroy(&ref);
+    if (diff) { img_destroy(&diff); }
+    return ok;
+}
+
+static void json_string(FILE *f, const std::string &s) {
+    fputc('"', f);
+    for (char c : s) {
+        if (c == '"' || c == '\\') { fputc('\\', f); }
+        fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void write_json(FILE *f, const std::vector<result_t> &results, const char *exe) {
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    fprintf(f, "{\n  \"context\": {\n");
+    fprintf(f, "    \"date\": \"%s\",\n", date);
+    fprintf(f, "    \"executable\": ");
+    json_string(f, exe);
+    fprintf(f, ",\n    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#if defined(NDEBUG) || defined(QT_NO_DEBUG)
+    fprintf(f, "    \"library_build_type\": \"release\"\n");
+#else
+    fprintf(f, "    \"library_build_type\": \"debug\"\n");
+#endif
+    fprintf(f, "  },\n  \"benchmarks\": [");
+    for (size_t i = 0; i < results.size(); i++) {
+        const result_t &r = results[i];
+        fprintf(f, "%s\n    {\n      \"name\": ", i ? "," : "");
+        json_string(f, r.name);
+        fprintf(f, ",\n      \"run_name\": ");
+        json_string(f, r.name);
+        fprintf(f, ",\n      \"run_type\": \"iteration\",\n");
+        fprintf(f, "      \"iterations\": %ld,\n", r.iterations);
+        fprintf(f, "      \"real_time\": %.3f,\n", r.real_ns);
+        fprintf(f, "      \"cpu_time\": %.3f,\n", r.cpu_ns);
+        fprintf(f, "      \"time_unit\": \"ns\",\n");
+        fprintf(f, "      \"items_per_second\": %.6e", r.items * 1e9 / r.real_ns);
+#ifdef PROFILE_STATS
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            if (r.prof.stage_ms[s] == 0) { continue; }
+            fprintf(f, ",\n      \"%s_ms\": %.6f", profile_stage_name((prof_stage_t) s),
+                    r.prof.stage_ms[s] / r.iterations);
+        }
+        for (int c = 0; c < COUNT_COUNT; c++) {
+            if (r.prof.counters[c] == 0) { continue; }
+            fprintf(f, ",\n      \"%s\": %.1f", profile_counter_name((prof_counter_t) c),
+                    (double) r.prof.counters[c] / r.iterations);
+        }
+        if (r.prof.counters[COUNT_PIXELS_COVERED]) {
+            fprintf(f, ",\n      \"overdraw\": %.4f", profile_overdraw(&r.prof));
+        }
+#endif
+        fprintf(f, "\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+static const char *option(const char *arg, const char *name) {
+    size_t n = strlen(name);
+    if (strncmp(arg, name, n) == 0 && arg[n] == '=') { return arg + n + 1; }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    std::string filter = ".";
+    double min_time = 0.5;
+    const char *out = NULL;
+    bool list = false;
+    QString root = "..";
+    const char *golden_dir = NULL;
+    bool golden_update = false;
+    int golden_max_diff = 1;
+    double golden_min_psnr = 48;
+    const char *trace_out = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *v;
+        if ((v = option(argv[i], "--benchmark_filter"))) {
+            filter = v;
+        } else if ((v = option(argv[i], "--benchmark_min_time"))) {
+            min_time = atof(v);
+        } else if ((v = option(argv[i], "--benchmark_out"))) {
+            out = v;
+        } else if ((v = option(argv[i], "--trace_out"))) {
+            trace_out = v;
+        } else if ((v = option(argv[i], "--root"))) {
+            root = v;
+        } else if ((v = option(argv[i], "--golden_dir"))) {
+            golden_dir = v;
+        } else if ((v = option(argv[i], "--golden_max_diff"))) {
+            golden_max_diff = atoi(v);
+        } else if ((v = option(argv[i], "--golden_min_psnr"))) {
+            golden_min_psnr = atof(v);
+        } else if (strcmp(argv[i], "--golden_update") == 0) {
+            golden_update = true;
+        } else if (strcmp(argv[i], "--benchmark_list_tests") == 0) {
+            list = true;
+        } else {
+            fprintf(stderr, "error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    root = QDir(root).absolutePath();
+    if (!QDir(root + "/obj").exists()) {
+        fprintf(stderr, "error: no obj/ directory under %s\n", root.toStdString().c_str());
+        return 1;
+    }
+
+    std::vector<bench_t> benches;
+    add_filter_benchmarks(benches);
+    add_ppm_benchmarks(benches);
+    add_mesh_benchmarks(benches, root);
+
+    std::regex re;
+    try {
+        re = std::regex(filter);
+    } catch (const std::regex_error &) {
+        fprintf(stderr, "error: bad filter %s\n", filter.c_str());
+        return 1;
+    }
+
+    // Output paths are relative to where bench was started, not obj/
+    std::string golden_path;
+    if (golden_dir) {
+        if (golden_update) { QDir().mkpath(golden_dir); }
+        golden_path = QDir(golden_dir).absolutePath().toStdString();
+    }
+    std::string out_path = out ? QFileInfo(out).absoluteFilePath().toStdString() : "";
+    std::string trace_path = trace_out ? QFileInfo(trace_out).absoluteFilePath().toStdString() : "";
+
+    QDir::setCurrent(root + "/obj");
+
+    if (trace_out) {
+        trace_thread_name("bench");
+        trace_start();
+    }
+
+    if (golden_dir) {
+        int checked = 0, failed = 0;
+        for (const bench_t &b : benches) {
+            if (!b.output || !std::regex_search(b.name, re)) { continue; }
+            TRACE_SCOPE("bench", b.name.c_str());
+            checked++;
+            if (!golden(b, golden_path, golden_update, golden_max_diff, golden_min_psnr)) {
+                failed++;
+            }
+        }
+        printf("%d of %d cases %s\n", checked - failed, checked,
+               golden_update ? "written" : "match");
+        if (trace_out && !trace_write(trace_path.c_str())) { return 1; }
+        return failed ? 1 : 0;
+    }
+
+    std::vector<result_t> results;
+    for (const bench_t &b : benches) {
+        if (!std::regex_search(b.name, re)) { continue; }
+        if (list) {
+            printf("%s\n", b.name.c_str());
+            continue;
+        }
+        TRACE_SCOPE("bench", b.name.c_str());
+        result_t r = run(b, min_time);
+        fprintf(stderr, "%-48s %14.0f ns %10ld\n", r.name.c_str(), r.real_ns, r.iterations);
+        results.push_back(r);
+    }
+    if (list) { return 0; }
+    if (trace_out && !trace_write(trace_path.c_str())) { return 1; }
+
+    FILE *f = stdout;
+    if (out) {
+        f = fopen(out_path.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "error: cannot write %s\n", out);
+            return 1;
+        }
+    }
+    write_json(f, results, argv[0]);
+    if (f != stdout) { fclose(f); }
+    return 0;
+}
@@ -0,0 +1,54 @@
+# Benchmarks for the filters, PPM I/O, OBJ loading and the rasterizer.
+# Build it as its own project and run it from this directory, or pass
+# --root=<source tree>:
+#   qmake && make && ./bench --benchmark_out=results.json
+# See bench.cc for the other options.
+#
+# "make check" runs the golden-image regression check against the
+# images checked in under ../golden and fails if any case differs.
+
+QT += core \
+    widgets
+
+CONFIG += c++11 release
+
+TARGET = bench
+CONFIG += console
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+# Adds per-stage times and counters (profile.h) to the JSON
+DEFINES += PROFILE_STATS
+
+SOURCES += bench.cc \
+    ../im_op.cpp \
+    ../ppm.cpp \
+    ../image.cpp \
+    ../rasterize.cpp \
+    ../tiny_obj_loader.cc \
+    ../mat4.cpp \
+    ../vec4.cpp \
+    ../meshbin.cpp \
+    ../meshopt.cpp \
+    ../profile.cpp \
+    ../trace.cpp
+
+HEADERS += \
+    ../im_op.h \
+    ../ppm.h \
+    ../image.h \
+    ../rasterize.h \
+    ../tiny_obj_loader.h \
+    ../mat4.h \
+    ../vec4.h \
+    ../meshbin.h \
+    ../meshopt.h \
+    ../profile.h \
+    ../trace.h
+
+check.commands = ./$(TARGET) --root=$$PWD/.. --golden_dir=$$PWD/../golden
+check.depends = $(TARGET)
+QMAKE_EXTRA_TARGETS += check
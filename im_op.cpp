@@ -1,29 +1,433 @@
+#ifndef _USE_MATH_DEFINES
+#define _USE_MATH_DEFINES
+#endif // _USE_MATH_DEFINES
+
 #include <QImage>
 #include <QColor>
 #include <cmath>
+#include <cstdlib>
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include "im_op.h"
+#include "image.h"
+#include "profile.h"
+#include "trace.h"
 
-void grayscale(QImage *in, QProgressBar *qpb) {
-	qpb->setRange(0, in->height() * in->width());
-	int curr_pix = 0;
-	for (int i = 0; i < in->height(); ++i) {
-		for (int j = 0; j < in->width(); ++j) {
-			QRgb tmp = in->pixel(j, i);
-			int val = .299 * qRed(tmp) + \
-					  .587 * qGreen(tmp) + \
-					  .114 * qBlue(tmp);
-			in->setPixel(j, i, qRgb(val, val, val));
+// SSE2 is part of x86-64; other targets take the scalar loops
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IM_OP_SSE 1
+#include <emmintrin.h>
+#endif
+
+// Rows (or columns) handed to one worker thread at least
+static const int MIN_ROWS_PER_THREAD = 64;
+
+// Runs f(begin, end) over [0, n) split across the hardware threads, at
+// least min_chunk (taken as 1 if smaller) to a thread
+static void parallel_ranges(int n, int min_chunk, const std::function<void(int, int)> &f) {
+	int threads = (int) std::thread::hardware_concurrency();
+	int chunks = std::max(1, std::min(threads, n / std::max(1, min_chunk)));
+	std::vector<std::thread> workers;
+	for (int i = 1; i < chunks; ++i) {
+		workers.push_back(std::thread([&, i]() {
+			trace_thread_name("filter worker");
+			f(n / chunks * i, i + 1 == chunks ? n : n / chunks * (i + 1));
+		}));
+	}
+	f(0, chunks == 1 ? n : n / chunks);
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+}
+
+// A w by h RGB32 image whose rows start on Image::IMAGE_ALIGN boundaries,
+// so the vector loads and stores of the kernels below never straddle a
+// cache line. Every filter allocates its output here.
+static QImage rgb32_image(int w, int h) {
+	return Image::newQImage(w, h, PIX_RGB32);
+}
+
+// in, or a copy of it whose scan lines are QRgb
+static QImage rgb32(const QImage *in) {
+	if (in->format() == QImage::Format_RGB32 || in->format() == QImage::Format_ARGB32) {
+		return *in;
+	}
+	return in->convertToFormat(QImage::Format_RGB32);
+}
+
+// Luminance as grayscale() computes it, for rows [y0, y1) of src
+static void luminance_rows(const QImage &src, float *lum, int y0, int y1) {
+	int w = src.width();
+	for (int y = y0; y < y1; ++y) {
+		const QRgb *p = (const QRgb *) src.constScanLine(y);
+		for (int x = 0; x < w; ++x) {
+			int val = .299 * qRed(p[x]) + .587 * qGreen(p[x]) + .114 * qBlue(p[x]);
+			lum[y * w + x] = val;
 		}
-		curr_pix += in->width();
-		qpb->setValue(curr_pix);
 	}
 }
 
+static inline void sobel_at(const float *up, const float *mid, const float *down,
+		int w, int x, float *gx, float *gy) {
+	int l = std::max(x - 1, 0);
+	int r = std::min(x + 1, w - 1);
+	gx[x] = (up[r] + 2 * mid[r] + down[r]) - (up[l] + 2 * mid[l] + down[l]);
+	gy[x] = (down[l] + 2 * down[x] + down[r]) - (up[l] + 2 * up[x] + up[r]);
+}
+
+// 3x3 Sobel gradients of a w by h plane for rows [y0, y1), with y
+// pointing down and the edge pixels repeated past the border
+static void sobel_rows(const float *plane, int w, int h, float *gx, float *gy, int y0, int y1) {
+	for (int y = y0; y < y1; ++y) {
+		const float *up = plane + std::max(y - 1, 0) * w;
+		const float *mid = plane + y * w;
+		const float *down = plane + std::min(y + 1, h - 1) * w;
+		float *ox = gx + y * w;
+		float *oy = gy + y * w;
+		sobel_at(up, mid, down, w, 0, ox, oy);
+		int x = 1;
+#ifdef IM_OP_SSE
+		const __m128 two = _mm_set1_ps(2);
+		for (; x + 4 < w; x += 4) {
+			__m128 ul = _mm_loadu_ps(up + x - 1), u = _mm_loadu_ps(up + x), ur = _mm_loadu_ps(up + x + 1);
+			__m128 ml = _mm_loadu_ps(mid + x - 1), mr = _mm_loadu_ps(mid + x + 1);
+			__m128 dl = _mm_loadu_ps(down + x - 1), d = _mm_loadu_ps(down + x), dr = _mm_loadu_ps(down + x + 1);
+			__m128 right = _mm_add_ps(_mm_add_ps(ur, _mm_mul_ps(two, mr)), dr);
+			__m128 left = _mm_add_ps(_mm_add_ps(ul, _mm_mul_ps(two, ml)), dl);
+			__m128 bottom = _mm_add_ps(_mm_add_ps(dl, _mm_mul_ps(two, d)), dr);
+			__m128 top = _mm_add_ps(_mm_add_ps(ul, _mm_mul_ps(two, u)), ur);
+			_mm_storeu_ps(ox + x, _mm_sub_ps(right, left));
+			_mm_storeu_ps(oy + x, _mm_sub_ps(bottom, top));
+		}
+#endif
+		for (; x < w; ++x) {
+			sobel_at(up, mid, down, w, x, ox, oy);
+		}
+	}
+}
+
+/*
+ * Pointwise operations
+ */
+
+// Luminance as grayscale() has always computed it, truncated
+static inline int luminance_of(int r, int g, int b) {
+	return .299 * r + .587 * g + .114 * b;
+}
+
+static inline uint8_t clamp_byte(double v) {
+	return (uint8_t) std::min(std::max((int) floor(v + 0.5), 0), 255);
+}
+
+lut_t identityLut() {
+	lut_t lut;
+	for (int c = 0; c < 3; ++c) {
+		for (int i = 0; i < 256; ++i) {
+			lut.pre[c][i] = i;
+			lut.post[c][i] = i;
+		}
+	}
+	lut.luminance = false;
+	return lut;
+}
+
+// A lut_t sending all three channels through table
+static lut_t channel_lut(const uint8_t *table) {
+	lut_t lut = identityLut();
+	for (int c = 0; c < 3; ++c) {
+		std::copy(table, table + 256, lut.pre[c]);
+	}
+	return lut;
+}
+
+lut_t grayscaleLut() {
+	lut_t lut = identityLut();
+	lut.luminance = true;
+	return lut;
+}
+
+lut_t brightnessContrastLut(int brightness, float contrast) {
+	uint8_t t[256];
+	for (int i = 0; i < 256; ++i) {
+		t[i] = clamp_byte((i + brightness - 128) * (double) contrast + 128);
+	}
+	return channel_lut(t);
+}
+
+lut_t gammaLut(float gamma) {
+	if (gamma <= 0) { return identityLut(); }
+	uint8_t t[256];
+	for (int i = 0; i < 256; ++i) {
+		t[i] = clamp_byte(255 * pow(i / 255.0, 1.0 / gamma));
+	}
+	return channel_lut(t);
+}
+
+lut_t invertLut() {
+	uint8_t t[256];
+	for (int i = 0; i < 256; ++i) {
+		t[i] = 255 - i;
+	}
+	return channel_lut(t);
+}
+
+lut_t thresholdLut(int level) {
+	lut_t lut = grayscaleLut();
+	for (int c = 0; c < 3; ++c) {
+		for (int i = 0; i < 256; ++i) {
+			lut.post[c][i] = i >= level ? 255 : 0;
+		}
+	}
+	return lut;
+}
+
+// Table of levelsLut() for one channel
+static void levels_table(int black, int white, float gamma, uint8_t *t) {
+	white = std::max(white, black + 1);
+	if (gamma <= 0) { gamma = 1; }
+	for (int i = 0; i < 256; ++i) {
+		double v = std::min(std::max((i - black) / (double) (white - black), 0.0), 1.0);
+		t[i] = clamp_byte(255 * pow(v, 1.0 / gamma));
+	}
+}
+
+lut_t levelsLut(int black, int white, float gamma) {
+	uint8_t t[256];
+	levels_table(black, white, gamma, t);
+	return channel_lut(t);
+}
+
+lut_t curvesLut(const int *x, const int *y, int n) {
+	if (n < 1) { return identityLut(); }
+	// Fritsch-Carlson tangents, limited so the curve does not overshoot
+	// between points
+	std::vector<double> d(std::max(n - 1, 0)), m(n, 0.0);
+	for (int k = 0; k + 1 < n; ++k) {
+		d[k] = (y[k + 1] - y[k]) / (double) std::max(x[k + 1] - x[k], 1);
+	}
+	if (n > 1) {
+		m[0] = d[0];
+		m[n - 1] = d[n - 2];
+	}
+	for (int k = 1; k + 1 < n; ++k) {
+		m[k] = d[k - 1] * d[k] <= 0 ? 0 : (d[k - 1] + d[k]) / 2;
+	}
+	for (int k = 0; k + 1 < n; ++k) {
+		if (d[k] == 0) {
+			m[k] = m[k + 1] = 0;
+			continue;
+		}
+		double a = m[k] / d[k];
+		double b = m[k + 1] / d[k];
+		double s = a * a + b * b;
+		if (s > 9) {
+			double t = 3 / sqrt(s);
+			m[k] = t * a * d[k];
+			m[k + 1] = t * b * d[k];
+		}
+	}
+
+	uint8_t t[256];
+	int k = 0;
+	for (int i = 0; i < 256; ++i) {
+		if (i <= x[0]) {
+			t[i] = clamp_byte(y[0]);
+			continue;
+		}
+		if (i >= x[n - 1]) {
+			t[i] = clamp_byte(y[n - 1]);
+			continue;
+		}
+		while (x[k + 1] < i) { ++k; }
+		double h = std::max(x[k + 1] - x[k], 1);
+		double s = (i - x[k]) / h;
+		double s2 = s * s, s3 = s2 * s;
+		t[i] = clamp_byte((2 * s3 - 3 * s2 + 1) * y[k] + (s3 - 2 * s2 + s) * h * m[k]
+						  + (-2 * s3 + 3 * s2) * y[k + 1] + (s3 - s2) * h * m[k + 1]);
+	}
+	return channel_lut(t);
+}
+
+lut_t equalizeLut(const histogram_t &h) {
+	lut_t lut = identityLut();
+	for (int c = 0; c < 3; ++c) {
+		uint64_t total = 0;
+		for (int i = 0; i < 256; ++i) { total += h.count[c][i]; }
+		uint64_t cdf = 0;
+		uint64_t lowest = 0;	// count of the darkest value present
+		for (int i = 0; i < 256; ++i) {
+			cdf += h.count[c][i];
+			if (!lowest) { lowest = cdf; }
+			if (total > lowest) {
+				lut.pre[c][i] = clamp_byte((cdf - lowest) * 255.0 / (total - lowest));
+			}
+		}
+	}
+	return lut;
+}
+
+lut_t autoLevelsLut(const histogram_t &h, float clip) {
+	lut_t lut = identityLut();
+	for (int c = 0; c < 3; ++c) {
+		uint64_t total = 0;
+		for (int i = 0; i < 256; ++i) { total += h.count[c][i]; }
+		uint64_t skip = (uint64_t) (total * (double) clip);
+		int black = 0, white = 255;
+		for (uint64_t sum = 0; black < 255 && (sum += h.count[c][black]) <= skip; ++black) {}
+		for (uint64_t sum = 0; white > 0 && (sum += h.count[c][white]) <= skip; --white) {}
+		if (white > black) { levels_table(black, white, 1, lut.pre[c]); }
+	}
+	return lut;
+}
+
+lut_t composeLut(const lut_t &first, const lut_t &then) {
+	lut_t lut = first;
+	if (!then.luminance) {
+		// then's tables follow whichever tables first ends with
+		uint8_t (*last)[256] = first.luminance ? lut.post : lut.pre;
+		for (int c = 0; c < 3; ++c) {
+			for (int i = 0; i < 256; ++i) {
+				last[c][i] = then.pre[c][last[c][i]];
+			}
+		}
+		return lut;
+	}
+	if (!first.luminance) {
+		for (int c = 0; c < 3; ++c) {
+			for (int i = 0; i < 256; ++i) {
+				lut.pre[c][i] = then.pre[c][first.pre[c][i]];
+				lut.post[c][i] = then.post[c][i];
+			}
+		}
+		lut.luminance = true;
+		return lut;
+	}
+	// After first's luminance every channel is a function of one value v,
+	// so then's luminance is one too and folds into the last tables
+	for (int v = 0; v < 256; ++v) {
+		int l = luminance_of(then.pre[0][first.post[0][v]], then.pre[1][first.post[1][v]],
+							 then.pre[2][first.post[2][v]]);
+		for (int c = 0; c < 3; ++c) {
+			lut.post[c][v] = then.post[c][l];
+		}
+	}
+	return lut;
+}
+
+void applyLut(QImage *in, const lut_t &lut, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "applyLut");
+	if (qpb) { qpb->setRange(0, 1); }
+	// In place unless the scan lines are not QRgb
+	QImage converted;
+	QImage *img = in;
+	if (in->format() != QImage::Format_RGB32 && in->format() != QImage::Format_ARGB32) {
+		converted = in->convertToFormat(QImage::Format_RGB32);
+		img = &converted;
+	}
+	int w = img->width();
+	// Detach before the threads write
+	uchar *bits = img->bits();
+	int stride = img->bytesPerLine();
+
+	// Tables widened to their place in a QRgb, so a pixel takes three
+	// loads and two ors. The luminance path weights in double, so its
+	// sums match grayscale()'s.
+	uint32_t red[256], green[256], blue[256], post[256];
+	double wr[256], wg[256], wb[256];
+	for (int i = 0; i < 256; ++i) {
+		red[i] = (uint32_t) lut.pre[0][i] << 16;
+		green[i] = (uint32_t) lut.pre[1][i] << 8;
+		blue[i] = lut.pre[2][i];
+		post[i] = (uint32_t) lut.post[0][i] << 16 | lut.post[1][i] << 8 | lut.post[2][i];
+		wr[i] = .299 * lut.pre[0][i];
+		wg[i] = .587 * lut.pre[1][i];
+		wb[i] = .114 * lut.pre[2][i];
+	}
+	parallel_ranges(img->height(), MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		for (int y = y0; y < y1; ++y) {
+			QRgb *p = (QRgb *) (bits + (size_t) y * stride);
+			if (lut.luminance) {
+				for (int x = 0; x < w; ++x) {
+					QRgb c = p[x];
+					int v = wr[(c >> 16) & 0xff] + wg[(c >> 8) & 0xff] + wb[c & 0xff];
+					p[x] = (c & 0xff000000) | post[v];
+				}
+			} else {
+				for (int x = 0; x < w; ++x) {
+					QRgb c = p[x];
+					p[x] = (c & 0xff000000) | red[(c >> 16) & 0xff] | green[(c >> 8) & 0xff]
+						 | blue[c & 0xff];
+				}
+			}
+		}
+	});
+	if (qpb) { qpb->setValue(1); }
+
+	if (img != in) { *in = converted.convertToFormat(in->format()); }
+}
+
+// Sets of counts each histogram() thread spreads its pixels over
+static const int HISTOGRAM_SETS = 4;
+
+histogram_t histogram(const QImage *in) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "histogram");
+	QImage src = rgb32(in);
+	int w = src.width();
+	histogram_t h = histogram_t();
+	std::mutex lock;
+	parallel_ranges(src.height(), MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		// Each thread counts its rows on its own and adds them in at the
+		// end. Neighbouring pixels go to separate sets of counts, so runs
+		// of one colour do not queue on a single counter.
+		histogram_t part[HISTOGRAM_SETS] = {};
+		for (int y = y0; y < y1; ++y) {
+			const QRgb *p = (const QRgb *) src.constScanLine(y);
+			int x = 0;
+			for (; x + HISTOGRAM_SETS <= w; x += HISTOGRAM_SETS) {
+				for (int k = 0; k < HISTOGRAM_SETS; ++k) {
+					// A copy, as the counts could alias the scan line
+					QRgb c = p[x + k];
+					++part[k].count[0][qRed(c)];
+					++part[k].count[1][qGreen(c)];
+					++part[k].count[2][qBlue(c)];
+				}
+			}
+			for (; x < w; ++x) {
+				QRgb c = p[x];
+				++part[0].count[0][qRed(c)];
+				++part[0].count[1][qGreen(c)];
+				++part[0].count[2][qBlue(c)];
+			}
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		for (int k = 0; k < HISTOGRAM_SETS; ++k) {
+			for (int c = 0; c < 3; ++c) {
+				for (int i = 0; i < 256; ++i) {
+					h.count[c][i] += part[k].count[c][i];
+				}
+			}
+		}
+	});
+	return h;
+}
+
+void grayscale(QImage *in, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "grayscale");
+	applyLut(in, grayscaleLut(), qpb);
+}
+
 void flip(QImage *in, QProgressBar *qpb) {
-	qpb->setRange(0, in->height() * in->width() / 2);
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "flip");
+	if (qpb) { qpb->setRange(0, in->height() * in->width() / 2); }
 	int curr_pix = 0;
 	for (int i = 0; i < in->height(); ++i) {
 		for (int j = 0; j < in->width() / 2; ++j) {
@@ -32,12 +436,14 @@ void flip(QImage *in, QProgressBar *qpb) {
 			in->setPixel(in->width() - j - 1, i, tmp);
 		}
 		curr_pix += in->width() / 2;
-		qpb->setValue(curr_pix);
+		if (qpb) { qpb->setValue(curr_pix); }
 	}
 }
 
 void flop(QImage *in, QProgressBar *qpb) {
-	qpb->setRange(0, in->height() * in->width() / 2);
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "flop");
+	if (qpb) { qpb->setRange(0, in->height() * in->width() / 2); }
 	int curr_pix = 0;
 	for (int i = 0; i < in->width(); ++i) {
 		for (int j = 0; j < in->height() / 2; ++j) {
@@ -46,12 +452,14 @@ void flop(QImage *in, QProgressBar *qpb) {
 			in->setPixel(i, in->height() - j - 1, tmp);
 		}
 		curr_pix += in->width() / 2;
-		qpb->setValue(curr_pix);
+		if (qpb) { qpb->setValue(curr_pix); }
 	}
 }
 
 QImage transpose(QImage *in, QProgressBar *qpb) {
-	qpb->setRange(0, in->height() * in->width());
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "transpose");
+	if (qpb) { qpb->setRange(0, in->height() * in->width()); }
 	int curr_pix = 0;
 	QImage out(in->height(), in->width(), in->format());
 	for (int i = 0; i < in->width(); ++i) {
@@ -59,50 +467,208 @@ QImage transpose(QImage *in, QProgressBar *qpb) {
 			out.setPixel(j, i, in->pixel(i, j));
 		}
 		curr_pix += in->height();
-		qpb->setValue(curr_pix);
+		if (qpb) { qpb->setValue(curr_pix); }
 	}
 	return out;
 }
 
+// Summed-area tables. Entry (x, y) of a table holds the sums over the
+// pixels above and to the left of pixel (x, y), with a zero first row and
+// column, as three lanes in QRgb's byte order: blue, green and red. The
+// SSE paths move an entry as four lanes, the fourth spilling into the
+// next entry, so the table has one lane of padding at its end. Sums are
+// 32 bits and wrap, which still gives exact rectangle sums as long as the
+// true sum fits in 32 bits: any rectangle of up to 2^32 / 255 pixels, or
+// 2^32 / 255^2 pixels for the squares.
+struct sat_t {
+	int width;
+	int height;
+	std::vector<uint32_t> sum;
+	std::vector<uint32_t> sq;	// empty unless squares were asked for
+};
+
+static const int SAT_LANES = 3;
+
+// First pass: running sums along each row
+static void sat_scan_rows(const QImage &src, sat_t *t, int y0, int y1) {
+	size_t stride = (size_t) (t->width + 1) * SAT_LANES;
+	bool squares = !t->sq.empty();
+	for (int y = y0; y < y1; ++y) {
+		const QRgb *p = (const QRgb *) src.constScanLine(y);
+		uint32_t *s = &t->sum[(y + 1) * stride + SAT_LANES];
+		uint32_t *q = squares ? &t->sq[(y + 1) * stride + SAT_LANES] : 0;
+#ifdef IM_OP_SSE
+		// Left to right, so each store's fourth lane is overwritten by
+		// the next entry. That lane is always zero, so the last store's
+		// leaves the next row's zero first entry, or the padding, as it was.
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i rgb_mask = _mm_set_epi32(0, -1, -1, -1);
+		__m128i acc = zero;
+		__m128i acc_sq = zero;
+		for (int x = 0; x < t->width; ++x) {
+			__m128i v16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) p[x]), zero);
+			acc = _mm_add_epi32(acc, _mm_and_si128(_mm_unpacklo_epi16(v16, zero), rgb_mask));
+			_mm_storeu_si128((__m128i *) (s + SAT_LANES * x), acc);
+			if (squares) {
+				// 255^2 still fits the 16-bit lanes
+				__m128i sq16 = _mm_mullo_epi16(v16, v16);
+				acc_sq = _mm_add_epi32(acc_sq, _mm_and_si128(_mm_unpacklo_epi16(sq16, zero), rgb_mask));
+				_mm_storeu_si128((__m128i *) (q + SAT_LANES * x), acc_sq);
+			}
+		}
+#else
+		uint32_t acc[3] = { 0, 0, 0 };
+		uint32_t acc_sq[3] = { 0, 0, 0 };
+		for (int x = 0; x < t->width; ++x) {
+			uint32_t c[3] = { (uint32_t) qBlue(p[x]), (uint32_t) qGreen(p[x]), (uint32_t) qRed(p[x]) };
+			for (int k = 0; k < 3; ++k) {
+				acc[k] += c[k];
+				s[SAT_LANES * x + k] = acc[k];
+				if (squares) {
+					acc_sq[k] += c[k] * c[k];
+					q[SAT_LANES * x + k] = acc_sq[k];
+				}
+			}
+		}
+#endif
+	}
+}
+
+// Second pass: adds each row into the one below it, over entries
+// [x0, x1) of every row
+static void sat_scan_columns(std::vector<uint32_t> &table, int width, int height, int x0, int x1) {
+	size_t stride = (size_t) (width + 1) * SAT_LANES;
+	size_t k0 = (size_t) x0 * SAT_LANES;
+	size_t k1 = (size_t) x1 * SAT_LANES;
+	for (int y = 2; y <= height; ++y) {
+		const uint32_t *above = &table[(y - 1) * stride];
+		uint32_t *row = &table[y * stride];
+		size_t k = k0;
+#ifdef IM_OP_SSE
+		for (; k + 4 <= k1; k += 4) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (above + k));
+			__m128i b = _mm_loadu_si128((const __m128i *) (row + k));
+			_mm_storeu_si128((__m128i *) (row + k), _mm_add_epi32(a, b));
+		}
+#endif
+		for (; k < k1; ++k) {
+			row[k] += above[k];
+		}
+	}
+}
+
+static std::shared_ptr<sat_t> sat_build(const QImage *in, bool squares) {
+	TRACE_SCOPE("filter", "summedAreaTable");
+	QImage src = rgb32(in);
+
+	std::shared_ptr<sat_t> t = std::make_shared<sat_t>();
+	t->width = src.width();
+	t->height = src.height();
+	size_t lanes = (size_t) (t->width + 1) * (t->height + 1) * SAT_LANES + 1;
+	t->sum.assign(lanes, 0);
+	if (squares) { t->sq.assign(lanes, 0); }
+
+	parallel_ranges(t->height, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		sat_scan_rows(src, t.get(), y0, y1);
+	});
+	parallel_ranges(t->width + 1, MIN_ROWS_PER_THREAD, [&](int x0, int x1) {
+		sat_scan_columns(t->sum, t->width, t->height, x0, x1);
+		if (squares) { sat_scan_columns(t->sq, t->width, t->height, x0, x1); }
+	});
+	return t;
+}
+
+// The last table built, while anyone still holds it. Weak, so a table
+// never outlives the filters and callers using it.
+static std::mutex sat_cache_lock;
+static qint64 sat_cache_key;
+static std::weak_ptr<sat_t> sat_cache;
+
+std::shared_ptr<const sat_t> summedAreaTable(const QImage *in, bool squares) {
+	std::lock_guard<std::mutex> lock(sat_cache_lock);
+	std::shared_ptr<sat_t> t = sat_cache.lock();
+	if (t && sat_cache_key == in->cacheKey() && (!squares || !t->sq.empty())) {
+		return t;
+	}
+	t = sat_build(in, squares);
+	sat_cache = t;
+	sat_cache_key = in->cacheKey();
+	return t;
+}
+
+void clearSummedAreaTableCache() {
+	std::lock_guard<std::mutex> lock(sat_cache_lock);
+	sat_cache.reset();
+}
+
+static inline void sat_rect(const std::vector<uint32_t> &table, int width,
+		int x0, int y0, int x1, int y1, uint32_t out[4]) {
+	size_t stride = (size_t) (width + 1) * SAT_LANES;
+	const uint32_t *top = &table[y0 * stride];
+	const uint32_t *bottom = &table[y1 * stride];
+#ifdef IM_OP_SSE
+	// The fourth lane reads the next entry, or the padding, and is ignored
+	__m128i a = _mm_loadu_si128((const __m128i *) (top + SAT_LANES * x0));
+	__m128i b = _mm_loadu_si128((const __m128i *) (top + SAT_LANES * x1));
+	__m128i c = _mm_loadu_si128((const __m128i *) (bottom + SAT_LANES * x0));
+	__m128i d = _mm_loadu_si128((const __m128i *) (bottom + SAT_LANES * x1));
+	_mm_storeu_si128((__m128i *) out, _mm_add_epi32(_mm_sub_epi32(d, _mm_add_epi32(b, c)), a));
+#else
+	for (int k = 0; k < SAT_LANES; ++k) {
+		out[k] = bottom[SAT_LANES * x1 + k] - top[SAT_LANES * x1 + k]
+			- bottom[SAT_LANES * x0 + k] + top[SAT_LANES * x0 + k];
+	}
+#endif
+}
+
+void rectSum(const sat_t *sat, int x0, int y0, int x1, int y1, uint32_t rgb[3]) {
+	uint32_t s[4];
+	sat_rect(sat->sum, sat->width, x0, y0, x1, y1, s);
+	rgb[0] = s[2]; rgb[1] = s[1]; rgb[2] = s[0];
+}
+
+void rectSquareSum(const sat_t *sat, int x0, int y0, int x1, int y1, uint32_t rgb[3]) {
+	uint32_t s[4];
+	sat_rect(sat->sq, sat->width, x0, y0, x1, y1, s);
+	rgb[0] = s[2]; rgb[1] = s[1]; rgb[2] = s[0];
+}
+
 QImage boxBlur(QImage *in, int radius, QProgressBar *qpb) {
-	QImage out(in->width(), in->height(), in->format());
-	qpb->setRange(0, in->width() * in->height());
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "boxBlur");
+	std::shared_ptr<const sat_t> sat = summedAreaTable(in);
+	QImage out = rgb32_image(in->width(), in->height());
+	if (qpb) { qpb->setRange(0, in->height()); }
 
 	int pix_count = (2 * radius + 1) * (2 * radius + 1);
-	int curr_pix = 0;
 
-	for (int i = 0; i < in->width(); ++i) {
-		for (int j = 0; j < in->height(); ++j) {
+	for (int j = 0; j < in->height(); ++j) {
+		QRgb *dst = (QRgb *) out.scanLine(j);
+		for (int i = 0; i < in->width(); ++i) {
 			if (i < radius || i + radius + 1 > in->width() ||
 					j < radius || j + radius + 1 > in->height()) {
-				out.setPixel(i, j, qRgb(0, 255, 0));
+				dst[i] = qRgb(0, 255, 0);
 				continue;
 			}
-			float rSum = 0; float gSum = 0; float bSum = 0;
-			for (int k = i - radius; k < i + radius + 1; ++k) {
-				for (int l = j - radius; l < j + radius + 1; ++l) {
-					rSum += qRed(in->pixel(k, l));
-					gSum += qGreen(in->pixel(k, l));
-					bSum += qBlue(in->pixel(k, l));
-				}
-			}
-			rSum /= pix_count;
-			gSum /= pix_count;
-			bSum /= pix_count;
-			out.setPixel(i, j, qRgb((int) rSum, (int) gSum, (int) bSum));
+			uint32_t sum[3];
+			rectSum(sat.get(), i - radius, j - radius, i + radius + 1, j + radius + 1, sum);
+			float rSum = (float) sum[0] / pix_count;
+			float gSum = (float) sum[1] / pix_count;
+			float bSum = (float) sum[2] / pix_count;
+			dst[i] = qRgb((int) rSum, (int) gSum, (int) bSum);
 		}
-		curr_pix += in->height();
-		qpb->setValue(curr_pix);
+		if (qpb) { qpb->setValue(j + 1); }
 	}
 
-	qpb->setValue(qpb->maximum());
-
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
 	return out;
 }
 
 QImage medianFilter(QImage *in, int radius, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "medianFilter");
 	QImage out(in->width(), in->height(), in->format());
-	qpb->setRange(0, in->width() * in->height());
+	if (qpb) { qpb->setRange(0, in->width() * in->height()); }
 
 	int curr_pix = 0;
 
@@ -132,9 +698,9 @@ QImage medianFilter(QImage *in, int radius, QProgressBar *qpb) {
 			out.setPixel(i, j, qRgb(r_med, g_med, b_med));
 		}
 		curr_pix += in->height();
-		qpb->setValue(curr_pix);
+		if (qpb) { qpb->setValue(curr_pix); }
 	}
-	qpb->setValue(qpb->maximum());
+	if (qpb) { qpb->setValue(qpb->maximum()); }
 	return out;
 }
 
@@ -143,10 +709,12 @@ double weight(int dist, float sigma) {
 }
 
 QImage gaussianBlur(QImage *in, int radius, float sigma, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "gaussianBlur");
 	QImage row(in->width(), in->height(), in->format());
 	QImage out(in->width(), in->height(), in->format());
 
-	qpb->setRange(0, 2 * in->width() * in->height());
+	if (qpb) { qpb->setRange(0, 2 * in->width() * in->height()); }
 	int pix_count = 0;
 
 	float weight_sum = 0;
@@ -171,7 +739,7 @@ QImage gaussianBlur(QImage *in, int radius, float sigma, QProgressBar *qpb) {
 									 bsum / weight_sum));
 		}
 		pix_count += in->width();
-		qpb->setValue(pix_count);
+		if (qpb) { qpb->setValue(pix_count); }
 	}
 
 	for (int i = 0; i < in->height(); ++i) {
@@ -194,110 +762,1557 @@ QImage gaussianBlur(QImage *in, int radius, float sigma, QProgressBar *qpb) {
 									 bsum / weight_sum));
 		}
 		pix_count += in->width();
-		qpb->setValue(pix_count);
+		if (qpb) { qpb->setValue(pix_count); }
 	}
 
 	return out;
 }
 
+// sobel() scaled by max, or by the largest magnitude found when max is 0
+static QImage sobel_magnitude(QImage *in, float max, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "sobel");
+	int w = in->width();
+	int h = in->height();
+	QImage src = rgb32(in);
+	QImage out = rgb32_image(w, h);
+	if (qpb) { qpb->setRange(0, 3); }
+
+	std::vector<float> lum(w * h);
+	std::vector<float> Gx(w * h);
+	std::vector<float> Gy(w * h);
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		luminance_rows(src, lum.data(), y0, y1);
+	});
+	if (qpb) { qpb->setValue(1); }
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		sobel_rows(lum.data(), w, h, Gx.data(), Gy.data(), y0, y1);
+	});
+	if (qpb) { qpb->setValue(2); }
+
+	// The border is left out, so the maximum is taken inside it
+	std::vector<float> &G = lum;
+	int found = 0;
+	for (int i = 1; i + 1 < h; ++i) {
+		for (int j = 1; j + 1 < w; ++j) {
+			int ind = i * w + j;
+			G[ind] = sqrt(Gx[ind] * Gx[ind] + Gy[ind] * Gy[ind]);
+			if (G[ind] > found) { found = G[ind]; }
+		}
+	}
+	if (max <= 0) { max = found; }
+
+	for (int i = 0; i < h; ++i) {
+		QRgb *dst = (QRgb *) out.scanLine(i);
+		for (int j = 0; j < w; ++j) {
+			if (i < 1 || j < 1 || i + 1 >= h || j + 1 >= w) {
+				dst[j] = qRgb(0, 255, 0);
+				continue;
+			}
+			int ind = i * w + j;
+			float g = max > 0 ? std::min((G[ind] / max) * 255, 255.f) : 0;
+			dst[j] = qRgb(g, g, g);
+		}
+	}
+	if (qpb) { qpb->setValue(3); }
+
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
+
 QImage sobel(QImage *in, QProgressBar *qpb) {
-	grayscale(in, qpb);
-	QImage out(in->width(), in->height(), in->format());
+	return sobel_magnitude(in, 0, qpb);
+}
 
-	qpb->setRange(0, 6 * in->width() * in->height());
-	int pix_count = 0;
+QImage sobelScaled(QImage *in, float max, QProgressBar *qpb) {
+	return sobel_magnitude(in, std::max(max, 1.f), qpb);
+}
 
-	float *Gx_int = (float *) malloc(in->width() * in->height() * sizeof(*Gx_int));
-    float *Gx = (float *) malloc(in->width() * in->height() * sizeof(*Gx));
-    float *Gy_int = (float *) malloc(in->width() * in->height() * sizeof(*Gy_int));
-    float *Gy = (float *) malloc(in->width() * in->height() * sizeof(*Gy));
+static inline float blur_at(const float *s, int w, const std::vector<float> &kernel, int x) {
+	int r = (int) kernel.size() / 2;
+	float acc = 0;
+	for (int k = -r; k <= r; ++k) {
+		acc += kernel[k + r] * s[std::min(std::max(x + k, 0), w - 1)];
+	}
+	return acc;
+}
 
-	for (int i = 0; i < in->height(); ++i) {
-		for (int j = 0; j < in->width(); ++j) {
-			if (i < 1 || i + 1 >= in->height()) { continue; }
-			Gx_int[i * in->width() + j] = \
-				qRed(in->pixel(j, i - 1)) + \
-				qRed(in->pixel(j, i)) * 2 + \
-				qRed(in->pixel(j, i + 1));
+// One pass of a separable blur along rows [y0, y1), with the edge pixels
+// repeated past the border
+static void blur_rows(const float *src, float *dst, int w,
+		const std::vector<float> &kernel, int y0, int y1) {
+	int r = (int) kernel.size() / 2;
+	for (int y = y0; y < y1; ++y) {
+		const float *s = src + y * w;
+		float *d = dst + y * w;
+		int x = 0;
+		for (; x < std::min(r, w); ++x) {
+			d[x] = blur_at(s, w, kernel, x);
+		}
+#ifdef IM_OP_SSE
+		// Four pixels at a time while the window stays inside the row
+		for (; x + r + 4 <= w; x += 4) {
+			__m128 acc = _mm_setzero_ps();
+			for (int k = -r; k <= r; ++k) {
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(kernel[k + r]),
+						_mm_loadu_ps(s + x + k)));
+			}
+			_mm_storeu_ps(d + x, acc);
+		}
+#endif
+		for (; x < w; ++x) {
+			d[x] = blur_at(s, w, kernel, x);
 		}
 	}
+}
 
-	pix_count += in->width() * in->height();
-	qpb->setValue(pix_count);
+// The other pass, down columns, for rows [y0, y1) of a w by h plane
+static void blur_columns(const float *src, float *dst, int w, int h,
+		const std::vector<float> &kernel, int y0, int y1) {
+	int r = (int) kernel.size() / 2;
+	for (int y = y0; y < y1; ++y) {
+		float *d = dst + y * w;
+		int x = 0;
+#ifdef IM_OP_SSE
+		for (; x + 4 <= w; x += 4) {
+			__m128 acc = _mm_setzero_ps();
+			for (int k = -r; k <= r; ++k) {
+				const float *s = src + std::min(std::max(y + k, 0), h - 1) * w;
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(kernel[k + r]),
+						_mm_loadu_ps(s + x)));
+			}
+			_mm_storeu_ps(d + x, acc);
+		}
+#endif
+		for (; x < w; ++x) {
+			float acc = 0;
+			for (int k = -r; k <= r; ++k) {
+				acc += kernel[k + r] * src[std::min(std::max(y + k, 0), h - 1) * w + x];
+			}
+			d[x] = acc;
+		}
+	}
+}
 
-	for (int i = 0; i < in->height(); ++i) {
-		for (int j = 0; j < in->width(); ++j) {
-			if (j < 1 || j + 1 >= in->height()) { continue; }
-			Gx[i * in->width() + j] = \
-				Gx_int[i * in->width() + (j - 1)] * -1 + \
-				Gx_int[i * in->width() + (j + 1)];
+// Pixel classes left by non-maximum suppression
+enum { EDGE_NONE = 0, EDGE_WEAK = 1, EDGE_STRONG = 2 };
+
+// tan(22.5) and tan(67.5) degrees, the bounds of the diagonal directions
+static const float TAN_22_5 = 0.41421356f;
+static const float TAN_67_5 = 2.41421356f;
+
+static inline unsigned char nms_at(const float *mag, const float *gx, const float *gy,
+		int w, int i, float low, float high) {
+	float m = mag[i];
+	float ax = std::fabs(gx[i]);
+	float ay = std::fabs(gy[i]);
+	int step;
+	if (ay <= TAN_22_5 * ax) { step = 1; }
+	else if (ay >= TAN_67_5 * ax) { step = w; }
+	else if ((gx[i] > 0) == (gy[i] > 0)) { step = w + 1; }
+	else { step = w - 1; }
+	if (m < mag[i - step] || m <= mag[i + step]) { return EDGE_NONE; }
+	return m >= high ? EDGE_STRONG : m >= low ? EDGE_WEAK : EDGE_NONE;
+}
+
+// Non-maximum suppression and the two thresholds for rows [y0, y1). A
+// pixel stays when its magnitude is a maximum across the edge, i.e. along
+// the gradient quantized to 0, 45, 90 or 135 degrees. The outermost rows
+// and columns are dropped.
+static void nms_rows(const float *mag, const float *gx, const float *gy,
+		int w, int h, float low, float high, unsigned char *cls, int y0, int y1) {
+	for (int y = y0; y < y1; ++y) {
+		unsigned char *c = cls + y * w;
+		if (y == 0 || y == h - 1) {
+			std::fill(c, c + w, EDGE_NONE);
+			continue;
+		}
+		c[0] = EDGE_NONE;
+		c[w - 1] = EDGE_NONE;
+		int x = 1;
+#ifdef IM_OP_SSE
+		const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		const __m128 t1 = _mm_set1_ps(TAN_22_5);
+		const __m128 t2 = _mm_set1_ps(TAN_67_5);
+		const __m128 lo = _mm_set1_ps(low);
+		const __m128 hi = _mm_set1_ps(high);
+		const __m128 zero = _mm_setzero_ps();
+		for (; x + 4 < w; x += 4) {
+			int i = y * w + x;
+			__m128 m = _mm_loadu_ps(mag + i);
+			__m128 vx = _mm_loadu_ps(gx + i);
+			__m128 vy = _mm_loadu_ps(gy + i);
+			__m128 ax = _mm_and_ps(vx, abs_mask);
+			__m128 ay = _mm_and_ps(vy, abs_mask);
+			__m128 horiz = _mm_cmple_ps(ay, _mm_mul_ps(t1, ax));
+			__m128 vert = _mm_andnot_ps(horiz, _mm_cmpge_ps(ay, _mm_mul_ps(t2, ax)));
+			__m128 diag = _mm_andnot_ps(_mm_or_ps(horiz, vert), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+			// Gradients along the main diagonal have x and y of one sign
+			__m128 signs_differ = _mm_xor_ps(_mm_cmpgt_ps(vx, zero), _mm_cmpgt_ps(vy, zero));
+			__m128 main_diag = _mm_andnot_ps(signs_differ, diag);
+			__m128 anti_diag = _mm_and_ps(signs_differ, diag);
+
+			// The neighbours before and after along each direction,
+			// blended by the lanes' directions
+			__m128 before = _mm_or_ps(
+				_mm_or_ps(_mm_and_ps(horiz, _mm_loadu_ps(mag + i - 1)),
+						  _mm_and_ps(vert, _mm_loadu_ps(mag + i - w))),
+				_mm_or_ps(_mm_and_ps(main_diag, _mm_loadu_ps(mag + i - w - 1)),
+						  _mm_and_ps(anti_diag, _mm_loadu_ps(mag + i - w + 1))));
+			__m128 after = _mm_or_ps(
+				_mm_or_ps(_mm_and_ps(horiz, _mm_loadu_ps(mag + i + 1)),
+						  _mm_and_ps(vert, _mm_loadu_ps(mag + i + w))),
+				_mm_or_ps(_mm_and_ps(main_diag, _mm_loadu_ps(mag + i + w + 1)),
+						  _mm_and_ps(anti_diag, _mm_loadu_ps(mag + i + w - 1))));
+			__m128 peak = _mm_and_ps(_mm_cmpge_ps(m, before), _mm_cmpgt_ps(m, after));
+
+			int weak = _mm_movemask_ps(_mm_and_ps(peak, _mm_cmpge_ps(m, lo)));
+			int strong = _mm_movemask_ps(_mm_and_ps(peak, _mm_cmpge_ps(m, hi)));
+			for (int k = 0; k < 4; ++k) {
+				c[x + k] = (strong >> k & 1) ? EDGE_STRONG : (weak >> k & 1) ? EDGE_WEAK : EDGE_NONE;
+			}
+		}
+#endif
+		for (; x < w - 1; ++x) {
+			c[x] = nms_at(mag, gx, gy, w, y * w + x, low, high);
 		}
 	}
+}
 
-	pix_count += in->width() * in->height();
-	qpb->setValue(pix_count);
+QImage canny(QImage *in, float sigma, float low, float high, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "canny");
+	int w = in->width();
+	int h = in->height();
+	QImage src = rgb32(in);
+	if (qpb) { qpb->setRange(0, 5); }
 
-	for (int i = 0; i < in->height(); ++i) {
-		for (int j = 0; j < in->width(); ++j) {
-			if (i < 1 || i + 1 >= in->height()) { continue; }
-			Gy_int[i * in->width() + j] = \
-				qRed(in->pixel(j, i - 1)) + \
-				qRed(in->pixel(j, i + 1)) * -1;
+	// A sigma of 0 skips the smoothing
+	int radius = sigma > 0 ? std::max(1, (int) ceil(3 * sigma)) : 0;
+	std::vector<float> kernel(2 * radius + 1, 1);
+	if (radius > 0) {
+		float weight_sum = 0;
+		for (int i = -radius; i <= radius; ++i) {
+			kernel[i + radius] = weight(abs(i), sigma);
+			weight_sum += kernel[i + radius];
+		}
+		for (size_t i = 0; i < kernel.size(); ++i) {
+			kernel[i] /= weight_sum;
 		}
 	}
 
-	pix_count += in->width() * in->height();
-	qpb->setValue(pix_count);
+	std::vector<float> a(w * h);
+	std::vector<float> b(w * h);
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		TRACE_SCOPE("filter", "canny smooth");
+		luminance_rows(src, a.data(), y0, y1);
+		blur_rows(a.data(), b.data(), w, kernel, y0, y1);
+	});
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		TRACE_SCOPE("filter", "canny smooth");
+		blur_columns(b.data(), a.data(), w, h, kernel, y0, y1);
+	});
+	if (qpb) { qpb->setValue(1); }
 
-	for (int i = 0; i < in->height(); ++i) {
-		for (int j = 0; j < in->width(); ++j) {
-			if (j < 1 || j + 1 >= in->height()) { continue; }
-			Gy[i * in->width() + j] = \
-				Gy_int[i * in->width() + (j - 1)] + \
-				Gy_int[i * in->width() + j] * 2 + \
-				Gy_int[i * in->width() + (j + 1)];
+	std::vector<float> gx(w * h);
+	std::vector<float> &gy = b;
+	std::vector<float> mag(w * h);
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		TRACE_SCOPE("filter", "canny gradient");
+		sobel_rows(a.data(), w, h, gx.data(), gy.data(), y0, y1);
+		int i = y0 * w;
+		int end = y1 * w;
+#ifdef IM_OP_SSE
+		for (; i + 4 <= end; i += 4) {
+			__m128 vx = _mm_loadu_ps(&gx[i]);
+			__m128 vy = _mm_loadu_ps(&gy[i]);
+			_mm_storeu_ps(&mag[i], _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy))));
+		}
+#endif
+		for (; i < end; ++i) {
+			mag[i] = sqrt(gx[i] * gx[i] + gy[i] * gy[i]);
+		}
+	});
+	if (qpb) { qpb->setValue(2); }
+
+	std::vector<unsigned char> cls(w * h);
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		TRACE_SCOPE("filter", "canny suppress");
+		nms_rows(mag.data(), gx.data(), gy.data(), w, h, low, high, cls.data(), y0, y1);
+	});
+	if (qpb) { qpb->setValue(3); }
+
+	// Hysteresis: weak pixels are kept when connected to a strong one.
+	// Strong pixels seed a stack, and every weak 8-neighbour reached is
+	// promoted and pushed in turn.
+	std::vector<int> stack;
+	{
+		TRACE_SCOPE("filter", "canny hysteresis");
+		for (int i = 0; i < w * h; ++i) {
+			if (cls[i] == EDGE_STRONG) { stack.push_back(i); }
+		}
+		const int offsets[8] = { -w - 1, -w, -w + 1, -1, 1, w - 1, w, w + 1 };
+		while (!stack.empty()) {
+			int i = stack.back();
+			stack.pop_back();
+			for (int k = 0; k < 8; ++k) {
+				// Border pixels are never weak, so neighbours stay in range
+				int n = i + offsets[k];
+				if (cls[n] == EDGE_WEAK) {
+					cls[n] = EDGE_STRONG;
+					stack.push_back(n);
+				}
+			}
 		}
 	}
+	if (qpb) { qpb->setValue(4); }
 
-	pix_count += in->width() * in->height();
-	qpb->setValue(pix_count);
+	QImage out = rgb32_image(w, h);
+	for (int y = 0; y < h; ++y) {
+		QRgb *dst = (QRgb *) out.scanLine(y);
+		for (int x = 0; x < w; ++x) {
+			dst[x] = cls[y * w + x] == EDGE_STRONG ? qRgb(255, 255, 255) : qRgb(0, 0, 0);
+		}
+	}
+	if (qpb) { qpb->setValue(5); }
 
-	free(Gx_int);
-    free(Gy_int);
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
 
-    float *G = (float *) malloc(in->width() * in->height() * sizeof(*G));
+// The window of radius around (x, y), clipped to the image, as the
+// corners rectSum takes
+static inline void clip_window(const QImage *in, int x, int y, int radius,
+		int *x0, int *y0, int *x1, int *y1) {
+	*x0 = std::max(x - radius, 0);
+	*y0 = std::max(y - radius, 0);
+	*x1 = std::min(x + radius + 1, in->width());
+	*y1 = std::min(y + radius + 1, in->height());
+}
 
-	int max = 0;
+QImage localMean(QImage *in, int radius, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "localMean");
+	std::shared_ptr<const sat_t> sat = summedAreaTable(in);
+	QImage out = rgb32_image(in->width(), in->height());
+	if (qpb) { qpb->setRange(0, in->height()); }
 
-	for (int i = 0; i < in->height(); ++i) {
-		for (int j = 0; j < in->width(); ++j) {
-			int ind = i * in->width() + j;
-			G[ind] = sqrt(Gx[ind] * Gx[ind] + Gy[ind] * Gy[ind]);
-			if (G[ind] > max) { max = G[ind]; }
+	for (int j = 0; j < in->height(); ++j) {
+		QRgb *dst = (QRgb *) out.scanLine(j);
+		for (int i = 0; i < in->width(); ++i) {
+			int x0, y0, x1, y1;
+			clip_window(in, i, j, radius, &x0, &y0, &x1, &y1);
+			uint32_t n = (x1 - x0) * (y1 - y0);
+			uint32_t sum[3];
+			rectSum(sat.get(), x0, y0, x1, y1, sum);
+			dst[i] = qRgb((sum[0] + n / 2) / n, (sum[1] + n / 2) / n, (sum[2] + n / 2) / n);
 		}
+		if (qpb) { qpb->setValue(j + 1); }
 	}
 
-	pix_count += in->width() * in->height();
-	qpb->setValue(pix_count);
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
 
-	for (int i = 0; i < in->height(); ++i) {
-		for (int j = 0; j < in->width(); ++j) {
-			if (i < 1 || j < 1 || i + 1 >= in->height() || j + 1 >= in->width()) {
-				out.setPixel(j, i, qRgb(0, 255, 0));
-				continue;
+QImage localStdDev(QImage *in, int radius, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "localStdDev");
+	radius = std::min(radius, MAX_STDDEV_RADIUS);
+	std::shared_ptr<const sat_t> sat = summedAreaTable(in, true);
+	QImage out = rgb32_image(in->width(), in->height());
+	if (qpb) { qpb->setRange(0, in->height()); }
+
+	for (int j = 0; j < in->height(); ++j) {
+		QRgb *dst = (QRgb *) out.scanLine(j);
+		for (int i = 0; i < in->width(); ++i) {
+			int x0, y0, x1, y1;
+			clip_window(in, i, j, radius, &x0, &y0, &x1, &y1);
+			double n = (x1 - x0) * (y1 - y0);
+			uint32_t sum[3];
+			uint32_t sq[3];
+			rectSum(sat.get(), x0, y0, x1, y1, sum);
+			rectSquareSum(sat.get(), x0, y0, x1, y1, sq);
+			int dev[3];
+			for (int k = 0; k < 3; ++k) {
+				double mean = sum[k] / n;
+				double var = std::max(sq[k] / n - mean * mean, 0.0);
+				dev[k] = std::min((int) (std::sqrt(var) + 0.5), 255);
+			}
+			dst[i] = qRgb(dev[0], dev[1], dev[2]);
+		}
+		if (qpb) { qpb->setValue(j + 1); }
+	}
+
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
+
+QImage adaptiveThreshold(QImage *in, int radius, int offset, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "adaptiveThreshold");
+	std::shared_ptr<const sat_t> sat = summedAreaTable(in);
+	QImage out = rgb32_image(in->width(), in->height());
+	if (qpb) { qpb->setRange(0, in->height()); }
+
+	bool rgb32 = in->format() == QImage::Format_RGB32 ||
+			in->format() == QImage::Format_ARGB32;
+	for (int j = 0; j < in->height(); ++j) {
+		const QRgb *src = rgb32 ? (const QRgb *) in->constScanLine(j) : 0;
+		QRgb *dst = (QRgb *) out.scanLine(j);
+		for (int i = 0; i < in->width(); ++i) {
+			int x0, y0, x1, y1;
+			clip_window(in, i, j, radius, &x0, &y0, &x1, &y1);
+			double n = (x1 - x0) * (y1 - y0);
+			uint32_t sum[3];
+			rectSum(sat.get(), x0, y0, x1, y1, sum);
+			// Luminance is linear, so the mean of the grayscale values is
+			// the grayscale value of the channel means
+			double mean = (.299 * sum[0] + .587 * sum[1] + .114 * sum[2]) / n;
+			QRgb tmp = rgb32 ? src[i] : in->pixel(i, j);
+			int val = .299 * qRed(tmp) + .587 * qGreen(tmp) + .114 * qBlue(tmp);
+			dst[i] = val > mean - offset ? qRgb(255, 255, 255) : qRgb(0, 0, 0);
+		}
+		if (qpb) { qpb->setValue(j + 1); }
+	}
+
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
+
+/*
+ * Convolution
+ */
+
+// GCC and Clang can compile the AVX2 loops into any x86 build and pick
+// them at run time; other compilers only get them when the target has
+// AVX2. Every path does the same arithmetic in the same order, so the
+// output does not depend on the CPU.
+#if defined(IM_OP_SSE) && (defined(__GNUC__) || defined(__clang__))
+#define IM_OP_AVX2 1
+#define IM_OP_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(IM_OP_SSE) && defined(__AVX2__)
+#define IM_OP_AVX2 1
+#define IM_OP_AVX2_TARGET
+#endif
+#ifdef IM_OP_AVX2
+#include <immintrin.h>
+
+static bool have_avx2() {
+#if defined(__AVX2__)
+	return true;
+#elif defined(__GNUC__) || defined(__clang__)
+	static const bool ok = __builtin_cpu_supports("avx2");
+	return ok;
+#else
+	return false;
+#endif
+}
+#endif
+
+kernel_t makeKernel(int width, int height, const float *weights) {
+	kernel_t k;
+	k.width = width;
+	k.height = height;
+	k.weights.assign(weights, weights + width * height);
+	return k;
+}
+
+kernel_t sharpenKernel() {
+	const float w[] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+	return makeKernel(3, 3, w);
+}
+
+kernel_t embossKernel() {
+	const float w[] = { -2, -1, 0, -1, 1, 1, 0, 1, 2 };
+	return makeKernel(3, 3, w);
+}
+
+kernel_t laplacianKernel() {
+	const float w[] = { 0, 1, 0, 1, -4, 1, 0, 1, 0 };
+	return makeKernel(3, 3, w);
+}
+
+bool parseKernel(const char *text, kernel_t *k) {
+	std::vector<float> weights;
+	int width = -1;
+	int height = 0;
+	const char *p = text;
+	while (true) {
+		// One row: numbers up to a ';', a newline or the end
+		int n = 0;
+		while (*p && *p != ';' && *p != '\n') {
+			if (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r') { ++p; continue; }
+			char *end;
+			float v = strtof(p, &end);
+			if (end == p) { return false; }
+			weights.push_back(v);
+			++n;
+			p = end;
+		}
+		if (n > 0) {
+			if (width >= 0 && n != width) { return false; }
+			width = n;
+			++height;
+		}
+		if (!*p) { break; }
+		++p;
+	}
+	if (height == 0 || width % 2 == 0 || height % 2 == 0) { return false; }
+	*k = makeKernel(width, height, weights.data());
+	return true;
+}
+
+bool separateKernel(const kernel_t &k, std::vector<float> *col, std::vector<float> *row) {
+	// A rank-1 matrix is the outer product of any of its nonzero columns
+	// with the matching row, scaled by their shared entry. The largest
+	// entry keeps that division well conditioned.
+	int pr = 0;
+	int pc = 0;
+	float big = 0;
+	for (int i = 0; i < k.height; ++i) {
+		for (int j = 0; j < k.width; ++j) {
+			float a = std::fabs(k.weights[i * k.width + j]);
+			if (a > big) { big = a; pr = i; pc = j; }
+		}
+	}
+	if (big == 0) { return false; }
+	col->resize(k.height);
+	row->resize(k.width);
+	for (int i = 0; i < k.height; ++i) {
+		(*col)[i] = k.weights[i * k.width + pc];
+	}
+	float pivot = k.weights[pr * k.width + pc];
+	for (int j = 0; j < k.width; ++j) {
+		(*row)[j] = k.weights[pr * k.width + j] / pivot;
+	}
+	for (int i = 0; i < k.height; ++i) {
+		for (int j = 0; j < k.width; ++j) {
+			float d = k.weights[i * k.width + j] - (*col)[i] * (*row)[j];
+			if (std::fabs(d) > 1e-5f * big) { return false; }
+		}
+	}
+	return true;
+}
+
+// Where index i of a line of n pixels reads from, or -1 for the constant
+static inline int border_index(int i, int n, border_t border) {
+	if (i >= 0 && i < n) { return i; }
+	switch (border) {
+	case BORDER_CLAMP:
+		return std::min(std::max(i, 0), n - 1);
+	case BORDER_REFLECT: {
+		if (n == 1) { return 0; }
+		int period = 2 * n - 2;
+		i %= period;
+		if (i < 0) { i += period; }
+		return i < n ? i : period - i;
+	}
+	case BORDER_WRAP:
+		i %= n;
+		return i < 0 ? i + n : i;
+	default:
+		return -1;
+	}
+}
+
+// Output rows convolved per band. A band and its margins are staged in a
+// buffer small enough to stay in cache.
+static const int CONV_BAND_ROWS = 32;
+
+// Pixels are staged as four lanes in QRgb's byte order: blue, green, red
+// and a zero lane
+template <typename T>
+static void stage_band(const QImage &src, int y0, int rows, int rx, int ry,
+		border_t border, QRgb constant, int stride, T *band) {
+	int w = src.width();
+	int h = src.height();
+	for (int r = 0; r < rows + 2 * ry; ++r) {
+		int sy = border_index(y0 - ry + r, h, border);
+		const QRgb *line = sy >= 0 ? (const QRgb *) src.constScanLine(sy) : 0;
+		T *dst = band + (size_t) r * stride * 4;
+		for (int x = 0; x < stride; ++x) {
+			int sx = border_index(x - rx, w, border);
+			QRgb c = line && sx >= 0 && x < w + 2 * rx ? line[sx] : constant;
+			dst[4 * x] = qBlue(c);
+			dst[4 * x + 1] = qGreen(c);
+			dst[4 * x + 2] = qRed(c);
+			dst[4 * x + 3] = 0;
+		}
+	}
+}
+
+// Rounds n float lanes to the nearest integer, ties to even, and packs
+// them into pixels clamped to [0, 255]
+static void pack_float_row(const float *acc, int w, float bias, QRgb *dst) {
+	int x = 0;
+#ifdef IM_OP_SSE
+	const __m128 b = _mm_set1_ps(bias);
+	const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+	for (; x < w; ++x) {
+		__m128i v = _mm_cvtps_epi32(_mm_add_ps(_mm_loadu_ps(acc + 4 * x), b));
+		v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+		dst[x] = (QRgb) _mm_cvtsi128_si32(_mm_or_si128(v, alpha));
+	}
+#endif
+	for (; x < w; ++x) {
+		int c[3];
+		for (int k = 0; k < 3; ++k) {
+			c[k] = std::min(std::max((int) lrintf(acc[4 * x + k] + bias), 0), 255);
+		}
+		dst[x] = qRgb(c[2], c[1], c[0]);
+	}
+}
+
+#ifdef IM_OP_AVX2
+IM_OP_AVX2_TARGET
+static int dot_taps_avx2(const float *src, const std::vector<float> &weights,
+		const std::vector<int> &offsets, int n, float *acc) {
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 a = _mm256_setzero_ps();
+		for (size_t t = 0; t < weights.size(); ++t) {
+			a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_set1_ps(weights[t]),
+					_mm256_loadu_ps(src + i + offsets[t])));
+		}
+		_mm256_storeu_ps(acc + i, a);
+	}
+	return i;
+}
+#endif
+
+// acc[i] = sum over taps t of weights[t] * src[i + offsets[t]], for i in
+// [0, n), with the taps added in order
+static void dot_taps(const float *src, const std::vector<float> &weights,
+		const std::vector<int> &offsets, int n, float *acc) {
+	int i = 0;
+#ifdef IM_OP_AVX2
+	if (have_avx2()) { i = dot_taps_avx2(src, weights, offsets, n, acc); }
+#endif
+#ifdef IM_OP_SSE
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_setzero_ps();
+		for (size_t t = 0; t < weights.size(); ++t) {
+			a = _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(weights[t]),
+					_mm_loadu_ps(src + i + offsets[t])));
+		}
+		_mm_storeu_ps(acc + i, a);
+	}
+#endif
+	for (; i < n; ++i) {
+		float a = 0;
+		for (size_t t = 0; t < weights.size(); ++t) {
+			a += weights[t] * src[i + offsets[t]];
+		}
+		acc[i] = a;
+	}
+}
+
+// Float convolution of one band, in two 1-D passes when the kernel
+// separates
+static void conv_band_float(const QImage &src, QImage &out, int y0, int rows,
+		const kernel_t &k, bool separable, const std::vector<float> &col,
+		const std::vector<float> &row, border_t border, QRgb constant, float bias) {
+	int w = src.width();
+	int rx = k.width / 2;
+	int ry = k.height / 2;
+	int stride = w + 2 * rx;
+	std::vector<float> band((size_t) (rows + 2 * ry) * stride * 4);
+	stage_band(src, y0, rows, rx, ry, border, constant, stride, band.data());
+	std::vector<float> acc((size_t) w * 4);
+
+	if (separable) {
+		// Rows first, into a band without the column margins
+		std::vector<int> offsets(k.width);
+		for (int t = 0; t < k.width; ++t) { offsets[t] = 4 * t; }
+		std::vector<float> tmp((size_t) (rows + 2 * ry) * w * 4);
+		for (int r = 0; r < rows + 2 * ry; ++r) {
+			dot_taps(&band[(size_t) r * stride * 4], row, offsets, 4 * w, &tmp[(size_t) r * w * 4]);
+		}
+		offsets.resize(k.height);
+		for (int t = 0; t < k.height; ++t) { offsets[t] = 4 * w * t; }
+		for (int r = 0; r < rows; ++r) {
+			dot_taps(&tmp[(size_t) r * w * 4], col, offsets, 4 * w, acc.data());
+			pack_float_row(acc.data(), w, bias, (QRgb *) out.scanLine(y0 + r));
+		}
+		return;
+	}
+
+	std::vector<int> offsets(k.width * k.height);
+	for (int i = 0; i < k.height; ++i) {
+		for (int j = 0; j < k.width; ++j) {
+			offsets[i * k.width + j] = 4 * (i * stride + j);
+		}
+	}
+	for (int r = 0; r < rows; ++r) {
+		dot_taps(&band[(size_t) r * stride * 4], k.weights, offsets, 4 * w, acc.data());
+		pack_float_row(acc.data(), w, bias, (QRgb *) out.scanLine(y0 + r));
+	}
+}
+
+// Fixed-point weights carry this many fraction bits
+static const int CONV_FRACTION_BITS = 8;
+
+// The kernel's weights in fixed point, if each is exact there and fits
+// 16 bits, and no pixel's sum (255 times the weights' magnitudes, plus
+// the bias) can overflow the 32-bit accumulators
+static bool fixed_weights(const kernel_t &k, float bias, std::vector<int16_t> *out) {
+	out->resize(k.weights.size());
+	double bound = std::fabs((double) bias * (1 << CONV_FRACTION_BITS)) + (1 << CONV_FRACTION_BITS);
+	for (size_t i = 0; i < k.weights.size(); ++i) {
+		float s = k.weights[i] * (1 << CONV_FRACTION_BITS);
+		if (s != std::floor(s) || std::fabs(s) > 32767) { return false; }
+		(*out)[i] = (int16_t) s;
+		bound += 255.0 * std::fabs(s);
+	}
+	return bound < 2147483648.0;
+}
+
+// Packs fixed-point lanes into pixels, rounding halves up
+static inline QRgb pack_fixed(const int32_t *acc, int32_t bias) {
+	int c[3];
+	for (int k = 0; k < 3; ++k) {
+		c[k] = std::min(std::max((acc[k] + bias) >> CONV_FRACTION_BITS, 0), 255);
+	}
+	return qRgb(c[2], c[1], c[0]);
+}
+
+#ifdef IM_OP_SSE
+static inline QRgb pack_fixed(__m128i acc, __m128i bias) {
+	__m128i v = _mm_srai_epi32(_mm_add_epi32(acc, bias), CONV_FRACTION_BITS);
+	v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+	return (QRgb) _mm_cvtsi128_si32(_mm_or_si128(v, _mm_set1_epi32((int) 0xff000000)));
+}
+#endif
+
+#ifdef IM_OP_AVX2
+// Four pixels per iteration. Each 128-bit half holds two neighbouring
+// pixels, so the low unpack gives pixels x and x + 2 and the high one
+// x + 1 and x + 3.
+IM_OP_AVX2_TARGET
+static int conv_row_fixed_avx2(const int16_t *band, int stride, int w, int kw, int kh,
+		const std::vector<int32_t> &pairs, int32_t bias, QRgb *dst) {
+	const __m256i b = _mm256_set1_epi32(bias);
+	const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+	int x = 0;
+	for (; x + 4 <= w; x += 4) {
+		__m256i lo = _mm256_setzero_si256();
+		__m256i hi = _mm256_setzero_si256();
+		for (int i = 0; i < kh; ++i) {
+			const int16_t *p = band + ((size_t) i * stride + x) * 4;
+			for (int j = 0; j < kw; j += 2) {
+				__m256i wp = _mm256_set1_epi32(pairs[i * (kw / 2) + j / 2]);
+				__m256i a = _mm256_loadu_si256((const __m256i *) (p + 4 * j));
+				__m256i c = _mm256_loadu_si256((const __m256i *) (p + 4 * j + 4));
+				lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, c), wp));
+				hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, c), wp));
+			}
+		}
+		lo = _mm256_srai_epi32(_mm256_add_epi32(lo, b), CONV_FRACTION_BITS);
+		hi = _mm256_srai_epi32(_mm256_add_epi32(hi, b), CONV_FRACTION_BITS);
+		// x, x + 1 | x + 2, x + 3
+		__m256i v = _mm256_packs_epi32(lo, hi);
+		v = _mm256_packus_epi16(v, v);
+		v = _mm256_or_si256(v, alpha);
+		_mm_storel_epi64((__m128i *) (dst + x), _mm256_castsi256_si128(v));
+		_mm_storel_epi64((__m128i *) (dst + x + 2), _mm256_extracti128_si256(v, 1));
+	}
+	return x;
+}
+#endif
+
+// Fixed-point convolution of one output row. Taps are taken in pairs
+// along the row so that one multiply-add covers two of them; kw is even,
+// with a zero weight padding odd kernels.
+static void conv_row_fixed(const int16_t *band, int stride, int w, int kw, int kh,
+		const std::vector<int32_t> &pairs, const std::vector<int16_t> &weights,
+		int32_t bias, QRgb *dst) {
+	int x = 0;
+#ifdef IM_OP_AVX2
+	if (have_avx2()) { x = conv_row_fixed_avx2(band, stride, w, kw, kh, pairs, bias, dst); }
+#endif
+#ifdef IM_OP_SSE
+	const __m128i b = _mm_set1_epi32(bias);
+	for (; x + 2 <= w; x += 2) {
+		__m128i lo = _mm_setzero_si128();
+		__m128i hi = _mm_setzero_si128();
+		for (int i = 0; i < kh; ++i) {
+			const int16_t *p = band + ((size_t) i * stride + x) * 4;
+			for (int j = 0; j < kw; j += 2) {
+				__m128i wp = _mm_set1_epi32(pairs[i * (kw / 2) + j / 2]);
+				__m128i a = _mm_loadu_si128((const __m128i *) (p + 4 * j));
+				__m128i c = _mm_loadu_si128((const __m128i *) (p + 4 * j + 4));
+				lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, c), wp));
+				hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, c), wp));
+			}
+		}
+		dst[x] = pack_fixed(lo, b);
+		dst[x + 1] = pack_fixed(hi, b);
+	}
+#endif
+	for (; x < w; ++x) {
+		int32_t acc[4] = { 0, 0, 0, 0 };
+		for (int i = 0; i < kh; ++i) {
+			const int16_t *p = band + ((size_t) i * stride + x) * 4;
+			for (int j = 0; j < kw; ++j) {
+				for (int l = 0; l < 4; ++l) {
+					acc[l] += weights[i * kw + j] * p[4 * j + l];
+				}
+			}
+		}
+		dst[x] = pack_fixed(acc, bias);
+	}
+}
+
+static void conv_band_fixed(const QImage &src, QImage &out, int y0, int rows,
+		const kernel_t &k, const std::vector<int16_t> &fixed,
+		border_t border, QRgb constant, float bias) {
+	int w = src.width();
+	int rx = k.width / 2;
+	int ry = k.height / 2;
+	int kw = k.width + 1;
+	// One spare column for the padding tap, and one more pixel of slack
+	// for the loads of the last pair
+	int stride = w + 2 * rx + 2;
+	std::vector<int16_t> band((size_t) (rows + 2 * ry) * stride * 4);
+	stage_band(src, y0, rows, rx, ry, border, constant, stride, band.data());
+
+	std::vector<int16_t> weights(kw * k.height, 0);
+	std::vector<int32_t> pairs(kw / 2 * k.height);
+	for (int i = 0; i < k.height; ++i) {
+		for (int j = 0; j < k.width; ++j) {
+			weights[i * kw + j] = fixed[i * k.width + j];
+		}
+		for (int j = 0; j < kw; j += 2) {
+			pairs[i * (kw / 2) + j / 2] = (int32_t) ((uint16_t) weights[i * kw + j] |
+					((uint32_t) (uint16_t) weights[i * kw + j + 1] << 16));
+		}
+	}
+	int32_t b = (int32_t) lrintf(bias * (1 << CONV_FRACTION_BITS)) + (1 << (CONV_FRACTION_BITS - 1));
+	for (int r = 0; r < rows; ++r) {
+		conv_row_fixed(&band[(size_t) r * stride * 4], stride, w, kw, k.height,
+				pairs, weights, b, (QRgb *) out.scanLine(y0 + r));
+	}
+}
+
+/*
+ * FFT convolution
+ */
+
+// Twiddle factors and the bit-reversal permutation for one transform
+// size. The stage combining blocks of len has its len / 2 twiddles
+// exp(-2 pi i k / len) stored contiguously from offset len / 2 - 1.
+struct fft_plan_t {
+	int n;
+	std::vector<int> rev;
+	std::vector<float> tw_re;
+	std::vector<float> tw_im;
+};
+
+static void fft_plan(int n, fft_plan_t *p) {
+	p->n = n;
+	p->rev.resize(n);
+	int bits = 0;
+	while ((1 << bits) < n) { ++bits; }
+	for (int i = 0; i < n; ++i) {
+		int r = 0;
+		for (int b = 0; b < bits; ++b) {
+			if (i & (1 << b)) { r |= 1 << (bits - 1 - b); }
+		}
+		p->rev[i] = r;
+	}
+	p->tw_re.resize(std::max(n - 1, 1));
+	p->tw_im.resize(std::max(n - 1, 1));
+	for (int len = 2; len <= n; len <<= 1) {
+		for (int k = 0; k < len / 2; ++k) {
+			double a = -2 * M_PI * k / len;
+			p->tw_re[len / 2 - 1 + k] = (float) cos(a);
+			p->tw_im[len / 2 - 1 + k] = (float) sin(a);
+		}
+	}
+}
+
+// In-place radix-2 FFT of n complex values, stored as separate real and
+// imaginary arrays. The inverse is not scaled by 1 / n. Butterflies of
+// the wider stages run four at a time.
+static void fft(float *re, float *im, const fft_plan_t &p, bool inverse) {
+	int n = p.n;
+	for (int i = 0; i < n; ++i) {
+		int r = p.rev[i];
+		if (r > i) {
+			std::swap(re[i], re[r]);
+			std::swap(im[i], im[r]);
+		}
+	}
+	// The inverse uses the conjugate twiddles
+	float sign = inverse ? -1 : 1;
+	for (int len = 2; len <= n; len <<= 1) {
+		int half = len / 2;
+		const float *wre = &p.tw_re[half - 1];
+		const float *wim = &p.tw_im[half - 1];
+		for (int i = 0; i < n; i += len) {
+			float *ar = re + i, *ai = im + i;
+			float *br = ar + half, *bi = ai + half;
+			int k = 0;
+#ifdef IM_OP_SSE
+			const __m128 sg = _mm_set1_ps(sign);
+			for (; k + 4 <= half; k += 4) {
+				__m128 wr = _mm_loadu_ps(wre + k);
+				__m128 wi = _mm_mul_ps(sg, _mm_loadu_ps(wim + k));
+				__m128 xr = _mm_loadu_ps(br + k);
+				__m128 xi = _mm_loadu_ps(bi + k);
+				__m128 vr = _mm_sub_ps(_mm_mul_ps(xr, wr), _mm_mul_ps(xi, wi));
+				__m128 vi = _mm_add_ps(_mm_mul_ps(xr, wi), _mm_mul_ps(xi, wr));
+				__m128 ur = _mm_loadu_ps(ar + k);
+				__m128 ui = _mm_loadu_ps(ai + k);
+				_mm_storeu_ps(br + k, _mm_sub_ps(ur, vr));
+				_mm_storeu_ps(bi + k, _mm_sub_ps(ui, vi));
+				_mm_storeu_ps(ar + k, _mm_add_ps(ur, vr));
+				_mm_storeu_ps(ai + k, _mm_add_ps(ui, vi));
+			}
+#endif
+			for (; k < half; ++k) {
+				float wr = wre[k];
+				float wi = sign * wim[k];
+				float vr = br[k] * wr - bi[k] * wi;
+				float vi = br[k] * wi + bi[k] * wr;
+				br[k] = ar[k] - vr;
+				bi[k] = ai[k] - vi;
+				ar[k] += vr;
+				ai[k] += vi;
 			}
-			int ind = i * in->width() + j;
-			G[ind] = (G[ind] / max) * 255;
-			out.setPixel(j, i, qRgb(G[ind], G[ind], G[ind]));
 		}
 	}
+}
 
-	pix_count += in->width() * in->height();
-	qpb->setValue(pix_count);
+static const int FFT_COLUMNS = 8;
+
+// Transforms the rows of an n by n plane, then its columns. Rows from
+// rows on are zero going forward, so they are skipped; going back only
+// the first rows rows are wanted, so only they are transformed. col_re
+// and col_im hold FFT_COLUMNS columns.
+static void fft_2d(float *re, float *im, const fft_plan_t &p, bool inverse, int rows,
+		std::vector<float> &col_re, std::vector<float> &col_im) {
+	int n = p.n;
+	if (!inverse) {
+		for (int y = 0; y < rows; ++y) {
+			fft(re + (size_t) y * n, im + (size_t) y * n, p, false);
+		}
+	}
+	// Columns are gathered FFT_COLUMNS at a time, so each row's cache
+	// line is read once per group rather than once per column
+	for (int x0 = 0; x0 < n; x0 += FFT_COLUMNS) {
+		int cols = std::min(FFT_COLUMNS, n - x0);
+		for (int y = 0; y < n; ++y) {
+			for (int c = 0; c < cols; ++c) {
+				col_re[(size_t) c * n + y] = re[(size_t) y * n + x0 + c];
+				col_im[(size_t) c * n + y] = im[(size_t) y * n + x0 + c];
+			}
+		}
+		for (int c = 0; c < cols; ++c) {
+			fft(&col_re[(size_t) c * n], &col_im[(size_t) c * n], p, inverse);
+		}
+		for (int y = 0; y < n; ++y) {
+			for (int c = 0; c < cols; ++c) {
+				re[(size_t) y * n + x0 + c] = col_re[(size_t) c * n + y];
+				im[(size_t) y * n + x0 + c] = col_im[(size_t) c * n + y];
+			}
+		}
+	}
+	if (inverse) {
+		for (int y = 0; y < rows; ++y) {
+			fft(re + (size_t) y * n, im + (size_t) y * n, p, true);
+		}
+	}
+}
 
-	free(Gx);
-    free(Gy);
-    free(G);
+// Largest transform side tried. Tiles of 512 x 512 complex floats keep a
+// thread's buffers at a few megabytes.
+static const int FFT_MAX_SIZE = 512;
 
+// Rough cost of one output pixel, in nanoseconds, on the spatial paths
+// and with transforms of side n. The constants were measured on one
+// x86-64 machine with AVX2; only their ratio matters.
+static double spatial_cost(const kernel_t &k, bool separable) {
+	return separable ? 1.3 * (k.width + k.height) : 0.6 * k.width * k.height;
+}
+
+static double fft_cost(const kernel_t &k, int n, int w, int h) {
+	int tw = std::min(n - (k.width - 1), w);
+	int th = std::min(n - (k.height - 1), h);
+	if (tw <= 0 || th <= 0) { return INFINITY; }
+	// A tile's four transforms take about n^2 log2(n) butterflies, and
+	// staging adds a little
+	return 15 * (double) n * n * std::log2((double) n) / ((double) tw * th);
+}
+
+// The cheapest transform side for kernel on a w by h image, or 0 when
+// none beats a spatial path of cost spatial
+static int fft_size(const kernel_t &k, int w, int h, double spatial) {
+	double best = spatial;
+	int best_n = 0;
+	for (int n = 16; n <= FFT_MAX_SIZE; n *= 2) {
+		double c = fft_cost(k, n, w, h);
+		if (c < best) {
+			best = c;
+			best_n = n;
+		}
+		// Past the image and kernel, larger sides only add zeros
+		if (n >= w + k.width - 1 && n >= h + k.height - 1) { break; }
+	}
+	return best_n;
+}
+
+// Convolves the tile of output starting at (x0, y0) by overlap-save: the
+// tile and its kernel margins are staged, with borders applied, into an
+// n by n plane. Circular convolution there matches the linear one on the
+// tile, since no tap reaches around. The channels are packed two to a
+// complex plane: blue + i green, then red.
+static void fft_tile(const QImage &src, QImage &out, int x0, int y0, int tw, int th,
+		const kernel_t &k, const fft_plan_t &p, const float *k_re, const float *k_im,
+		border_t border, QRgb constant, float bias, std::vector<float> *bufs,
+		std::vector<float> &col_re, std::vector<float> &col_im) {
+	int n = p.n;
+	int rx = k.width / 2;
+	int ry = k.height / 2;
+	int sw = tw + k.width - 1;
+	int sh = th + k.height - 1;
+	for (int b = 0; b < 4; ++b) {
+		std::fill(bufs[b].begin(), bufs[b].end(), 0.f);
+	}
+	float *re0 = bufs[0].data(), *im0 = bufs[1].data();
+	float *re1 = bufs[2].data(), *im1 = bufs[3].data();
+	for (int i = 0; i < sh; ++i) {
+		int sy = border_index(y0 - ry + i, src.height(), border);
+		const QRgb *line = sy >= 0 ? (const QRgb *) src.constScanLine(sy) : 0;
+		for (int j = 0; j < sw; ++j) {
+			int sx = border_index(x0 - rx + j, src.width(), border);
+			QRgb c = line && sx >= 0 ? line[sx] : constant;
+			size_t at = (size_t) i * n + j;
+			re0[at] = qBlue(c);
+			im0[at] = qGreen(c);
+			re1[at] = qRed(c);
+		}
+	}
+
+	fft_2d(re0, im0, p, false, sh, col_re, col_im);
+	fft_2d(re1, im1, p, false, sh, col_re, col_im);
+	for (size_t i = 0; i < (size_t) n * n; ++i) {
+		float a = re0[i], b = im0[i];
+		re0[i] = a * k_re[i] - b * k_im[i];
+		im0[i] = a * k_im[i] + b * k_re[i];
+		a = re1[i];
+		b = im1[i];
+		re1[i] = a * k_re[i] - b * k_im[i];
+		im1[i] = a * k_im[i] + b * k_re[i];
+	}
+	fft_2d(re0, im0, p, true, th, col_re, col_im);
+	fft_2d(re1, im1, p, true, th, col_re, col_im);
+
+	for (int i = 0; i < th; ++i) {
+		QRgb *dst = (QRgb *) out.scanLine(y0 + i) + x0;
+		for (int j = 0; j < tw; ++j) {
+			size_t at = (size_t) i * n + j;
+			int c[3] = { (int) lrintf(re1[at] + bias), (int) lrintf(im0[at] + bias),
+						 (int) lrintf(re0[at] + bias) };
+			for (int l = 0; l < 3; ++l) {
+				c[l] = std::min(std::max(c[l], 0), 255);
+			}
+			dst[j] = qRgb(c[0], c[1], c[2]);
+		}
+	}
+}
+
+static void convolve_fft(const QImage &src, QImage &out, const kernel_t &k, int n,
+		border_t border, QRgb constant, float bias) {
+	fft_plan_t p;
+	fft_plan(n, &p);
+
+	// The kernel's spectrum, scaled by 1 / n^2 for the inverse. Weight
+	// (a, b) goes to (-a, -b) mod n, which turns the transform's
+	// convolution into the correlation convolve() computes.
+	std::vector<float> k_re((size_t) n * n, 0.f);
+	std::vector<float> k_im((size_t) n * n, 0.f);
+	float scale = 1.f / ((float) n * n);
+	for (int a = 0; a < k.height; ++a) {
+		for (int b = 0; b < k.width; ++b) {
+			k_re[(size_t) ((n - a) % n) * n + (n - b) % n] = k.weights[a * k.width + b] * scale;
+		}
+	}
+	{
+		std::vector<float> col_re((size_t) FFT_COLUMNS * n), col_im((size_t) FFT_COLUMNS * n);
+		fft_2d(k_re.data(), k_im.data(), p, false, n, col_re, col_im);
+	}
+
+	int tw = std::min(n - (k.width - 1), src.width());
+	int th = std::min(n - (k.height - 1), src.height());
+	int tiles_x = (src.width() + tw - 1) / tw;
+	int tiles_y = (src.height() + th - 1) / th;
+	parallel_ranges(tiles_x * tiles_y, 1, [&](int t0, int t1) {
+		std::vector<float> bufs[4];
+		for (int b = 0; b < 4; ++b) {
+			bufs[b].resize((size_t) n * n);
+		}
+		std::vector<float> col_re((size_t) FFT_COLUMNS * n), col_im((size_t) FFT_COLUMNS * n);
+		for (int t = t0; t < t1; ++t) {
+			TRACE_SCOPE("filter", "convolve fft tile");
+			int x0 = t % tiles_x * tw;
+			int y0 = t / tiles_x * th;
+			fft_tile(src, out, x0, y0, std::min(tw, src.width() - x0),
+					 std::min(th, src.height() - y0), k, p, k_re.data(), k_im.data(),
+					 border, constant, bias, bufs, col_re, col_im);
+		}
+	});
+}
+
+QImage convolve(QImage *in, const kernel_t &kernel, border_t border, QRgb constant,
+		float bias, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "convolve");
+	QImage src = rgb32(in);
+	QImage out = rgb32_image(in->width(), in->height());
+	if (qpb) { qpb->setRange(0, 1); }
+
+	std::vector<float> col;
+	std::vector<float> row;
+	std::vector<int16_t> fixed;
+	bool separable = separateKernel(kernel, &col, &row);
+	bool use_fixed = !separable && fixed_weights(kernel, bias, &fixed);
+
+	int n = fft_size(kernel, in->width(), in->height(), spatial_cost(kernel, separable));
+	if (n > 0) {
+		convolve_fft(src, out, kernel, n, border, constant, bias);
+		if (qpb) { qpb->setValue(1); }
+		if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+		return out;
+	}
+
+	// Bands at least as tall as their margins, so tall kernels do not
+	// stage (and, when separable, filter) each row many times over
+	int band_rows = std::max(CONV_BAND_ROWS, kernel.height - 1);
+	int bands = (in->height() + band_rows - 1) / band_rows;
+	parallel_ranges(bands, 1, [&](int b0, int b1) {
+		for (int b = b0; b < b1; ++b) {
+			TRACE_SCOPE("filter", "convolve band");
+			int y0 = b * band_rows;
+			int rows = std::min(band_rows, in->height() - y0);
+			if (use_fixed) {
+				conv_band_fixed(src, out, y0, rows, kernel, fixed, border, constant, bias);
+			} else {
+				conv_band_float(src, out, y0, rows, kernel, separable, col, row,
+						border, constant, bias);
+			}
+		}
+	});
+	if (qpb) { qpb->setValue(1); }
+
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
+
+QImage convolveFFT(QImage *in, const kernel_t &kernel, border_t border, QRgb constant,
+		float bias, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "convolveFFT");
+	QImage src = rgb32(in);
+	QImage out = rgb32_image(in->width(), in->height());
+	if (qpb) { qpb->setRange(0, 1); }
+	int n = fft_size(kernel, in->width(), in->height(), INFINITY);
+	if (n == 0) {
+		// Wider than the largest transform: the spatial paths still work
+		return convolve(in, kernel, border, constant, bias, qpb);
+	}
+	convolve_fft(src, out, kernel, n, border, constant, bias);
+	if (qpb) { qpb->setValue(1); }
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
+
+kernel_t gaussianKernel(float sigma) {
+	if (sigma <= 0) {
+		const float one = 1;
+		return makeKernel(1, 1, &one);
+	}
+	int radius = std::max(1, (int) ceil(3 * sigma));
+	int size = 2 * radius + 1;
+	std::vector<float> g(size);
+	float sum = 0;
+	for (int i = -radius; i <= radius; ++i) {
+		g[i + radius] = weight(abs(i), sigma);
+		sum += g[i + radius];
+	}
+	std::vector<float> w(size * size);
+	for (int i = 0; i < size; ++i) {
+		for (int j = 0; j < size; ++j) {
+			w[i * size + j] = g[i] / sum * (g[j] / sum);
+		}
+	}
+	return makeKernel(size, size, w.data());
+}
+
+/*
+ * Edge-preserving smoothing
+ */
+
+static inline float luma(QRgb c) {
+	return .299f * qRed(c) + .587f * qGreen(c) + .114f * qBlue(c);
+}
+
+// Cells of zeros around the data, enough for the grid blur to spread
+// into without bounds checks
+static const int GRID_PAD = 2;
+
+// A bilateral grid: cells of (blue, green, red, count) over x, y and
+// luminance, with luminance innermost
+struct bilateral_grid_t {
+	int gw, gh, gd;
+	std::vector<float> cells;
+
+	float *at(int x, int y, int z) {
+		return &cells[(((size_t) y * gw + x) * gd + z) * 4];
+	}
+};
+
+// Blurs a line of n grid cells with the binomial taps 1 4 6 4 1 / 16.
+// stride is the distance between neighbouring cells, in floats; the two
+// cells at each end are padding and come out zero.
+static void grid_blur_line(float *line, int n, size_t stride, std::vector<float> &tmp) {
+	static const float taps[5] = { 1 / 16.f, 4 / 16.f, 6 / 16.f, 4 / 16.f, 1 / 16.f };
+	tmp.assign((size_t) n * 4, 0.f);
+	for (int i = 2; i < n - 2; ++i) {
+		float *t = &tmp[(size_t) i * 4];
+#ifdef IM_OP_SSE
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < 5; ++k) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(taps[k]),
+					_mm_loadu_ps(line + (i + k - 2) * stride)));
+		}
+		_mm_storeu_ps(t, acc);
+#else
+		for (int l = 0; l < 4; ++l) {
+			float acc = 0;
+			for (int k = 0; k < 5; ++k) {
+				acc += taps[k] * line[(i + k - 2) * stride + l];
+			}
+			t[l] = acc;
+		}
+#endif
+	}
+	for (int i = 0; i < n; ++i) {
+		for (int l = 0; l < 4; ++l) {
+			line[i * stride + l] = tmp[(size_t) i * 4 + l];
+		}
+	}
+}
+
+QImage bilateralFilter(QImage *in, float sigma_s, float sigma_r, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "bilateralFilter");
+	int w = in->width();
+	int h = in->height();
+	QImage src = rgb32(in);
+	QImage out = rgb32_image(w, h);
+	if (qpb) { qpb->setRange(0, 3); }
+	sigma_s = std::max(sigma_s, 1.f);
+	sigma_r = std::max(sigma_r, 1.f);
+
+	bilateral_grid_t g;
+	g.gw = (int) ((w - 1) / sigma_s + 0.5f) + 1 + 2 * GRID_PAD;
+	g.gh = (int) ((h - 1) / sigma_s + 0.5f) + 1 + 2 * GRID_PAD;
+	g.gd = (int) (255 / sigma_r + 0.5f) + 1 + 2 * GRID_PAD;
+	g.cells.assign((size_t) g.gw * g.gh * g.gd * 4, 0.f);
+
+	// Splat each pixel into its nearest cell. Threads take whole grid
+	// rows, i.e. the image rows rounding to them, so none share a cell.
+	int data_rows = g.gh - 2 * GRID_PAD;
+	std::vector<int> grid_row(h), first_row(data_rows + 1, h), grid_col(w);
+	for (int y = h - 1; y >= 0; --y) {
+		grid_row[y] = (int) (y / sigma_s + 0.5f);
+		first_row[grid_row[y]] = y;
+	}
+	for (int x = 0; x < w; ++x) {
+		grid_col[x] = (int) (x / sigma_s + 0.5f) + GRID_PAD;
+	}
+	float inv_r = 1 / sigma_r;
+	parallel_ranges(data_rows, 4, [&](int g0, int g1) {
+		TRACE_SCOPE("filter", "bilateral splat");
+		for (int y = first_row[g0]; y < first_row[g1]; ++y) {
+			const QRgb *p = (const QRgb *) src.constScanLine(y);
+			int gy = grid_row[y] + GRID_PAD;
+			for (int x = 0; x < w; ++x) {
+				float *c = g.at(grid_col[x], gy, (int) (luma(p[x]) * inv_r + 0.5f) + GRID_PAD);
+				c[0] += qBlue(p[x]);
+				c[1] += qGreen(p[x]);
+				c[2] += qRed(p[x]);
+				c[3] += 1;
+			}
+		}
+	});
+	if (qpb) { qpb->setValue(1); }
+
+	// Blur along luminance and x within each grid row, then along y
+	// within each grid column
+	parallel_ranges(g.gh, 4, [&](int r0, int r1) {
+		TRACE_SCOPE("filter", "bilateral blur");
+		std::vector<float> tmp;
+		for (int y = r0; y < r1; ++y) {
+			for (int x = 0; x < g.gw; ++x) {
+				grid_blur_line(g.at(x, y, 0), g.gd, 4, tmp);
+			}
+			for (int z = 0; z < g.gd; ++z) {
+				grid_blur_line(g.at(0, y, z), g.gw, (size_t) g.gd * 4, tmp);
+			}
+		}
+	});
+	parallel_ranges(g.gw, 4, [&](int c0, int c1) {
+		TRACE_SCOPE("filter", "bilateral blur");
+		std::vector<float> tmp;
+		for (int x = c0; x < c1; ++x) {
+			for (int z = 0; z < g.gd; ++z) {
+				grid_blur_line(g.at(x, 0, z), g.gh, (size_t) g.gw * g.gd * 4, tmp);
+			}
+		}
+	});
+	if (qpb) { qpb->setValue(2); }
+
+	// Slice: interpolate the grid trilinearly at each pixel and divide the
+	// colour by the count
+	std::vector<int> slice_col(w);
+	std::vector<float> slice_tx(w);
+	for (int x = 0; x < w; ++x) {
+		float fx = x / sigma_s + GRID_PAD;
+		slice_col[x] = (int) fx;
+		slice_tx[x] = fx - slice_col[x];
+	}
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		TRACE_SCOPE("filter", "bilateral slice");
+		for (int y = y0; y < y1; ++y) {
+			const QRgb *p = (const QRgb *) src.constScanLine(y);
+			QRgb *dst = (QRgb *) out.scanLine(y);
+			float fy = y / sigma_s + GRID_PAD;
+			int iy = (int) fy;
+			float ty = fy - iy;
+			for (int x = 0; x < w; ++x) {
+				float fz = luma(p[x]) * inv_r + GRID_PAD;
+				int ix = slice_col[x];
+				int iz = (int) fz;
+				float tx = slice_tx[x];
+				float tz = fz - iz;
+#ifdef IM_OP_SSE
+				__m128 acc = _mm_setzero_ps();
+				for (int k = 0; k < 4; ++k) {
+					int dy = k >> 1, dx = k & 1;
+					const float *c = g.at(ix + dx, iy + dy, iz);
+					float wxy = (dx ? tx : 1 - tx) * (dy ? ty : 1 - ty);
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(wxy * (1 - tz)), _mm_loadu_ps(c)));
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(wxy * tz), _mm_loadu_ps(c + 4)));
+				}
+				float v[4];
+				_mm_storeu_ps(v, acc);
+#else
+				float v[4] = { 0, 0, 0, 0 };
+				for (int k = 0; k < 4; ++k) {
+					int dy = k >> 1, dx = k & 1;
+					const float *c = g.at(ix + dx, iy + dy, iz);
+					float wxy = (dx ? tx : 1 - tx) * (dy ? ty : 1 - ty);
+					for (int l = 0; l < 4; ++l) {
+						v[l] += wxy * (1 - tz) * c[l] + wxy * tz * c[4 + l];
+					}
+				}
+#endif
+				// The pixel's own cell is never empty, so the count is
+				// positive
+				float inv = 1 / v[3];
+				dst[x] = qRgb(std::min((int) (v[2] * inv + 0.5f), 255),
+							  std::min((int) (v[1] * inv + 0.5f), 255),
+							  std::min((int) (v[0] * inv + 0.5f), 255));
+			}
+		}
+	});
+	if (qpb) { qpb->setValue(3); }
+
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
+	return out;
+}
+
+// Mean over the window of radius around each pixel of a w by h plane,
+// clipped to the plane: a sliding sum along rows, then down columns.
+// Sums are kept in double so long rows do not drift. tmp is scratch
+// space of w * h floats.
+static void box_mean(const float *src, float *dst, int w, int h, int radius, float *tmp) {
+	// 1 / the window's length at each position along a row or column
+	std::vector<double> inv_w(w), inv_h(h);
+	for (int x = 0; x < w; ++x) {
+		inv_w[x] = 1.0 / (std::min(x + radius, w - 1) - std::max(x - radius, 0) + 1);
+	}
+	for (int y = 0; y < h; ++y) {
+		inv_h[y] = 1.0 / (std::min(y + radius, h - 1) - std::max(y - radius, 0) + 1);
+	}
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		for (int y = y0; y < y1; ++y) {
+			const float *s = src + (size_t) y * w;
+			float *t = tmp + (size_t) y * w;
+			double sum = 0;
+			for (int x = 0; x < std::min(radius, w); ++x) { sum += s[x]; }
+			// Windows reaching past the left edge, then those inside the
+			// row, then those reaching past the right edge
+			int x = 0;
+			for (; x < w && x <= radius; ++x) {
+				if (x + radius < w) { sum += s[x + radius]; }
+				t[x] = (float) (sum * inv_w[x]);
+			}
+			for (; x + radius < w; ++x) {
+				sum += (double) s[x + radius] - s[x - radius - 1];
+				t[x] = (float) (sum * inv_w[x]);
+			}
+			for (; x < w; ++x) {
+				sum -= s[x - radius - 1];
+				t[x] = (float) (sum * inv_w[x]);
+			}
+		}
+	});
+	std::vector<float> zeros(w, 0.f);
+	parallel_ranges(w, MIN_ROWS_PER_THREAD, [&](int x0, int x1) {
+		std::vector<double> sum(x1 - x0, 0.0);
+		for (int y = 0; y < std::min(radius, h); ++y) {
+			for (int x = x0; x < x1; ++x) { sum[x - x0] += tmp[(size_t) y * w + x]; }
+		}
+		for (int y = 0; y < h; ++y) {
+			// Rows entering and leaving the window, or zeros past the edges
+			const float *add = y + radius < h ? tmp + (size_t) (y + radius) * w : &zeros[0];
+			const float *sub = y - radius - 1 >= 0 ? tmp + (size_t) (y - radius - 1) * w : &zeros[0];
+			float *d = dst + (size_t) y * w;
+			for (int x = x0; x < x1; ++x) {
+				double &acc = sum[x - x0];
+				acc += (double) add[x] - sub[x];
+				d[x] = (float) (acc * inv_h[y]);
+			}
+		}
+	});
+}
+
+// The guided filter's coefficients are computed on the image shrunk by
+// this factor per GUIDED_RADIUS_PER_STEP of radius and interpolated back,
+// which changes them little while the windows stay several pixels wide
+static const int GUIDED_RADIUS_PER_STEP = 4;
+
+QImage guidedFilter(QImage *in, int radius, float eps, QProgressBar *qpb) {
+	PROFILE_SCOPE(STAGE_FILTER);
+	TRACE_SCOPE("filter", "guidedFilter");
+	int w = in->width();
+	int h = in->height();
+	QImage src = rgb32(in);
+	QImage out = rgb32_image(w, h);
+	if (qpb) { qpb->setRange(0, 4); }
+	radius = std::max(radius, 1);
+
+	// Shrink the image by step, averaging step x step blocks
+	int step = std::max(1, radius / GUIDED_RADIUS_PER_STEP);
+	int r = std::max(1, radius / step);
+	int sw = (w + step - 1) / step;
+	int sh = (h + step - 1) / step;
+	size_t n = (size_t) sw * sh;
+	std::vector<float> I(n), rgb[3] = { std::vector<float>(n), std::vector<float>(n), std::vector<float>(n) };
+	parallel_ranges(sh, std::max(1, MIN_ROWS_PER_THREAD / step), [&](int y0, int y1) {
+		for (int y = y0; y < y1; ++y) {
+			for (int x = 0; x < sw; ++x) {
+				float sum[4] = { 0, 0, 0, 0 };
+				int bx1 = std::min((x + 1) * step, w), by1 = std::min((y + 1) * step, h);
+				for (int by = y * step; by < by1; ++by) {
+					const QRgb *p = (const QRgb *) src.constScanLine(by);
+					for (int bx = x * step; bx < bx1; ++bx) {
+						sum[0] += qRed(p[bx]);
+						sum[1] += qGreen(p[bx]);
+						sum[2] += qBlue(p[bx]);
+						sum[3] += luma(p[bx]);
+					}
+				}
+				float inv = 1.f / ((bx1 - x * step) * (by1 - y * step));
+				size_t i = (size_t) y * sw + x;
+				rgb[0][i] = sum[0] * inv;
+				rgb[1][i] = sum[1] * inv;
+				rgb[2][i] = sum[2] * inv;
+				I[i] = sum[3] * inv;
+			}
+		}
+	});
+
+	// The guide is the luminance; each channel is fitted over every
+	// window as a linear function of it, q = a I + b, and a and b are
+	// averaged over the windows holding each pixel
+	std::vector<float> mean_I(n), var_I(n), t0(n), t1(n), scratch(n);
+	for (size_t i = 0; i < n; ++i) { t0[i] = I[i] * I[i]; }
+	box_mean(I.data(), mean_I.data(), sw, sh, r, scratch.data());
+	box_mean(t0.data(), var_I.data(), sw, sh, r, scratch.data());
+	for (size_t i = 0; i < n; ++i) {
+		var_I[i] = std::max(var_I[i] - mean_I[i] * mean_I[i], 0.f);
+	}
+	if (qpb) { qpb->setValue(1); }
+
+	std::vector<float> mean_a[3], mean_b[3];
+	for (int c = 0; c < 3; ++c) {
+		std::vector<float> &p = rgb[c];
+		for (size_t i = 0; i < n; ++i) { t0[i] = I[i] * p[i]; }
+		box_mean(p.data(), t1.data(), sw, sh, r, scratch.data());		// mean of p
+		box_mean(t0.data(), p.data(), sw, sh, r, scratch.data());		// mean of I p
+		for (size_t i = 0; i < n; ++i) {
+			// A flat window with an eps of 0 keeps its mean
+			float d = var_I[i] + eps;
+			float a = d > 0 ? (p[i] - mean_I[i] * t1[i]) / d : 0;
+			t0[i] = a;
+			t1[i] = t1[i] - a * mean_I[i];
+		}
+		mean_a[c].resize(n);
+		mean_b[c].resize(n);
+		box_mean(t0.data(), mean_a[c].data(), sw, sh, r, scratch.data());
+		box_mean(t1.data(), mean_b[c].data(), sw, sh, r, scratch.data());
+		std::vector<float>().swap(p);
+		if (qpb) { qpb->setValue(2 + c); }
+	}
+
+	// Apply the coefficients to the full-size luminance, interpolating
+	// them between the centres of the blocks
+	std::vector<int> col0(w), col1(w);
+	std::vector<float> col_t(w);
+	for (int x = 0; x < w; ++x) {
+		float fx = std::min(std::max((x + 0.5f) / step - 0.5f, 0.f), (float) (sw - 1));
+		col0[x] = (int) fx;
+		col1[x] = std::min(col0[x] + 1, sw - 1);
+		col_t[x] = fx - col0[x];
+	}
+	parallel_ranges(h, MIN_ROWS_PER_THREAD, [&](int y0, int y1) {
+		// a and b of red, green and blue, interpolated down to row y
+		std::vector<float> rows((size_t) 6 * sw);
+		for (int y = y0; y < y1; ++y) {
+			float fy = std::min(std::max((y + 0.5f) / step - 0.5f, 0.f), (float) (sh - 1));
+			int r0 = (int) fy;
+			int r1 = std::min(r0 + 1, sh - 1);
+			float ty = fy - r0;
+			for (int c = 0; c < 6; ++c) {
+				const float *plane = c < 3 ? mean_a[c].data() : mean_b[c - 3].data();
+				const float *u = plane + (size_t) r0 * sw;
+				const float *v = plane + (size_t) r1 * sw;
+				float *row = &rows[(size_t) c * sw];
+				for (int x = 0; x < sw; ++x) {
+					row[x] = u[x] + (v[x] - u[x]) * ty;
+				}
+			}
+			const QRgb *p = (const QRgb *) src.constScanLine(y);
+			QRgb *d = (QRgb *) out.scanLine(y);
+			for (int x = 0; x < w; ++x) {
+				float l = luma(p[x]);
+				int v[3];
+				for (int c = 0; c < 3; ++c) {
+					const float *ra = &rows[(size_t) c * sw];
+					const float *rb = &rows[(size_t) (c + 3) * sw];
+					float a = ra[col0[x]] + (ra[col1[x]] - ra[col0[x]]) * col_t[x];
+					float b = rb[col0[x]] + (rb[col1[x]] - rb[col0[x]]) * col_t[x];
+					v[c] = std::min(std::max((int) (a * l + b + 0.5f), 0), 255);
+				}
+				d[x] = qRgb(v[0], v[1], v[2]);
+			}
+		}
+	});
+
+	if (in->format() != out.format()) { out = out.convertToFormat(in->format()); }
 	return out;
-}
\ No newline at end of file
+}
@@ -1,18 +1,215 @@
+#ifndef __IM_OP_H__
+#define __IM_OP_H__
+
 #include <QImage>
 #include <QProgressBar>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+// Every operation reports progress through qpb when one is given; pass 0
+// to run headless (e.g. per tile or from a batch tool).
+
+// Pointwise edits as lookup tables. A lut_t sends red, green and blue
+// through their pre tables. With luminance set, the three are then
+// replaced by their luminance, as grayscale() computes it, and that goes
+// through the post tables. Any run of such edits composes into a single
+// lut_t, so applying several costs one pass over the image.
+struct lut_t {
+	uint8_t pre[3][256];	// red, green, blue
+	bool luminance;
+	uint8_t post[3][256];
+};
+
+// Counts of each value of red, green and blue
+struct histogram_t {
+	uint32_t count[3][256];
+};
+
+lut_t identityLut();
+
+lut_t grayscaleLut();
+
+// Adds brightness, then scales the distance from 128 by contrast
+lut_t brightnessContrastLut(int brightness, float contrast);
+
+// 255 (v / 255)^(1 / gamma); above 1 brightens
+lut_t gammaLut(float gamma);
+
+lut_t invertLut();
+
+// White where the luminance is at least level, black elsewhere
+lut_t thresholdLut(int level);
+
+// Stretches [black, white] to [0, 255], clipping outside it, with gamma
+// applied in between
+lut_t levelsLut(int black, int white, float gamma = 1);
+
+// A smooth curve through n points (x[i], y[i]) with increasing x, which
+// rises or falls only where the points do. It is flat past the ends.
+lut_t curvesLut(const int *x, const int *y, int n);
+
+// Spreads each channel's values so their counts in h even out
+lut_t equalizeLut(const histogram_t &h);
+
+// Stretches each channel so its darkest and brightest values, ignoring
+// the fraction clip of its pixels at either end, span [0, 255]
+lut_t autoLevelsLut(const histogram_t &h, float clip = 0.005f);
+
+// first, then then
+lut_t composeLut(const lut_t &first, const lut_t &then);
+
+// Applies lut to in in one pass on every hardware thread. Alpha is kept.
+void applyLut(QImage *in, const lut_t &lut, QProgressBar *qpb = 0);
+
+// Counted on every hardware thread, each into its own histogram, which
+// are summed at the end
+histogram_t histogram(const QImage *in);
+
+void grayscale(QImage *in, QProgressBar *qpb = 0);
+
+void flip(QImage *in, QProgressBar *qpb = 0);
+
+void flop(QImage *in, QProgressBar *qpb = 0);
+
+QImage transpose(QImage *in, QProgressBar *qpb = 0);
+
+// A summed-area table of the red, green and blue channels, and optionally
+// of their squares. The sum over any rectangle then costs four lookups, so
+// the filters built on it take the same time at every radius.
+struct sat_t;
+
+// The table of in. While a caller still holds the last table built, it
+// is handed out again for an unchanged in (by QImage::cacheKey()), so
+// filters over one image can share a single build by holding on to it.
+// Nothing else keeps it alive. Asking for squares builds them too. The
+// build runs on every hardware thread.
+std::shared_ptr<const sat_t> summedAreaTable(const QImage *in, bool squares = false);
+
+// Stops handing out the last table; callers holding it keep their copy
+void clearSummedAreaTableCache();
+
+// Red, green and blue sums over columns [x0, x1) of rows [y0, y1), exact
+// for rectangles of up to 2^32 / 255 pixels
+void rectSum(const sat_t *sat, int x0, int y0, int x1, int y1, uint32_t rgb[3]);
+
+// Sums of the squares over the same rectangle, exact for up to
+// 2^32 / 255^2 pixels. The table must have been built with squares.
+void rectSquareSum(const sat_t *sat, int x0, int y0, int x1, int y1, uint32_t rgb[3]);
+
+QImage boxBlur(QImage *in, int radius, QProgressBar *qpb = 0);
+
+QImage medianFilter(QImage *in, int radius, QProgressBar *qpb = 0);
+
+QImage gaussianBlur(QImage *in, int radius, float sigma, QProgressBar *qpb = 0);
+
+// Normalized Sobel gradient magnitude of the luminance, scaled so the
+// image's largest magnitude is white
+QImage sobel(QImage *in, QProgressBar *qpb = 0);
+
+// The largest Sobel magnitude 8-bit luminance can reach, 4 * 255 * sqrt(2)
+#define SOBEL_MAX_MAGNITUDE 1442.5f
+
+// sobel(), scaled so a magnitude of max is white rather than by the
+// image's own maximum. Pieces of an image filtered separately, such as
+// tiles, then share one scale.
+QImage sobelScaled(QImage *in, float max, QProgressBar *qpb = 0);
+
+// Canny edges: the luminance is smoothed with a Gaussian of sigma, then
+// Sobel gradients are thinned to their maxima across the edge. Maxima of
+// magnitude at least high are edges, and so are those of at least low
+// connected to one. Magnitudes run up to about 1443 on 8-bit input.
+// Edges come out white on black.
+QImage canny(QImage *in, float sigma, float low, float high, QProgressBar *qpb = 0);
+
+// Filters on summed-area tables. Their windows are clipped at the image's
+// edges rather than leaving a border.
+
+QImage localMean(QImage *in, int radius, QProgressBar *qpb = 0);
+
+// Largest radius whose window keeps rectSquareSum exact
+#define MAX_STDDEV_RADIUS 128
+
+// Per-channel standard deviation over the window, with radius clamped to
+// MAX_STDDEV_RADIUS
+QImage localStdDev(QImage *in, int radius, QProgressBar *qpb = 0);
+
+// White where a pixel's luminance is above the window's mean luminance
+// minus offset, black elsewhere
+QImage adaptiveThreshold(QImage *in, int radius, int offset, QProgressBar *qpb = 0);
+
+// How convolve() reads pixels past the image's edges
+typedef enum {
+	BORDER_CLAMP,		// the nearest edge pixel
+	BORDER_REFLECT,		// mirrored about the edge pixel: 2 1 | 0 1 2
+	BORDER_WRAP,		// from the opposite edge
+	BORDER_CONSTANT		// a given colour
+} border_t;
+
+// A convolution kernel of odd width and height. weights is row-major.
+struct kernel_t {
+	int width;
+	int height;
+	std::vector<float> weights;
+};
+
+kernel_t makeKernel(int width, int height, const float *weights);
+
+kernel_t sharpenKernel();
+
+// Its output centres on 0; convolve it with a bias of 128
+kernel_t embossKernel();
+
+// Its output centres on 0; convolve it with a bias of 128
+kernel_t laplacianKernel();
 
-void grayscale(QImage *in, QProgressBar *qpb);
+// Parses rows of numbers separated by ';' or newlines, the numbers by
+// spaces or commas, e.g. "0 -1 0; -1 5 -1; 0 -1 0". Returns false when
+// the rows differ in length or either side is even.
+bool parseKernel(const char *text, kernel_t *k);
 
-void flip(QImage *in, QProgressBar *qpb);
+// Returns true when k is, to float precision, the outer product of a
+// column and a row vector, and sets them. Such a kernel convolves in two
+// 1-D passes.
+bool separateKernel(const kernel_t &k, std::vector<float> *col, std::vector<float> *row);
 
-void flop(QImage *in, QProgressBar *qpb);
+// Convolves the red, green and blue channels with kernel, adds bias and
+// rounds to the nearest value in [0, 255]. Large kernels go through
+// convolveFFT() when a cost model expects it to be faster. Otherwise,
+// separable kernels take two float passes. Other kernels whose weights
+// are exact with 8 fraction bits (integer kernels, for one), and whose
+// sums fit 32 bits, accumulate in fixed point, and the rest in float.
+// Rows are split across hardware threads, and AVX2 is used when the CPU
+// has it, without changing the result.
+QImage convolve(QImage *in, const kernel_t &kernel, border_t border = BORDER_CLAMP,
+		QRgb constant = qRgb(0, 0, 0), float bias = 0, QProgressBar *qpb = 0);
 
-QImage transpose(QImage *in, QProgressBar *qpb);
+// convolve() by FFT, whatever the kernel's size. The image is cut into
+// tiles of up to 512 x 512 including the kernel's margins, so memory
+// stays bounded; each tile is transformed, multiplied by the kernel's
+// spectrum and transformed back. Results may differ from the spatial
+// paths by rounding, i.e. by 1.
+QImage convolveFFT(QImage *in, const kernel_t &kernel, border_t border = BORDER_CLAMP,
+		QRgb constant = qRgb(0, 0, 0), float bias = 0, QProgressBar *qpb = 0);
 
-QImage boxBlur(QImage *in, int radius, QProgressBar *qpb);
+// A normalized 2-D Gaussian of radius ceil(3 sigma), or the identity for
+// a sigma of 0. It is separable, and large ones convolve by FFT.
+kernel_t gaussianKernel(float sigma);
 
-QImage medianFilter(QImage *in, int radius, QProgressBar *qpb);
+// Edge-preserving smoothing by a bilateral grid: pixels are averaged
+// into cells sigma_s pixels wide and sigma_r luminance levels deep, the
+// grid is blurred and read back at each pixel's position and luminance.
+// Its cost does not grow with sigma_s, unlike a brute-force bilateral
+// filter, and it approximates one with those sigmas.
+QImage bilateralFilter(QImage *in, float sigma_s, float sigma_r, QProgressBar *qpb = 0);
 
-QImage gaussianBlur(QImage *in, int radius, float sigma, QProgressBar *qpb);
+// Edge-preserving smoothing by a guided filter with the luminance as the
+// guide: each channel is fitted as a linear function of the luminance
+// over every window of radius, using box means, so its cost does not
+// grow with radius. eps, in squared levels, sets how large a variance
+// counts as an edge; (0.1 * 255)^2 is a typical value. From a radius of
+// 8 the fit is made on a shrunk image and interpolated back, which moves
+// results by a few levels.
+QImage guidedFilter(QImage *in, int radius, float eps, QProgressBar *qpb = 0);
 
-QImage sobel(QImage *in, QProgressBar *qpb);
\ No newline at end of file
+#endif
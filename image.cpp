@@ -0,0 +1,323 @@
+#include <QImage>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "image.h"
+#include "ppm.h"
+
+/*
+ * Format table
+ */
+
+typedef struct {
+    int size;
+    int channels;
+    QImage::Format qt;
+} pix_fmt_info_t;
+
+static const pix_fmt_info_t fmt_info[PIX_FORMAT_COUNT] = {
+    { 3, 3, QImage::Format_RGB888 },        // PIX_RGB8
+    { 4, 4, QImage::Format_RGBA8888 },      // PIX_RGBA8
+    { 4, 3, QImage::Format_RGB32 },         // PIX_RGB32
+    { 1, 1, QImage::Format_Grayscale8 },    // PIX_GRAY8
+    { 2, 1, QImage::Format_Grayscale16 },   // PIX_GRAY16
+    { 4, 1, QImage::Format_Invalid },       // PIX_FLOAT32
+};
+
+int pix_fmt_size(pix_fmt_t fmt) {
+    return fmt_info[fmt].size;
+}
+
+int pix_fmt_channels(pix_fmt_t fmt) {
+    return fmt_info[fmt].channels;
+}
+
+/*
+ * Shared buffer. mem is set when Image allocated the pixels; otherwise
+ * they belong to someone else and are only read.
+ */
+
+struct Image::buffer_t {
+    std::atomic<int> ref;
+    unsigned char *mem;
+    QImage *qimg;
+};
+
+static unsigned char *aligned_alloc_bytes(size_t size) {
+    void *p = NULL;
+#ifdef _WIN32
+    p = _aligned_malloc(size, Image::IMAGE_ALIGN);
+#else
+    if (posix_memalign(&p, Image::IMAGE_ALIGN, size) != 0) { p = NULL; }
+#endif
+    return (unsigned char *) p;
+}
+
+static void aligned_free_bytes(unsigned char *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+Image::Image() :
+    buf(0), data(0), w(0), h(0), row_stride(0), fmt(PIX_RGB8) {
+}
+
+Image::Image(int w, int h, pix_fmt_t fmt) :
+    buf(0), data(0), w(0), h(0), row_stride(0), fmt(fmt) {
+    if (w <= 0 || h <= 0) { return; }
+    size_t row = (size_t) w * fmt_info[fmt].size;
+    size_t stride = (row + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    unsigned char *mem = aligned_alloc_bytes(stride * h);
+    if (!mem) { return; }
+    buf = new buffer_t;
+    buf->ref = 1;
+    buf->mem = mem;
+    buf->qimg = 0;
+    this->data = mem;
+    this->w = w;
+    this->h = h;
+    this->row_stride = stride;
+}
+
+Image::Image(const Image &other) :
+    buf(other.buf), data(other.data), w(other.w), h(other.h),
+    row_stride(other.row_stride), fmt(other.fmt) {
+    if (buf) { ++buf->ref; }
+}
+
+Image &Image::operator=(const Image &other) {
+    if (other.buf) { ++other.buf->ref; }
+    release();
+    buf = other.buf;
+    data = other.data;
+    w = other.w;
+    h = other.h;
+    row_stride = other.row_stride;
+    fmt = other.fmt;
+    return *this;
+}
+
+Image::~Image() {
+    release();
+}
+
+void Image::releaseBuffer(void *p) {
+    buffer_t *b = (buffer_t *) p;
+    if (--b->ref > 0) { return; }
+    if (b->mem) { aligned_free_bytes(b->mem); }
+    delete b->qimg;
+    delete b;
+}
+
+void Image::release() {
+    if (buf) { releaseBuffer(buf); }
+    buf = 0;
+    data = 0;
+}
+
+Image Image::fromQImage(const QImage &img) {
+    Image out;
+    if (img.isNull()) { return out; }
+
+    QImage src = img;
+    int f = 0;
+    for (; f < PIX_FORMAT_COUNT; ++f) {
+        if (fmt_info[f].qt == img.format()) { break; }
+    }
+    if (f == PIX_FORMAT_COUNT) {
+        // No equivalent layout; this is the one case that copies
+        f = img.hasAlphaChannel() ? PIX_RGBA8 : PIX_RGB32;
+        src = img.convertToFormat(fmt_info[f].qt);
+    }
+
+    out.buf = new buffer_t;
+    out.buf->ref = 1;
+    out.buf->mem = 0;
+    out.buf->qimg = new QImage(src);
+    out.data = (unsigned char *) out.buf->qimg->constBits();
+    out.w = src.width();
+    out.h = src.height();
+    out.row_stride = src.bytesPerLine();
+    out.fmt = (pix_fmt_t) f;
+    return out;
+}
+
+Image Image::fromImg(const img_t *img) {
+    Image out;
+    if (!img || !img->data) { return out; }
+    out.buf = new buffer_t;
+    out.buf->ref = 1;
+    out.buf->mem = 0;
+    out.buf->qimg = 0;
+    out.data = (unsigned char *) img->data;
+    out.w = img->w;
+    out.h = img->h;
+    out.row_stride = (size_t) img->w * sizeof(pixel_t);
+    out.fmt = PIX_RGB8;
+    return out;
+}
+
+QImage Image::toQImage() const {
+    if (!buf) { return QImage(); }
+    if (fmt_info[fmt].qt == QImage::Format_Invalid) {
+        return convert(PIX_GRAY8).toQImage();
+    }
+    // The const constructor makes QImage copy before its first write
+    ++buf->ref;
+    return QImage((const uchar *) data, w, h, (int) row_stride,
+                  fmt_info[fmt].qt, releaseBuffer, buf);
+}
+
+QImage Image::newQImage(int w, int h, pix_fmt_t fmt) {
+    Image out(w, h, fmt);
+    if (!out.buf || fmt_info[fmt].qt == QImage::Format_Invalid) { return QImage(); }
+    // The QImage takes a reference that outlives out's
+    ++out.buf->ref;
+    return QImage(out.data, w, h, (int) out.row_stride,
+                  fmt_info[fmt].qt, releaseBuffer, out.buf);
+}
+
+bool Image::viewAsImg(img_t *view) const {
+    if (!buf || fmt != PIX_RGB8 || row_stride != (size_t) w * sizeof(pixel_t)) {
+        return false;
+    }
+    view->data = (pixel_t *) data;
+    view->w = w;
+    view->h = h;
+    return true;
+}
+
+bool Image::isNull() const {
+    return buf == 0;
+}
+
+int Image::width() const {
+    return w;
+}
+
+int Image::height() const {
+    return h;
+}
+
+pix_fmt_t Image::format() const {
+    return fmt;
+}
+
+size_t Image::stride() const {
+    return row_stride;
+}
+
+bool Image::isAligned() const {
+    return ((size_t) data % IMAGE_ALIGN) == 0 && (row_stride % IMAGE_ALIGN) == 0;
+}
+
+const unsigned char *Image::constScanLine(int y) const {
+    return data + row_stride * y;
+}
+
+unsigned char *Image::scanLine(int y) {
+    detach();
+    return data + row_stride * y;
+}
+
+void Image::detach() {
+    if (!buf || (buf->mem && buf->ref == 1)) { return; }
+    Image copy(w, h, fmt);
+    size_t row = (size_t) w * fmt_info[fmt].size;
+    for (int y = 0; y < h; ++y) {
+        memcpy(copy.data + copy.row_stride * y, data + row_stride * y, row);
+    }
+    *this = copy;
+}
+
+/*
+ * Conversion. Every pixel goes through normalized float RGBA.
+ */
+
+static void load_rgba(pix_fmt_t fmt, const unsigned char *p, float *rgba) {
+    switch (fmt) {
+    case PIX_RGB8:
+        rgba[0] = p[0] / 255.f; rgba[1] = p[1] / 255.f; rgba[2] = p[2] / 255.f;
+        rgba[3] = 1;
+        break;
+    case PIX_RGBA8:
+        rgba[0] = p[0] / 255.f; rgba[1] = p[1] / 255.f; rgba[2] = p[2] / 255.f;
+        rgba[3] = p[3] / 255.f;
+        break;
+    case PIX_RGB32: {
+        unsigned int v = *(const unsigned int *) p;
+        rgba[0] = qRed(v) / 255.f; rgba[1] = qGreen(v) / 255.f; rgba[2] = qBlue(v) / 255.f;
+        rgba[3] = 1;
+        break;
+    }
+    case PIX_GRAY8:
+        rgba[0] = rgba[1] = rgba[2] = p[0] / 255.f;
+        rgba[3] = 1;
+        break;
+    case PIX_GRAY16:
+        rgba[0] = rgba[1] = rgba[2] = *(const unsigned short *) p / 65535.f;
+        rgba[3] = 1;
+        break;
+    case PIX_FLOAT32:
+        rgba[0] = rgba[1] = rgba[2] = *(const float *) p;
+        rgba[3] = 1;
+        break;
+    default:
+        break;
+    }
+}
+
+static unsigned char to8(float v) {
+    return (unsigned char) (std::min(std::max(v, 0.f), 1.f) * 255 + .5f);
+}
+
+static void store_rgba(pix_fmt_t fmt, const float *rgba, unsigned char *p) {
+    float gray = .299f * rgba[0] + .587f * rgba[1] + .114f * rgba[2];
+    switch (fmt) {
+    case PIX_RGB8:
+        p[0] = to8(rgba[0]); p[1] = to8(rgba[1]); p[2] = to8(rgba[2]);
+        break;
+    case PIX_RGBA8:
+        p[0] = to8(rgba[0]); p[1] = to8(rgba[1]); p[2] = to8(rgba[2]);
+        p[3] = to8(rgba[3]);
+        break;
+    case PIX_RGB32:
+        *(unsigned int *) p = qRgb(to8(rgba[0]), to8(rgba[1]), to8(rgba[2]));
+        break;
+    case PIX_GRAY8:
+        p[0] = to8(gray);
+        break;
+    case PIX_GRAY16:
+        *(unsigned short *) p = (unsigned short)
+                (std::min(std::max(gray, 0.f), 1.f) * 65535 + .5f);
+        break;
+    case PIX_FLOAT32:
+        *(float *) p = gray;
+        break;
+    default:
+        break;
+    }
+}
+
+Image Image::convert(pix_fmt_t to) const {
+    if (!buf) { return Image(); }
+    if (to == fmt) { return *this; }
+    Image out(w, h, to);
+    int in_size = fmt_info[fmt].size;
+    int out_size = fmt_info[to].size;
+    float rgba[4];
+    for (int y = 0; y < h; ++y) {
+        const unsigned char *in = constScanLine(y);
+        unsigned char *dst = out.data + out.row_stride * y;
+        for (int x = 0; x < w; ++x) {
+            load_rgba(fmt, in + x * in_size, rgba);
+            store_rgba(to, rgba, dst + x * out_size);
+        }
+    }
+    return out;
+}
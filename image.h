@@ -0,0 +1,116 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stddef.h>
+
+class QImage;
+struct img_t;
+
+/*
+ * The one definition of an 8-bit RGB pixel, shared by ppm.h and
+ * rasterize.h.
+ */
+typedef struct pixel_t {
+    unsigned char r, g, b;
+} pixel_t;
+
+/*
+ * Pixel layouts an Image can hold. PIX_RGB32 is Qt's native 0xffRRGGBB
+ * word, the layout of every image the filters in im_op.cpp produce. Add a
+ * format by extending this enum and the table in image.cpp.
+ */
+typedef enum {
+    PIX_RGB8,       // r, g, b bytes
+    PIX_RGBA8,      // r, g, b, a bytes
+    PIX_RGB32,      // 32-bit 0xffRRGGBB, native byte order
+    PIX_GRAY8,
+    PIX_GRAY16,     // native byte order
+    PIX_FLOAT32,    // one float channel
+    PIX_FORMAT_COUNT
+} pix_fmt_t;
+
+/// Bytes per pixel of fmt
+int pix_fmt_size(pix_fmt_t fmt);
+
+/// Channels per pixel of fmt
+int pix_fmt_channels(pix_fmt_t fmt);
+
+/*
+ * A reference-counted image buffer with copy-on-write semantics. Copies
+ * share pixels until one of them asks for a writable row. Buffers that
+ * Image allocates have every row starting on an IMAGE_ALIGN boundary.
+ *
+ * An Image can wrap a QImage or an img_t without copying, and can be
+ * wrapped by a QImage without copying. Wrapped memory is treated as
+ * read-only: the first writable access copies it into an owned, aligned
+ * buffer.
+ */
+class Image {
+public:
+    static const int IMAGE_ALIGN = 64;
+
+    /// A null image
+    Image();
+
+    /// Allocates an uninitialized w by h image with an aligned stride
+    Image(int w, int h, pix_fmt_t fmt);
+
+    Image(const Image &other);
+    Image &operator=(const Image &other);
+    ~Image();
+
+    /// Wraps img's pixels. The QImage is kept alive (and shared) until the
+    /// Image lets go. Formats without a pix_fmt_t equivalent are converted.
+    static Image fromQImage(const QImage &img);
+
+    /// Wraps img's pixels. img must outlive every Image sharing them.
+    static Image fromImg(const img_t *img);
+
+    /// A QImage over the same pixels, keeping this buffer alive until the
+    /// QImage and all its copies are gone. Writing to the QImage detaches
+    /// it. PIX_FLOAT32 has no Qt equivalent and is converted to Gray8.
+    QImage toQImage() const;
+
+    /// A new, uninitialized w by h QImage over an aligned buffer that only
+    /// the QImage owns, so writing to it does not copy. Null for
+    /// PIX_FLOAT32 or when the allocation fails.
+    static QImage newQImage(int w, int h, pix_fmt_t fmt);
+
+    /// Points view at the pixels if this is a PIX_RGB8 image with no row
+    /// padding, and returns false otherwise
+    bool viewAsImg(img_t *view) const;
+
+    bool isNull() const;
+    int width() const;
+    int height() const;
+    pix_fmt_t format() const;
+    size_t stride() const;
+
+    /// True if every row starts on an IMAGE_ALIGN boundary
+    bool isAligned() const;
+
+    const unsigned char *constScanLine(int y) const;
+
+    /// Writable row y. Detaches first if the pixels are shared or wrapped.
+    unsigned char *scanLine(int y);
+
+    /// Makes this the only owner of an aligned copy of its pixels
+    void detach();
+
+    /// A converted copy. Conversions go through 8-bit RGB(A) or gray.
+    Image convert(pix_fmt_t fmt) const;
+
+private:
+    struct buffer_t;
+
+    void release();
+    static void releaseBuffer(void *buf);
+
+    buffer_t *buf;
+    unsigned char *data;
+    int w, h;
+    size_t row_stride;
+    pix_fmt_t fmt;
+};
+
+#endif
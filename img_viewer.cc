@@ -6,8 +6,8 @@
 #include <QMenu>
 #include <QMenuBar>
 #include <QFileDialog>
-#include <QPixmap>
 #include <QComboBox>
+#include <QLineEdit>
 #include <QDockWidget>
 #include <QDebug>
 #include <QGroupBox>
@@ -17,8 +17,17 @@
 #include <QMessageBox>
 #include <QSpinBox>
 #include <QProgressBar>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QImageReader>
+#include <QTimer>
+#include <QFontDatabase>
+#include <QStandardPaths>
+#include <QDir>
 #include <string>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <float.h>
 #include <iostream>
 #include "ImageViewControls.h"
@@ -27,11 +36,74 @@
 #include "im_op.h"
 #include "mat4.h"
 #include "vec4.h"
+#include "meshbin.h"
+#include "profile.h"
+#include "trace.h"
 
 const double PI = 3.1415926;
 
+// Default memory cap for the render cache, in megabytes
+const int RENDER_CACHE_MB = 256;
+
+// Images with more pixels than this are opened as a TiledImage
+const qint64 TILED_IMAGE_PIXELS = 64LL * 1024 * 1024;
+
+// Memory cap for decoded tiles, in megabytes
+const int TILE_CACHE_MB = 512;
+
+// Width and height of rendered frames
+const int RENDER_SIZE = 512;
+
+// Meshes with fewer triangles are always drawn at full detail
+const size_t LOD_MIN_TRIANGLES = 50000;
+
+// Fractions of the triangles kept by each preview level
+const float LOD_RATIOS[] = { 0.25f, 0.05f };
+
+// Screen pixels per triangle a preview aims for
+const float PREVIEW_PIXELS_PER_TRI = 8;
+
+// How long the camera must rest before the full mesh is drawn, in ms
+const int REFINE_DELAY_MS = 250;
+
+// 64-bit FNV-1a, used to build render cache keys
+static quint64 fnv1a(quint64 hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The bounding box of the pixels that differ between two frames, or all
+// of after when their sizes or formats differ. Successive renders only
+// change where the mesh was or is, so only that part is repainted.
+static QRect changedRect(const QImage &before, const QImage &after) {
+    if (before.size() != after.size() || before.format() != after.format() ||
+            after.depth() != 32) {
+        return after.rect();
+    }
+    int w = after.width();
+    int x0 = w, x1 = -1, y0 = -1, y1 = -1;
+    for (int y = 0; y < after.height(); ++y) {
+        const QRgb *a = (const QRgb *) before.constScanLine(y);
+        const QRgb *b = (const QRgb *) after.constScanLine(y);
+        if (a == b || memcmp(a, b, w * sizeof(QRgb)) == 0) { continue; }
+        if (y0 < 0) { y0 = y; }
+        y1 = y;
+        int l = 0, r = w - 1;
+        while (a[l] == b[l]) { ++l; }
+        while (a[r] == b[r]) { --r; }
+        x0 = std::min(x0, l);
+        x1 = std::max(x1, r);
+    }
+    if (y0 < 0) { return QRect(); }
+    return QRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
 ImageViewer::ImageViewer(QWidget *parent) :
-    QMainWindow(parent) {
+    QMainWindow(parent), tiledImg(0), lod(0) {
 
     this->setWindowTitle("Rasterizer and Image Viewer");
 
@@ -72,13 +144,13 @@ ImageViewer::ImageViewer(QWidget *parent) :
 
     createCameraDock();
     createFilterDock();
+    createProfileDock();
     createActions();
     createMenus();
 
-    img = QImage(512, 512, QImage::Format_RGB888);
+    img = QImage(512, 512, QImage::Format_RGB32);
     img.fill(qRgb(0, 0, 0));
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
 
     objFileLabel = new QLabel(tr("No obj loaded"), this);
     layout->addWidget(objFileLabel);
@@ -94,6 +166,7 @@ ImageViewer::ImageViewer(QWidget *parent) :
     shadingOptionBox->addItem(tr("Gouraud, perspective correct"));
     shadingOptionBox->addItem(tr("Barycentric"));
     shadingOptionBox->addItem(tr("Barycentric, perspective correct"));
+    shadingOptionBox->addItem(tr("Blinn-Phong"));
 
     h_layout->addWidget(shadingOptionBox);
 
@@ -103,6 +176,25 @@ ImageViewer::ImageViewer(QWidget *parent) :
 
     h_layout->addWidget(rasterizeButton);
 
+    renderCacheSizeBox = new QSpinBox(this);
+    renderCacheSizeBox->setRange(0, 16384);
+    renderCacheSizeBox->setSuffix(tr(" MB cache"));
+    renderCacheSizeBox->setValue(RENDER_CACHE_MB);
+    renderCacheSizeBox->setKeyboardTracking(false);
+    renderCache.setMaxCost(RENDER_CACHE_MB * 1024);
+    connect(renderCacheSizeBox, SIGNAL(valueChanged(int)),
+                                this, SLOT(renderCacheSizeChanged(int)));
+
+    h_layout->addWidget(renderCacheSizeBox);
+
+    meshOptimizeBox = new QCheckBox(tr("Optimize mesh order"), this);
+    meshOptimizeBox->setChecked(true);
+    meshOptFlags = MESH_OPT_ALL;
+    connect(meshOptimizeBox, SIGNAL(toggled(bool)),
+                             this, SLOT(meshOptimizeToggled(bool)));
+
+    h_layout->addWidget(meshOptimizeBox);
+
     shadingGroup->setLayout(h_layout);
 
     layout->addWidget(shadingGroup);
@@ -113,9 +205,18 @@ ImageViewer::ImageViewer(QWidget *parent) :
                               this, SLOT(shadingOptionChanged(int)));
 
     camera_init(&camera);
+    lighting_init(&lighting);
+    randomSeed = 0;
+
+    refineTimer = new QTimer(this);
+    refineTimer->setSingleShot(true);
+    refineTimer->setInterval(REFINE_DELAY_MS);
+    connect(refineTimer, SIGNAL(timeout()), this, SLOT(rasterize_wrapper()));
 }
 
 ImageViewer::~ImageViewer() {
+    delete tiledImg;
+    delete lod;
 }
 
 void ImageViewer::shadingOptionChanged(int index) {
@@ -141,6 +242,9 @@ void ImageViewer::shadingOptionChanged(int index) {
     case 6:
         shadingOption = NORM_BARY_Z;
         break;
+    case 7:
+        shadingOption = BLINN_PHONG;
+        break;
     default:
         break;
     }
@@ -158,6 +262,16 @@ void ImageViewer::rasterizeButtonClicked() {
 }
 
 void ImageViewer::cameraOptionsChanged() {
+    readCameraOptions();
+    rasterize_wrapper();
+}
+
+void ImageViewer::cameraMoved() {
+    readCameraOptions();
+    previewRender();
+}
+
+void ImageViewer::readCameraOptions() {
     camera.left = cam_left_box->value();
     camera.right = cam_right_box->value();
     camera.bottom = cam_bottom_box->value();
@@ -174,7 +288,6 @@ void ImageViewer::cameraOptionsChanged() {
     camera.up_y = cam_up_y_box->value();
     camera.up_z = cam_up_z_box->value();
     update_matrices(&camera);
-    rasterize_wrapper();
 }
 
 void ImageViewer::saveCamera() {
@@ -193,6 +306,8 @@ void ImageViewer::open_obj() {
     QString tmp("Loaded .obj: ");
     tmp.append(obj_file.right(obj_file.size() - obj_file.lastIndexOf('/') - 1));
     objFileLabel->setText(tmp);
+    delete lod;
+    lod = 0;
 }
 
 void ImageViewer::blockCameraOptionSignals(bool b) {
@@ -221,6 +336,20 @@ void ImageViewer::open_cam() {
     cameraChanged();
 }
 
+void ImageViewer::open_lights() {
+    QString filename = QFileDialog::getOpenFileName(this,
+            tr("Open lights file"), "./", tr("Text files (*.txt)"));
+    if (filename == "") { return; }
+    if (!load_lighting(filename.toStdString().c_str(), &lighting)) {
+        QMessageBox errorBox;
+        errorBox.setText("Could not read the lights file");
+        errorBox.setIcon(QMessageBox::Warning);
+        errorBox.exec();
+        return;
+    }
+    if (shadingOption == BLINN_PHONG) { rasterize_wrapper(); }
+}
+
 void ImageViewer::cameraChanged() {
     blockCameraOptionSignals(true);
     cam_left_box->setValue(camera.left);
@@ -245,9 +374,25 @@ void ImageViewer::open_img() {
     QString filename = QFileDialog::getOpenFileName(this,
             tr("Open image"), "./", tr("Image files (*.ppm *.png *.jpg *.bmp)"));
     if (filename == "") { return; }
-    img.load(filename);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+
+    QSize size = QImageReader(filename).size();
+    if (size.isValid() &&
+            (qint64) size.width() * size.height() > TILED_IMAGE_PIXELS) {
+        leaveTiledMode();
+        tiledImg = new TiledImage(filename, TILE_CACHE_MB);
+        imgLabel->setTiledImage(tiledImg);
+        return;
+    }
+
+    leaveTiledMode();
+    {
+        TRACE_SCOPE("io", "QImage::load");
+        img.load(filename);
+    }
+    if (img.format() != QImage::Format_RGB32) {
+        img = img.convertToFormat(QImage::Format_RGB32);
+    }
+    imgLabel->setImage(img);
 }
 
 void ImageViewer::save() {
@@ -255,39 +400,65 @@ void ImageViewer::save() {
             tr("Save image"), "./",
             tr("Image files (*.ppm *.png *.jpg *.bmp)"));
     if (filename == "") { return; }
+    if (tiledImg) {
+        QMessageBox errorBox;
+        errorBox.setText("Saving tiled images is not supported");
+        errorBox.setIcon(QMessageBox::Warning);
+        errorBox.exec();
+        return;
+    }
+    TRACE_SCOPE("io", "QImage::save");
     img.save(filename);
 }
 
+void ImageViewer::leaveTiledMode() {
+    if (!tiledImg) { return; }
+    imgLabel->setTiledImage(0);
+    delete tiledImg;
+    tiledImg = 0;
+}
+
+// Runs filter on every tile as it is decoded. margin is how far outside a
+// tile the filter reads.
+bool ImageViewer::addTileFilter(const TiledImage::tile_filter_t &filter, int margin) {
+    if (!tiledImg) { return false; }
+    tiledImg->addFilter(filter, margin);
+    imgLabel->update();
+    return true;
+}
+
 void ImageViewer::undo() {
-    redoImageStack.push(img.copy());
+    leaveTiledMode();
+    redoImageStack.push(img);
     redoCameraStack.push(camera);
     redoAct->setEnabled(true);
     img = undoImageStack.pop();
     camera = undoCameraStack.pop();
     cameraChanged();
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
     if (undoImageStack.isEmpty()) {
         undoAct->setEnabled(false);
     }
 }
 
 void ImageViewer::redo() {
-    undoImageStack.push(img.copy());
+    leaveTiledMode();
+    undoImageStack.push(img);
     undoCameraStack.push(camera);
     undoAct->setEnabled(true);
     img = redoImageStack.pop();
     camera = redoCameraStack.pop();
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
     cameraChanged();
     if (redoImageStack.isEmpty()) {
         redoAct->setEnabled(false);
     }
 }
 
+// QImage is implicitly shared, so the stacks only hold a reference until
+// an operation writes to img and detaches it.
 void ImageViewer::addOperationForUndo() {
-    undoImageStack.push(img.copy());
+    undoImageStack.push(img);
     undoCameraStack.push(camera);
     undoAct->setEnabled(true);
     redoImageStack.clear();
@@ -295,61 +466,276 @@ void ImageViewer::addOperationForUndo() {
     redoAct->setEnabled(false);
 }
 
+quint64 ImageViewer::renderKey(int w, int h) const {
+    quint64 key = 14695981039346656037ULL;
+
+    // The mesh is identified by its path plus size and modification time,
+    // so editing the .obj on disk invalidates its entries.
+    QFileInfo info(obj_file);
+    std::string path = info.absoluteFilePath().toStdString();
+    qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+    qint64 size = info.size();
+    key = fnv1a(key, path.data(), path.size());
+    key = fnv1a(key, &mtime, sizeof(mtime));
+    key = fnv1a(key, &size, sizeof(size));
+
+    // proj and view are derived from the scalar fields, so skip them
+    const float cam[] = { camera.left, camera.right, camera.bottom, camera.top,
+                          camera.near, camera.far,
+                          camera.eye_x, camera.eye_y, camera.eye_z,
+                          camera.c_x, camera.c_y, camera.c_z,
+                          camera.up_x, camera.up_y, camera.up_z };
+    key = fnv1a(key, cam, sizeof(cam));
+    key = fnv1a(key, &w, sizeof(w));
+    key = fnv1a(key, &h, sizeof(h));
+    key = fnv1a(key, &shadingOption, sizeof(shadingOption));
+    key = fnv1a(key, &meshOptFlags, sizeof(meshOptFlags));
+    if (shadingOption == BLINN_PHONG) {
+        key = fnv1a(key, lighting.ambient, sizeof(lighting.ambient));
+        if (!lighting.lights.empty()) {
+            key = fnv1a(key, &lighting.lights[0],
+                        lighting.lights.size() * sizeof(light_t));
+        }
+    }
+    return key;
+}
+
 void ImageViewer::rasterize_wrapper() {
     if (obj_file == "") { return; }
-    img = rasterize(obj_file.toStdString().c_str(), &camera, 512, 512, shadingOption);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    leaveTiledMode();
+    refineTimer->stop();
+    const int w = RENDER_SIZE;
+    const int h = RENDER_SIZE;
+    profile_reset();
+
+    // RANDOM picks new colors on every render, so it is never cached
+    bool cacheable = shadingOption != RANDOM;
+    quint64 key = 0;
+    if (cacheable) {
+        key = renderKey(w, h);
+        QImage *cached = renderCache.object(key);
+        if (cached) {
+            QImage before = img;
+            img = *cached;
+            imgLabel->setImage(img, changedRect(before, img));
+            showProfile(tr("Render (cached)"));
+            return;
+        }
+    }
+
+    QImage before = img;
+    img = rasterize(obj_file.toStdString().c_str(), &camera, w, h, shadingOption,
+                    meshOptFlags, &lighting, ++randomSeed);
+    if (cacheable) {
+        renderCache.insert(key, new QImage(img),
+                           qMax(1, img.bytesPerLine() * img.height() / 1024));
+    }
+    imgLabel->setImage(img, changedRect(before, img));
+    showProfile(tr("Render"));
+}
+
+bool ImageViewer::buildLod() {
+    if (lod) { return true; }
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string err = load_mesh(obj_file.toStdString().c_str(), "../obj/",
+                                shapes, materials, meshOptFlags);
+    if (err != "") { return false; }
+
+    lod = new lod_chain_t;
+    size_t triangles = 0;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        triangles += shapes[i].mesh.indices.size() / 3;
+    }
+    if (triangles < LOD_MIN_TRIANGLES) {
+        // Not worth simplifying; previews draw the full mesh
+        lod->full_triangles = triangles;
+        return true;
+    }
+    build_lod_chain(shapes, materials, LOD_RATIOS,
+                    sizeof(LOD_RATIOS) / sizeof(LOD_RATIOS[0]), lod);
+    return true;
+}
+
+void ImageViewer::previewRender() {
+    if (obj_file == "") { return; }
+    if (shadingOption != RANDOM && renderCache.object(renderKey(RENDER_SIZE, RENDER_SIZE))) {
+        rasterize_wrapper();
+        return;
+    }
+    if (!buildLod() || lod->levels.empty()) {
+        rasterize_wrapper();
+        return;
+    }
+    leaveTiledMode();
+
+    // Draw a simplified level now and the full mesh once the camera rests
+    int level = lod_select(lod, &camera, RENDER_SIZE, RENDER_SIZE, PREVIEW_PIXELS_PER_TRI);
+    if (level < 0) { level = 0; }
+    std::vector<mesh_view_t> meshes;
+    mesh_views(lod->levels[level].shapes, meshes);
+    profile_reset();
+    QImage before = img;
+    img = rasterize_meshes(meshes, lod->materials, &camera,
+                           RENDER_SIZE, RENDER_SIZE, shadingOption, &lighting, ++randomSeed);
+    imgLabel->setImage(img, changedRect(before, img));
+    showProfile(tr("Preview, level %1").arg(level));
+    refineTimer->start();
+}
+
+void ImageViewer::exportLods() {
+    if (obj_file == "") {
+        QMessageBox errorBox;
+        errorBox.setText("Please open an .obj file");
+        errorBox.setIcon(QMessageBox::Warning);
+        errorBox.exec();
+        return;
+    }
+    QString filename = QFileDialog::getSaveFileName(this,
+            tr("Export simplified .obj"), "./",
+            tr("Object files (*.obj)"));
+    if (filename == "") { return; }
+
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string err = load_mesh(obj_file.toStdString().c_str(), "../obj/",
+                                shapes, materials, meshOptFlags);
+    if (err != "") { return; }
+    lod_chain_t chain;
+    build_lod_chain(shapes, materials, LOD_RATIOS,
+                    sizeof(LOD_RATIOS) / sizeof(LOD_RATIOS[0]), &chain);
+
+    // One file per level: name_lod1.obj, name_lod2.obj, ...
+    QString base = filename;
+    if (base.endsWith(".obj", Qt::CaseInsensitive)) { base.chop(4); }
+    for (size_t i = 0; i < chain.levels.size(); ++i) {
+        QString out = base + QString("_lod%1.obj").arg(i + 1);
+        if (!write_obj(out.toStdString().c_str(), chain.levels[i].shapes, chain.materials)) {
+            QMessageBox errorBox;
+            errorBox.setText("Could not write " + out);
+            errorBox.setIcon(QMessageBox::Warning);
+            errorBox.exec();
+            return;
+        }
+    }
+}
+
+// Checking the action starts recording; unchecking stops it and asks
+// where to save the trace
+void ImageViewer::recordTrace(bool on) {
+    if (on) {
+        trace_thread_name("main");
+        trace_start();
+        return;
+    }
+    trace_stop();
+    QString filename = QFileDialog::getSaveFileName(this,
+            tr("Save trace"), "./", tr("Trace files (*.json)"));
+    if (filename == "") { return; }
+    if (!trace_write(filename.toStdString().c_str())) {
+        QMessageBox errorBox;
+        errorBox.setText("Could not write the trace file");
+        errorBox.setIcon(QMessageBox::Warning);
+        errorBox.exec();
+    }
+}
+
+void ImageViewer::renderCacheSizeChanged(int mb) {
+    renderCache.setMaxCost(mb * 1024);
+}
+
+void ImageViewer::meshOptimizeToggled(bool on) {
+    meshOptFlags = on ? MESH_OPT_ALL : 0;
+    // The levels were simplified from the old index order
+    delete lod;
+    lod = 0;
+    rasterize_wrapper();
 }
 
 void ImageViewer::grayscale_wrapper() {
+    if (addTileFilter([](QImage *t) { grayscale(t); return *t; }, 0)) { return; }
     addOperationForUndo();
+    profile_reset();
     grayscale(&img, filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
 }
 
 void ImageViewer::flip_wrapper() {
+    if (tiledImg) {
+        QMessageBox errorBox;
+        errorBox.setText("Not available for tiled images");
+        errorBox.setIcon(QMessageBox::Warning);
+        errorBox.exec();
+        return;
+    }
     addOperationForUndo();
+    profile_reset();
     flip(&img, filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
 }
 
 void ImageViewer::flop_wrapper() {
+    if (tiledImg) {
+        QMessageBox errorBox;
+        errorBox.setText("Not available for tiled images");
+        errorBox.setIcon(QMessageBox::Warning);
+        errorBox.exec();
+        return;
+    }
     addOperationForUndo();
+    profile_reset();
     flop(&img, filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
 }
 
 void ImageViewer::transpose_wrapper() {
+    if (tiledImg) {
+        QMessageBox errorBox;
+        errorBox.setText("Not available for tiled images");
+        errorBox.setIcon(QMessageBox::Warning);
+        errorBox.exec();
+        return;
+    }
     addOperationForUndo();
+    profile_reset();
     img = transpose(&img, filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
 }
 
 void ImageViewer::boxBlur_wrapper() {
+    int radius = boxBlurRadiusBox->value();
+    if (addTileFilter([radius](QImage *t) { return boxBlur(t, radius); }, radius)) { return; }
     addOperationForUndo();
-    img = boxBlur(&img, boxBlurRadiusBox->value(), filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    profile_reset();
+    img = boxBlur(&img, radius, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
 }
 
 void ImageViewer::medianFilter_wrapper() {
+    int radius = medianFilterRadiusBox->value();
+    if (addTileFilter([radius](QImage *t) { return medianFilter(t, radius); }, radius)) { return; }
     addOperationForUndo();
-    img = medianFilter(&img, medianFilterRadiusBox->value(), filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    profile_reset();
+    img = medianFilter(&img, radius, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
 }
 
 void ImageViewer::gaussianBlur_wrapper() {
+    int radius = gaussianBlurRadiusBox->value();
+    float sigma = gaussianBlurSigmaBox->value();
+    if (addTileFilter([radius, sigma](QImage *t) {
+            return gaussianBlur(t, radius, sigma); }, radius)) { return; }
     addOperationForUndo();
-    img = gaussianBlur(&img, gaussianBlurRadiusBox->value(),
-                        gaussianBlurSigmaBox->value(), filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    profile_reset();
+    img = gaussianBlur(&img, radius, sigma, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
 }
 
 void ImageViewer::resize_wrapper() {
@@ -360,10 +746,195 @@ void ImageViewer::resize_wrapper() {
 }
 
 void ImageViewer::sobel_wrapper() {
+    // Each tile's own maximum would give each its own brightness, so
+    // tiles share the largest magnitude possible instead
+    if (addTileFilter([](QImage *t) {
+            return sobelScaled(t, SOBEL_MAX_MAGNITUDE); }, 1)) { return; }
     addOperationForUndo();
+    profile_reset();
     img = sobel(&img, filterProgress);
-    pixmap = QPixmap::fromImage(img);
-    imgLabel->setPixmap(pixmap);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+void ImageViewer::localMean_wrapper() {
+    int radius = localMeanRadiusBox->value();
+    if (addTileFilter([radius](QImage *t) { return localMean(t, radius); }, radius)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    img = localMean(&img, radius, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+void ImageViewer::localStdDev_wrapper() {
+    int radius = localStdDevRadiusBox->value();
+    if (addTileFilter([radius](QImage *t) { return localStdDev(t, radius); }, radius)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    img = localStdDev(&img, radius, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+void ImageViewer::adaptiveThreshold_wrapper() {
+    int radius = adaptiveThresholdRadiusBox->value();
+    int offset = adaptiveThresholdOffsetBox->value();
+    if (addTileFilter([radius, offset](QImage *t) {
+            return adaptiveThreshold(t, radius, offset); }, radius)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    img = adaptiveThreshold(&img, radius, offset, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+void ImageViewer::canny_wrapper() {
+    float sigma = cannySigmaBox->value();
+    int low = cannyLowBox->value();
+    int high = cannyHighBox->value();
+    // The smoothing, the Sobel taps and the suppression each reach a
+    // little further into the neighbouring tiles
+    int margin = (int) ceil(3 * sigma) + 2;
+    if (addTileFilter([sigma, low, high](QImage *t) {
+            return canny(t, sigma, low, high); }, margin)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    img = canny(&img, sigma, low, high, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+// Entries of convolveKernelBox
+enum { KERNEL_SHARPEN, KERNEL_EMBOSS, KERNEL_LAPLACIAN, KERNEL_GAUSSIAN, KERNEL_CUSTOM };
+
+void ImageViewer::convolveKernelChanged(int index) {
+    // Emboss and Laplacian respond around 0, so they are shown on gray
+    convolveBiasBox->setValue(index == KERNEL_EMBOSS || index == KERNEL_LAPLACIAN ? 128 : 0);
+    convolveCustomEdit->setEnabled(index == KERNEL_CUSTOM);
+}
+
+void ImageViewer::convolve_wrapper() {
+    kernel_t kernel;
+    switch (convolveKernelBox->currentIndex()) {
+    case KERNEL_SHARPEN: kernel = sharpenKernel(); break;
+    case KERNEL_EMBOSS: kernel = embossKernel(); break;
+    case KERNEL_LAPLACIAN: kernel = laplacianKernel(); break;
+    // Takes the Gaussian blur's sigma; large ones convolve by FFT
+    case KERNEL_GAUSSIAN: kernel = gaussianKernel(gaussianBlurSigmaBox->value()); break;
+    default:
+        if (!parseKernel(convolveCustomEdit->text().toStdString().c_str(), &kernel)) {
+            QMessageBox errorBox;
+            errorBox.setText("The kernel needs rows of equal, odd length, "
+                             "separated by ';', e.g. 0 -1 0; -1 5 -1; 0 -1 0");
+            errorBox.setIcon(QMessageBox::Warning);
+            errorBox.exec();
+            return;
+        }
+        break;
+    }
+    border_t border = (border_t) convolveBorderBox->currentIndex();
+    float bias = convolveBiasBox->value();
+    int margin = std::max(kernel.width, kernel.height) / 2;
+    if (addTileFilter([kernel, border, bias](QImage *t) {
+            return convolve(t, kernel, border, qRgb(0, 0, 0), bias); }, margin)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    img = convolve(&img, kernel, border, qRgb(0, 0, 0), bias, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+void ImageViewer::bilateral_wrapper() {
+    float sigma_s = bilateralSpaceBox->value();
+    float sigma_r = bilateralRangeBox->value();
+    // Splatting, the grid blur and slicing each spread a pixel by about
+    // a cell
+    int margin = (int) ceil(4 * sigma_s);
+    if (addTileFilter([sigma_s, sigma_r](QImage *t) {
+            return bilateralFilter(t, sigma_s, sigma_r); }, margin)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    img = bilateralFilter(&img, sigma_s, sigma_r, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+void ImageViewer::guided_wrapper() {
+    int radius = guidedRadiusBox->value();
+    // Shown as a deviation in levels, like the bilateral filter's range
+    float eps = guidedRangeBox->value() * guidedRangeBox->value();
+    // Two rounds of box means, plus the interpolation of a shrunk fit
+    int margin = 3 * radius;
+    if (addTileFilter([radius, eps](QImage *t) {
+            return guidedFilter(t, radius, eps); }, margin)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    img = guidedFilter(&img, radius, eps, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+// Applies lut to the image, or adds it to the tiles' filters
+void ImageViewer::applyLutFilter(const lut_t &lut) {
+    if (addTileFilter([lut](QImage *t) { applyLut(t, lut); return *t; }, 0)) { return; }
+    addOperationForUndo();
+    profile_reset();
+    applyLut(&img, lut, filterProgress);
+    imgLabel->setImage(img);
+    showProfile(tr("Filter"));
+}
+
+// The histogram the equalize and levels tables are built from. Tiled
+// images are counted on their coarsest level, with the filters so far.
+histogram_t ImageViewer::imageHistogram() {
+    if (tiledImg) {
+        QImage thumb = tiledImg->tile(tiledImg->levels() - 1, 0, 0);
+        return histogram(&thumb);
+    }
+    return histogram(&img);
+}
+
+void ImageViewer::adjust_wrapper() {
+    // One table for all of them, applied in a single pass
+    lut_t lut = brightnessContrastLut(adjustBrightnessBox->value(), adjustContrastBox->value());
+    lut = composeLut(lut, gammaLut(adjustGammaBox->value()));
+    if (adjustInvertBox->isChecked()) { lut = composeLut(lut, invertLut()); }
+    applyLutFilter(lut);
+}
+
+void ImageViewer::equalize_wrapper() {
+    applyLutFilter(equalizeLut(imageHistogram()));
+}
+
+void ImageViewer::autoLevels_wrapper() {
+    applyLutFilter(autoLevelsLut(imageHistogram()));
+}
+
+void ImageViewer::threshold_wrapper() {
+    applyLutFilter(thresholdLut(thresholdLevelBox->value()));
+}
+
+// Shows the stats recorded since the last profile_reset() under title
+void ImageViewer::showProfile(const QString &title) {
+    profile_t prof;
+    profile_get(&prof);
+    profileLabel->setText(title + "\n\n" + QString::fromStdString(profile_summary(&prof)));
+}
+
+void ImageViewer::createProfileDock() {
+    profileLabel = new QLabel(this);
+    profileLabel->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    profileLabel->setAlignment(Qt::AlignLeft | Qt::AlignTop);
+    profileLabel->setTextInteractionFlags(Qt::TextSelectableByMouse);
+
+    profileDock = new QDockWidget(tr("Performance"), this);
+    profileDock->setAllowedAreas(Qt::LeftDockWidgetArea | Qt::RightDockWidgetArea);
+    addDockWidget(Qt::RightDockWidgetArea, profileDock);
+    profileDock->setWidget(profileLabel);
+
+    profile_reset();
+    showProfile(tr("Nothing measured yet"));
 }
 
 void ImageViewer::createCameraDock() {
@@ -559,6 +1130,32 @@ void ImageViewer::createFilterDock() {
     gaussianBlurButton = new QPushButton(tr("Gaussian blur"), filterDockContents);
     sobelButton = new QPushButton(tr("Sobel"), filterDockContents);
     resizeButton = new QPushButton(tr("Resize"), filterDockContents);
+    localMeanButton = new QPushButton(tr("Local mean"), filterDockContents);
+    localStdDevButton = new QPushButton(tr("Local std dev"), filterDockContents);
+    adaptiveThresholdButton = new QPushButton(tr("Adaptive threshold"), filterDockContents);
+    cannyButton = new QPushButton(tr("Canny"), filterDockContents);
+    convolveButton = new QPushButton(tr("Convolve"), filterDockContents);
+    convolveKernelBox = new QComboBox(filterDockContents);
+    convolveKernelBox->addItem(tr("Sharpen"));
+    convolveKernelBox->addItem(tr("Emboss"));
+    convolveKernelBox->addItem(tr("Laplacian"));
+    convolveKernelBox->addItem(tr("Gaussian"));
+    convolveKernelBox->addItem(tr("Custom"));
+    // In border_t's order
+    convolveBorderBox = new QComboBox(filterDockContents);
+    convolveBorderBox->addItem(tr("Clamp"));
+    convolveBorderBox->addItem(tr("Reflect"));
+    convolveBorderBox->addItem(tr("Wrap"));
+    convolveBorderBox->addItem(tr("Black"));
+    convolveCustomEdit = new QLineEdit(tr("-1 -1 -1; -1 9 -1; -1 -1 -1"), filterDockContents);
+    convolveCustomEdit->setEnabled(false);
+    bilateralButton = new QPushButton(tr("Bilateral"), filterDockContents);
+    guidedButton = new QPushButton(tr("Guided"), filterDockContents);
+    adjustButton = new QPushButton(tr("Adjust"), filterDockContents);
+    adjustInvertBox = new QCheckBox(tr("Invert"), filterDockContents);
+    equalizeButton = new QPushButton(tr("Equalize"), filterDockContents);
+    autoLevelsButton = new QPushButton(tr("Auto levels"), filterDockContents);
+    thresholdButton = new QPushButton(tr("Threshold"), filterDockContents);
 
     boxBlurRadiusBox = new QSpinBox(filterDockContents);
     boxBlurRadiusBox->setRange(1, 255);
@@ -570,6 +1167,49 @@ void ImageViewer::createFilterDock() {
     gaussianBlurSigmaBox->setValue(1);
     resizeWidthBox = new QSpinBox(filterDockContents);
     resizeHeightBox = new QSpinBox(filterDockContents);
+    localMeanRadiusBox = new QSpinBox(filterDockContents);
+    localMeanRadiusBox->setRange(1, 255);
+    localStdDevRadiusBox = new QSpinBox(filterDockContents);
+    localStdDevRadiusBox->setRange(1, MAX_STDDEV_RADIUS);
+    adaptiveThresholdRadiusBox = new QSpinBox(filterDockContents);
+    adaptiveThresholdRadiusBox->setRange(1, 255);
+    adaptiveThresholdRadiusBox->setValue(7);
+    adaptiveThresholdOffsetBox = new QSpinBox(filterDockContents);
+    adaptiveThresholdOffsetBox->setRange(-255, 255);
+    adaptiveThresholdOffsetBox->setValue(5);
+    cannySigmaBox = new QDoubleSpinBox(filterDockContents);
+    cannySigmaBox->setValue(1.4);
+    cannyLowBox = new QSpinBox(filterDockContents);
+    cannyLowBox->setRange(0, 1500);
+    cannyLowBox->setValue(40);
+    cannyHighBox = new QSpinBox(filterDockContents);
+    cannyHighBox->setRange(0, 1500);
+    cannyHighBox->setValue(100);
+    convolveBiasBox = new QSpinBox(filterDockContents);
+    convolveBiasBox->setRange(-255, 255);
+    bilateralSpaceBox = new QDoubleSpinBox(filterDockContents);
+    bilateralSpaceBox->setRange(1, 255);
+    bilateralSpaceBox->setValue(16);
+    bilateralRangeBox = new QDoubleSpinBox(filterDockContents);
+    bilateralRangeBox->setRange(1, 255);
+    bilateralRangeBox->setValue(25);
+    guidedRadiusBox = new QSpinBox(filterDockContents);
+    guidedRadiusBox->setRange(1, 255);
+    guidedRadiusBox->setValue(8);
+    guidedRangeBox = new QDoubleSpinBox(filterDockContents);
+    guidedRangeBox->setRange(0, 255);
+    guidedRangeBox->setValue(25);
+    adjustBrightnessBox = new QSpinBox(filterDockContents);
+    adjustBrightnessBox->setRange(-255, 255);
+    adjustContrastBox = new QDoubleSpinBox(filterDockContents);
+    adjustContrastBox->setRange(0, 10);
+    adjustContrastBox->setValue(1);
+    adjustGammaBox = new QDoubleSpinBox(filterDockContents);
+    adjustGammaBox->setRange(0.1, 10);
+    adjustGammaBox->setValue(1);
+    thresholdLevelBox = new QSpinBox(filterDockContents);
+    thresholdLevelBox->setRange(0, 255);
+    thresholdLevelBox->setValue(128);
 
     boxBlurRadiusLabel = new QLabel(tr("Radius: "), filterDockContents);
     medianFilterRadiusLabel = new QLabel(tr("Radius: "), filterDockContents);
@@ -577,6 +1217,22 @@ void ImageViewer::createFilterDock() {
     gaussianBlurSigmaLabel = new QLabel(tr("Sigma: "), filterDockContents);
     resizeWidthLabel = new QLabel(tr("Width: "), filterDockContents);
     resizeHeightLabel = new QLabel(tr("Height: "), filterDockContents);
+    localMeanRadiusLabel = new QLabel(tr("Radius: "), filterDockContents);
+    localStdDevRadiusLabel = new QLabel(tr("Radius: "), filterDockContents);
+    adaptiveThresholdRadiusLabel = new QLabel(tr("Radius: "), filterDockContents);
+    adaptiveThresholdOffsetLabel = new QLabel(tr("Offset: "), filterDockContents);
+    cannySigmaLabel = new QLabel(tr("Sigma: "), filterDockContents);
+    cannyLowLabel = new QLabel(tr("Low: "), filterDockContents);
+    cannyHighLabel = new QLabel(tr("High: "), filterDockContents);
+    convolveBorderLabel = new QLabel(tr("Border: "), filterDockContents);
+    convolveBiasLabel = new QLabel(tr("Bias: "), filterDockContents);
+    bilateralSpaceLabel = new QLabel(tr("Space: "), filterDockContents);
+    bilateralRangeLabel = new QLabel(tr("Range: "), filterDockContents);
+    guidedRadiusLabel = new QLabel(tr("Radius: "), filterDockContents);
+    guidedRangeLabel = new QLabel(tr("Range: "), filterDockContents);
+    adjustBrightnessLabel = new QLabel(tr("Brightness: "), filterDockContents);
+    adjustContrastLabel = new QLabel(tr("Contrast: "), filterDockContents);
+    adjustGammaLabel = new QLabel(tr("Gamma: "), filterDockContents);
 
     filterDockLayout->addWidget(grayscaleButton, 0, 0, 1, 2);
     filterDockLayout->addWidget(flipButton, 1, 0, 1, 2);
@@ -599,14 +1255,61 @@ void ImageViewer::createFilterDock() {
     filterDockLayout->addWidget(resizeWidthBox, 6, 3, 1, 1);
     filterDockLayout->addWidget(resizeHeightLabel, 7, 2, 1, 1, Qt::AlignRight);
     filterDockLayout->addWidget(resizeHeightBox, 7, 3, 1, 1);
+    filterDockLayout->addWidget(localMeanButton, 8, 0, 1, 2);
+    filterDockLayout->addWidget(localMeanRadiusLabel, 9, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(localMeanRadiusBox, 9, 1, 1, 1);
+    filterDockLayout->addWidget(localStdDevButton, 8, 2, 1, 2);
+    filterDockLayout->addWidget(localStdDevRadiusLabel, 9, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(localStdDevRadiusBox, 9, 3, 1, 1);
+    filterDockLayout->addWidget(adaptiveThresholdButton, 10, 0, 1, 2);
+    filterDockLayout->addWidget(adaptiveThresholdRadiusLabel, 11, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(adaptiveThresholdRadiusBox, 11, 1, 1, 1);
+    filterDockLayout->addWidget(adaptiveThresholdOffsetLabel, 11, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(adaptiveThresholdOffsetBox, 11, 3, 1, 1);
+    filterDockLayout->addWidget(cannyButton, 12, 0, 1, 2);
+    filterDockLayout->addWidget(cannySigmaLabel, 13, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(cannySigmaBox, 13, 1, 1, 1);
+    filterDockLayout->addWidget(cannyLowLabel, 12, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(cannyLowBox, 12, 3, 1, 1);
+    filterDockLayout->addWidget(cannyHighLabel, 13, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(cannyHighBox, 13, 3, 1, 1);
+    filterDockLayout->addWidget(convolveButton, 14, 0, 1, 2);
+    filterDockLayout->addWidget(convolveKernelBox, 14, 2, 1, 2);
+    filterDockLayout->addWidget(convolveBorderLabel, 15, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(convolveBorderBox, 15, 1, 1, 1);
+    filterDockLayout->addWidget(convolveBiasLabel, 15, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(convolveBiasBox, 15, 3, 1, 1);
+    filterDockLayout->addWidget(convolveCustomEdit, 16, 0, 1, -1);
+    filterDockLayout->addWidget(bilateralButton, 17, 0, 1, 2);
+    filterDockLayout->addWidget(bilateralSpaceLabel, 18, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(bilateralSpaceBox, 18, 1, 1, 1);
+    filterDockLayout->addWidget(bilateralRangeLabel, 19, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(bilateralRangeBox, 19, 1, 1, 1);
+    filterDockLayout->addWidget(guidedButton, 17, 2, 1, 2);
+    filterDockLayout->addWidget(guidedRadiusLabel, 18, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(guidedRadiusBox, 18, 3, 1, 1);
+    filterDockLayout->addWidget(guidedRangeLabel, 19, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(guidedRangeBox, 19, 3, 1, 1);
+    filterDockLayout->addWidget(adjustButton, 20, 0, 1, 2);
+    filterDockLayout->addWidget(adjustInvertBox, 20, 2, 1, 2);
+    filterDockLayout->addWidget(adjustBrightnessLabel, 21, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(adjustBrightnessBox, 21, 1, 1, 1);
+    filterDockLayout->addWidget(adjustContrastLabel, 21, 2, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(adjustContrastBox, 21, 3, 1, 1);
+    filterDockLayout->addWidget(adjustGammaLabel, 22, 0, 1, 1, Qt::AlignRight);
+    filterDockLayout->addWidget(adjustGammaBox, 22, 1, 1, 1);
+    filterDockLayout->addWidget(equalizeButton, 23, 0, 1, 2);
+    filterDockLayout->addWidget(autoLevelsButton, 23, 2, 1, 2);
+    filterDockLayout->addWidget(thresholdButton, 24, 0, 1, 2);
+    filterDockLayout->addWidget(thresholdLevelBox, 24, 2, 1, 2);
 
     filterProgress = new QProgressBar(filterDockContents);
     filterProgress->setValue(0);
-    filterDockLayout->addWidget(filterProgress, 8, 0, 1, -1);
+    filterDockLayout->addWidget(filterProgress, 25, 0, 1, -1);
 
     QSpacerItem *spacer = new QSpacerItem(
                     40, 20, QSizePolicy::Minimum, QSizePolicy::Expanding);
-    filterDockLayout->addItem(spacer, 9, 0, -1, -1, Qt::AlignTop);
+    filterDockLayout->addItem(spacer, 26, 0, -1, -1, Qt::AlignTop);
 
     filterDock = new QDockWidget(tr("Filters"), this);
     filterDock->setAllowedAreas(Qt::LeftDockWidgetArea | Qt::RightDockWidgetArea);
@@ -632,6 +1335,30 @@ void ImageViewer::createFilterDock() {
                                 this, SLOT(gaussianBlur_wrapper()));
     connect(resizeButton, SIGNAL(clicked()),
                           this, SLOT(resize_wrapper()));
+    connect(localMeanButton, SIGNAL(clicked()),
+                             this, SLOT(localMean_wrapper()));
+    connect(localStdDevButton, SIGNAL(clicked()),
+                               this, SLOT(localStdDev_wrapper()));
+    connect(adaptiveThresholdButton, SIGNAL(clicked()),
+                                     this, SLOT(adaptiveThreshold_wrapper()));
+    connect(cannyButton, SIGNAL(clicked()),
+                         this, SLOT(canny_wrapper()));
+    connect(convolveButton, SIGNAL(clicked()),
+                            this, SLOT(convolve_wrapper()));
+    connect(convolveKernelBox, SIGNAL(activated(int)),
+                               this, SLOT(convolveKernelChanged(int)));
+    connect(bilateralButton, SIGNAL(clicked()),
+                             this, SLOT(bilateral_wrapper()));
+    connect(guidedButton, SIGNAL(clicked()),
+                          this, SLOT(guided_wrapper()));
+    connect(adjustButton, SIGNAL(clicked()),
+                          this, SLOT(adjust_wrapper()));
+    connect(equalizeButton, SIGNAL(clicked()),
+                            this, SLOT(equalize_wrapper()));
+    connect(autoLevelsButton, SIGNAL(clicked()),
+                              this, SLOT(autoLevels_wrapper()));
+    connect(thresholdButton, SIGNAL(clicked()),
+                             this, SLOT(threshold_wrapper()));
 }
 
 void ImageViewer::activateRotateLeft() {
@@ -650,7 +1377,7 @@ void ImageViewer::activateRotateLeft() {
     cam_cen_y_box->setValue(rotated[1]);
     cam_cen_z_box->setValue(rotated[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateRotateRight() {
@@ -669,7 +1396,7 @@ void ImageViewer::activateRotateRight() {
     cam_cen_y_box->setValue(rotated[1]);
     cam_cen_z_box->setValue(rotated[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateRotateUp() {
@@ -691,7 +1418,7 @@ void ImageViewer::activateRotateUp() {
     cam_up_y_box->setValue(up_rot[1]);
     cam_up_z_box->setValue(up_rot[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateRotateDown() {
@@ -713,7 +1440,7 @@ void ImageViewer::activateRotateDown() {
     cam_up_y_box->setValue(up_rot[1]);
     cam_up_z_box->setValue(up_rot[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateIncreaseFOV() {
@@ -744,7 +1471,7 @@ void ImageViewer::activateTranslateRight() {
     cam_eye_y_box->setValue(cam_eye_y_box->value() + right[1]);
     cam_eye_z_box->setValue(cam_eye_z_box->value() + right[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateTranslateLeft() {
@@ -767,7 +1494,7 @@ void ImageViewer::activateTranslateLeft() {
     cam_eye_y_box->setValue(cam_eye_y_box->value() - right[1]);
     cam_eye_z_box->setValue(cam_eye_z_box->value() - right[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateTranslateUp() {
@@ -784,7 +1511,7 @@ void ImageViewer::activateTranslateUp() {
     cam_eye_y_box->setValue(cam_eye_y_box->value() + up[1]);
     cam_eye_z_box->setValue(cam_eye_z_box->value() + up[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateTranslateDown() {
@@ -801,7 +1528,7 @@ void ImageViewer::activateTranslateDown() {
     cam_eye_y_box->setValue(cam_eye_y_box->value() - up[1]);
     cam_eye_z_box->setValue(cam_eye_z_box->value() - up[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateZoomIn() {
@@ -821,7 +1548,7 @@ void ImageViewer::activateZoomIn() {
     cam_eye_y_box->setValue(cam_eye_y_box->value() + lookAt[1]);
     cam_eye_z_box->setValue(cam_eye_z_box->value() + lookAt[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::activateZoomOut() {
@@ -841,7 +1568,7 @@ void ImageViewer::activateZoomOut() {
     cam_eye_y_box->setValue(cam_eye_y_box->value() - lookAt[1]);
     cam_eye_z_box->setValue(cam_eye_z_box->value() - lookAt[2]);
     blockCameraOptionSignals(false);
-    cameraOptionsChanged();
+    cameraMoved();
 }
 
 void ImageViewer::createActions() {
@@ -854,6 +1581,10 @@ void ImageViewer::createActions() {
     openCamAct->setStatusTip(tr("Open a camera file"));
     connect(openCamAct, &QAction::triggered, this, &ImageViewer::open_cam);
 
+    openLightsAct = new QAction(tr("Open lights file"), this);
+    openLightsAct->setStatusTip(tr("Open a lights file for Blinn-Phong shading"));
+    connect(openLightsAct, &QAction::triggered, this, &ImageViewer::open_lights);
+
     openImgAct = new QAction(tr("Open image"), this);
     openImgAct->setStatusTip(tr("Open an image"));
     connect(openImgAct, &QAction::triggered, this, &ImageViewer::open_img);
@@ -863,6 +1594,15 @@ void ImageViewer::createActions() {
     saveImgAct->setStatusTip(tr("Save image to disk"));
     connect(saveImgAct, &QAction::triggered, this, &ImageViewer::save);
 
+    traceAct = new QAction(tr("Record trace"), this);
+    traceAct->setCheckable(true);
+    traceAct->setStatusTip(tr("Record a timeline; uncheck to save it for chrome://tracing or Perfetto"));
+    connect(traceAct, &QAction::toggled, this, &ImageViewer::recordTrace);
+
+    exportLodAct = new QAction(tr("Export simplified .obj..."), this);
+    exportLodAct->setStatusTip(tr("Write simplified levels of the .obj"));
+    connect(exportLodAct, &QAction::triggered, this, &ImageViewer::exportLods);
+
     rasterizeAct = new QAction(tr("&Rasterize"), this);
     rasterizeAct->setShortcut(tr("Ctrl+R"));
     rasterizeAct->setStatusTip(tr("Rasterize .obj"));
@@ -885,10 +1625,13 @@ void ImageViewer::createMenus() {
     fileMenu = menuBar()->addMenu(tr("&File"));
     fileMenu->addAction(openObjAct);
     fileMenu->addAction(openCamAct);
+    fileMenu->addAction(openLightsAct);
     fileMenu->addAction(openImgAct);
     fileMenu->addSeparator();
     fileMenu->addAction(saveImgAct);
     fileMenu->addAction(rasterizeAct);
+    fileMenu->addAction(exportLodAct);
+    fileMenu->addAction(traceAct);
 
     editMenu = menuBar()->addMenu(tr("&Edit"));
     editMenu->addAction(undoAct);
@@ -898,6 +1641,13 @@ void ImageViewer::createMenus() {
 int main(int argc, char **argv) {
     QApplication app(argc, argv);
 
+    // Keep .meshbin files out of the obj/ directory
+    QString meshbin_dir =
+        QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/meshbin";
+    if (QDir().mkpath(meshbin_dir)) {
+        meshbin_set_cache_dir(QDir::toNativeSeparators(meshbin_dir).toStdString().c_str());
+    }
+
     ImageViewer *imgViewer = new ImageViewer();
     imgViewer->show();
 
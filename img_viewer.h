@@ -4,10 +4,10 @@
 #include <QMainWindow>
 #include <QCheckBox>
 #include <QLabel>
-#include <QPixmap>
 #include <QAction>
 #include <QMenu>
 #include <QComboBox>
+#include <QLineEdit>
 #include <QDockWidget>
 #include <QSpinBox>
 #include <QDoubleSpinBox>
@@ -15,9 +15,15 @@
 #include <QPushButton>
 #include <QStack>
 #include <QProgressBar>
+#include <QCache>
+#include <QTimer>
 
 #include "ImageViewControls.h"
+#include "TiledImage.h"
+#include "im_op.h"
 #include "rasterize.h"
+#include "simplify.h"
+#include "meshopt.h"
 
 // ":" is just like "extends" in Java
 class ImageViewer : public QMainWindow {
@@ -107,6 +113,21 @@ private:
   QPushButton *gaussianBlurButton;
   QPushButton *sobelButton;
   QPushButton *resizeButton;
+  QPushButton *localMeanButton;
+  QPushButton *localStdDevButton;
+  QPushButton *adaptiveThresholdButton;
+  QPushButton *cannyButton;
+  QPushButton *convolveButton;
+  QComboBox *convolveKernelBox;
+  QComboBox *convolveBorderBox;
+  QLineEdit *convolveCustomEdit;
+  QPushButton *bilateralButton;
+  QPushButton *guidedButton;
+  QPushButton *adjustButton;
+  QCheckBox *adjustInvertBox;
+  QPushButton *equalizeButton;
+  QPushButton *autoLevelsButton;
+  QPushButton *thresholdButton;
 
   QSpinBox *boxBlurRadiusBox;
   QSpinBox *medianFilterRadiusBox;
@@ -114,6 +135,22 @@ private:
   QDoubleSpinBox *gaussianBlurSigmaBox;
   QSpinBox *resizeWidthBox;
   QSpinBox *resizeHeightBox;
+  QSpinBox *localMeanRadiusBox;
+  QSpinBox *localStdDevRadiusBox;
+  QSpinBox *adaptiveThresholdRadiusBox;
+  QSpinBox *adaptiveThresholdOffsetBox;
+  QDoubleSpinBox *cannySigmaBox;
+  QSpinBox *cannyLowBox;
+  QSpinBox *cannyHighBox;
+  QSpinBox *convolveBiasBox;
+  QDoubleSpinBox *bilateralSpaceBox;
+  QDoubleSpinBox *bilateralRangeBox;
+  QSpinBox *guidedRadiusBox;
+  QDoubleSpinBox *guidedRangeBox;
+  QSpinBox *adjustBrightnessBox;
+  QDoubleSpinBox *adjustContrastBox;
+  QDoubleSpinBox *adjustGammaBox;
+  QSpinBox *thresholdLevelBox;
 
   QLabel *boxBlurRadiusLabel;
   QLabel *medianFilterRadiusLabel;
@@ -121,24 +158,81 @@ private:
   QLabel *gaussianBlurSigmaLabel;
   QLabel *resizeWidthLabel;
   QLabel *resizeHeightLabel;
+  QLabel *localMeanRadiusLabel;
+  QLabel *localStdDevRadiusLabel;
+  QLabel *adaptiveThresholdRadiusLabel;
+  QLabel *adaptiveThresholdOffsetLabel;
+  QLabel *cannySigmaLabel;
+  QLabel *cannyLowLabel;
+  QLabel *cannyHighLabel;
+  QLabel *convolveBorderLabel;
+  QLabel *convolveBiasLabel;
+  QLabel *bilateralSpaceLabel;
+  QLabel *bilateralRangeLabel;
+  QLabel *guidedRadiusLabel;
+  QLabel *guidedRangeLabel;
+  QLabel *adjustBrightnessLabel;
+  QLabel *adjustContrastLabel;
+  QLabel *adjustGammaLabel;
 
   QDockWidget *filterDock;
 
   ImageViewControls *imgLabel;
-  QPixmap pixmap;
   QImage img;
+
+  // Set while viewing an image too large to load whole; filters are then
+  // queued on the tiles instead of applied to img.
+  TiledImage *tiledImg;
+  void leaveTiledMode();
+  bool addTileFilter(const TiledImage::tile_filter_t &filter, int margin);
+  void applyLutFilter(const lut_t &lut);
+  histogram_t imageHistogram();
   QLabel *objFileLabel;
   QGroupBox *shadingGroup;
   QComboBox *shadingOptionBox;
   QPushButton *rasterizeButton;
+  QSpinBox *renderCacheSizeBox;
+  QCheckBox *meshOptimizeBox;
 
   QDockWidget *cameraDock;
 
+  // Stage times and counters of the last render or filter, from profile.h
+  void createProfileDock();
+  void showProfile(const QString &title);
+  QDockWidget *profileDock;
+  QLabel *profileLabel;
+
   QString obj_file;
   camera_mat_t camera;
   e_shader shadingOption;
 
+  // Lights for BLINN_PHONG; a headlight until a lights file is opened
+  lighting_t lighting;
+
+  // Bumped on every render so RANDOM shading picks new colors each time
+  unsigned randomSeed;
+
+  // MESH_OPT_* flags every load of obj_file passes, so the viewer, the
+  // LOD builder and the .meshbin cache all see the same index order
+  int meshOptFlags;
+
   void cameraChanged();
+  void readCameraOptions();
+
+  // Camera moves from the keyboard draw a simplified level of the mesh
+  // and schedule a full render for when the camera rests. The levels are
+  // built on the first move and dropped when another .obj is opened.
+  void cameraMoved();
+  void previewRender();
+  bool buildLod();
+  lod_chain_t *lod;
+  QTimer *refineTimer;
+
+  // Rendered frames keyed by renderKey(), so revisiting a viewpoint or
+  // shading mode skips the rasterizer. Costs are in kilobytes.
+  quint64 renderKey(int w, int h) const;
+  QCache<quint64, QImage> renderCache;
+
   void addOperationForUndo();
   QStack<QImage> undoImageStack;
   QStack<QImage> redoImageStack;
@@ -151,20 +245,28 @@ private:
   QMenu *editMenu;
   QAction *openObjAct;
   QAction *openCamAct;
+  QAction *openLightsAct;
   QAction *openImgAct;
   QAction *saveImgAct;
   QAction *undoAct;
   QAction *redoAct;
   QAction *rasterizeAct;
+  QAction *exportLodAct;
+  QAction *traceAct;
 
 private slots:
   void open_obj();
   void open_cam();
+  void open_lights();
   void open_img();
   void save();
   void undo();
   void redo();
   void rasterize_wrapper();
+  void exportLods();
+  void renderCacheSizeChanged(int mb);
+  void recordTrace(bool on);
+  void meshOptimizeToggled(bool on);
   void saveCamera();
   void grayscale_wrapper();
   void flip_wrapper();
@@ -175,6 +277,18 @@ private slots:
   void gaussianBlur_wrapper();
   void resize_wrapper();
   void sobel_wrapper();
+  void localMean_wrapper();
+  void localStdDev_wrapper();
+  void adaptiveThreshold_wrapper();
+  void canny_wrapper();
+  void convolve_wrapper();
+  void convolveKernelChanged(int index);
+  void bilateral_wrapper();
+  void guided_wrapper();
+  void adjust_wrapper();
+  void equalize_wrapper();
+  void autoLevels_wrapper();
+  void threshold_wrapper();
   void activateRotateLeft();
   void activateRotateRight();
   void activateRotateUp();
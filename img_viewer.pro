@@ -3,6 +3,10 @@ QT += core \
 
 CONFIG += c++11
 
+# vec4.h and mat4.h use SSE2, which every x86-64 build has. Their AVX
+# and FMA paths are only compiled when the target has them, e.g. with
+#   QMAKE_CXXFLAGS += -mavx2 -mfma
+
 TARGET = img_viewer
 CONFIG += console
 CONFIG -= app_bundle
@@ -16,7 +20,14 @@ SOURCES += img_viewer.cc \
     tiny_obj_loader.cc \
     vec4.cpp \
     im_op.cpp \
-    ImageViewControls.cpp
+    ImageViewControls.cpp \
+    TiledImage.cpp \
+    image.cpp \
+    meshbin.cpp \
+    simplify.cpp \
+    meshopt.cpp \
+    profile.cpp \
+    trace.cpp
 
 # The following define makes your compiler emit warnings if you use
 # any feature of Qt which as been marked deprecated (the exact warnings
@@ -24,6 +35,10 @@ SOURCES += img_viewer.cc \
 # deprecated API in order to know how to port your code away from it.
 DEFINES += QT_DEPRECATED_WARNINGS
 
+# Per-stage timers and counters shown in the Performance dock (profile.h).
+# Remove to compile them out.
+DEFINES += PROFILE_STATS
+
 # You can also make your code fail to compile if you use deprecated APIs.
 # In order to do so, uncomment the following line.
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
@@ -40,4 +55,11 @@ HEADERS += \
     tiny_obj_loader.h \
     vec4.h \
     im_op.h \
-    ImageViewControls.h
+    ImageViewControls.h \
+    TiledImage.h \
+    image.h \
+    meshbin.h \
+    simplify.h \
+    meshopt.h \
+    profile.h \
+    trace.h
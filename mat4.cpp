@@ -11,52 +11,7 @@
 
 #include "mat4.h"
 
-mat4::mat4() {
-	this->data[0] = vec4(1, 0, 0, 0);
-	this->data[1] = vec4(0, 1, 0, 0);
-	this->data[2] = vec4(0, 0, 1, 0);
-	this->data[3] = vec4(0, 0, 0, 1);
-}
-
-mat4::mat4(float diag) {
-	this->data[0] = vec4(diag, 0, 0, 0);
-	this->data[1] = vec4(0, diag, 0, 0);
-	this->data[2] = vec4(0, 0, diag, 0);
-	this->data[3] = vec4(0, 0, 0, diag);
-}
-
-mat4::mat4(const vec4 &col0, const vec4 &col1,
-				const vec4 &col2, const vec4 &col3) {
-	this->data[0] = col0;
-	this->data[1] = col1;
-	this->data[2] = col2;
-	this->data[3] = col3;
-}
-
-mat4::mat4(const mat4 &m2) {
-	this->data[0] = m2[0];
-	this->data[1] = m2[1];
-	this->data[2] = m2[2];
-	this->data[3] = m2[3];
-}
-
-const vec4 &mat4::operator[](unsigned int index) const {
-	return this->data[index];
-}
-
-vec4 &mat4::operator[](unsigned int index) {
-	return this->data[index];
-}
-
-const vec4 &mat4::operator()(unsigned int index) const {
-    assert(index < 4);
-	return this->data[index];
-}
-
-vec4 &mat4::operator()(unsigned int index) {
-    assert(index < 4);
-	return this->data[index];
-}
+// Constructors, accessors and arithmetic are inline in mat4.h
 
 /**
  * Static Initializers
@@ -111,130 +66,6 @@ mat4 mat4::proj(float l, float r, float t, float b, float n, float f) {
 	return ret;
 }
 
-/**
- * Operator Functions
- */
-
-mat4 &mat4::operator=(const mat4 &m2) {
-	this->data[0] = m2[0];
-	this->data[1] = m2[1];
-	this->data[2] = m2[2];
-	this->data[3] = m2[3];
-	return *this;
-}
-
-bool mat4::operator==(const mat4 & m2) const {
-	return (this->data[0] == m2[0] && this->data[1] == m2[1] &&
-				this->data[2] == m2[2] && this->data[3] == m2[3]);
-}
-
-bool mat4::operator!=(const mat4 &m2) const {
-	return (this->data[0] != m2[0] || this->data[1] != m2[1] ||
-				this->data[2] != m2[2] || this->data[3] != m2[3]);
-}
-
-mat4 &mat4::operator+=(const mat4 &m2) {
-	this->data[0] += m2[0];
-	this->data[1] += m2[1];
-	this->data[2] += m2[2];
-	this->data[3] += m2[3];
-	return *this;
-}
-
-mat4 &mat4::operator-=(const mat4 &m2) {
-	this->data[0] -= m2[0];
-	this->data[1] -= m2[1];
-	this->data[2] -= m2[2];
-	this->data[3] -= m2[3];
-	return *this;
-}
-
-mat4 &mat4::operator*=(float c) {
-	this->data[0] *= c;
-	this->data[1] *= c;
-	this->data[2] *= c;
-	this->data[3] *= c;
-	return *this;
-}
-
-mat4 &mat4::operator/=(float c) {
-	this->data[0] /= c;
-	this->data[1] /= c;
-	this->data[2] /= c;
-	this->data[3] /= c;
-	return *this;
-}
-
-mat4 mat4::operator+(const mat4 &m2) const {
-	return mat4(this->data[0] + m2[0], this->data[1] + m2[1],
-					this->data[2] + m2[2], this->data[3] + m2[3]);
-}
-
-mat4 mat4::operator-(const mat4 &m2) const {
-	return mat4(this->data[0] - m2[0], this->data[1] - m2[1],
-					this->data[2] - m2[2], this->data[3] - m2[3]);
-}
-
-mat4 mat4::operator*(float c) const {
-	return mat4(this->data[0] * c, this->data[1] * c,
-					this->data[2] * c, this->data[3] * c);
-}
-
-mat4 mat4::operator/(float c) const {
-	return mat4(this->data[0] / c, this->data[1] / c,
-					this->data[2] / c, this->data[3] / c);
-}
-
-mat4 mat4::operator*(const mat4 &m2) const {
-	vec4 col0, col1, col2, col3;
-	col0[0] = this->data[0][0] * m2[0][0] + this->data[1][0] * m2[0][1] +
-				this->data[2][0] * m2[0][2] + this->data[3][0] * m2[0][3];
-	col0[1] = this->data[0][1] * m2[0][0] + this->data[1][1] * m2[0][1] +
-				this->data[2][1] * m2[0][2] + this->data[3][1] * m2[0][3];
-	col0[2] = this->data[0][2] * m2[0][0] + this->data[1][2] * m2[0][1] +
-				this->data[2][2] * m2[0][2] + this->data[3][2] * m2[0][3];
-	col0[3] = this->data[0][3] * m2[0][0] + this->data[1][3] * m2[0][1] +
-				this->data[2][3] * m2[0][2] + this->data[3][3] * m2[0][3];
-	col1[0] = this->data[0][0] * m2[1][0] + this->data[1][0] * m2[1][1] +
-				this->data[2][0] * m2[1][2] + this->data[3][0] * m2[1][3];
-	col1[1] = this->data[0][1] * m2[1][0] + this->data[1][1] * m2[1][1] +
-				this->data[2][1] * m2[1][2] + this->data[3][1] * m2[1][3];
-	col1[2] = this->data[0][2] * m2[1][0] + this->data[1][2] * m2[1][1] +
-				this->data[2][2] * m2[1][2] + this->data[3][2] * m2[1][3];
-	col1[3] = this->data[0][3] * m2[1][0] + this->data[1][3] * m2[1][1] +
-				this->data[2][3] * m2[1][2] + this->data[3][3] * m2[1][3];
-	col2[0] = this->data[0][0] * m2[2][0] + this->data[1][0] * m2[2][1] +
-				this->data[2][0] * m2[2][2] + this->data[3][0] * m2[2][3];
-	col2[1] = this->data[0][1] * m2[2][0] + this->data[1][1] * m2[2][1] +
-				this->data[2][1] * m2[2][2] + this->data[3][1] * m2[2][3];
-	col2[2] = this->data[0][2] * m2[2][0] + this->data[1][2] * m2[2][1] +
-				this->data[2][2] * m2[2][2] + this->data[3][2] * m2[2][3];
-	col2[3] = this->data[0][3] * m2[2][0] + this->data[1][3] * m2[2][1] +
-				this->data[2][3] * m2[2][2] + this->data[3][3] * m2[2][3];
-	col3[0] = this->data[0][0] * m2[3][0] + this->data[1][0] * m2[3][1] +
-				this->data[2][0] * m2[3][2] + this->data[3][0] * m2[3][3];
-	col3[1] = this->data[0][1] * m2[3][0] + this->data[1][1] * m2[3][1] +
-				this->data[2][1] * m2[3][2] + this->data[3][1] * m2[3][3];
-	col3[2] = this->data[0][2] * m2[3][0] + this->data[1][2] * m2[3][1] +
-				this->data[2][2] * m2[3][2] + this->data[3][2] * m2[3][3];
-	col3[3] = this->data[0][3] * m2[3][0] + this->data[1][3] * m2[3][1] +
-				this->data[2][3] * m2[3][2] + this->data[3][3] * m2[3][3];
-	return mat4(col0, col1, col2, col3);
-}
-
-vec4 mat4::operator*(const vec4 &v) const {
-	vec4 ret;
-	ret[0] = this->data[0][0] * v[0] + this->data[1][0] * v[1] +
-				this->data[2][0] * v[2] + this->data[3][0] * v[3];
-	ret[1] = this->data[0][1] * v[0] + this->data[1][1] * v[1] +
-				this->data[2][1] * v[2] + this->data[3][1] * v[3];
-	ret[2] = this->data[0][2] * v[0] + this->data[1][2] * v[1] +
-				this->data[2][2] * v[2] + this->data[3][2] * v[3];
-	ret[3] = this->data[0][3] * v[0] + this->data[1][3] * v[1] +
-				this->data[2][3] * v[2] + this->data[3][3] * v[3];
-	return ret;
-}
-
 /**
  * Matrix Operations
  */
@@ -250,29 +81,144 @@ mat4 mat4::transpose() const {
 	return ret;
 }
 
-const vec4 &mat4::col(unsigned int index) const {
-	return this->data[index];
-}
-
-vec4 &mat4::col(unsigned int index) {
-	return this->data[index];
-}
-
-mat4 operator*(float c, const mat4 &m) {
-	return mat4(m[0] * c, m[1] * c, m[2] * c, m[3] * c);
-}
+/**
+ * Batched Transforms
+ */
 
-vec4 operator*(const vec4 &v, const mat4 &m) {
-	vec4 ret;
-	ret[0] = v[0] * m[0][0] + v[1] * m[0][1] +
-			v[2] * m[0][2] + v[3] * m[0][3];
-	ret[1] = v[0] * m[1][0] + v[1] * m[1][1] +
-			v[2] * m[1][2] + v[3] * m[1][3];
-	ret[2] = v[0] * m[2][0] + v[1] * m[2][1] +
-			v[2] * m[2][2] + v[3] * m[2][3];
-	ret[3] = v[0] * m[3][0] + v[1] * m[3][1] +
-			v[2] * m[3][2] + v[3] * m[3][3];
-    return ret;
+// GCC and Clang can compile the AVX2 kernel into any x86 build and pick it
+// at run time; other compilers only get it when the target has AVX2.
+#if defined(VEC4_SSE) && (defined(__GNUC__) || defined(__clang__))
+#define MAT4_AVX2 1
+#define MAT4_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(VEC4_SSE) && defined(__AVX2__)
+#define MAT4_AVX2 1
+#define MAT4_AVX2_TARGET
+#endif
+#ifdef MAT4_AVX2
+#include <immintrin.h>
+#endif
+
+enum { XF_POINTS, XF_NORMALS, XF_PROJECT };
+
+static inline void transform_one(const mat4 &m, const float *in, float *out,
+								 int kind, float half_w, float half_h) {
+	vec4 r = m * vec4(in[0], in[1], in[2], kind == XF_NORMALS ? 0 : 1);
+	if (kind == XF_PROJECT) {
+		r = vec4((r[0] / r[3] + 1) * half_w, (1 - r[1] / r[3]) * half_h,
+				 r[2] / r[3], r[3]);
+	}
+	out[0] = r[0];
+	out[1] = r[1];
+	out[2] = r[2];
+	out[3] = r[3];
+}
+
+#ifdef MAT4_AVX2
+static bool have_avx2() {
+#if defined(__AVX2__)
+	return true;
+#elif defined(__GNUC__) || defined(__clang__)
+	static const bool ok = __builtin_cpu_supports("avx2");
+	return ok;
+#else
+	return false;
+#endif
+}
+
+// Transforms the leading multiple of 8 points and returns how many that
+// was. Each iteration splits 8 packed xyz points into x, y and z
+// registers, evaluates the four output rows and transposes the rows back
+// into 8 packed xyzw points. The arithmetic is the same, in the same
+// order, as mat4 * vec4 without FMA, so every path gives identical bits
+// and a render does not depend on the CPU it ran on.
+MAT4_AVX2_TARGET
+static size_t transform_avx2(const mat4 &m, const float *in, float *out, size_t n,
+							 int kind, float half_w, float half_h) {
+	__m256 c[4][4];
+	for (int j = 0; j < 4; ++j) {
+		for (int k = 0; k < 4; ++k) {
+			c[j][k] = _mm256_set1_ps(m[j][k]);
+		}
+	}
+	const __m256 one = _mm256_set1_ps(1);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 hw = _mm256_set1_ps(half_w);
+	const __m256 hh = _mm256_set1_ps(half_h);
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		// m03 = x0 y0 z0 x1 | x4 y4 z4 x5, m14 = y1 z1 x2 y2 | y5 z5 x6 y6,
+		// m25 = z2 x3 y3 z3 | z6 x7 y7 z7
+		const float *p = in + 3 * i;
+		__m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)),
+										  _mm_loadu_ps(p + 12), 1);
+		__m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)),
+										  _mm_loadu_ps(p + 16), 1);
+		__m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)),
+										  _mm_loadu_ps(p + 20), 1);
+		__m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+		__m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+		__m256 x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+		__m256 y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+		__m256 z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+
+		__m256 r[4];
+		__m256 w = kind == XF_NORMALS ? zero : one;
+		for (int k = 0; k < 4; ++k) {
+			__m256 acc = _mm256_mul_ps(c[0][k], x);
+			acc = _mm256_add_ps(_mm256_mul_ps(c[1][k], y), acc);
+			acc = _mm256_add_ps(_mm256_mul_ps(c[2][k], z), acc);
+			r[k] = _mm256_add_ps(_mm256_mul_ps(c[3][k], w), acc);
+		}
+		if (kind == XF_PROJECT) {
+			r[0] = _mm256_mul_ps(_mm256_add_ps(_mm256_div_ps(r[0], r[3]), one), hw);
+			r[1] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_div_ps(r[1], r[3])), hh);
+			r[2] = _mm256_div_ps(r[2], r[3]);
+		}
+
+		// Transpose within each 128-bit half, then pair the halves up
+		__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+		__m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+		__m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+		__m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+		__m256 p04 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 p15 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+		__m256 p26 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 p37 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+		float *q = out + 4 * i;
+		_mm256_storeu_ps(q, _mm256_permute2f128_ps(p04, p15, 0x20));
+		_mm256_storeu_ps(q + 8, _mm256_permute2f128_ps(p26, p37, 0x20));
+		_mm256_storeu_ps(q + 16, _mm256_permute2f128_ps(p04, p15, 0x31));
+		_mm256_storeu_ps(q + 24, _mm256_permute2f128_ps(p26, p37, 0x31));
+	}
+	return i;
+}
+#endif
+
+static void transform_batch(const mat4 &m, const float *in, float *out, size_t n,
+							int kind, float half_w, float half_h) {
+	size_t i = 0;
+#ifdef MAT4_AVX2
+	if (have_avx2()) {
+		i = transform_avx2(m, in, out, n, kind, half_w, half_h);
+	}
+#endif
+	for (; i < n; ++i) {
+		transform_one(m, in + 3 * i, out + 4 * i, kind, half_w, half_h);
+	}
+}
+
+void transformPoints(const mat4 &m, const float *in, float *out, size_t n) {
+	transform_batch(m, in, out, n, XF_POINTS, 0, 0);
+}
+
+void transformNormals(const mat4 &m, const float *in, float *out, size_t n) {
+	transform_batch(m, in, out, n, XF_NORMALS, 0, 0);
+}
+
+void projectPoints(const mat4 &m, const float *in, float *out, size_t n,
+				   int w, int h) {
+	transform_batch(m, in, out, n, XF_PROJECT, w * 0.5f, h * 0.5f);
 }
 
 std::ostream &operator<<(std::ostream &o, const mat4 &m) {
@@ -11,6 +11,7 @@
 #define MAT4_H
 
 #include <iostream>
+#include <stddef.h>
 #include "vec4.h"
 
 class mat4 {
@@ -32,7 +33,7 @@ class mat4 {
   /// Initializes matrix with each vector representing a column in the matrix
   mat4(const vec4 &col0, const vec4 &col1, const vec4 &col2, const vec4& col3);
 
-  mat4(const mat4 &m2); // copy constructor; copies values of m2 into this
+  // Like vec4, copying is the implicit member-wise copy
 
 	///----------------------------------------------------------------------
 	/// Getters
@@ -78,9 +79,6 @@ class mat4 {
 	/// Operator Functions
 	///----------------------------------------------------------------------
 
-  /// Assign m2 to this and return this
-  mat4 &operator=(const mat4 &m2);
-
   /// Test for equality
  	bool operator==(const mat4 &m2) const;
 
@@ -129,4 +127,194 @@ vec4 operator*(const vec4 &v, const mat4 &m);
 /// Prints the matrix to a stream in a nice format
 std::ostream &operator<<(std::ostream &o, const mat4 &m);
 
+///----------------------------------------------------------------------
+/// Batched Transforms
+///
+/// in holds n points as packed x, y, z floats (the layout of OBJ
+/// positions and normals) and out receives n packed x, y, z, w floats, so
+/// it can be an array of vec4. in and out must not overlap. On CPUs with
+/// AVX2, eight points are transformed per iteration in SoA form;
+/// elsewhere they go through mat4 * vec4 one at a time. Both give the
+/// same results as m * vec4(x, y, z, w) built without FMA.
+///----------------------------------------------------------------------
+
+/// out = m * (x, y, z, 1)
+void transformPoints(const mat4 &m, const float *in, float *out, size_t n);
+
+/// out = m * (x, y, z, 0). For a view matrix (rotation and translation)
+/// this takes normals to view space.
+void transformNormals(const mat4 &m, const float *in, float *out, size_t n);
+
+/// Transforms points by m, divides by w and maps x and y to a w by h
+/// viewport with y down: out = ((x' + 1) * w / 2, (1 - y') * h / 2, z', w)
+/// where x', y', z' are the normalized device coordinates and w is the
+/// clip-space w.
+void projectPoints(const mat4 &m, const float *in, float *out, size_t n,
+                   int w, int h);
+
+///----------------------------------------------------------------------
+/// Inline definitions
+///
+/// Products are sums of columns scaled by broadcast lanes, so each output
+/// column is four multiply-adds. With AVX two output columns share one
+/// 256-bit register.
+///----------------------------------------------------------------------
+
+inline mat4::mat4() {
+	data[0] = vec4(1, 0, 0, 0);
+	data[1] = vec4(0, 1, 0, 0);
+	data[2] = vec4(0, 0, 1, 0);
+	data[3] = vec4(0, 0, 0, 1);
+}
+
+inline mat4::mat4(float diag) {
+	data[0] = vec4(diag, 0, 0, 0);
+	data[1] = vec4(0, diag, 0, 0);
+	data[2] = vec4(0, 0, diag, 0);
+	data[3] = vec4(0, 0, 0, diag);
+}
+
+inline mat4::mat4(const vec4 &col0, const vec4 &col1,
+				  const vec4 &col2, const vec4 &col3) {
+	data[0] = col0;
+	data[1] = col1;
+	data[2] = col2;
+	data[3] = col3;
+}
+
+inline const vec4 &mat4::operator[](unsigned int index) const {
+	return data[index];
+}
+
+inline vec4 &mat4::operator[](unsigned int index) {
+	return data[index];
+}
+
+inline const vec4 &mat4::operator()(unsigned int index) const {
+	assert(index < 4);
+	return data[index];
+}
+
+inline vec4 &mat4::operator()(unsigned int index) {
+	assert(index < 4);
+	return data[index];
+}
+
+inline const vec4 &mat4::col(unsigned int index) const {
+	return data[index];
+}
+
+inline vec4 &mat4::col(unsigned int index) {
+	return data[index];
+}
+
+inline bool mat4::operator==(const mat4 &m2) const {
+	return (data[0] == m2[0] && data[1] == m2[1] &&
+			data[2] == m2[2] && data[3] == m2[3]);
+}
+
+inline bool mat4::operator!=(const mat4 &m2) const {
+	return !(*this == m2);
+}
+
+inline mat4 &mat4::operator+=(const mat4 &m2) {
+	return *this = *this + m2;
+}
+
+inline mat4 &mat4::operator-=(const mat4 &m2) {
+	return *this = *this - m2;
+}
+
+inline mat4 &mat4::operator*=(float c) {
+	return *this = *this * c;
+}
+
+inline mat4 &mat4::operator/=(float c) {
+	return *this = *this / c;
+}
+
+inline mat4 mat4::operator+(const mat4 &m2) const {
+	return mat4(data[0] + m2[0], data[1] + m2[1],
+				data[2] + m2[2], data[3] + m2[3]);
+}
+
+inline mat4 mat4::operator-(const mat4 &m2) const {
+	return mat4(data[0] - m2[0], data[1] - m2[1],
+				data[2] - m2[2], data[3] - m2[3]);
+}
+
+inline mat4 mat4::operator*(float c) const {
+	return mat4(data[0] * c, data[1] * c, data[2] * c, data[3] * c);
+}
+
+inline mat4 mat4::operator/(float c) const {
+	return mat4(data[0] / c, data[1] / c, data[2] / c, data[3] / c);
+}
+
+#ifdef VEC4_SSE
+// a * b + c, fused when the target has FMA
+inline __m128 mat4_madd(__m128 a, __m128 b, __m128 c) {
+#ifdef __FMA__
+	return _mm_fmadd_ps(a, b, c);
+#else
+	return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+#endif
+
+inline vec4 mat4::operator*(const vec4 &v) const {
+#ifdef VEC4_SSE
+	__m128 x = v.m128();
+	__m128 r = _mm_mul_ps(data[0].m128(), _mm_shuffle_ps(x, x, _MM_SHUFFLE(0, 0, 0, 0)));
+	r = mat4_madd(data[1].m128(), _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)), r);
+	r = mat4_madd(data[2].m128(), _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 2, 2, 2)), r);
+	r = mat4_madd(data[3].m128(), _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3)), r);
+	return vec4(r);
+#else
+	return data[0] * v[0] + data[1] * v[1] + data[2] * v[2] + data[3] * v[3];
+#endif
+}
+
+inline mat4 mat4::operator*(const mat4 &m2) const {
+	mat4 ret;
+#if defined(VEC4_SSE) && defined(__AVX__)
+	// Each 128-bit half holds one column of m2; in-lane shuffles broadcast
+	// that column's lanes against columns of this duplicated in both halves.
+	// vec4 is standard layout, so the columns are 16 contiguous floats.
+	const float *a = reinterpret_cast<const float *>(data);
+	__m256 a0 = _mm256_broadcast_ps((const __m128 *) (a + 0));
+	__m256 a1 = _mm256_broadcast_ps((const __m128 *) (a + 4));
+	__m256 a2 = _mm256_broadcast_ps((const __m128 *) (a + 8));
+	__m256 a3 = _mm256_broadcast_ps((const __m128 *) (a + 12));
+	for (int j = 0; j < 4; j += 2) {
+		__m256 b = _mm256_loadu_ps(reinterpret_cast<const float *>(&m2[j]));
+		__m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(b, b, _MM_SHUFFLE(0, 0, 0, 0)));
+#ifdef __FMA__
+		r = _mm256_fmadd_ps(a1, _mm256_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 1, 1)), r);
+		r = _mm256_fmadd_ps(a2, _mm256_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 2, 2)), r);
+		r = _mm256_fmadd_ps(a3, _mm256_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 3, 3)), r);
+#else
+		r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 1, 1))));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(b, b, _MM_SHUFFLE(2, 2, 2, 2))));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(b, b, _MM_SHUFFLE(3, 3, 3, 3))));
+#endif
+		_mm256_storeu_ps(reinterpret_cast<float *>(&ret[j]), r);
+	}
+#else
+	ret[0] = *this * m2[0];
+	ret[1] = *this * m2[1];
+	ret[2] = *this * m2[2];
+	ret[3] = *this * m2[3];
+#endif
+	return ret;
+}
+
+inline mat4 operator*(float c, const mat4 &m) {
+	return m * c;
+}
+
+inline vec4 operator*(const vec4 &v, const mat4 &m) {
+	return vec4(dot(v, m[0]), dot(v, m[1]), dot(v, m[2]), dot(v, m[3]));
+}
+
 #endif /* MAT4_H */
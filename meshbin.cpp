@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "meshbin.h"
+#include "meshopt.h"
+#include "trace.h"
+
+static const char MESHBIN_MAGIC[8] = { 'M', 'E', 'S', 'H', 'B', 'I', 'N', 0 };
+
+static unsigned long long fnv1a(const char *s, unsigned long long h) {
+    for (; *s; ++s) {
+        h ^= (unsigned char) *s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long long source_key(const char *obj, const char *mtl_basepath) {
+    unsigned long long h = fnv1a(obj, 14695981039346656037ULL);
+    return fnv1a(mtl_basepath ? mtl_basepath : "", h ^ '\n');
+}
+
+static void stamp_mtl(meshbin_mtl_t *mtl) {
+    struct stat st;
+    if (stat(mtl->path.c_str(), &st) != 0) {
+        mtl->size = ~0ULL;
+        mtl->mtime = 0;
+        return;
+    }
+    mtl->size = (unsigned long long) st.st_size;
+    mtl->mtime = (long long) st.st_mtime;
+}
+
+/*
+ * Writing
+ */
+
+typedef struct {
+    FILE *f;
+    size_t pos;
+    int ok;
+} bin_writer_t;
+
+static void put_bytes(bin_writer_t *w, const void *p, size_t n) {
+    if (w->ok && n && fwrite(p, 1, n, w->f) != n) { w->ok = 0; }
+    w->pos += n;
+}
+
+static void put_pad(bin_writer_t *w) {
+    static const char zeros[MESHBIN_ALIGN] = { 0 };
+    put_bytes(w, zeros, (MESHBIN_ALIGN - w->pos % MESHBIN_ALIGN) % MESHBIN_ALIGN);
+}
+
+static void put_u32(bin_writer_t *w, unsigned int v) {
+    put_bytes(w, &v, sizeof(v));
+}
+
+static void put_string(bin_writer_t *w, const std::string &s) {
+    put_u32(w, (unsigned int) s.size());
+    put_bytes(w, s.data(), s.size());
+}
+
+template <typename T>
+static void put_array(bin_writer_t *w, const std::vector<T> &v) {
+    unsigned long long n = v.size();
+    put_pad(w);
+    put_bytes(w, &n, sizeof(n));
+    put_pad(w);
+    put_bytes(w, v.empty() ? NULL : &v[0], v.size() * sizeof(T));
+}
+
+int write_meshbin(const char *fname, const meshbin_header_t *hdr,
+                  const std::vector<meshbin_mtl_t> &mtls,
+                  const std::vector<tinyobj::shape_t> &shapes,
+                  const std::vector<tinyobj::material_t> &materials) {
+    TRACE_SCOPE("io", "write_meshbin");
+    if (!(fname && hdr)) {
+        fprintf(stderr, "error: illegal argument\n");
+        return 0;
+    }
+    std::string tmp = std::string(fname) + ".tmp";
+    bin_writer_t w = { fopen(tmp.c_str(), "wb"), 0, 1 };
+    if (!w.f) { return 0; }
+
+    meshbin_header_t out = *hdr;
+    memcpy(out.magic, MESHBIN_MAGIC, sizeof(out.magic));
+    out.version = MESHBIN_VERSION;
+    out.num_shapes = (unsigned int) shapes.size();
+    out.num_materials = (unsigned int) materials.size();
+    put_bytes(&w, &out, sizeof(out));
+
+    put_u32(&w, (unsigned int) mtls.size());
+    for (size_t i = 0; i < mtls.size(); ++i) {
+        put_string(&w, mtls[i].path);
+        put_bytes(&w, &mtls[i].size, sizeof(mtls[i].size));
+        put_bytes(&w, &mtls[i].mtime, sizeof(mtls[i].mtime));
+    }
+
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        const tinyobj::mesh_t &mesh = shapes[i].mesh;
+        put_string(&w, shapes[i].name);
+        put_array(&w, mesh.positions);
+        put_array(&w, mesh.normals);
+        put_array(&w, mesh.texcoords);
+        put_array(&w, mesh.indices);
+        put_array(&w, mesh.material_ids);
+    }
+
+    for (size_t i = 0; i < materials.size(); ++i) {
+        const tinyobj::material_t &m = materials[i];
+        put_string(&w, m.name);
+        put_string(&w, m.ambient_texname);
+        put_string(&w, m.diffuse_texname);
+        put_string(&w, m.specular_texname);
+        put_string(&w, m.normal_texname);
+        put_bytes(&w, m.ambient, sizeof(m.ambient));
+        put_bytes(&w, m.diffuse, sizeof(m.diffuse));
+        put_bytes(&w, m.specular, sizeof(m.specular));
+        put_bytes(&w, m.transmittance, sizeof(m.transmittance));
+        put_bytes(&w, m.emission, sizeof(m.emission));
+        put_bytes(&w, &m.shininess, sizeof(m.shininess));
+        put_bytes(&w, &m.ior, sizeof(m.ior));
+        put_bytes(&w, &m.dissolve, sizeof(m.dissolve));
+        put_bytes(&w, &m.illum, sizeof(m.illum));
+        put_u32(&w, (unsigned int) m.unknown_parameter.size());
+        std::map<std::string, std::string>::const_iterator it;
+        for (it = m.unknown_parameter.begin(); it != m.unknown_parameter.end(); ++it) {
+            put_string(&w, it->first);
+            put_string(&w, it->second);
+        }
+    }
+
+    if (fclose(w.f) != 0) { w.ok = 0; }
+    if (w.ok) {
+#ifdef _WIN32
+        // rename does not replace an existing file here
+        remove(fname);
+#endif
+        w.ok = rename(tmp.c_str(), fname) == 0;
+    }
+    if (!w.ok) {
+        fprintf(stderr, "error: could not write mesh cache %s\n", fname);
+        remove(tmp.c_str());
+    }
+    return w.ok;
+}
+
+/*
+ * Reading. Every read is bounds-checked; a short or corrupt file just
+ * clears ok.
+ */
+
+typedef struct {
+    const unsigned char *base, *p, *end;
+    int ok;
+} bin_reader_t;
+
+static void get_bytes(bin_reader_t *r, void *out, size_t n) {
+    if (!r->ok || (size_t) (r->end - r->p) < n) {
+        r->ok = 0;
+        return;
+    }
+    if (n) { memcpy(out, r->p, n); }
+    r->p += n;
+}
+
+static void get_pad(bin_reader_t *r) {
+    size_t pos = (size_t) (r->p - r->base);
+    size_t pad = (MESHBIN_ALIGN - pos % MESHBIN_ALIGN) % MESHBIN_ALIGN;
+    if ((size_t) (r->end - r->p) < pad) {
+        r->ok = 0;
+        return;
+    }
+    r->p += pad;
+}
+
+static unsigned int get_u32(bin_reader_t *r) {
+    unsigned int v = 0;
+    get_bytes(r, &v, sizeof(v));
+    return v;
+}
+
+static std::string get_string(bin_reader_t *r) {
+    unsigned int n = get_u32(r);
+    if (!r->ok || (size_t) (r->end - r->p) < n) {
+        r->ok = 0;
+        return std::string();
+    }
+    std::string s((const char *) r->p, n);
+    r->p += n;
+    return s;
+}
+
+// Points at a count-prefixed array in place
+template <typename T>
+static const T *get_array(bin_reader_t *r, size_t *count) {
+    unsigned long long n = 0;
+    get_pad(r);
+    get_bytes(r, &n, sizeof(n));
+    get_pad(r);
+    if (!r->ok || n > (unsigned long long) (r->end - r->p) / sizeof(T)) {
+        r->ok = 0;
+        return NULL;
+    }
+    const T *p = (const T *) r->p;
+    r->p += (size_t) n * sizeof(T);
+    *count = (size_t) n;
+    return p;
+}
+
+static int parse_meshbin(bin_reader_t *r, const meshbin_header_t *expect,
+                         meshbin_map_t *map) {
+    meshbin_header_t &hdr = map->hdr;
+    get_bytes(r, &hdr, sizeof(hdr));
+    if (!r->ok || memcmp(hdr.magic, MESHBIN_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != MESHBIN_VERSION) {
+        return 0;
+    }
+    if (expect && (hdr.src_size != expect->src_size ||
+                   hdr.src_mtime != expect->src_mtime ||
+                   hdr.src_key != expect->src_key ||
+                   hdr.opt_flags != expect->opt_flags)) {
+        return 0;
+    }
+
+    unsigned int num_mtls = get_u32(r);
+    for (unsigned int i = 0; r->ok && i < num_mtls; ++i) {
+        meshbin_mtl_t cached, now;
+        cached.path = get_string(r);
+        get_bytes(r, &cached.size, sizeof(cached.size));
+        get_bytes(r, &cached.mtime, sizeof(cached.mtime));
+        if (!r->ok || !expect) { continue; }
+        now.path = cached.path;
+        stamp_mtl(&now);
+        if (now.size != cached.size || now.mtime != cached.mtime) { return 0; }
+    }
+
+    map->shapes.resize(hdr.num_shapes);
+    for (size_t i = 0; r->ok && i < map->shapes.size(); ++i) {
+        mesh_view_t &mesh = map->shapes[i];
+        mesh.name = get_string(r);
+        mesh.positions = get_array<float>(r, &mesh.num_positions);
+        mesh.normals = get_array<float>(r, &mesh.num_normals);
+        mesh.texcoords = get_array<float>(r, &mesh.num_texcoords);
+        mesh.indices = get_array<unsigned int>(r, &mesh.num_indices);
+        mesh.material_ids = get_array<int>(r, &mesh.num_material_ids);
+    }
+
+    map->materials.resize(hdr.num_materials);
+    for (size_t i = 0; r->ok && i < map->materials.size(); ++i) {
+        tinyobj::material_t &m = map->materials[i];
+        m.name = get_string(r);
+        m.ambient_texname = get_string(r);
+        m.diffuse_texname = get_string(r);
+        m.specular_texname = get_string(r);
+        m.normal_texname = get_string(r);
+        get_bytes(r, m.ambient, sizeof(m.ambient));
+        get_bytes(r, m.diffuse, sizeof(m.diffuse));
+        get_bytes(r, m.specular, sizeof(m.specular));
+        get_bytes(r, m.transmittance, sizeof(m.transmittance));
+        get_bytes(r, m.emission, sizeof(m.emission));
+        get_bytes(r, &m.shininess, sizeof(m.shininess));
+        get_bytes(r, &m.ior, sizeof(m.ior));
+        get_bytes(r, &m.dissolve, sizeof(m.dissolve));
+        get_bytes(r, &m.illum, sizeof(m.illum));
+        unsigned int n = get_u32(r);
+        for (unsigned int k = 0; r->ok && k < n; ++k) {
+            std::string key = get_string(r);
+            m.unknown_parameter[key] = get_string(r);
+        }
+    }
+    return r->ok;
+}
+
+meshbin_map_t *meshbin_map(const char *fname, const meshbin_header_t *expect) {
+    TRACE_SCOPE("io", "meshbin_map");
+    if (!fname) { return NULL; }
+
+    void *base = NULL;
+    size_t len = 0;
+#ifndef _WIN32
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) { return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(meshbin_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    len = (size_t) st.st_size;
+    base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) { return NULL; }
+#else
+    // No mmap; read the file into memory instead
+    FILE *f = fopen(fname, "rb");
+    if (!f) { return NULL; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size <= 0 || !(base = malloc(size))) {
+        fclose(f);
+        return NULL;
+    }
+    len = fread(base, 1, size, f);
+    fclose(f);
+#endif
+
+    meshbin_map_t *map = new meshbin_map_t;
+    map->base = base;
+    map->len = len;
+    bin_reader_t r = { (const unsigned char *) base, (const unsigned char *) base,
+                       (const unsigned char *) base + len, 1 };
+    if (!parse_meshbin(&r, expect, map)) {
+        meshbin_unmap(&map);
+        return NULL;
+    }
+    return map;
+}
+
+meshbin_map_t **meshbin_unmap(meshbin_map_t **map) {
+    if (!*map) { return map; }
+#ifndef _WIN32
+    munmap((*map)->base, (*map)->len);
+#else
+    free((*map)->base);
+#endif
+    delete *map;
+    *map = NULL;
+    return map;
+}
+
+void mesh_views(const std::vector<tinyobj::shape_t> &shapes,
+                std::vector<mesh_view_t> &views) {
+    views.resize(shapes.size());
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        const tinyobj::mesh_t &mesh = shapes[i].mesh;
+        mesh_view_t &v = views[i];
+        v.name = shapes[i].name;
+        v.positions = mesh.positions.empty() ? NULL : &mesh.positions[0];
+        v.normals = mesh.normals.empty() ? NULL : &mesh.normals[0];
+        v.texcoords = mesh.texcoords.empty() ? NULL : &mesh.texcoords[0];
+        v.indices = mesh.indices.empty() ? NULL : &mesh.indices[0];
+        v.material_ids = mesh.material_ids.empty() ? NULL : &mesh.material_ids[0];
+        v.num_positions = mesh.positions.size();
+        v.num_normals = mesh.normals.size();
+        v.num_texcoords = mesh.texcoords.size();
+        v.num_indices = mesh.indices.size();
+        v.num_material_ids = mesh.material_ids.size();
+    }
+}
+
+template <typename T>
+static void copy_array(const T *p, size_t n, std::vector<T> &out) {
+    out.assign(p, p + n);
+}
+
+int read_meshbin(const char *fname, const meshbin_header_t *expect,
+                 std::vector<tinyobj::shape_t> &shapes,
+                 std::vector<tinyobj::material_t> &materials) {
+    shapes.clear();
+    materials.clear();
+    meshbin_map_t *map = meshbin_map(fname, expect);
+    if (!map) { return 0; }
+
+    shapes.resize(map->shapes.size());
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        const mesh_view_t &v = map->shapes[i];
+        tinyobj::mesh_t &mesh = shapes[i].mesh;
+        shapes[i].name = v.name;
+        copy_array(v.positions, v.num_positions, mesh.positions);
+        copy_array(v.normals, v.num_normals, mesh.normals);
+        copy_array(v.texcoords, v.num_texcoords, mesh.texcoords);
+        copy_array(v.indices, v.num_indices, mesh.indices);
+        copy_array(v.material_ids, v.num_material_ids, mesh.material_ids);
+    }
+    materials.swap(map->materials);
+    meshbin_unmap(&map);
+    return 1;
+}
+
+/*
+ * Cache lookup
+ */
+
+static std::string cache_dir;
+
+void meshbin_set_cache_dir(const char *dir) {
+    cache_dir = dir ? dir : "";
+}
+
+std::string meshbin_path(const char *obj) {
+    const char *dir = getenv("MESHBIN_CACHE_DIR");
+    if (!dir || !*dir) {
+        dir = cache_dir.c_str();
+    }
+    if (!*dir) {
+        return std::string(obj) + ".meshbin";
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.meshbin",
+             fnv1a(obj, 14695981039346656037ULL));
+    std::string path(dir);
+    if (path[path.size() - 1] != '/' && path[path.size() - 1] != '\\') {
+        path += '/';
+    }
+    return path + name;
+}
+
+int meshbin_stamp(const char *obj, const char *mtl_basepath, int opt_flags,
+                  meshbin_header_t *key) {
+    struct stat st;
+    if (!obj || stat(obj, &st) != 0) { return 0; }
+    memset(key, 0, sizeof(*key));
+    key->src_size = (unsigned long long) st.st_size;
+    key->src_mtime = (long long) st.st_mtime;
+    key->src_key = source_key(obj, mtl_basepath);
+    key->opt_flags = (unsigned int) opt_flags;
+    return 1;
+}
+
+void meshbin_mtl_stamps(const char *obj, const char *mtl_basepath,
+                        std::vector<meshbin_mtl_t> &mtls) {
+    mtls.clear();
+    FILE *f = obj ? fopen(obj, "rb") : NULL;
+    if (!f) { return; }
+    // Lines longer than the buffer come in pieces; only a piece that
+    // starts a line can be an mtllib line
+    char line[4096];
+    bool line_start = true;
+    while (fgets(line, sizeof(line), f)) {
+        size_t n = strlen(line);
+        bool was_start = line_start;
+        line_start = n > 0 && line[n - 1] == '\n';
+        if (!was_start) { continue; }
+        const char *p = line + strspn(line, " \t");
+        if (strncmp(p, "mtllib", 6) != 0 || (p[6] != ' ' && p[6] != '\t')) { continue; }
+        // The first name only, as tinyobj reads it
+        p += 6;
+        p += strspn(p, " \t");
+        std::string name(p, strcspn(p, " \t\r\n"));
+        meshbin_mtl_t mtl;
+        mtl.path = (mtl_basepath ? std::string(mtl_basepath) : std::string()) + name;
+        bool seen = false;
+        for (size_t i = 0; i < mtls.size(); ++i) {
+            if (mtls[i].path == mtl.path) { seen = true; }
+        }
+        if (seen) { continue; }
+        stamp_mtl(&mtl);
+        mtls.push_back(mtl);
+    }
+    fclose(f);
+}
+
+std::string load_mesh(const char *obj, const char *mtl_basepath,
+                      std::vector<tinyobj::shape_t> &shapes,
+                      std::vector<tinyobj::material_t> &materials,
+                      int opt_flags) {
+    TRACE_SCOPE("mesh", "load_mesh");
+    meshbin_header_t key;
+    if (!meshbin_stamp(obj, mtl_basepath, opt_flags, &key)) {
+        // Let the loader report the missing file
+        return tinyobj::LoadObj(shapes, materials, obj, mtl_basepath);
+    }
+
+    std::string cache = meshbin_path(obj);
+    if (read_meshbin(cache.c_str(), &key, shapes, materials)) {
+        return std::string();
+    }
+
+    // Stamped before the parse, so an edit made during it still shows
+    std::vector<meshbin_mtl_t> mtls;
+    meshbin_mtl_stamps(obj, mtl_basepath, mtls);
+    materials.clear();
+    std::string err = tinyobj::LoadObj(shapes, materials, obj, mtl_basepath);
+    if (err.empty()) {
+        for (size_t i = 0; opt_flags && i < shapes.size(); ++i) {
+            optimize_mesh(shapes[i].mesh, opt_flags);
+        }
+        write_meshbin(cache.c_str(), &key, mtls, shapes, materials);
+    }
+    return err;
+}
@@ -0,0 +1,164 @@
+#ifndef __MESHBIN_H__
+#define __MESHBIN_H__
+
+#include <string>
+#include <vector>
+
+#include "tiny_obj_loader.h"
+
+/*
+ * Binary mesh cache. A .meshbin file holds the shapes and materials
+ * tinyobj::LoadObj produced for one .obj, so reopening it is a single
+ * mmap and a copy per array instead of a text parse.
+ *
+ * Layout, in native byte order (the cache is per machine):
+ *   header        meshbin_header_t
+ *   mtl stamps    a u32 count, then per mtllib the path, its size (u64)
+ *                 and mtime (s64)
+ *   per shape     name, then positions, normals, texcoords, indices and
+ *                 material_ids, each a u64 count followed by the elements
+ *                 starting on a MESHBIN_ALIGN boundary
+ *   per material  name, texture names, the float/int parameters and the
+ *                 unknown_parameter pairs
+ * Strings are a u32 length followed by the bytes.
+ */
+
+#define MESHBIN_VERSION 3
+#define MESHBIN_ALIGN 16
+
+typedef struct meshbin_header_t {
+    char magic[8];              // "MESHBIN\0"
+    unsigned int version;       // MESHBIN_VERSION
+    unsigned int num_shapes;
+    unsigned int num_materials;
+    unsigned int opt_flags;     // MESH_OPT_* applied before writing
+    unsigned long long src_size;
+    long long src_mtime;
+    unsigned long long src_key; // hash of the .obj path and mtl base path
+} meshbin_header_t;
+
+/*
+ * Size and mtime of a material file the cached materials came from. A
+ * file that could not be stat'ed has size ~0ULL.
+ */
+typedef struct meshbin_mtl_t {
+    std::string path;
+    unsigned long long size;
+    long long mtime;
+} meshbin_mtl_t;
+
+/*
+ * Read-only view of one shape's arrays. Counts are in elements (floats,
+ * indices), not vertices.
+ */
+typedef struct mesh_view_t {
+    std::string name;
+    const float *positions;
+    const float *normals;
+    const float *texcoords;
+    const unsigned int *indices;
+    const int *material_ids;
+    size_t num_positions, num_normals, num_texcoords;
+    size_t num_indices, num_material_ids;
+} mesh_view_t;
+
+/*
+ * A .meshbin file mapped into memory. The shape views point into the
+ * mapping, so only the pages actually read are resident; the materials
+ * are copied.
+ */
+typedef struct meshbin_map_t {
+    meshbin_header_t hdr;
+    std::vector<mesh_view_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    void *base;
+    size_t len;
+} meshbin_map_t;
+
+/*
+ * Fills the src_* and opt_flags fields of key for obj as load_mesh stamps
+ * its cache. If obj cannot be stat'ed, 0 is returned.
+ */
+int meshbin_stamp(const char *obj, const char *mtl_basepath, int opt_flags,
+                  meshbin_header_t *key);
+
+/*
+ * Stamps every material file obj's mtllib lines name, resolved against
+ * mtl_basepath as tinyobj::LoadObj does. This reads the whole .obj, so
+ * it is only done when the cache is (re)written; a cache's own list is
+ * re-stamped when it is mapped.
+ */
+void meshbin_mtl_stamps(const char *obj, const char *mtl_basepath,
+                        std::vector<meshbin_mtl_t> &mtls);
+
+/*
+ * Loads obj like tinyobj::LoadObj, going through the cache: a cache file
+ * whose header matches obj's size, mtime and path, and whose material
+ * files are unchanged, is mapped instead of
+ * parsing, and after a parse each shape is run through optimize_mesh
+ * with opt_flags and the cache file is (re)written. The flags are part
+ * of the stamp, so callers sharing a cache should agree on them. Failure to
+ * write the cache is not an error. Returns an empty string on success and
+ * the loader's error message otherwise.
+ *
+ * The cache file is a file named after the hash of obj's path in the
+ * MESHBIN_CACHE_DIR environment variable's directory, or in the directory
+ * given to meshbin_set_cache_dir. With neither, it is obj with ".meshbin"
+ * appended.
+ */
+std::string load_mesh(const char *obj, const char *mtl_basepath,
+                      std::vector<tinyobj::shape_t> &shapes,
+                      std::vector<tinyobj::material_t> &materials,
+                      int opt_flags = 0);
+
+/*
+ * Where load_mesh keeps the cache for obj.
+ */
+std::string meshbin_path(const char *obj);
+
+/*
+ * Sets the directory load_mesh caches into when MESHBIN_CACHE_DIR is not
+ * set. The directory must exist. NULL or "" puts caches next to the OBJ.
+ */
+void meshbin_set_cache_dir(const char *dir);
+
+/*
+ * Writes shapes and materials to fname, stamped with hdr's src_* and
+ * opt_flags fields and with mtls.
+ * The file is written under a temporary name and renamed, so readers never
+ * see a partial file. If the write is unsuccessful, 0 is returned.
+ */
+int write_meshbin(const char *fname, const meshbin_header_t *hdr,
+                  const std::vector<meshbin_mtl_t> &mtls,
+                  const std::vector<tinyobj::shape_t> &shapes,
+                  const std::vector<tinyobj::material_t> &materials);
+
+/*
+ * Maps fname without copying the mesh arrays. Fails, returning NULL, in
+ * the same cases as read_meshbin.
+ */
+meshbin_map_t *meshbin_map(const char *fname, const meshbin_header_t *expect);
+
+/*
+ * Unmaps a file mapped with meshbin_map. NULL is returned.
+ */
+meshbin_map_t **meshbin_unmap(meshbin_map_t **map);
+
+/*
+ * Views over in-memory shapes, so loaded and mapped meshes can be drawn
+ * by the same code. The views are valid while shapes is unchanged.
+ */
+void mesh_views(const std::vector<tinyobj::shape_t> &shapes,
+                std::vector<mesh_view_t> &views);
+
+/*
+ * Maps fname and reads it into shapes and materials. If the file is
+ * missing, truncated, of another version, or its stamp differs from
+ * expect's or one of its material files changed, 0 is returned and the
+ * outputs are left empty.
+ */
+int read_meshbin(const char *fname, const meshbin_header_t *expect,
+                 std::vector<tinyobj::shape_t> &shapes,
+                 std::vector<tinyobj::material_t> &materials);
+
+#endif
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "meshopt.h"
+#include "trace.h"
+
+// Reorders the triangles of mesh so that new triangle i is old order[i]
+static void apply_triangle_order(tinyobj::mesh_t &mesh, const std::vector<unsigned int> &order) {
+    std::vector<unsigned int> indices(mesh.indices.size());
+    std::vector<int> material_ids;
+    bool has_materials = mesh.material_ids.size() == order.size();
+    if (has_materials) { material_ids.resize(order.size()); }
+    for (size_t i = 0; i < order.size(); ++i) {
+        unsigned int t = order[i];
+        indices[3 * i] = mesh.indices[3 * t];
+        indices[3 * i + 1] = mesh.indices[3 * t + 1];
+        indices[3 * i + 2] = mesh.indices[3 * t + 2];
+        if (has_materials) { material_ids[i] = mesh.material_ids[t]; }
+    }
+    mesh.indices.swap(indices);
+    if (has_materials) { mesh.material_ids.swap(material_ids); }
+}
+
+/*
+ * Morton order
+ */
+
+// Spreads the low 10 bits of x so there are two zero bits between each
+static unsigned int spread_bits(unsigned int x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+void reorder_triangles_morton(tinyobj::mesh_t &mesh) {
+    size_t num_tris = mesh.indices.size() / 3;
+    size_t num_verts = mesh.positions.size() / 3;
+    if (num_tris < 2 || num_verts == 0) { return; }
+
+    float lo[3] = { HUGE_VALF, HUGE_VALF, HUGE_VALF };
+    float hi[3] = { -HUGE_VALF, -HUGE_VALF, -HUGE_VALF };
+    for (size_t i = 0; i < mesh.positions.size(); ++i) {
+        lo[i % 3] = std::min(lo[i % 3], mesh.positions[i]);
+        hi[i % 3] = std::max(hi[i % 3], mesh.positions[i]);
+    }
+    float scale[3];
+    for (int k = 0; k < 3; ++k) {
+        scale[k] = hi[k] > lo[k] ? 1023.0f / (hi[k] - lo[k]) : 0;
+    }
+
+    std::vector<std::pair<unsigned int, unsigned int> > keys(num_tris);
+    for (size_t t = 0; t < num_tris; ++t) {
+        unsigned int code = 0;
+        for (int k = 0; k < 3; ++k) {
+            float c = (mesh.positions[3 * mesh.indices[3 * t] + k] +
+                       mesh.positions[3 * mesh.indices[3 * t + 1] + k] +
+                       mesh.positions[3 * mesh.indices[3 * t + 2] + k]) / 3;
+            code |= spread_bits((unsigned int) ((c - lo[k]) * scale[k])) << k;
+        }
+        keys[t] = std::make_pair(code, (unsigned int) t);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<unsigned int> order(num_tris);
+    for (size_t t = 0; t < num_tris; ++t) { order[t] = keys[t].second; }
+    apply_triangle_order(mesh, order);
+}
+
+/*
+ * Tipsify. Triangles are emitted by fanning around one vertex at a time;
+ * the next fan vertex is the candidate that will still be in the cache
+ * once its remaining triangles are emitted, falling back to recently used
+ * vertices and then to the first triangle of the current order not yet
+ * emitted. Fans start from that triangle too and emit their triangles in
+ * the current order, so an earlier sort survives wherever the cache does
+ * not decide.
+ */
+
+void reorder_triangles_tipsify(tinyobj::mesh_t &mesh, int cache_size) {
+    size_t num_tris = mesh.indices.size() / 3;
+    size_t num_verts = mesh.positions.size() / 3;
+    if (num_tris < 2 || num_verts == 0) { return; }
+    const std::vector<unsigned int> &idx = mesh.indices;
+
+    // Vertex to triangle adjacency, as offsets into one array
+    std::vector<unsigned int> live(num_verts, 0);
+    for (size_t i = 0; i < idx.size(); ++i) { ++live[idx[i]]; }
+    std::vector<unsigned int> offset(num_verts + 1, 0);
+    for (size_t v = 0; v < num_verts; ++v) { offset[v + 1] = offset[v] + live[v]; }
+    std::vector<unsigned int> adj(idx.size());
+    std::vector<unsigned int> fill(offset.begin(), offset.end() - 1);
+    for (size_t i = 0; i < idx.size(); ++i) { adj[fill[idx[i]]++] = (unsigned int) (i / 3); }
+
+    std::vector<int> stamp(num_verts, 0);
+    std::vector<char> emitted(num_tris, 0);
+    std::vector<unsigned int> dead_end;
+    std::vector<unsigned int> candidates;
+    std::vector<unsigned int> order;
+    order.reserve(num_tris);
+
+    int time = cache_size + 1;
+    size_t cursor = 0;
+    long fan = idx[0];
+    while (fan >= 0) {
+        candidates.clear();
+        for (unsigned int a = offset[fan]; a < offset[fan + 1]; ++a) {
+            unsigned int t = adj[a];
+            if (emitted[t]) { continue; }
+            emitted[t] = 1;
+            order.push_back(t);
+            for (int k = 0; k < 3; ++k) {
+                unsigned int v = idx[3 * t + k];
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if (time - stamp[v] > cache_size) {
+                    stamp[v] = time++;
+                }
+            }
+        }
+
+        // Best candidate still in cache after its own fan is emitted
+        fan = -1;
+        int best = -1;
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            unsigned int v = candidates[i];
+            if (live[v] == 0) { continue; }
+            int priority = 0;
+            if (time - stamp[v] + 2 * (int) live[v] <= cache_size) {
+                priority = time - stamp[v];
+            }
+            if (priority > best) {
+                best = priority;
+                fan = v;
+            }
+        }
+        if (fan >= 0) { continue; }
+
+        // Dead end: most recently used vertex with triangles left
+        while (!dead_end.empty()) {
+            unsigned int v = dead_end.back();
+            dead_end.pop_back();
+            if (live[v] > 0) {
+                fan = v;
+                break;
+            }
+        }
+        if (fan >= 0) { continue; }
+
+        // Otherwise the next triangle in the current order
+        while (cursor < num_tris && emitted[cursor]) { ++cursor; }
+        if (cursor < num_tris) { fan = idx[3 * cursor]; }
+    }
+
+    apply_triangle_order(mesh, order);
+}
+
+/*
+ * Vertex fetch order
+ */
+
+template <typename T>
+static void permute(std::vector<T> &data, size_t stride, const std::vector<unsigned int> &remap,
+                    size_t num_used) {
+    std::vector<T> out(num_used * stride);
+    for (size_t v = 0; v < remap.size(); ++v) {
+        if (remap[v] == ~0u) { continue; }
+        for (size_t k = 0; k < stride; ++k) {
+            out[remap[v] * stride + k] = data[v * stride + k];
+        }
+    }
+    data.swap(out);
+}
+
+void reorder_vertices_by_first_use(tinyobj::mesh_t &mesh) {
+    size_t num_verts = mesh.positions.size() / 3;
+    if (num_verts == 0) { return; }
+
+    std::vector<unsigned int> remap(num_verts, ~0u);
+    unsigned int next = 0;
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+        unsigned int &r = remap[mesh.indices[i]];
+        if (r == ~0u) { r = next++; }
+        mesh.indices[i] = r;
+    }
+
+    // Unreferenced vertices are dropped. Normals and texcoords are only
+    // per-vertex when every vertex has one.
+    if (mesh.normals.size() == mesh.positions.size()) {
+        permute(mesh.normals, 3, remap, next);
+    }
+    if (mesh.texcoords.size() == num_verts * 2) {
+        permute(mesh.texcoords, 2, remap, next);
+    }
+    permute(mesh.positions, 3, remap, next);
+}
+
+void optimize_mesh(tinyobj::mesh_t &mesh, int flags) {
+    TRACE_SCOPE("mesh", "optimize_mesh");
+    if (flags & MESH_OPT_MORTON) {
+        reorder_triangles_morton(mesh);
+    }
+    if (flags & MESH_OPT_VERTEX_CACHE) {
+        reorder_triangles_tipsify(mesh, MESH_OPT_CACHE_SIZE);
+    }
+    if (flags & MESH_OPT_VERTEX_FETCH) {
+        reorder_vertices_by_first_use(mesh);
+    }
+}
+
+float mesh_acmr(const tinyobj::mesh_t &mesh, int cache_size) {
+    size_t num_tris = mesh.indices.size() / 3;
+    if (num_tris == 0) { return 0; }
+    std::vector<unsigned int> fifo(cache_size, ~0u);
+    size_t head = 0, misses = 0;
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+        unsigned int v = mesh.indices[i];
+        if (std::find(fifo.begin(), fifo.end(), v) != fifo.end()) { continue; }
+        fifo[head] = v;
+        head = (head + 1) % cache_size;
+        ++misses;
+    }
+    return (float) misses / num_tris;
+}
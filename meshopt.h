@@ -0,0 +1,46 @@
+#ifndef __MESHOPT_H__
+#define __MESHOPT_H__
+
+#include <stddef.h>
+
+#include "tiny_obj_loader.h"
+
+/*
+ * Post-load reordering of a mesh for memory locality. None of these
+ * change what is drawn, only the order triangles and vertices are stored
+ * in. Flags for optimize_mesh:
+ *
+ *   MESH_OPT_MORTON        sort triangles along a Morton (Z-order) curve
+ *                          through their centroids, so consecutive
+ *                          triangles are close on screen
+ *   MESH_OPT_VERTEX_CACHE  reorder triangles for post-transform vertex
+ *                          reuse (Tipsify, Sander et al. 2007); applied
+ *                          after the Morton sort, whose order it keeps
+ *                          where it has a free choice
+ *   MESH_OPT_VERTEX_FETCH  renumber vertices in order of first use, so
+ *                          vertex reads walk memory forwards
+ */
+#define MESH_OPT_MORTON        0x1
+#define MESH_OPT_VERTEX_CACHE  0x2
+#define MESH_OPT_VERTEX_FETCH  0x4
+#define MESH_OPT_ALL           0x7
+
+/* Cache size Tipsify optimizes for */
+#define MESH_OPT_CACHE_SIZE 16
+
+void optimize_mesh(tinyobj::mesh_t &mesh, int flags);
+
+void reorder_triangles_morton(tinyobj::mesh_t &mesh);
+
+void reorder_triangles_tipsify(tinyobj::mesh_t &mesh, int cache_size);
+
+void reorder_vertices_by_first_use(tinyobj::mesh_t &mesh);
+
+/*
+ * Average cache misses per triangle of mesh's index order with a FIFO
+ * vertex cache of cache_size entries. 3 is the worst case; well ordered
+ * meshes get close to 0.5.
+ */
+float mesh_acmr(const tinyobj::mesh_t &mesh, int cache_size);
+
+#endif
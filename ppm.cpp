@@ -1,8 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <cstring>
+#include <cctype>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "ppm.h"
+#include "trace.h"
 
 pixel_t img_t::operator()(int i, int j) const {
     return (this->data)[i * this->w + j];
@@ -12,45 +21,225 @@ pixel_t &img_t::operator()(int i, int j) {
     return (this->data)[i * this->w + j];
 }
 
-img_t *read_ppm(const char *fname) {
-    FILE *img_file = NULL;
-    if (!(img_file = fopen(fname, "rb"))) {
-        fprintf(stderr, "error: could not open file %s\n", fname);
+/*
+ * Header parsing. The same tokenizer runs over a FILE * or a mapped
+ * buffer; get returns the next byte or EOF.
+ */
+
+typedef int (*get_byte_fn)(void *);
+
+typedef struct {
+    const unsigned char *p, *end;
+} buf_cursor_t;
+
+static int get_file_byte(void *ctx) {
+    return getc((FILE *) ctx);
+}
+
+static int get_buf_byte(void *ctx) {
+    buf_cursor_t *c = (buf_cursor_t *) ctx;
+    return c->p < c->end ? *(c->p++) : EOF;
+}
+
+// Reads an unsigned decimal, skipping whitespace and '#' comments before
+// it. The byte after the number is consumed and returned through term.
+static int read_header_int(get_byte_fn get, void *ctx, int *term) {
+    int c = get(ctx);
+    for (;;) {
+        if (c == '#') {
+            while (c != '\n' && c != '\r' && c != EOF) { c = get(ctx); }
+        } else if (c != EOF && isspace(c)) {
+            c = get(ctx);
+        } else {
+            break;
+        }
     }
-    int w = 0;
-    int h = 0;
-    img_t *img = NULL;
-    if (fscanf(img_file, "P6 %d %d 255%*c", &w, &h)) {
-        img = img_init(w, h);
+    if (c == EOF || !isdigit(c)) { return -1; }
+    long val = 0;
+    while (c != EOF && isdigit(c)) {
+        val = val * 10 + (c - '0');
+        if (val > 0x7fffffff) { return -1; }
+        c = get(ctx);
+    }
+    *term = c;
+    return (int) val;
+}
+
+static int parse_header(get_byte_fn get, void *ctx, ppm_header_t *hdr) {
+    if (get(ctx) != 'P') { return 0; }
+    int kind = get(ctx);
+    if (kind == '5') {
+        hdr->channels = 1;
+    } else if (kind == '6') {
+        hdr->channels = 3;
     } else {
-        fprintf(stderr, "error: invalid ppm file header\n");
-        return NULL;
+        return 0;
+    }
+    int term = 0;
+    hdr->w = read_header_int(get, ctx, &term);
+    hdr->h = read_header_int(get, ctx, &term);
+    hdr->maxval = read_header_int(get, ctx, &term);
+    // Exactly one whitespace byte separates maxval from the samples
+    if (hdr->w <= 0 || hdr->h <= 0 || hdr->maxval <= 0 ||
+            hdr->maxval > 65535 || term == EOF || !isspace(term)) {
+        return 0;
     }
+    hdr->bytes_per_sample = hdr->maxval < 256 ? 1 : 2;
+    return 1;
+}
 
-    if (!fread(img->data, 3, w * h, img_file)) {
-        fprintf(stderr, "error: invalid ppm file format\n");
-        return NULL;
+static size_t row_bytes(const ppm_header_t *hdr) {
+    return (size_t) hdr->w * hdr->channels * hdr->bytes_per_sample;
+}
+
+// Converts one row of raw samples to 8-bit RGB
+static void row_to_rgb(const ppm_header_t *hdr, const unsigned char *in,
+                       pixel_t *out) {
+    if (hdr->channels == 3 && hdr->maxval == 255) {
+        memcpy(out, in, (size_t) hdr->w * 3);
+        return;
+    }
+    unsigned char *dst = (unsigned char *) out;
+    int n = hdr->w * hdr->channels;
+    int maxval = hdr->maxval;
+    for (int i = 0; i < n; ++i) {
+        unsigned int s = hdr->bytes_per_sample == 1 ? in[i]
+                       : (unsigned int) ((in[2 * i] << 8) | in[2 * i + 1]);
+        if (s > (unsigned int) maxval) { s = maxval; }
+        unsigned char v = (unsigned char) ((s * 255 + maxval / 2) / maxval);
+        if (hdr->channels == 1) {
+            dst[3 * i] = dst[3 * i + 1] = dst[3 * i + 2] = v;
+        } else {
+            dst[i] = v;
+        }
     }
+}
+
+img_t *read_ppm(const char *fname) {
+    TRACE_SCOPE("io", "read_ppm");
+    ppm_reader_t *reader = ppm_open_reader(fname);
+    if (!reader) { return NULL; }
 
-    fclose(img_file);
+    img_t *img = img_init(reader->hdr.w, reader->hdr.h);
+    if (!img) {
+        ppm_close_reader(&reader);
+        return NULL;
+    }
+    if (ppm_read_rows_rgb(reader, img->data, img->h) != img->h) {
+        fprintf(stderr, "error: truncated ppm file %s\n", fname);
+        img_destroy(&img);
+    }
+    ppm_close_reader(&reader);
     return img;
 }
 
 int write_ppm(const img_t *img, const char *fname) {
+    TRACE_SCOPE("io", "write_ppm");
     if (!(img && fname)) {
         fprintf(stderr, "error: illegal argument\n");
         return 0;
     }
-    FILE *img_file = NULL;
-    if (!(img_file = fopen(fname, "wb"))) {
-        fprintf(stderr, "error: could not open file %s\n", fname);
+    ppm_writer_t *writer = ppm_open_writer(fname, img->w, img->h, 3, 255);
+    if (!writer) { return 0; }
+    ppm_write_rows(writer, img->data, img->h);
+    return ppm_close_writer(&writer);
+}
+
+// Reads the rows of reader into img, whose format was picked from the
+// header by read_ppm_image
+static int read_rows_image(ppm_reader_t *reader, Image *img) {
+    const ppm_header_t *hdr = &reader->hdr;
+    if (hdr->channels == 3) {
+        for (int y = 0; y < hdr->h; ++y) {
+            if (ppm_read_rows_rgb(reader, (pixel_t *) img->scanLine(y), 1) != 1) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    unsigned char *raw = (unsigned char *) malloc(row_bytes(hdr));
+    if (!raw) { return 0; }
+    int ok = 1;
+    unsigned int maxval = hdr->maxval;
+    unsigned int full = hdr->bytes_per_sample == 1 ? 255 : 65535;
+    for (int y = 0; ok && y < hdr->h; ++y) {
+        if (ppm_read_rows(reader, raw, 1) != 1) {
+            ok = 0;
+            break;
+        }
+        unsigned char *dst8 = img->scanLine(y);
+        unsigned short *dst16 = (unsigned short *) dst8;
+        for (int x = 0; x < hdr->w; ++x) {
+            unsigned int s = hdr->bytes_per_sample == 1 ? raw[x]
+                           : (unsigned int) ((raw[2 * x] << 8) | raw[2 * x + 1]);
+            if (s > maxval) { s = maxval; }
+            if (maxval != full) { s = (s * full + maxval / 2) / maxval; }
+            if (hdr->bytes_per_sample == 1) {
+                dst8[x] = (unsigned char) s;
+            } else {
+                dst16[x] = (unsigned short) s;
+            }
+        }
+    }
+    free(raw);
+    return ok;
+}
+
+Image read_ppm_image(const char *fname) {
+    TRACE_SCOPE("io", "read_ppm_image");
+    ppm_reader_t *reader = ppm_open_reader(fname);
+    if (!reader) { return Image(); }
+
+    const ppm_header_t *hdr = &reader->hdr;
+    pix_fmt_t fmt = hdr->channels == 3 ? PIX_RGB8
+                  : hdr->bytes_per_sample == 1 ? PIX_GRAY8 : PIX_GRAY16;
+    Image img(hdr->w, hdr->h, fmt);
+    if (img.isNull()) {
+        fprintf(stderr, "error: out of memory for %d by %d image\n", hdr->w, hdr->h);
+    } else if (!read_rows_image(reader, &img)) {
+        fprintf(stderr, "error: truncated ppm file %s\n", fname);
+        img = Image();
+    }
+    ppm_close_reader(&reader);
+    return img;
+}
+
+int write_ppm_image(const Image &img, const char *fname) {
+    TRACE_SCOPE("io", "write_ppm_image");
+    if (img.isNull() || !fname) {
+        fprintf(stderr, "error: illegal argument\n");
         return 0;
     }
-    fprintf(img_file, "P6\n%d %d\n255\n", img->w, img->h);
-    fwrite(img->data, img->w * img->h, 3, img_file);
+    if (img.format() == PIX_GRAY8 || img.format() == PIX_GRAY16) {
+        int wide = img.format() == PIX_GRAY16;
+        ppm_writer_t *writer = ppm_open_writer(fname, img.width(), img.height(),
+                                               1, wide ? 65535 : 255);
+        if (!writer) { return 0; }
+        unsigned char *raw = (unsigned char *) malloc((size_t) img.width() * 2);
+        for (int y = 0; raw && y < img.height(); ++y) {
+            const unsigned char *row = img.constScanLine(y);
+            if (wide) {
+                // Samples are big-endian on disk
+                const unsigned short *row16 = (const unsigned short *) row;
+                for (int x = 0; x < img.width(); ++x) {
+                    raw[2 * x] = (unsigned char) (row16[x] >> 8);
+                    raw[2 * x + 1] = (unsigned char) (row16[x] & 0xff);
+                }
+                row = raw;
+            }
+            ppm_write_rows(writer, row, 1);
+        }
+        free(raw);
+        return ppm_close_writer(&writer);
+    }
 
-    fclose(img_file);
-    return 1;
+    Image rgb = img.convert(PIX_RGB8);
+    ppm_writer_t *writer = ppm_open_writer(fname, rgb.width(), rgb.height(), 3, 255);
+    if (!writer) { return 0; }
+    for (int y = 0; y < rgb.height(); ++y) {
+        ppm_write_rows(writer, rgb.constScanLine(y), 1);
+    }
+    return ppm_close_writer(&writer);
 }
 
 img_t *img_init(int w, int h) {
@@ -60,11 +249,16 @@ img_t *img_init(int w, int h) {
         return NULL;
     }
     img_t *img = (img_t *) malloc(sizeof(*img));
+    if (!img) { return NULL; }
     img->w = w;
     img->h = h;
 
-    img->data = (pixel_t *) malloc(w * h * sizeof(*(img->data)));
-    memset(img->data, 0, w * h * sizeof(*(img->data)));
+    img->data = (pixel_t *) calloc((size_t) w * h, sizeof(*(img->data)));
+    if (!img->data) {
+        fprintf(stderr, "error: out of memory for %d by %d image\n", w, h);
+        free(img);
+        return NULL;
+    }
 
     return img;
 }
@@ -76,3 +270,216 @@ img_t **img_destroy(img_t **img) {
     *img = NULL;
     return img;
 }
+
+/*
+ * Memory-mapped access
+ */
+
+ppm_map_t *ppm_map(const char *fname) {
+    TRACE_SCOPE("io", "ppm_map");
+    if (!fname) { return NULL; }
+    void *base = NULL;
+    size_t len = 0;
+#ifndef _WIN32
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error: could not open file %s\n", fname);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    len = (size_t) st.st_size;
+    base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "error: could not map file %s\n", fname);
+        return NULL;
+    }
+#else
+    // No mmap; read the file into memory instead
+    FILE *f = fopen(fname, "rb");
+    if (!f) {
+        fprintf(stderr, "error: could not open file %s\n", fname);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size <= 0 || !(base = malloc(size))) {
+        fclose(f);
+        return NULL;
+    }
+    len = fread(base, 1, size, f);
+    fclose(f);
+#endif
+
+    ppm_map_t *map = (ppm_map_t *) calloc(1, sizeof(*map));
+    if (!map) {
+        fprintf(stderr, "error: out of memory mapping %s\n", fname);
+#ifndef _WIN32
+        munmap(base, len);
+#else
+        free(base);
+#endif
+        return NULL;
+    }
+    map->base = base;
+    map->len = len;
+
+    buf_cursor_t cursor = { (const unsigned char *) base,
+                            (const unsigned char *) base + len };
+    if (!parse_header(get_buf_byte, &cursor, &map->hdr)) {
+        fprintf(stderr, "error: invalid ppm file header\n");
+        ppm_unmap(&map);
+        return NULL;
+    }
+    map->pixels = cursor.p;
+    map->row_bytes = row_bytes(&map->hdr);
+    if ((size_t) (cursor.end - cursor.p) < map->row_bytes * map->hdr.h) {
+        fprintf(stderr, "error: truncated ppm file %s\n", fname);
+        ppm_unmap(&map);
+        return NULL;
+    }
+    return map;
+}
+
+ppm_map_t **ppm_unmap(ppm_map_t **map) {
+    if (!*map) { return map; }
+#ifndef _WIN32
+    munmap((*map)->base, (*map)->len);
+#else
+    free((*map)->base);
+#endif
+    free(*map);
+    *map = NULL;
+    return map;
+}
+
+int ppm_map_view(const ppm_map_t *map, img_t *view) {
+    if (!(map && view) || map->hdr.channels != 3 || map->hdr.maxval != 255) {
+        return 0;
+    }
+    view->data = (pixel_t *) map->pixels;
+    view->w = map->hdr.w;
+    view->h = map->hdr.h;
+    return 1;
+}
+
+void ppm_map_row_rgb(const ppm_map_t *map, int y, int x, int n, pixel_t *out) {
+    ppm_header_t span = map->hdr;
+    span.w = n;
+    const unsigned char *in = map->pixels + map->row_bytes * y +
+            (size_t) x * span.channels * span.bytes_per_sample;
+    row_to_rgb(&span, in, out);
+}
+
+/*
+ * Streaming access
+ */
+
+ppm_reader_t *ppm_open_reader(const char *fname) {
+    if (!fname) {
+        fprintf(stderr, "error: illegal argument\n");
+        return NULL;
+    }
+    FILE *img_file = NULL;
+    if (!(img_file = fopen(fname, "rb"))) {
+        fprintf(stderr, "error: could not open file %s\n", fname);
+        return NULL;
+    }
+    ppm_reader_t *reader = (ppm_reader_t *) calloc(1, sizeof(*reader));
+    if (!reader) {
+        fprintf(stderr, "error: out of memory opening %s\n", fname);
+        fclose(img_file);
+        return NULL;
+    }
+    if (!parse_header(get_file_byte, img_file, &reader->hdr)) {
+        fprintf(stderr, "error: invalid ppm file header\n");
+        fclose(img_file);
+        free(reader);
+        return NULL;
+    }
+    reader->file = img_file;
+    return reader;
+}
+
+int ppm_read_rows(ppm_reader_t *reader, void *buf, int rows) {
+    if (rows > reader->hdr.h - reader->row) { rows = reader->hdr.h - reader->row; }
+    if (rows <= 0) { return 0; }
+    size_t n = fread(buf, row_bytes(&reader->hdr), rows, (FILE *) reader->file);
+    reader->row += (int) n;
+    return (int) n;
+}
+
+int ppm_read_rows_rgb(ppm_reader_t *reader, pixel_t *buf, int rows) {
+    const ppm_header_t *hdr = &reader->hdr;
+    if (hdr->channels == 3 && hdr->maxval == 255) {
+        return ppm_read_rows(reader, buf, rows);
+    }
+    unsigned char *raw = (unsigned char *) malloc(row_bytes(hdr));
+    if (!raw) { return 0; }
+    int done = 0;
+    while (done < rows && ppm_read_rows(reader, raw, 1) == 1) {
+        row_to_rgb(hdr, raw, buf + (size_t) done * hdr->w);
+        ++done;
+    }
+    free(raw);
+    return done;
+}
+
+ppm_reader_t **ppm_close_reader(ppm_reader_t **reader) {
+    if (!*reader) { return reader; }
+    fclose((FILE *) (*reader)->file);
+    free(*reader);
+    *reader = NULL;
+    return reader;
+}
+
+ppm_writer_t *ppm_open_writer(const char *fname, int w, int h,
+                              int channels, int maxval) {
+    if (!fname || w <= 0 || h <= 0 || (channels != 1 && channels != 3) ||
+            maxval <= 0 || maxval > 65535) {
+        fprintf(stderr, "error: illegal argument\n");
+        return NULL;
+    }
+    FILE *img_file = NULL;
+    if (!(img_file = fopen(fname, "wb"))) {
+        fprintf(stderr, "error: could not open file %s\n", fname);
+        return NULL;
+    }
+    ppm_writer_t *writer = (ppm_writer_t *) calloc(1, sizeof(*writer));
+    if (!writer) {
+        fprintf(stderr, "error: out of memory opening %s\n", fname);
+        fclose(img_file);
+        return NULL;
+    }
+    writer->hdr.w = w;
+    writer->hdr.h = h;
+    writer->hdr.channels = channels;
+    writer->hdr.maxval = maxval;
+    writer->hdr.bytes_per_sample = maxval < 256 ? 1 : 2;
+    writer->file = img_file;
+    fprintf(img_file, "P%c\n%d %d\n%d\n", channels == 1 ? '5' : '6', w, h, maxval);
+    return writer;
+}
+
+int ppm_write_rows(ppm_writer_t *writer, const void *buf, int rows) {
+    if (rows > writer->hdr.h - writer->row) { rows = writer->hdr.h - writer->row; }
+    if (rows <= 0) { return 0; }
+    size_t n = fwrite(buf, row_bytes(&writer->hdr), rows, (FILE *) writer->file);
+    writer->row += (int) n;
+    return (int) n;
+}
+
+int ppm_close_writer(ppm_writer_t **writer) {
+    if (!*writer) { return 0; }
+    int ok = (*writer)->row == (*writer)->hdr.h;
+    if (fclose((FILE *) (*writer)->file) != 0) { ok = 0; }
+    if (!ok) { fprintf(stderr, "error: incomplete ppm file written\n"); }
+    free(*writer);
+    *writer = NULL;
+    return ok;
+}
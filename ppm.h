@@ -1,9 +1,9 @@
 #ifndef __PPM_H__
 #define __PPM_H__
 
-typedef struct pixel_t {
-    unsigned char r, g, b;
-} pixel_t;
+#include <stddef.h>
+
+#include "image.h"
 
 typedef struct img_t {
     pixel_t *data;
@@ -12,6 +12,46 @@ typedef struct img_t {
     pixel_t &operator()(int, int);
 } img_t;
 
+/*
+ * Header fields shared by every reader. channels is 1 for P5 (PGM) and 3
+ * for P6 (PPM). Samples are 1 byte when maxval < 256, otherwise 2 bytes,
+ * big-endian as the format requires.
+ */
+typedef struct ppm_header_t {
+    int w, h;
+    int channels;
+    int maxval;
+    int bytes_per_sample;
+} ppm_header_t;
+
+/*
+ * A P5/P6 file mapped read-only into memory. pixels points at the first
+ * sample and rows are row_bytes apart, with no padding.
+ */
+typedef struct ppm_map_t {
+    ppm_header_t hdr;
+    const unsigned char *pixels;
+    size_t row_bytes;
+    void *base;
+    size_t len;
+} ppm_map_t;
+
+/*
+ * Sequential row-by-row access, so files larger than memory can be
+ * processed with a buffer of a few rows.
+ */
+typedef struct ppm_reader_t {
+    ppm_header_t hdr;
+    void *file;
+    int row;
+} ppm_reader_t;
+
+typedef struct ppm_writer_t {
+    ppm_header_t hdr;
+    void *file;
+    int row;
+} ppm_writer_t;
+
 /*
  * Initialize a new img_t with corresponding height and width.
  * If creation is unsuccessful, NULL is returned.
@@ -24,8 +64,10 @@ img_t *img_init(int w, int h);
 img_t **img_destroy(img_t **img);
 
 /*
- * Read a *.ppm file and return the corresponding img_t * struct.
- * If the reading is unsuccessful, NULL is returned.
+ * Read a *.ppm or *.pgm file (P5/P6, any maxval) and return the
+ * corresponding 8-bit RGB img_t * struct. Gray images are expanded and
+ * samples are rescaled to 0..255. If the reading is unsuccessful, NULL
+ * is returned.
  */
 img_t *read_ppm(const char *fname);
 
@@ -35,4 +77,86 @@ img_t *read_ppm(const char *fname);
  */
 int write_ppm(const img_t *img, const char *fname);
 
+/*
+ * Read a *.ppm or *.pgm file into an Image, keeping gray files gray:
+ * P5 gives PIX_GRAY8 (maxval < 256) or PIX_GRAY16, P6 gives PIX_RGB8.
+ * Samples are rescaled to the full range of the format. If the reading
+ * is unsuccessful, a null Image is returned.
+ */
+Image read_ppm_image(const char *fname);
+
+/*
+ * Write an Image to fname. Gray formats are written as P5, everything
+ * else is converted to PIX_RGB8 and written as P6. If the write is
+ * unsuccessful, 0 is returned.
+ */
+int write_ppm_image(const Image &img, const char *fname);
+
+/*
+ * Map fname into memory and parse its header. The pixel data is not
+ * touched until it is read. If the file is not a valid P5/P6 file, NULL
+ * is returned.
+ */
+ppm_map_t *ppm_map(const char *fname);
+
+/*
+ * Unmaps a file mapped with ppm_map. NULL is returned.
+ */
+ppm_map_t **ppm_unmap(ppm_map_t **map);
+
+/*
+ * Points view at the mapped pixels without copying. Only 8-bit P6 files
+ * have the img_t layout; for anything else 0 is returned. The view is
+ * valid until the map is unmapped and must not be passed to img_destroy.
+ */
+int ppm_map_view(const ppm_map_t *map, img_t *view);
+
+/*
+ * Converts n pixels of row y, starting at column x, of a mapped file to
+ * 8-bit RGB. Only the pages holding those samples are touched.
+ */
+void ppm_map_row_rgb(const ppm_map_t *map, int y, int x, int n, pixel_t *out);
+
+/*
+ * Opens fname for row-by-row reading. If the file cannot be opened or
+ * its header is invalid, NULL is returned.
+ */
+ppm_reader_t *ppm_open_reader(const char *fname);
+
+/*
+ * Reads up to rows rows of raw samples into buf, which must hold
+ * rows * w * channels * bytes_per_sample bytes. Returns the number of
+ * rows read, which is less than rows at the end of the image or on error.
+ */
+int ppm_read_rows(ppm_reader_t *reader, void *buf, int rows);
+
+/*
+ * As ppm_read_rows, but converts each row to 8-bit RGB.
+ */
+int ppm_read_rows_rgb(ppm_reader_t *reader, pixel_t *buf, int rows);
+
+/*
+ * Closes a reader. NULL is returned.
+ */
+ppm_reader_t **ppm_close_reader(ppm_reader_t **reader);
+
+/*
+ * Creates fname and writes a header for a w by h image. channels must be
+ * 1 (P5) or 3 (P6). If the file cannot be created, NULL is returned.
+ */
+ppm_writer_t *ppm_open_writer(const char *fname, int w, int h,
+                              int channels, int maxval);
+
+/*
+ * Appends rows rows of raw samples from buf. Returns the number of rows
+ * written.
+ */
+int ppm_write_rows(ppm_writer_t *writer, const void *buf, int rows);
+
+/*
+ * Closes a writer. Returns 0 if any row is missing or the file could not
+ * be flushed, 1 otherwise.
+ */
+int ppm_close_writer(ppm_writer_t **writer);
+
 #endif
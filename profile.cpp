@@ -0,0 +1,81 @@
+#include <cstdio>
+#include <cstring>
+
+#include "profile.h"
+
+static profile_t stats;
+static int depth[STAGE_COUNT];
+
+static const char *stage_names[STAGE_COUNT] = {
+    "load", "transform", "setup", "raster", "filter"
+};
+
+static const char *counter_names[COUNT_COUNT] = {
+    "triangles", "triangles_drawn", "fragments", "z_pass", "z_fail",
+    "pixels_covered"
+};
+
+const char *profile_stage_name(prof_stage_t stage) {
+    return stage_names[stage];
+}
+
+const char *profile_counter_name(prof_counter_t counter) {
+    return counter_names[counter];
+}
+
+void profile_reset() {
+    memset(&stats, 0, sizeof(stats));
+}
+
+void profile_get(profile_t *out) {
+    *out = stats;
+}
+
+void profile_add_time(prof_stage_t stage, double ms) {
+    stats.stage_ms[stage] += ms;
+}
+
+void profile_count(prof_counter_t counter, unsigned long long n) {
+    stats.counters[counter] += n;
+}
+
+bool profile_enter(prof_stage_t stage) {
+    return depth[stage]++ == 0;
+}
+
+void profile_leave(prof_stage_t stage) {
+    depth[stage]--;
+}
+
+double profile_overdraw(const profile_t *prof) {
+    unsigned long long covered = prof->counters[COUNT_PIXELS_COVERED];
+    if (covered == 0) { return 0; }
+    return (double) prof->counters[COUNT_Z_PASS] / covered;
+}
+
+std::string profile_summary(const profile_t *prof) {
+#ifndef PROFILE_STATS
+    (void) prof;
+    return "Built without PROFILE_STATS\n";
+#else
+    std::string s;
+    char line[128];
+    double total = 0;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        snprintf(line, sizeof(line), "%-16s %10.2f ms\n",
+                 stage_names[i], prof->stage_ms[i]);
+        s += line;
+        total += prof->stage_ms[i];
+    }
+    snprintf(line, sizeof(line), "%-16s %10.2f ms\n\n", "total", total);
+    s += line;
+    for (int i = 0; i < COUNT_COUNT; i++) {
+        snprintf(line, sizeof(line), "%-16s %13llu\n",
+                 counter_names[i], prof->counters[i]);
+        s += line;
+    }
+    snprintf(line, sizeof(line), "%-16s %12.2fx\n", "overdraw", profile_overdraw(prof));
+    s += line;
+    return s;
+#endif
+}
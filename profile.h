@@ -0,0 +1,105 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <string>
+
+/*
+ * Per-stage wall time and counters for the rasterizer and the filters,
+ * so a slow frame can be told apart as I/O (load), geometry (transform,
+ * setup) or fill (raster) bound.
+ *
+ * Recording is compiled in when PROFILE_STATS is defined, as
+ * img_viewer.pro does. Without it PROFILE_SCOPE and PROFILE_COUNT expand
+ * to nothing and the stats stay zero. Stats accumulate until
+ * profile_reset(); they are not thread-safe, so record from the thread
+ * that calls rasterize() and the filters.
+ */
+typedef enum {
+    STAGE_LOAD,         // .meshbin map or .obj parse; a mapped cache is
+                        // paged in later, during transform
+    STAGE_TRANSFORM,    // vertex fetch and transforms
+    STAGE_SETUP,        // triangle setup and culling
+    STAGE_RASTER,       // scan conversion, depth test and shading
+    STAGE_FILTER,       // im_op filters
+    STAGE_COUNT
+} prof_stage_t;
+
+typedef enum {
+    COUNT_TRIANGLES,        // triangles submitted
+    COUNT_TRIANGLES_DRAWN,  // triangles left after culling
+    COUNT_FRAGMENTS,        // pixels scan converted and depth tested
+    COUNT_Z_PASS,
+    COUNT_Z_FAIL,
+    COUNT_PIXELS_COVERED,   // pixels of the frame holding a fragment
+    COUNT_COUNT
+} prof_counter_t;
+
+typedef struct {
+    double stage_ms[STAGE_COUNT];
+    unsigned long long counters[COUNT_COUNT];
+} profile_t;
+
+/// Short names for display and JSON keys, e.g. "load", "z_pass"
+const char *profile_stage_name(prof_stage_t stage);
+const char *profile_counter_name(prof_counter_t counter);
+
+void profile_reset();
+
+/// Copies the stats recorded since the last profile_reset()
+void profile_get(profile_t *out);
+
+void profile_add_time(prof_stage_t stage, double ms);
+void profile_count(prof_counter_t counter, unsigned long long n);
+
+/// Fragments that passed the depth test per covered pixel, or 0
+double profile_overdraw(const profile_t *prof);
+
+/// A few lines of text with every stage and counter, for display
+std::string profile_summary(const profile_t *prof);
+
+#ifdef PROFILE_STATS
+
+#include <chrono>
+
+/// Nesting depth bookkeeping for profile_scope. profile_enter returns
+/// true for the outermost scope of stage.
+bool profile_enter(prof_stage_t stage);
+void profile_leave(prof_stage_t stage);
+
+/*
+ * Adds the time from construction to destruction to a stage. Scopes of
+ * the same stage nest (sobel runs grayscale) and only the outermost one
+ * counts. Use PROFILE_SCOPE rather than naming one, so builds without
+ * PROFILE_STATS drop it.
+ */
+class profile_scope {
+public:
+    explicit profile_scope(prof_stage_t stage)
+        : stage(stage), outer(profile_enter(stage)),
+          start(std::chrono::steady_clock::now()) {}
+    ~profile_scope() {
+        profile_leave(stage);
+        if (!outer) { return; }
+        std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - start;
+        profile_add_time(stage, d.count());
+    }
+private:
+    prof_stage_t stage;
+    bool outer;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define PROFILE_CAT2(a, b) a##b
+#define PROFILE_CAT(a, b) PROFILE_CAT2(a, b)
+#define PROFILE_SCOPE(stage) profile_scope PROFILE_CAT(profile_scope_, __LINE__)(stage)
+#define PROFILE_COUNT(counter, n) profile_count(counter, n)
+
+#else
+
+#define PROFILE_SCOPE(stage) ((void) 0)
+#define PROFILE_COUNT(counter, n) ((void) (n))
+
+#endif
+
+#endif
@@ -4,12 +4,17 @@
 #include <QDebug>
 #include <QMessageBox>
 #include <fstream>
+#include <sstream>
+#include <cmath>
 #include <algorithm>
 
 #include "rasterize.h"
 #include "tiny_obj_loader.h"
+#include "meshbin.h"
 #include "vec4.h"
 #include "mat4.h"
+#include "profile.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -139,358 +144,737 @@ void camera_init(camera_mat_t *cam) {
     update_matrices(cam);
 }
 
-QImage rasterize(const char *obj, camera_mat_t *camera, int w, int h, e_shader shading) {
+void lighting_init(lighting_t *lighting) {
+    lighting->ambient[0] = 0.1f;
+    lighting->ambient[1] = 0.1f;
+    lighting->ambient[2] = 0.1f;
+    lighting->lights.clear();
+}
 
-    // Initialize output image
-    QImage out(w, h, QImage::Format_RGB888);
-    out.fill(qRgb(0, 0, 0));
+int load_lighting(const char *file, lighting_t *lighting) {
+    std::ifstream light_file(file);
+    if (!light_file.is_open()) {
+        fprintf(stderr, "error: could not open %s\n", file);
+        return 0;
+    }
+    lighting_t out;
+    lighting_init(&out);
+    std::string line;
+    for (int line_no = 1; std::getline(light_file, line); ++line_no) {
+        std::istringstream in(line);
+        std::string kind;
+        if (!(in >> kind) || kind[0] == '#') { continue; }
+        bool ok;
+        if (kind == "ambient") {
+            ok = !!(in >> out.ambient[0] >> out.ambient[1] >> out.ambient[2]);
+        } else if (kind == "directional" || kind == "point") {
+            light_t l;
+            l.type = kind == "point" ? LIGHT_POINT : LIGHT_DIRECTIONAL;
+            l.attenuation = 0;
+            ok = !!(in >> l.x >> l.y >> l.z >> l.r >> l.g >> l.b);
+            if (ok && l.type == LIGHT_POINT && !(in >> l.attenuation)) {
+                l.attenuation = 0;
+            }
+            out.lights.push_back(l);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "error: %s:%d: bad light \"%s\"\n", file, line_no, line.c_str());
+            return 0;
+        }
+    }
+    *lighting = out;
+    return 1;
+}
 
-    // Initialize z-buffer
-    std::vector<double> z_buf;
-    for (int i = 0; i < w * h; ++i) {
-        z_buf.push_back(2);
+// Triangles are gathered, set up and drawn this many at a time, so memory
+// use is bounded by the batch and not the mesh.
+#define RASTER_BATCH 65536
+
+// Copies 3 floats of attribute idx to out, or zeros if the mesh has none
+static void mesh_attr(const float *data, size_t count, unsigned int idx, float *out) {
+    if (!data || (size_t) idx * 3 + 2 >= count) {
+        out[0] = out[1] = out[2] = 0;
+        return;
     }
+    out[0] = data[idx * 3];
+    out[1] = data[idx * 3 + 1];
+    out[2] = data[idx * 3 + 2];
+}
 
-    std::string mtl_path = "../obj/";
+static bool uses_normals(e_shader shading) {
+    return shading == NORM_FLAT || shading == NORM_GOURAUD || shading == NORM_BARY ||
+           shading == NORM_GOURAUD_Z || shading == NORM_BARY_Z || shading == BLINN_PHONG;
+}
 
-    // LOAD OBJ
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string err = tinyobj::LoadObj(shapes, materials, obj, mtl_path.c_str());
-    if ("" != err) {
-        QMessageBox errorBox;
-        errorBox.setText(".obj file not valid");
-        errorBox.setIcon(QMessageBox::Warning);
-        errorBox.exec();
-        return out;
+static bool uses_view_pos(e_shader shading) {
+    return shading == BLINN_PHONG;
+}
+
+// Sets f's color and copies the object space corners of triangle i
+// (starting at index 3 * i) of mesh to pos, and their normals to nrm
+// unless it is NULL, 3 floats per corner
+static void gather_face(const mesh_view_t &mesh,
+                        const std::vector<tinyobj::material_t> &materials,
+                        size_t i, face_t &f, float *pos, float *nrm) {
+    for (int k = 0; k < 3; ++k) {
+        unsigned int idx = mesh.indices[3 * i + k];
+        mesh_attr(mesh.positions, mesh.num_positions, idx, pos + 3 * k);
+        if (nrm) { mesh_attr(mesh.normals, mesh.num_normals, idx, nrm + 3 * k); }
+    }
+    int material = i < mesh.num_material_ids ? mesh.material_ids[i] : -1;
+    if (material >= (int) materials.size()) { material = -1; }
+    f.material = material;
+    if (material >= 0) {
+        f.color = { (unsigned char) (materials[material].diffuse[0] * 255),
+                    (unsigned char) (materials[material].diffuse[1] * 255),
+                    (unsigned char) (materials[material].diffuse[2] * 255) };
+    } else {
+        f.color = { 255, 255, 255 };
     }
+}
 
-    std::vector<face_t> faces;
-    for (const auto &s : shapes) {
-        tinyobj::mesh_t mesh = s.mesh;
-        for (size_t i = 0; i < mesh.indices.size(); i += 3) {
-            face_t tmp;
-            tmp.vert[0] = vec4(mesh.positions[mesh.indices[i] * 3],
-                               mesh.positions[mesh.indices[i] * 3 + 1],
-                               mesh.positions[mesh.indices[i] * 3 + 2], 1);
-            tmp.vert[1] = vec4(mesh.positions[mesh.indices[i + 1] * 3],
-                               mesh.positions[mesh.indices[i + 1] * 3 + 1],
-                               mesh.positions[mesh.indices[i + 1] * 3 + 2], 1);
-            tmp.vert[2] = vec4(mesh.positions[mesh.indices[i + 2] * 3],
-                               mesh.positions[mesh.indices[i + 2] * 3 + 1],
-                               mesh.positions[mesh.indices[i + 2] * 3 + 2], 1);
-            tmp.normals[0] = vec4(mesh.normals[mesh.indices[i] * 3],
-                                  mesh.normals[mesh.indices[i] * 3 + 1],
-                                  mesh.normals[mesh.indices[i] * 3 + 2], 0);
-            tmp.normals[1] = vec4(mesh.normals[mesh.indices[i + 1] * 3],
-                                  mesh.normals[mesh.indices[i + 1] * 3 + 1],
-                                  mesh.normals[mesh.indices[i + 1] * 3 + 2], 0);
-            tmp.normals[2] = vec4(mesh.normals[mesh.indices[i + 2] * 3],
-                                  mesh.normals[mesh.indices[i + 2] * 3 + 1],
-                                  mesh.normals[mesh.indices[i + 2] * 3 + 2], 0);
-            tmp.color = { (unsigned char) (materials[mesh.material_ids[i / 3]].diffuse[0] * 255),
-                          (unsigned char) (materials[mesh.material_ids[i / 3]].diffuse[1] * 255),
-                          (unsigned char) (materials[mesh.material_ids[i / 3]].diffuse[2] * 255) };
-            faces.push_back(tmp);
+// Fills f from its corners as projectPoints and transformNormals left
+// them, and culls it if it is off screen. normals and view_pos may be NULL
+// when the shader does not use them.
+static void setup_face(face_t &f, const vec4 *screen, const vec4 *normals,
+                       const vec4 *view_pos, int w, int h, e_shader shading) {
+    for (int k = 0; k < 3; ++k) {
+        f.vert[k] = screen[k];
+        // [x, y, 0, 0]
+        f.pixel_coord[k] = vec4(screen[k][0], screen[k][1], 0, 0);
+        if (normals) { f.normals[k] = normals[k]; }
+        if (view_pos) { f.view_pos[k] = view_pos[k]; }
+    }
+    if ((f.vert[0][2] < 0 && f.vert[1][2] < 0 && f.vert[2][2] < 0) ||
+            (f.vert[0][2] > 1 && f.vert[1][2] > 1 && f.vert[2][2] > 1)) {
+        f.is_renderable = false;
+    }
+    if (f.pixel_coord[0][0] > f.pixel_coord[1][0]) {
+        std::swap(f.pixel_coord[0], f.pixel_coord[1]);
+        std::swap(f.vert[0], f.vert[1]);
+        std::swap(f.view_pos[0], f.view_pos[1]);
+        if (shading != NORM_FLAT) { std::swap(f.normals[0], f.normals[1]); }
+    }
+    if (f.pixel_coord[1][0] > f.pixel_coord[2][0]) {
+        std::swap(f.pixel_coord[1], f.pixel_coord[2]);
+        std::swap(f.vert[1], f.vert[2]);
+        std::swap(f.view_pos[1], f.view_pos[2]);
+        if (shading != NORM_FLAT) { std::swap(f.normals[1], f.normals[2]); }
+    }
+    if (f.pixel_coord[0][0] > f.pixel_coord[1][0]) {
+        std::swap(f.pixel_coord[0], f.pixel_coord[1]);
+        std::swap(f.vert[0], f.vert[1]);
+        std::swap(f.view_pos[0], f.view_pos[1]);
+        if (shading != NORM_FLAT) { std::swap(f.normals[0], f.normals[1]); }
+    }
+    f.bounding_box[0][0] = min(f.pixel_coord[0][0],
+                           min(f.pixel_coord[1][0], f.pixel_coord[2][0]));
+    f.bounding_box[0][1] = min(f.pixel_coord[0][1],
+                           min(f.pixel_coord[1][1], f.pixel_coord[2][1]));
+    f.bounding_box[1][0] = max(f.pixel_coord[0][0],
+                           max(f.pixel_coord[1][0], f.pixel_coord[2][0]));
+    f.bounding_box[1][1] = max(f.pixel_coord[0][1],
+                           max(f.pixel_coord[1][1], f.pixel_coord[2][1]));
+    if (f.bounding_box[0][0] > w || f.bounding_box[0][1] > h ||
+            f.bounding_box[1][0] < 0 || f.bounding_box[1][1] < 0) {
+        f.is_renderable = false;
+    }
+}
+
+// The RANDOM color of face id. Hashing the id instead of drawing from a
+// shared generator gives each face the same color for a seed no matter
+// which faces are culled or what order they are drawn in.
+static pixel_t random_color(unsigned seed, size_t id) {
+    unsigned long long x = ((unsigned long long) seed << 32) ^ id;
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    pixel_t c = { (unsigned char) x, (unsigned char) (x >> 8), (unsigned char) (x >> 16) };
+    return c;
+}
+
+/*
+ * Shaders. draw_faces<S> is instantiated once per shader and the
+ * instance is picked once per render, so the pixel loop has no switch and
+ * each shader's loop is compiled on its own. A shader has four stages,
+ * each called at the rate its inputs change:
+ *
+ *   init(ctx)     once per batch, for constants such as lights
+ *   face(f)       once per face, for constants such as vertex colors
+ *   row(f, s)     once per scanline of the face, for span endpoints
+ *   pixel(p)      once per fragment that passes the depth test
+ *
+ * To add one, derive a struct from shader_base, which has empty init()
+ * and row(), and add a case to draw_faces_for().
+ */
+
+// What shaders can see besides the face being drawn
+typedef struct {
+    const std::vector<tinyobj::material_t> *materials;
+    const lighting_t *lighting;
+    const camera_mat_t *camera;
+} shade_ctx_t;
+
+// Where a face covers one scanline: x0 <= x1 are the crossings and
+// (e[0], e[1]) and (e[2], e[3]) the vertices of the edges crossed there
+typedef struct {
+    float y;
+    float x0, x1;
+    int e[4];
+} span_t;
+
+// A fragment: its column, barycentric coordinates and depth
+typedef struct {
+    int i;
+    double l0, l1, l2;
+    double depth;
+} frag_t;
+
+struct shader_base {
+    void init(const shade_ctx_t &) {}
+    void row(const face_t &, const span_t &) {}
+};
+
+// Maps a view space normal component in [-1, 1] to [0, 255]
+static inline double normal_color(float n) {
+    return (n + 1) * 127.5;
+}
+
+// The face's material color (NONE) or its random color (RANDOM)
+struct color_shader : shader_base {
+    QRgb c;
+    void face(const face_t &f) { c = qRgb(f.color.r, f.color.g, f.color.b); }
+    QRgb pixel(const frag_t &) const { return c; }
+};
+
+struct white_shader : shader_base {
+    void face(const face_t &) {}
+    QRgb pixel(const frag_t &) const { return qRgb(255, 255, 255); }
+};
+
+// The first vertex's normal over the whole face
+struct flat_normal_shader : shader_base {
+    QRgb c;
+    void face(const face_t &f) {
+        c = qRgb((unsigned char) normal_color(f.normals[0][0]),
+                 (unsigned char) normal_color(f.normals[0][1]),
+                 (unsigned char) normal_color(f.normals[0][2]));
+    }
+    QRgb pixel(const frag_t &) const { return c; }
+};
+
+// Vertex normal colors interpolated along the crossed edges and then
+// across the span. With PERSPECTIVE the colors are divided by depth
+// before interpolating and multiplied back per pixel.
+template <bool PERSPECTIVE>
+struct gouraud_shader : shader_base {
+    float r[3], g[3], b[3];
+    float x0, x1;
+    float r1, g1, b1, r2, g2, b2;
+
+    void face(const face_t &f) {
+        for (int k = 0; k < 3; ++k) {
+            pixel_t c = { (unsigned char) normal_color(f.normals[k][0]),
+                          (unsigned char) normal_color(f.normals[k][1]),
+                          (unsigned char) normal_color(f.normals[k][2]) };
+            if (PERSPECTIVE) {
+                r[k] = c.r / f.vert[k][2];
+                g[k] = c.g / f.vert[k][2];
+                b[k] = c.b / f.vert[k][2];
+            } else {
+                r[k] = c.r;
+                g[k] = c.g;
+                b[k] = c.b;
+            }
         }
     }
 
-    for (auto &f : faces) {
-        f.vert[0] = camera->proj * camera->view * f.vert[0];
-        f.vert[1] = camera->proj * camera->view * f.vert[1];
-        f.vert[2] = camera->proj * camera->view * f.vert[2];
-        f.vert[0] /= f.vert[0][3];
-        f.vert[1] /= f.vert[1][3];
-        f.vert[2] /= f.vert[2][3];
-        // [x, y, 0, 0]
-        f.pixel_coord[0] = vec4((f.vert[0][0] + 1) * (w / 2),
-                                (1 - f.vert[0][1]) * (h / 2), 0, 0);
-        f.pixel_coord[1] = vec4((f.vert[1][0] + 1) * (w / 2),
-                                (1 - f.vert[1][1]) * (h / 2), 0, 0);
-        f.pixel_coord[2] = vec4((f.vert[2][0] + 1) * (w / 2),
-                                (1 - f.vert[2][1]) * (h / 2), 0, 0);
-        if ((f.vert[0][2] < 0 && f.vert[1][2] < 0 && f.vert[2][2] < 0) ||
-                (f.vert[0][2] > 1 && f.vert[1][2] > 1 && f.vert[2][2] > 1)) {
-            f.is_renderable = false;
+    void row(const face_t &f, const span_t &s) {
+        const int *e = s.e;
+        float d1 = dist2(f.pixel_coord[e[1]], f.pixel_coord[e[0]]);
+        float d2 = dist2(f.pixel_coord[e[3]], f.pixel_coord[e[2]]);
+        float t1 = dist2(f.pixel_coord[e[0]], vec4(s.x0, s.y, 0, 0)) / d1;
+        float t2 = dist2(f.pixel_coord[e[2]], vec4(s.x1, s.y, 0, 0)) / d2;
+        r1 = lerp(r[e[0]], r[e[1]], t1);
+        g1 = lerp(g[e[0]], g[e[1]], t1);
+        b1 = lerp(b[e[0]], b[e[1]], t1);
+        r2 = lerp(r[e[2]], r[e[3]], t2);
+        g2 = lerp(g[e[2]], g[e[3]], t2);
+        b2 = lerp(b[e[2]], b[e[3]], t2);
+        x0 = s.x0;
+        x1 = s.x1;
+    }
+
+    QRgb pixel(const frag_t &p) const {
+        float t = (p.i - x0) / (x1 - x0);
+        if (PERSPECTIVE) {
+            return qRgb((unsigned char) (p.depth * lerp(r1, r2, t)),
+                        (unsigned char) (p.depth * lerp(g1, g2, t)),
+                        (unsigned char) (p.depth * lerp(b1, b2, t)));
+        }
+        return qRgb((unsigned char) lerp(r1, r2, t),
+                    (unsigned char) lerp(g1, g2, t),
+                    (unsigned char) lerp(b1, b2, t));
+    }
+};
+
+// Vertex normal colors weighted by the barycentric coordinates, divided
+// by depth first with PERSPECTIVE
+template <bool PERSPECTIVE>
+struct bary_shader : shader_base {
+    float r[3], g[3], b[3];
+
+    void face(const face_t &f) {
+        for (int k = 0; k < 3; ++k) {
+            r[k] = normal_color(f.normals[k][0]);
+            g[k] = normal_color(f.normals[k][1]);
+            b[k] = normal_color(f.normals[k][2]);
+            if (PERSPECTIVE) {
+                r[k] = r[k] / f.vert[k][2];
+                g[k] = g[k] / f.vert[k][2];
+                b[k] = b[k] / f.vert[k][2];
+            }
+        }
+    }
+
+    QRgb pixel(const frag_t &p) const {
+        if (PERSPECTIVE) {
+            float r_o = r[0] * p.l0 + r[1] * p.l1 + r[2] * p.l2;
+            float g_o = g[0] * p.l0 + g[1] * p.l1 + g[2] * p.l2;
+            float b_o = b[0] * p.l0 + b[1] * p.l1 + b[2] * p.l2;
+            return qRgb((unsigned char) (r_o * p.depth),
+                        (unsigned char) (g_o * p.depth),
+                        (unsigned char) (b_o * p.depth));
+        }
+        return qRgb((unsigned char) (r[0] * p.l0 + r[1] * p.l1 + r[2] * p.l2),
+                    (unsigned char) (g[0] * p.l0 + g[1] * p.l1 + g[2] * p.l2),
+                    (unsigned char) (b[0] * p.l0 + b[1] * p.l1 + b[2] * p.l2));
+    }
+};
+
+// Blinn-Phong with the face's MTL material: emission + Ka * ambient plus,
+// for each light, Kd * (N.L) + Ks * (N.H)^Ns. Normals and view space
+// positions are interpolated perspective correctly (weighted by 1 / clip
+// w). Lights are moved to view space once in init() and multiplied by the
+// material once per face, so a fragment only does dot products and one
+// pow per lit light.
+struct blinn_phong_shader : shader_base {
+    // A light in view space: the unit vector towards it (directional) or
+    // its position (point)
+    typedef struct {
+        vec4 v;
+        vec4 color;
+        float attenuation;
+        bool point;
+    } view_light_t;
+
+    const std::vector<tinyobj::material_t> *materials;
+    std::vector<view_light_t> lights;
+    vec4 ambient;
+
+    // Per face: the constant term, each light's color times Kd and Ks,
+    // and corner normals and positions divided by clip w
+    vec4 base;
+    std::vector<vec4> diffuse, specular;
+    float shininess;
+    vec4 n_w[3], p_w[3];
+    float inv_w[3];
+    vec4 face_normal;
+
+    void init(const shade_ctx_t &ctx) {
+        materials = ctx.materials;
+        lighting_t defaults;
+        lighting_init(&defaults);
+        const lighting_t *lighting = ctx.lighting ? ctx.lighting : &defaults;
+        ambient = vec4(lighting->ambient[0], lighting->ambient[1], lighting->ambient[2], 0);
+
+        lights.clear();
+        const mat4 &view = ctx.camera->view;
+        for (size_t i = 0; i < lighting->lights.size(); ++i) {
+            const light_t &l = lighting->lights[i];
+            view_light_t vl;
+            vl.point = l.type == LIGHT_POINT;
+            vl.color = vec4(l.r, l.g, l.b, 0);
+            vl.attenuation = l.attenuation;
+            if (vl.point) {
+                vl.v = view * vec4(l.x, l.y, l.z, 1);
+            } else {
+                vl.v = (view * vec4(-l.x, -l.y, -l.z, 0)).normalize();
+            }
+            lights.push_back(vl);
         }
-        if (f.pixel_coord[0][0] > f.pixel_coord[1][0]) {
-            std::swap(f.pixel_coord[0], f.pixel_coord[1]);
-            std::swap(f.vert[0], f.vert[1]);
-            if (shading != NORM_FLAT) { std::swap(f.normals[0], f.normals[1]); }
+        if (lights.empty()) {
+            // The camera looks down +z in view space
+            view_light_t vl = { vec4(0, 0, -1, 0), vec4(1, 1, 1, 0), 0, false };
+            lights.push_back(vl);
         }
-        if (f.pixel_coord[1][0] > f.pixel_coord[2][0]) {
-            std::swap(f.pixel_coord[1], f.pixel_coord[2]);
-            std::swap(f.vert[1], f.vert[2]);
-            if (shading != NORM_FLAT) { std::swap(f.normals[1], f.normals[2]); }
+        diffuse.resize(lights.size());
+        specular.resize(lights.size());
+    }
+
+    static vec4 rgb(const float *c) { return vec4(c[0], c[1], c[2], 0); }
+
+    static vec4 mul(const vec4 &a, const vec4 &b) {
+        return vec4(a[0] * b[0], a[1] * b[1], a[2] * b[2], 0);
+    }
+
+    void face(const face_t &f) {
+        // Faces without a material get a plain white one
+        vec4 ka(1, 1, 1, 0), kd(1, 1, 1, 0), ks, ke;
+        shininess = 1;
+        if (f.material >= 0) {
+            const tinyobj::material_t &m = (*materials)[f.material];
+            ka = rgb(m.ambient);
+            kd = rgb(m.diffuse);
+            ks = rgb(m.specular);
+            ke = rgb(m.emission);
+            shininess = std::max(m.shininess, 1.0f);
         }
-        if (f.pixel_coord[0][0] > f.pixel_coord[1][0]) {
-            std::swap(f.pixel_coord[0], f.pixel_coord[1]);
-            std::swap(f.vert[0], f.vert[1]);
-            if (shading != NORM_FLAT) { std::swap(f.normals[0], f.normals[1]); }
+        base = ke + mul(ka, ambient);
+        for (size_t i = 0; i < lights.size(); ++i) {
+            diffuse[i] = mul(lights[i].color, kd);
+            specular[i] = mul(lights[i].color, ks);
         }
-        f.bounding_box[0][0] = min(f.pixel_coord[0][0],
-                               min(f.pixel_coord[1][0], f.pixel_coord[2][0]));
-        f.bounding_box[0][1] = min(f.pixel_coord[0][1],
-                               min(f.pixel_coord[1][1], f.pixel_coord[2][1]));
-        f.bounding_box[1][0] = max(f.pixel_coord[0][0],
-                               max(f.pixel_coord[1][0], f.pixel_coord[2][0]));
-        f.bounding_box[1][1] = max(f.pixel_coord[0][1],
-                               max(f.pixel_coord[1][1], f.pixel_coord[2][1]));
-        if (f.bounding_box[0][0] > w || f.bounding_box[0][1] > h ||
-                f.bounding_box[1][0] < 0 || f.bounding_box[1][1] < 0) {
-            f.is_renderable = false;
+
+        for (int k = 0; k < 3; ++k) {
+            inv_w[k] = 1 / f.vert[k][3];
+            n_w[k] = f.normals[k] * inv_w[k];
+            p_w[k] = f.view_pos[k] * inv_w[k];
         }
-        if (shading == RANDOM) {
-            f.color = { (unsigned char) ((float) std::rand() / RAND_MAX * 255),
-                        (unsigned char) ((float) std::rand() / RAND_MAX * 255),
-                        (unsigned char) ((float) std::rand() / RAND_MAX * 255) };
-        } else if (shading == NONE) {
+        // Used where the mesh has no normals, facing the camera
+        face_normal = cross(f.view_pos[1] - f.view_pos[0],
+                            f.view_pos[2] - f.view_pos[0]).normalize();
+        if (dot(face_normal, f.view_pos[0]) > 0) { face_normal = face_normal * -1; }
+    }
 
+    QRgb pixel(const frag_t &p) const {
+        float b0 = p.l0 * inv_w[0];
+        float b1 = p.l1 * inv_w[1];
+        float b2 = p.l2 * inv_w[2];
+        float s = 1 / (b0 + b1 + b2);
+        vec4 pos = (p_w[0] * b0 + p_w[1] * b1 + p_w[2] * b2) * s;
+        vec4 n = n_w[0] * b0 + n_w[1] * b1 + n_w[2] * b2;
+        float len = n.length();
+        n = len > 1e-12f ? n / len : face_normal;
+        // The eye is at the origin
+        vec4 v = (pos * -1).normalize();
+
+        vec4 c = base;
+        for (size_t i = 0; i < lights.size(); ++i) {
+            const view_light_t &l = lights[i];
+            vec4 to_light = l.v;
+            float atten = 1;
+            if (l.point) {
+                to_light = l.v - pos;
+                float d2 = dot(to_light, to_light);
+                to_light = to_light / std::sqrt(d2);
+                atten = 1 / (1 + l.attenuation * d2);
+            }
+            float n_l = dot(n, to_light);
+            if (n_l <= 0) { continue; }
+            float n_h = dot(n, (to_light + v).normalize());
+            float spec = n_h > 0 ? std::pow(n_h, shininess) : 0;
+            c += (diffuse[i] * n_l + specular[i] * spec) * atten;
         }
+        return qRgb((unsigned char) (std::min(c[0], 1.0f) * 255),
+                    (unsigned char) (std::min(c[1], 1.0f) * 255),
+                    (unsigned char) (std::min(c[2], 1.0f) * 255));
+    }
+};
+
+// Finds where the edge from vertex a to vertex b, which spans row y,
+// crosses it, appending one or (for a horizontal edge) two x coordinates
+// to xs and the edge's vertices to edges
+static void cross_edge(const face_t &f, int a, int b, float y,
+                       float *xs, int &num_xs, int *edges, int &num_edges) {
+    const vec4 &p = f.pixel_coord[a];
+    const vec4 &q = f.pixel_coord[b];
+    if ((int) p[0] == (int) q[0]) {
+        // vertical line
+        xs[num_xs++] = a == 0 && b == 2 ? q[0] : p[0];
+    } else if ((int) p[1] == (int) q[1]) {
+        xs[num_xs++] = p[0];
+        xs[num_xs++] = q[0];
+    } else {
+        // y = m * X - m * p[0] + p[1]
+        // (y + (m * p[0]) - p[1]) / m = X
+        float m = (q[1] - p[1]) / (q[0] - p[0]);
+        xs[num_xs++] = (y + (m * p[0]) - p[1]) / m;
     }
+    edges[num_edges++] = a;
+    edges[num_edges++] = b;
+}
 
-        // For each row in the output image
-    for (float y = 0.5; y < h; ++y) {
-        // Determine which faces intersect the row
-        for (auto &f : faces) {
-            if (!f.is_renderable) { continue; }
-            if (f.bounding_box[0][1] < y && y < f.bounding_box[1][1]) {
-                // Row will intersect the triangle
-                // Get beginning and ending intersection points
-
-                // Determine if intersects with pixel_coord[0], pixel_coord[1]
-                std::vector<float> intersects; // contains two x coordinates where the current face intersects with the row
-                std::vector<int> edge_intersects; // contains the indices of the vertices that are intersected
-                if (within(y, f.pixel_coord[0][1], f.pixel_coord[1][1])) {
-                    // intersects with pixel[0], pixel[1]
-                    // coordinates already sorted by increasing x
-                    if ((int) f.pixel_coord[0][0] == (int) f.pixel_coord[1][0]) {
-                        // vertical line
-                        intersects.push_back(f.pixel_coord[0][0]);
-                    } else if ((int) f.pixel_coord[0][1] == (int) f.pixel_coord[1][1]) {
-                        intersects.push_back(f.pixel_coord[0][0]);
-                        intersects.push_back(f.pixel_coord[1][0]);
-                    } else {
-                        // regular case, intersection testing
-                        float m = (f.pixel_coord[1][1] - f.pixel_coord[0][1]) /
-                                  (f.pixel_coord[1][0] - f.pixel_coord[0][0]);
-                        // y = m * X - m * pixel_coord[0][0] + pixel_coord[0][1]
-                        // (y + (m * pixel_coord[0][0]) - pixel_coord[0][1]) / m = X
-                        intersects.push_back((y + (m * f.pixel_coord[0][0]) -
-                                                f.pixel_coord[0][1]) / m);
-                    }
-                    edge_intersects.push_back(0);
-                    edge_intersects.push_back(1);
+// Scan converts faces into out with shader S, depth testing against z_buf.
+// Faces are drawn one after another over the rows their bounding box
+// covers; each pixel still sees the faces in batch order, so depth ties
+// resolve as they would row by row.
+template <class S>
+static void draw_faces(const std::vector<face_t> &faces, const shade_ctx_t &ctx,
+                       int w, int h, QImage &out, std::vector<double> &z_buf) {
+    PROFILE_SCOPE(STAGE_RASTER);
+    TRACE_SCOPE("render", "raster");
+    unsigned long long fragments = 0;
+    unsigned long long z_pass = 0;
+    S shader;
+    shader.init(ctx);
+    for (auto &f : faces) {
+        if (!f.is_renderable) { continue; }
+        float top = f.bounding_box[0][1];
+        float bottom = f.bounding_box[1][1];
+        if (!(bottom > 0.5f)) { continue; }
+        shader.face(f);
+
+        // Rows y = k + 0.5 strictly inside the bounding box
+        int k0 = top > 0 ? (int) std::min(top, (float) h) : 0;
+        for (int k = k0; k < h; ++k) {
+            float y = k + 0.5f;
+            if (!(y < bottom)) { break; }
+            if (!(top < y)) { continue; }
+
+            // Coordinates are sorted by increasing x; an edge can add two
+            // crossings when it is horizontal
+            float xs[6];
+            int edges[6];
+            int num_xs = 0;
+            int num_edges = 0;
+            if (within(y, f.pixel_coord[0][1], f.pixel_coord[1][1])) {
+                cross_edge(f, 0, 1, y, xs, num_xs, edges, num_edges);
+            }
+            if (within(y, f.pixel_coord[1][1], f.pixel_coord[2][1])) {
+                cross_edge(f, 1, 2, y, xs, num_xs, edges, num_edges);
+            }
+            if (within(y, f.pixel_coord[0][1], f.pixel_coord[2][1])) {
+                cross_edge(f, 0, 2, y, xs, num_xs, edges, num_edges);
+            }
+            if (num_xs < 2 || num_edges < 4) { continue; }
+
+            span_t s;
+            s.y = y;
+            s.x0 = xs[0];
+            s.x1 = xs[1];
+            s.e[0] = edges[0];
+            s.e[1] = edges[1];
+            s.e[2] = edges[2];
+            s.e[3] = edges[3];
+            if (s.x0 > s.x1) {
+                std::swap(s.x0, s.x1);
+                std::swap(s.e[0], s.e[2]);
+                std::swap(s.e[1], s.e[3]);
+            }
+            shader.row(f, s);
+
+            double x1 = f.pixel_coord[0][0];
+            double x2 = f.pixel_coord[1][0];
+            double x3 = f.pixel_coord[2][0];
+            double y1 = f.pixel_coord[0][1];
+            double y2 = f.pixel_coord[1][1];
+            double y3 = f.pixel_coord[2][1];
+            double inv_z1 = 1 / f.vert[0][2];
+            double inv_z2 = 1 / f.vert[1][2];
+            double inv_z3 = 1 / f.vert[2][2];
+            QRgb *row = (QRgb *) out.scanLine(k);
+            double *z_row = &z_buf[(size_t) k * w];
+            frag_t p;
+            int i0 = s.x0 > 0 ? (int) std::min(s.x0, (float) w) : 0;
+            for (p.i = i0; p.i < w && p.i < s.x1; ++p.i) {
+                // Get barycentric coordinate of pixel
+                double x = p.i;
+                p.l0 = ((y2 - y3) * (x - x3) + (x3 - x2) * (y - y3)) /
+                       ((y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3));
+                p.l1 = ((y3 - y1) * (x - x3) + (x1 - x3) * (y - y3)) /
+                       ((y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3));
+                p.l2 = 1 - p.l0 - p.l1;
+                p.depth = 1 / (inv_z1 * p.l0 + inv_z2 * p.l1 + inv_z3 * p.l2);
+                if (p.depth < z_row[p.i] && within(p.depth, 0, 1)) {
+                    row[p.i] = shader.pixel(p);
+                    z_row[p.i] = p.depth;
+                    z_pass++;
                 }
+            }
+            if (p.i > i0) { fragments += p.i - i0; }
+        }
+    }
+    PROFILE_COUNT(COUNT_FRAGMENTS, fragments);
+    PROFILE_COUNT(COUNT_Z_PASS, z_pass);
+    PROFILE_COUNT(COUNT_Z_FAIL, fragments - z_pass);
+}
 
-                if (within(y, f.pixel_coord[1][1], f.pixel_coord[2][1])) {
-                    if ((int) f.pixel_coord[1][0] == (int) f.pixel_coord[2][0]) {
-                        intersects.push_back(f.pixel_coord[1][0]);
-                    } else if ((int) f.pixel_coord[1][1] == (int) f.pixel_coord[2][1]) {
-                        intersects.push_back(f.pixel_coord[1][0]);
-                        intersects.push_back(f.pixel_coord[2][0]);
-                    } else {
-                        float m = (f.pixel_coord[2][1] - f.pixel_coord[1][1]) /
-                                  (f.pixel_coord[2][0] - f.pixel_coord[1][0]);
-                        intersects.push_back((y + (m * f.pixel_coord[1][0]) -
-                                                f.pixel_coord[1][1]) / m);
-                    }
-                    edge_intersects.push_back(1);
-                    edge_intersects.push_back(2);
-                }
+typedef void (*draw_faces_fn)(const std::vector<face_t> &faces, const shade_ctx_t &ctx,
+                              int w, int h, QImage &out, std::vector<double> &z_buf);
+
+// The draw_faces instance for shading, or NULL if it is not implemented
+static draw_faces_fn draw_faces_for(e_shader shading) {
+    switch (shading) {
+    case NONE:
+    case RANDOM:
+        return draw_faces<color_shader>;
+    case WHITE:
+        return draw_faces<white_shader>;
+    case NORM_FLAT:
+        return draw_faces<flat_normal_shader>;
+    case NORM_GOURAUD:
+        return draw_faces<gouraud_shader<false> >;
+    case NORM_GOURAUD_Z:
+        return draw_faces<gouraud_shader<true> >;
+    case NORM_BARY:
+        return draw_faces<bary_shader<false> >;
+    case NORM_BARY_Z:
+        return draw_faces<bary_shader<true> >;
+    case BLINN_PHONG:
+        return draw_faces<blinn_phong_shader>;
+    default:
+        return NULL;
+    }
+}
 
-                if (within(y, f.pixel_coord[0][1], f.pixel_coord[2][1])) {
-                    if ((int) f.pixel_coord[0][0] == (int) f.pixel_coord[2][0]) {
-                        intersects.push_back(f.pixel_coord[2][0]);
-                    } else if ((int) f.pixel_coord[0][1] == (int) f.pixel_coord[2][1]) {
-                        intersects.push_back(f.pixel_coord[0][0]);
-                        intersects.push_back(f.pixel_coord[2][0]);
-                    } else {
-                        float m = (f.pixel_coord[2][1] - f.pixel_coord[0][1]) /
-                                  (f.pixel_coord[2][0] - f.pixel_coord[0][0]);
-                        intersects.push_back((y + (m * f.pixel_coord[0][0]) -
-                                                f.pixel_coord[0][1]) / m);
-                    }
-                    edge_intersects.push_back(0);
-                    edge_intersects.push_back(2);
-                }
+QImage rasterize_meshes(const std::vector<mesh_view_t> &meshes,
+                        const std::vector<tinyobj::material_t> &materials,
+                        camera_mat_t *camera, int w, int h, e_shader shading,
+                        const lighting_t *lighting, unsigned seed) {
+    TRACE_SCOPE("render", "rasterize_meshes");
 
-                if (intersects[0] > intersects[1]) {
-                    std::swap(intersects[0], intersects[1]);
-                    std::swap(edge_intersects[0], edge_intersects[2]);
-                    std::swap(edge_intersects[1], edge_intersects[3]);
+    // Initialize output image
+    QImage out(w, h, QImage::Format_RGB32);
+    out.fill(qRgb(0, 0, 0));
+
+    draw_faces_fn draw = draw_faces_for(shading);
+    if (!draw) {
+        fprintf(stderr, "error: option not handled\n");
+        return out;
+    }
+
+    shade_ctx_t ctx = { &materials, lighting, camera };
+
+    // Initialize z-buffer
+    std::vector<double> z_buf(w * h, 2);
+
+    // Corners of the faces being set up, transformed RASTER_BATCH faces at
+    // a time: object space xyz in, projected and view space vec4s out
+    bool normals = uses_normals(shading);
+    bool positions = uses_view_pos(shading);
+    mat4 view_proj = camera->proj * camera->view;
+    std::vector<float> pos(9 * RASTER_BATCH);
+    std::vector<float> nrm(normals ? 9 * RASTER_BATCH : 0);
+    std::vector<vec4> screen(3 * RASTER_BATCH);
+    std::vector<vec4> view_nrm(normals ? 3 * RASTER_BATCH : 0);
+    std::vector<vec4> view_pos(positions ? 3 * RASTER_BATCH : 0);
+
+    std::vector<face_t> faces;
+    faces.reserve(RASTER_BATCH);
+    size_t face_id = 0;
+    for (size_t s = 0; s < meshes.size(); ++s) {
+        const mesh_view_t &mesh = meshes[s];
+        size_t num_faces = mesh.num_indices / 3;
+        for (size_t i = 0; i < num_faces; ) {
+            size_t n = std::min(num_faces - i, (size_t) RASTER_BATCH - faces.size());
+            size_t first = faces.size();
+            faces.resize(first + n);
+            {
+                PROFILE_SCOPE(STAGE_TRANSFORM);
+                TRACE_SCOPE("render", "transform");
+                for (size_t j = 0; j < n; ++j) {
+                    gather_face(mesh, materials, i + j, faces[first + j],
+                                &pos[9 * j], normals ? &nrm[9 * j] : NULL);
+                }
+                projectPoints(view_proj, &pos[0], (float *) &screen[0], 3 * n, w, h);
+                if (normals) {
+                    transformNormals(camera->view, &nrm[0], (float *) &view_nrm[0], 3 * n);
                 }
-                // y * h + i
-                double x1 = f.pixel_coord[0][0];
-                double x2 = f.pixel_coord[1][0];
-                double x3 = f.pixel_coord[2][0];
-                double y1 = f.pixel_coord[0][1];
-                double y2 = f.pixel_coord[1][1];
-                double y3 = f.pixel_coord[2][1];
-                for (int i = intersects[0]; i < intersects[1]; ++i) {
-                    if (i < 0 || i > w - 1) { continue; }
-                    // Get barycentric coordinate of pixel
-                    double x = i;
-                    double l0 = ((y2 - y3) * (x - x3) + (x3 - x2) * (y - y3)) /
-                                ((y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3));
-                    double l1 = ((y3 - y1) * (x - x3) + (x1 - x3) * (y - y3)) /
-                                ((y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3));
-                    double l2 = 1 - l0 - l1;
-                    double pix_depth = (1 / f.vert[0][2]) * l0 +
-                                       (1 / f.vert[1][2]) * l1 +
-                                       (1 / f.vert[2][2]) * l2;
-                    pix_depth = 1 / pix_depth;
-                    if (pix_depth < z_buf[y * w + i] && within(pix_depth, 0, 1)) {
-                        switch (shading) {
-                        case NONE:
-                            out.setPixel(x, y - 0.5, qRgb(f.color.r, f.color.g, f.color.b));
-                            break;
-                        case WHITE:
-                            out.setPixel(x, y - 0.5, qRgb(255, 255, 255));
-                            break;
-                        case NORM_FLAT: {
-                            vec4 view_n_1 = camera->view * f.normals[0];
-                            out.setPixel(x, y - 0.5, 
-                                qRgb((unsigned char) ((view_n_1[0] + 1) * 127.5),
-                                     (unsigned char) ((view_n_1[1] + 1) * 127.5),
-                                     (unsigned char) ((view_n_1[2] + 1) * 127.5)));
-                            break;
-                        }
-                        case NORM_GOURAUD: {
-                            vec4 view_n_1 = camera->view * f.normals[0];
-                            vec4 view_n_2 = camera->view * f.normals[1];
-                            vec4 view_n_3 = camera->view * f.normals[2];
-                            pixel_t c[3];
-                            c[0] = { (unsigned char) ((view_n_1[0] + 1) * 127.5),
-                                     (unsigned char) ((view_n_1[1] + 1) * 127.5),
-                                     (unsigned char) ((view_n_1[2] + 1) * 127.5) };
-                            c[1] = { (unsigned char) ((view_n_2[0] + 1) * 127.5),
-                                     (unsigned char) ((view_n_2[1] + 1) * 127.5),
-                                     (unsigned char) ((view_n_2[2] + 1) * 127.5) };
-                            c[2] = { (unsigned char) ((view_n_3[0] + 1) * 127.5),
-                                     (unsigned char) ((view_n_3[1] + 1) * 127.5),
-                                     (unsigned char) ((view_n_3[2] + 1) * 127.5) };
-
-                            float d1 = dist2(f.pixel_coord[edge_intersects[1]], f.pixel_coord[edge_intersects[0]]);
-                            float d2 = dist2(f.pixel_coord[edge_intersects[3]], f.pixel_coord[edge_intersects[2]]);
-                            float r1 = lerp(c[edge_intersects[0]].r,
-                                            c[edge_intersects[1]].r,
-                                            dist2(f.pixel_coord[edge_intersects[0]], vec4(intersects[0], y, 0, 0)) / d1);
-                            float g1 = lerp(c[edge_intersects[0]].g,
-                                            c[edge_intersects[1]].g,
-                                            dist2(f.pixel_coord[edge_intersects[0]], vec4(intersects[0], y, 0, 0)) / d1);
-                            float b1 = lerp(c[edge_intersects[0]].b,
-                                            c[edge_intersects[1]].b,
-                                            dist2(f.pixel_coord[edge_intersects[0]], vec4(intersects[0], y, 0, 0)) / d1);
-                            float r2 = lerp(c[edge_intersects[2]].r,
-                                            c[edge_intersects[3]].r,
-                                            dist2(f.pixel_coord[edge_intersects[2]], vec4(intersects[1], y, 0, 0)) / d2);
-                            float g2 = lerp(c[edge_intersects[2]].g,
-                                            c[edge_intersects[3]].g,
-                                            dist2(f.pixel_coord[edge_intersects[2]], vec4(intersects[1], y, 0, 0)) / d2);
-                            float b2 = lerp(c[edge_intersects[2]].b,
-                                            c[edge_intersects[3]].b,
-                                            dist2(f.pixel_coord[edge_intersects[2]], vec4(intersects[1], y, 0, 0)) / d2);
-                            out.setPixel(x, y - 0.5,
-                                qRgb((unsigned char) lerp(r1, r2, (i - intersects[0]) / (intersects[1] - intersects[0])),
-                                     (unsigned char) lerp(g1, g2, (i - intersects[0]) / (intersects[1] - intersects[0])),
-                                     (unsigned char) lerp(b1, b2, (i - intersects[0]) / (intersects[1] - intersects[0]))));
-                            break;
-                        }
-                        case NORM_BARY: {
-                            vec4 view_n_1 = camera->view * f.normals[0];
-                            vec4 view_n_2 = camera->view * f.normals[1];
-                            vec4 view_n_3 = camera->view * f.normals[2];
-                            float r[3], g[3], b[3];
-                            r[0] = (view_n_1[0] + 1) * 127.5; r[1] = (view_n_2[0] + 1) * 127.5; r[2] = (view_n_3[0] + 1) * 127.5;
-                            g[0] = (view_n_1[1] + 1) * 127.5; g[1] = (view_n_2[1] + 1) * 127.5; g[2] = (view_n_3[1] + 1) * 127.5;
-                            b[0] = (view_n_1[2] + 1) * 127.5; b[1] = (view_n_2[2] + 1) * 127.5; b[2] = (view_n_3[2] + 1) * 127.5;
-                            out.setPixel(x, y - 0.5,
-                                qRgb((unsigned char) (r[0] * l0 + r[1] * l1 + r[2] * l2),
-                                    (unsigned char) (g[0] * l0 + g[1] * l1 + g[2] * l2),
-                                    (unsigned char) (b[0] * l0 + b[1] * l1 + b[2] * l2)));
-                            break;
-                        }
-                        case NORM_GOURAUD_Z: {
-                            vec4 view_n_1 = camera->view * f.normals[0];
-                            vec4 view_n_2 = camera->view * f.normals[1];
-                            vec4 view_n_3 = camera->view * f.normals[2];
-                            pixel_t c[3];
-                            c[0] = { (unsigned char) ((view_n_1[0] + 1) * 127.5),
-                                     (unsigned char) ((view_n_1[1] + 1) * 127.5),
-                                     (unsigned char) ((view_n_1[2] + 1) * 127.5) };
-                            c[1] = { (unsigned char) ((view_n_2[0] + 1) * 127.5),
-                                     (unsigned char) ((view_n_2[1] + 1) * 127.5),
-                                     (unsigned char) ((view_n_2[2] + 1) * 127.5) };
-                            c[2] = { (unsigned char) ((view_n_3[0] + 1) * 127.5),
-                                     (unsigned char) ((view_n_3[1] + 1) * 127.5),
-                                     (unsigned char) ((view_n_3[2] + 1) * 127.5) };
-
-                            float r[3], g[3], b[3];
-                            r[0] = c[0].r / f.vert[0][2]; r[1] = c[1].r / f.vert[1][2]; r[2] = c[2].r / f.vert[2][2];
-                            g[0] = c[0].g / f.vert[0][2]; g[1] = c[1].g / f.vert[1][2]; g[2] = c[2].g / f.vert[2][2];
-                            b[0] = c[0].b / f.vert[0][2]; b[1] = c[1].b / f.vert[1][2]; b[2] = c[2].b / f.vert[2][2];
-
-                            float d1 = dist2(f.pixel_coord[edge_intersects[1]], f.pixel_coord[edge_intersects[0]]);
-                            float d2 = dist2(f.pixel_coord[edge_intersects[3]], f.pixel_coord[edge_intersects[2]]);
-                            float r1 = lerp(r[edge_intersects[0]], r[edge_intersects[1]],
-                                            dist2(f.pixel_coord[edge_intersects[0]], vec4(intersects[0], y, 0, 0)) / d1);
-                            float g1 = lerp(g[edge_intersects[0]], g[edge_intersects[1]],
-                                            dist2(f.pixel_coord[edge_intersects[0]], vec4(intersects[0], y, 0, 0)) / d1);
-                            float b1 = lerp(b[edge_intersects[0]], b[edge_intersects[1]],
-                                            dist2(f.pixel_coord[edge_intersects[0]], vec4(intersects[0], y, 0, 0)) / d1);
-                            float r2 = lerp(r[edge_intersects[2]], r[edge_intersects[3]],
-                                            dist2(f.pixel_coord[edge_intersects[2]], vec4(intersects[1], y, 0, 0)) / d2);
-                            float g2 = lerp(g[edge_intersects[2]], g[edge_intersects[3]],
-                                            dist2(f.pixel_coord[edge_intersects[2]], vec4(intersects[1], y, 0, 0)) / d2);
-                            float b2 = lerp(b[edge_intersects[2]], b[edge_intersects[3]],
-                                            dist2(f.pixel_coord[edge_intersects[2]], vec4(intersects[1], y, 0, 0)) / d2);
-                            out.setPixel(x, y - 0.5,
-                                qRgb((unsigned char) (pix_depth * lerp(r1, r2, (i - intersects[0]) / (intersects[1] - intersects[0]))),
-                                    (unsigned char) (pix_depth * lerp(g1, g2, (i - intersects[0]) / (intersects[1] - intersects[0]))),
-                                    (unsigned char) (pix_depth * lerp(b1, b2, (i - intersects[0]) / (intersects[1] - intersects[0])))));
-                            break;
-                        }
-                        case NORM_BARY_Z: {
-                            vec4 view_n_1 = camera->view * f.normals[0];
-                            vec4 view_n_2 = camera->view * f.normals[1];
-                            vec4 view_n_3 = camera->view * f.normals[2];
-                            float r[3], g[3], b[3];
-                            r[0] = (view_n_1[0] + 1) * 127.5; r[1] = (view_n_2[0] + 1) * 127.5; r[2] = (view_n_3[0] + 1) * 127.5;
-                            g[0] = (view_n_1[1] + 1) * 127.5; g[1] = (view_n_2[1] + 1) * 127.5; g[2] = (view_n_3[1] + 1) * 127.5;
-                            b[0] = (view_n_1[2] + 1) * 127.5; b[1] = (view_n_2[2] + 1) * 127.5; b[2] = (view_n_3[2] + 1) * 127.5;
-                            float r_o = (r[0] / f.vert[0][2]) * l0 +
-                                        (r[1] / f.vert[1][2]) * l1 + 
-                                        (r[2] / f.vert[2][2]) * l2;
-                            float g_o = (g[0] / f.vert[0][2]) * l0 +
-                                        (g[1] / f.vert[1][2]) * l1 + 
-                                        (g[2] / f.vert[2][2]) * l2;
-                            float b_o = (b[0] / f.vert[0][2]) * l0 +
-                                        (b[1] / f.vert[1][2]) * l1 + 
-                                        (b[2] / f.vert[2][2]) * l2;
-                            out.setPixel(x, y - 0.5,
-                                qRgb((unsigned char) (r_o * pix_depth),
-                                    (unsigned char) (g_o * pix_depth),
-                                    (unsigned char) (b_o * pix_depth)));
-                            break;
-                        }
-                        case RANDOM:
-                            out.setPixel(x, y - 0.5, qRgb(f.color.r, f.color.g, f.color.b));
-                            break;
-                        case TEXTURE:
-
-                        default:
-                            fprintf(stderr, "error: option not handled\n");
-                            break;
-                        }
-                        z_buf[y * w + i] = pix_depth;
-                    }
+                if (positions) {
+                    transformPoints(camera->view, &pos[0], (float *) &view_pos[0], 3 * n);
                 }
+            }
 
+            // Keep the faces that survive culling
+            size_t kept = first;
+            {
+                PROFILE_SCOPE(STAGE_SETUP);
+                TRACE_SCOPE("render", "setup");
+                for (size_t j = 0; j < n; ++j) {
+                    face_t &f = faces[first + j];
+                    setup_face(f, &screen[3 * j], normals ? &view_nrm[3 * j] : NULL,
+                               positions ? &view_pos[3 * j] : NULL, w, h, shading);
+                    if (!f.is_renderable) { continue; }
+                    if (shading == RANDOM) { f.color = random_color(seed, face_id + i + j); }
+                    faces[kept++] = f;
+                }
+            }
+            PROFILE_COUNT(COUNT_TRIANGLES, n);
+            PROFILE_COUNT(COUNT_TRIANGLES_DRAWN, kept - first);
+            faces.resize(kept);
+            i += n;
+
+            if (faces.size() == RASTER_BATCH) {
+                draw(faces, ctx, w, h, out, z_buf);
+                faces.clear();
             }
         }
+        face_id += num_faces;
+    }
+    draw(faces, ctx, w, h, out, z_buf);
+
+#ifdef PROFILE_STATS
+    unsigned long long covered = 0;
+    for (size_t i = 0; i < z_buf.size(); ++i) {
+        if (z_buf[i] < 2) { covered++; }
+    }
+    profile_count(COUNT_PIXELS_COVERED, covered);
+#endif
+
+    return out;
+}
+
+QImage rasterize(const char *obj, camera_mat_t *camera, int w, int h, e_shader shading,
+                 int opt_flags, const lighting_t *lighting, unsigned seed) {
+    TRACE_SCOPE("render", "rasterize");
+
+    std::string mtl_path = "../obj/";
+
+    // LOAD OBJ
+    // A valid .meshbin cache is drawn straight from its mapping. Otherwise
+    // the .obj is parsed, which writes the cache, and the fresh cache is
+    // mapped so the parsed copy can be freed before drawing.
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::vector<mesh_view_t> meshes;
+    meshbin_map_t *map = NULL;
+    {
+        PROFILE_SCOPE(STAGE_LOAD);
+        TRACE_SCOPE("render", "load");
+        std::string cache = meshbin_path(obj);
+        meshbin_header_t key;
+        if (meshbin_stamp(obj, mtl_path.c_str(), opt_flags, &key)) {
+            map = meshbin_map(cache.c_str(), &key);
+        }
+        if (!map) {
+            std::string err = load_mesh(obj, mtl_path.c_str(), shapes, materials, opt_flags);
+            if ("" != err) {
+                QMessageBox errorBox;
+                errorBox.setText(".obj file not valid");
+                errorBox.setIcon(QMessageBox::Warning);
+                errorBox.exec();
+                QImage out(w, h, QImage::Format_RGB32);
+                out.fill(qRgb(0, 0, 0));
+                return out;
+            }
+            if ((map = meshbin_map(cache.c_str(), &key))) {
+                std::vector<tinyobj::shape_t>().swap(shapes);
+            }
+        }
+        if (map) {
+            meshes = map->shapes;
+            materials = map->materials;
+        } else {
+            mesh_views(shapes, meshes);
+        }
     }
 
+    QImage out = rasterize_meshes(meshes, materials, camera, w, h, shading, lighting, seed);
+    meshbin_unmap(&map);
     return out;
 
 }
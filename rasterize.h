@@ -1,17 +1,25 @@
+#ifndef __RASTERIZE_H__
+#define __RASTERIZE_H__
+
 #include <QImage>
 #include <iostream>
 
 #include "vec4.h"
 #include "mat4.h"
+#include "image.h"
+#include "meshbin.h"
 
 bool within(float x, float c1, float c2);
 float lerp(float a, float b, float alpha);
 float dist2(vec4 p1, vec4 p2);
 
-typedef struct pixel_t {
-    unsigned char r, g, b;
-} pixel_t;
-
+/*
+ * A triangle ready for scan conversion. After setup, vert holds each
+ * corner as (pixel x, pixel y, NDC depth, clip w) and normals and
+ * view_pos are in view space. view_pos is only filled in for shaders
+ * that light the surface. material indexes the materials the face was
+ * drawn with, or is -1.
+ */
 typedef struct {
     vec4 vert[3];
     vec4 pixel_coord[3];
@@ -19,6 +27,8 @@ typedef struct {
     bool is_renderable = true;
     pixel_t color;
     vec4 normals[3];
+    vec4 view_pos[3];
+    int material;
 } face_t;
 
 typedef struct {
@@ -40,6 +50,64 @@ void write_camera(const char *file, camera_mat_t *cam);
 void camera_init(camera_mat_t *cam);
 
 typedef enum { NONE, WHITE, NORM_FLAT, NORM_GOURAUD, NORM_BARY,
-               NORM_GOURAUD_Z, NORM_BARY_Z, RANDOM, TEXTURE } e_shader;
+               NORM_GOURAUD_Z, NORM_BARY_Z, RANDOM, TEXTURE,
+               BLINN_PHONG } e_shader;
+
+typedef enum { LIGHT_DIRECTIONAL, LIGHT_POINT } e_light;
+
+/*
+ * A light for BLINN_PHONG, in world space. For LIGHT_DIRECTIONAL, x, y
+ * and z are the direction the light travels; for LIGHT_POINT, they are
+ * its position and its intensity falls off as
+ * 1 / (1 + attenuation * d^2). r, g and b are color times intensity.
+ */
+typedef struct {
+    e_light type;
+    float x, y, z;
+    float r, g, b;
+    float attenuation;
+} light_t;
+
+/*
+ * The lights BLINN_PHONG shades with. ambient is scaled by each
+ * material's Ka. With no lights, a white light shines from the camera
+ * along the view direction.
+ */
+typedef struct {
+    float ambient[3];
+    std::vector<light_t> lights;
+} lighting_t;
+
+/*
+ * Sets lighting to a dim ambient term and no lights (so the camera
+ * light is used).
+ */
+void lighting_init(lighting_t *lighting);
+
+/*
+ * Reads lights from file, one per line:
+ *     ambient r g b
+ *     directional x y z r g b
+ *     point x y z r g b [attenuation]
+ * Blank lines and lines starting with # are skipped. If the file cannot
+ * be read or a line is malformed, 0 is returned and lighting is left
+ * unchanged.
+ */
+int load_lighting(const char *file, lighting_t *lighting);
+
+/*
+ * Renders obj through its .meshbin cache. opt_flags (MESH_OPT_*) are the
+ * reorderings applied when the cache is built. lighting is only used by
+ * BLINN_PHONG; NULL means lighting_init's defaults. seed picks the RANDOM
+ * colors: the same seed, mesh and opt_flags give the same image.
+ */
+QImage rasterize(const char *obj, camera_mat_t *camera, int w, int h, e_shader shading,
+                 int opt_flags = 0, const lighting_t *lighting = NULL,
+                 unsigned seed = 0);
+
+QImage rasterize_meshes(const std::vector<mesh_view_t> &meshes,
+                        const std::vector<tinyobj::material_t> &materials,
+                        camera_mat_t *camera, int w, int h, e_shader shading,
+                        const lighting_t *lighting = NULL, unsigned seed = 0);
 
-QImage rasterize(const char *obj, camera_mat_t *camera, int w, int h, e_shader shading);
\ No newline at end of file
+#endif
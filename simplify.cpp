@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+
+#include "simplify.h"
+
+/*
+ * Quadrics. A quadric is the symmetric 4x4 matrix sum of p p^T over the
+ * planes p = (a, b, c, d) of the faces around a vertex; v^T Q v is then
+ * the sum of squared distances from v to those planes.
+ */
+
+typedef struct {
+    double a[10]; // aa ab ac ad bb bc bd cc cd dd
+} quadric_t;
+
+static void quadric_zero(quadric_t *q) {
+    memset(q->a, 0, sizeof(q->a));
+}
+
+static void quadric_add_plane(quadric_t *q, double a, double b, double c, double d, double w) {
+    q->a[0] += w * a * a; q->a[1] += w * a * b; q->a[2] += w * a * c; q->a[3] += w * a * d;
+    q->a[4] += w * b * b; q->a[5] += w * b * c; q->a[6] += w * b * d;
+    q->a[7] += w * c * c; q->a[8] += w * c * d;
+    q->a[9] += w * d * d;
+}
+
+static void quadric_add(quadric_t *q, const quadric_t *r) {
+    for (int i = 0; i < 10; ++i) { q->a[i] += r->a[i]; }
+}
+
+static double quadric_error(const quadric_t *q, const double *v) {
+    const double *a = q->a;
+    double x = v[0], y = v[1], z = v[2];
+    return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x +
+           a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y +
+           a[7] * z * z + 2 * a[8] * z + a[9];
+}
+
+// Solves for the point minimizing q. Returns 0 if the system is singular.
+static int quadric_optimum(const quadric_t *q, double *v) {
+    const double *a = q->a;
+    double m00 = a[0], m01 = a[1], m02 = a[2];
+    double m11 = a[4], m12 = a[5], m22 = a[7];
+    double det = m00 * (m11 * m22 - m12 * m12) - m01 * (m01 * m22 - m12 * m02) +
+                 m02 * (m01 * m12 - m11 * m02);
+    if (std::fabs(det) < 1e-12) { return 0; }
+    double b0 = -a[3], b1 = -a[6], b2 = -a[8];
+    // Cramer's rule
+    v[0] = (b0 * (m11 * m22 - m12 * m12) - m01 * (b1 * m22 - m12 * b2) +
+            m02 * (b1 * m12 - m11 * b2)) / det;
+    v[1] = (m00 * (b1 * m22 - m12 * b2) - b0 * (m01 * m22 - m12 * m02) +
+            m02 * (m01 * b2 - b1 * m02)) / det;
+    v[2] = (m00 * (m11 * b2 - b1 * m12) - m01 * (m01 * b2 - b1 * m02) +
+            b0 * (m01 * m12 - m11 * m02)) / det;
+    return 1;
+}
+
+static void sub3(const double *a, const double *b, double *out) {
+    out[0] = a[0] - b[0]; out[1] = a[1] - b[1]; out[2] = a[2] - b[2];
+}
+
+static void cross3(const double *a, const double *b, double *out) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static double dot3(const double *a, const double *b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/*
+ * Edge collapse
+ */
+
+typedef struct {
+    double cost;
+    int u, v;
+    unsigned int stamp; // version[u] + version[v] when pushed
+    double pos[3];
+} collapse_t;
+
+struct collapse_greater {
+    bool operator()(const collapse_t &a, const collapse_t &b) const {
+        return a.cost > b.cost;
+    }
+};
+
+typedef struct {
+    std::vector<double> pos;            // 3 per vertex
+    std::vector<int> tris;              // 3 per face
+    std::vector<int> material;          // per face
+    std::vector<char> face_dead;
+    std::vector<char> vert_dead;
+    std::vector<quadric_t> quadric;
+    std::vector<unsigned int> version;
+    std::vector<std::vector<int> > vert_faces;
+    std::priority_queue<collapse_t, std::vector<collapse_t>, collapse_greater> heap;
+} qem_mesh_t;
+
+static void plan_collapse(qem_mesh_t *m, int u, int v) {
+    quadric_t q = m->quadric[u];
+    quadric_add(&q, &m->quadric[v]);
+
+    collapse_t c;
+    c.u = u;
+    c.v = v;
+    c.stamp = m->version[u] + m->version[v];
+    if (!quadric_optimum(&q, c.pos)) {
+        // Flat or degenerate neighbourhood: try the ends and the middle
+        const double *pu = &m->pos[3 * u], *pv = &m->pos[3 * v];
+        double mid[3] = { (pu[0] + pv[0]) / 2, (pu[1] + pv[1]) / 2, (pu[2] + pv[2]) / 2 };
+        const double *cand[3] = { pu, pv, mid };
+        double best = 0;
+        for (int i = 0; i < 3; ++i) {
+            double e = quadric_error(&q, cand[i]);
+            if (i == 0 || e < best) {
+                best = e;
+                memcpy(c.pos, cand[i], sizeof(c.pos));
+            }
+        }
+    }
+    c.cost = std::max(0.0, quadric_error(&q, c.pos));
+    m->heap.push(c);
+}
+
+// True if moving u and v to pos would flip a face around either of them
+static int collapse_flips(const qem_mesh_t *m, int u, int v, const double *pos) {
+    for (int k = 0; k < 2; ++k) {
+        int a = k == 0 ? u : v;
+        const std::vector<int> &faces = m->vert_faces[a];
+        for (size_t i = 0; i < faces.size(); ++i) {
+            int f = faces[i];
+            if (m->face_dead[f]) { continue; }
+            const int *t = &m->tris[3 * f];
+            if ((t[0] == u || t[1] == u || t[2] == u) &&
+                    (t[0] == v || t[1] == v || t[2] == v)) {
+                continue; // removed by the collapse
+            }
+            double p[3][3], q[3][3];
+            for (int j = 0; j < 3; ++j) {
+                memcpy(p[j], &m->pos[3 * t[j]], sizeof(p[j]));
+                memcpy(q[j], t[j] == a ? pos : p[j], sizeof(q[j]));
+            }
+            double e1[3], e2[3], n0[3], n1[3];
+            sub3(p[1], p[0], e1); sub3(p[2], p[0], e2); cross3(e1, e2, n0);
+            sub3(q[1], q[0], e1); sub3(q[2], q[0], e2); cross3(e1, e2, n1);
+            if (dot3(n0, n1) <= 0) { return 1; }
+        }
+    }
+    return 0;
+}
+
+static void collapse(qem_mesh_t *m, const collapse_t &c, size_t *live_faces) {
+    int u = c.u, v = c.v;
+    memcpy(&m->pos[3 * u], c.pos, sizeof(c.pos));
+    quadric_add(&m->quadric[u], &m->quadric[v]);
+    m->vert_dead[v] = 1;
+    ++m->version[u];
+    ++m->version[v];
+
+    // Move v's faces to u and drop the ones that degenerate
+    std::vector<int> &uf = m->vert_faces[u];
+    std::vector<int> &vf = m->vert_faces[v];
+    for (size_t i = 0; i < vf.size(); ++i) {
+        int f = vf[i];
+        if (m->face_dead[f]) { continue; }
+        int *t = &m->tris[3 * f];
+        for (int j = 0; j < 3; ++j) {
+            if (t[j] == v) { t[j] = u; }
+        }
+        if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2]) {
+            m->face_dead[f] = 1;
+            --*live_faces;
+        } else {
+            uf.push_back(f);
+        }
+    }
+    std::vector<int>().swap(vf);
+
+    // Compact u's list and re-plan the edges around it
+    size_t n = 0;
+    std::vector<int> neighbours;
+    for (size_t i = 0; i < uf.size(); ++i) {
+        int f = uf[i];
+        if (m->face_dead[f]) { continue; }
+        if (std::find(uf.begin(), uf.begin() + n, f) != uf.begin() + n) { continue; }
+        uf[n++] = f;
+        const int *t = &m->tris[3 * f];
+        for (int j = 0; j < 3; ++j) {
+            if (t[j] != u) { neighbours.push_back(t[j]); }
+        }
+    }
+    uf.resize(n);
+    std::sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+    for (size_t i = 0; i < neighbours.size(); ++i) {
+        plan_collapse(m, u, neighbours[i]);
+    }
+}
+
+// Exact position match, for welding
+typedef struct {
+    float x, y, z;
+} pos_key_t;
+
+struct pos_key_ops {
+    size_t operator()(const pos_key_t &k) const {
+        // -0.0f and 0.0f compare equal, so they must hash alike; adding
+        // 0.0f turns the one into the other
+        float c[3] = { k.x + 0.0f, k.y + 0.0f, k.z + 0.0f };
+        unsigned int b[3];
+        memcpy(b, c, sizeof(b));
+        size_t h = b[0];
+        h = h * 0x9E3779B1u ^ b[1];
+        h = h * 0x9E3779B1u ^ b[2];
+        return h;
+    }
+    bool operator()(const pos_key_t &a, const pos_key_t &b) const {
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+};
+
+void simplify_shape(const tinyobj::shape_t &in, float ratio, tinyobj::shape_t &out) {
+    const tinyobj::mesh_t &mesh = in.mesh;
+    qem_mesh_t m;
+
+    // Weld vertices that share a position
+    std::unordered_map<pos_key_t, int, pos_key_ops, pos_key_ops> welded;
+    std::vector<int> remap(mesh.positions.size() / 3);
+    for (size_t i = 0; i < remap.size(); ++i) {
+        pos_key_t k = { mesh.positions[3 * i], mesh.positions[3 * i + 1],
+                        mesh.positions[3 * i + 2] };
+        std::pair<std::unordered_map<pos_key_t, int, pos_key_ops, pos_key_ops>::iterator, bool> r =
+                welded.insert(std::make_pair(k, (int) m.pos.size() / 3));
+        if (r.second) {
+            m.pos.push_back(k.x);
+            m.pos.push_back(k.y);
+            m.pos.push_back(k.z);
+        }
+        remap[i] = r.first->second;
+    }
+    size_t num_verts = m.pos.size() / 3;
+
+    size_t num_faces = 0;
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        int a = remap[mesh.indices[i]], b = remap[mesh.indices[i + 1]], c = remap[mesh.indices[i + 2]];
+        if (a == b || b == c || a == c) { continue; }
+        m.tris.push_back(a);
+        m.tris.push_back(b);
+        m.tris.push_back(c);
+        m.material.push_back(i / 3 < mesh.material_ids.size() ? mesh.material_ids[i / 3] : -1);
+        ++num_faces;
+    }
+
+    m.face_dead.assign(num_faces, 0);
+    m.vert_dead.assign(num_verts, 0);
+    m.version.assign(num_verts, 0);
+    m.vert_faces.resize(num_verts);
+    m.quadric.resize(num_verts);
+    for (size_t i = 0; i < num_verts; ++i) { quadric_zero(&m.quadric[i]); }
+
+    // Face plane quadrics, plus a stiff perpendicular plane along open
+    // edges so borders do not shrink
+    std::unordered_map<unsigned long long, int> edge_count;
+    for (size_t f = 0; f < num_faces; ++f) {
+        const int *t = &m.tris[3 * f];
+        double e1[3], e2[3], n[3];
+        sub3(&m.pos[3 * t[1]], &m.pos[3 * t[0]], e1);
+        sub3(&m.pos[3 * t[2]], &m.pos[3 * t[0]], e2);
+        cross3(e1, e2, n);
+        double len = std::sqrt(dot3(n, n));
+        if (len > 0) {
+            double area = len / 2;
+            n[0] /= len; n[1] /= len; n[2] /= len;
+            double d = -dot3(n, &m.pos[3 * t[0]]);
+            for (int j = 0; j < 3; ++j) {
+                quadric_add_plane(&m.quadric[t[j]], n[0], n[1], n[2], d, area);
+            }
+        }
+        for (int j = 0; j < 3; ++j) {
+            m.vert_faces[t[j]].push_back((int) f);
+            unsigned int a = t[j], b = t[(j + 1) % 3];
+            unsigned long long key = a < b ? ((unsigned long long) a << 32) | b
+                                           : ((unsigned long long) b << 32) | a;
+            ++edge_count[key];
+        }
+    }
+    for (size_t f = 0; f < num_faces; ++f) {
+        const int *t = &m.tris[3 * f];
+        double e1[3], e2[3], n[3];
+        sub3(&m.pos[3 * t[1]], &m.pos[3 * t[0]], e1);
+        sub3(&m.pos[3 * t[2]], &m.pos[3 * t[0]], e2);
+        cross3(e1, e2, n);
+        for (int j = 0; j < 3; ++j) {
+            unsigned int a = t[j], b = t[(j + 1) % 3];
+            unsigned long long key = a < b ? ((unsigned long long) a << 32) | b
+                                           : ((unsigned long long) b << 32) | a;
+            if (edge_count[key] != 1) { continue; }
+            double e[3], p[3];
+            sub3(&m.pos[3 * b], &m.pos[3 * a], e);
+            cross3(e, n, p);
+            double len = std::sqrt(dot3(p, p));
+            if (len == 0) { continue; }
+            p[0] /= len; p[1] /= len; p[2] /= len;
+            double d = -dot3(p, &m.pos[3 * a]);
+            double w = 1000 * dot3(e, e);
+            quadric_add_plane(&m.quadric[a], p[0], p[1], p[2], d, w);
+            quadric_add_plane(&m.quadric[b], p[0], p[1], p[2], d, w);
+        }
+    }
+
+    for (std::unordered_map<unsigned long long, int>::const_iterator it = edge_count.begin();
+            it != edge_count.end(); ++it) {
+        plan_collapse(&m, (int) (it->first >> 32), (int) (it->first & 0xffffffffu));
+    }
+
+    size_t live = num_faces;
+    size_t target = (size_t) std::max(1.0f, std::ceil(num_faces * ratio));
+    while (live > target && !m.heap.empty()) {
+        collapse_t c = m.heap.top();
+        m.heap.pop();
+        if (m.vert_dead[c.u] || m.vert_dead[c.v] ||
+                c.stamp != m.version[c.u] + m.version[c.v]) {
+            continue; // stale
+        }
+        if (collapse_flips(&m, c.u, c.v, c.pos)) { continue; }
+        collapse(&m, c, &live);
+    }
+
+    // Compact and recompute smooth normals
+    out = tinyobj::shape_t();
+    out.name = in.name;
+    tinyobj::mesh_t &om = out.mesh;
+    std::vector<int> index(num_verts, -1);
+    for (size_t f = 0; f < num_faces; ++f) {
+        if (m.face_dead[f]) { continue; }
+        for (int j = 0; j < 3; ++j) {
+            int v = m.tris[3 * f + j];
+            if (index[v] < 0) {
+                index[v] = (int) om.positions.size() / 3;
+                om.positions.push_back((float) m.pos[3 * v]);
+                om.positions.push_back((float) m.pos[3 * v + 1]);
+                om.positions.push_back((float) m.pos[3 * v + 2]);
+            }
+            om.indices.push_back(index[v]);
+        }
+        om.material_ids.push_back(m.material[f]);
+    }
+    om.normals.assign(om.positions.size(), 0);
+    for (size_t i = 0; i < om.indices.size(); i += 3) {
+        double p[3][3], e1[3], e2[3], n[3];
+        for (int j = 0; j < 3; ++j) {
+            for (int k = 0; k < 3; ++k) { p[j][k] = om.positions[3 * om.indices[i + j] + k]; }
+        }
+        sub3(p[1], p[0], e1);
+        sub3(p[2], p[0], e2);
+        cross3(e1, e2, n); // area weighted
+        for (int j = 0; j < 3; ++j) {
+            for (int k = 0; k < 3; ++k) { om.normals[3 * om.indices[i + j] + k] += (float) n[k]; }
+        }
+    }
+    for (size_t i = 0; i < om.normals.size(); i += 3) {
+        float *n = &om.normals[i];
+        float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (len > 0) { n[0] /= len; n[1] /= len; n[2] /= len; }
+    }
+}
+
+void build_lod_chain(const std::vector<tinyobj::shape_t> &shapes,
+                     const std::vector<tinyobj::material_t> &materials,
+                     const float *ratios, int num_ratios, lod_chain_t *chain) {
+    chain->levels.clear();
+    chain->materials = materials;
+    chain->full_triangles = 0;
+    for (int k = 0; k < 3; ++k) {
+        chain->bbox_min[k] = HUGE_VALF;
+        chain->bbox_max[k] = -HUGE_VALF;
+    }
+    for (size_t s = 0; s < shapes.size(); ++s) {
+        const tinyobj::mesh_t &mesh = shapes[s].mesh;
+        chain->full_triangles += mesh.indices.size() / 3;
+        for (size_t i = 0; i < mesh.positions.size(); ++i) {
+            chain->bbox_min[i % 3] = std::min(chain->bbox_min[i % 3], mesh.positions[i]);
+            chain->bbox_max[i % 3] = std::max(chain->bbox_max[i % 3], mesh.positions[i]);
+        }
+    }
+
+    // Each level is simplified from the previous one, which is much
+    // cheaper than starting from the full mesh every time
+    chain->levels.resize(num_ratios);
+    for (int l = 0; l < num_ratios; ++l) {
+        lod_level_t &level = chain->levels[l];
+        const std::vector<tinyobj::shape_t> &src = l == 0 ? shapes : chain->levels[l - 1].shapes;
+        float step = l == 0 ? ratios[0] : ratios[l] / ratios[l - 1];
+        level.ratio = ratios[l];
+        level.num_triangles = 0;
+        level.shapes.resize(src.size());
+        for (size_t s = 0; s < src.size(); ++s) {
+            simplify_shape(src[s], step, level.shapes[s]);
+            level.num_triangles += level.shapes[s].mesh.indices.size() / 3;
+        }
+    }
+}
+
+int lod_select(const lod_chain_t *chain, camera_mat_t *camera, int w, int h,
+               float pixels_per_tri) {
+    if (chain->levels.empty() || chain->full_triangles == 0) { return -1; }
+
+    // Screen area of the projected bounding box, clamped to the screen
+    float x0 = HUGE_VALF, y0 = HUGE_VALF, x1 = -HUGE_VALF, y1 = -HUGE_VALF;
+    for (int i = 0; i < 8; ++i) {
+        vec4 corner(i & 1 ? chain->bbox_max[0] : chain->bbox_min[0],
+                    i & 2 ? chain->bbox_max[1] : chain->bbox_min[1],
+                    i & 4 ? chain->bbox_max[2] : chain->bbox_min[2], 1);
+        vec4 p = camera->proj * camera->view * corner;
+        if (p[3] != 0) { p /= p[3]; }
+        float px = (p[0] + 1) * (w / 2), py = (1 - p[1]) * (h / 2);
+        x0 = std::min(x0, px); x1 = std::max(x1, px);
+        y0 = std::min(y0, py); y1 = std::max(y1, py);
+    }
+    x0 = std::max(x0, 0.0f); y0 = std::max(y0, 0.0f);
+    x1 = std::min(x1, (float) w); y1 = std::min(y1, (float) h);
+    float area = std::max(0.0f, x1 - x0) * std::max(0.0f, y1 - y0);
+
+    size_t wanted = (size_t) (area / pixels_per_tri);
+    int pick = -1;
+    for (size_t l = 0; l < chain->levels.size(); ++l) {
+        if (chain->levels[l].num_triangles >= wanted) { pick = (int) l; }
+    }
+    return pick;
+}
+
+/*
+ * Export
+ */
+
+int write_obj(const char *fname, const std::vector<tinyobj::shape_t> &shapes,
+              const std::vector<tinyobj::material_t> &materials) {
+    if (!fname) {
+        fprintf(stderr, "error: illegal argument\n");
+        return 0;
+    }
+    FILE *f = fopen(fname, "w");
+    if (!f) {
+        fprintf(stderr, "error: could not open file %s\n", fname);
+        return 0;
+    }
+
+    if (!materials.empty()) {
+        std::string mtl(fname);
+        size_t dot = mtl.rfind('.');
+        size_t slash = mtl.find_last_of("/\\");
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+            mtl.erase(dot);
+        }
+        mtl += ".mtl";
+        FILE *mf = fopen(mtl.c_str(), "w");
+        if (mf) {
+            for (size_t i = 0; i < materials.size(); ++i) {
+                const tinyobj::material_t &m = materials[i];
+                fprintf(mf, "newmtl %s\n", m.name.c_str());
+                fprintf(mf, "Ka %g %g %g\n", m.ambient[0], m.ambient[1], m.ambient[2]);
+                fprintf(mf, "Kd %g %g %g\n", m.diffuse[0], m.diffuse[1], m.diffuse[2]);
+                fprintf(mf, "Ks %g %g %g\n", m.specular[0], m.specular[1], m.specular[2]);
+                fprintf(mf, "Ns %g\nd %g\nillum %d\n\n", m.shininess, m.dissolve, m.illum);
+            }
+            fclose(mf);
+            std::string base = slash == std::string::npos ? mtl : mtl.substr(slash + 1);
+            fprintf(f, "mtllib %s\n", base.c_str());
+        }
+    }
+
+    size_t offset = 1;
+    for (size_t s = 0; s < shapes.size(); ++s) {
+        const tinyobj::mesh_t &mesh = shapes[s].mesh;
+        size_t n = mesh.positions.size() / 3;
+        bool normals = mesh.normals.size() == mesh.positions.size();
+        fprintf(f, "o %s\n", shapes[s].name.empty() ? "shape" : shapes[s].name.c_str());
+        for (size_t i = 0; i < n; ++i) {
+            fprintf(f, "v %.9g %.9g %.9g\n", mesh.positions[3 * i],
+                    mesh.positions[3 * i + 1], mesh.positions[3 * i + 2]);
+        }
+        if (normals) {
+            for (size_t i = 0; i < n; ++i) {
+                fprintf(f, "vn %.9g %.9g %.9g\n", mesh.normals[3 * i],
+                        mesh.normals[3 * i + 1], mesh.normals[3 * i + 2]);
+            }
+        }
+        int material = -2;
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            int id = i / 3 < mesh.material_ids.size() ? mesh.material_ids[i / 3] : -1;
+            if (id != material && id >= 0 && (size_t) id < materials.size()) {
+                fprintf(f, "usemtl %s\n", materials[id].name.c_str());
+            }
+            material = id;
+            size_t a = mesh.indices[i] + offset, b = mesh.indices[i + 1] + offset,
+                   c = mesh.indices[i + 2] + offset;
+            if (normals) {
+                fprintf(f, "f %zu//%zu %zu//%zu %zu//%zu\n", a, a, b, b, c, c);
+            } else {
+                fprintf(f, "f %zu %zu %zu\n", a, b, c);
+            }
+        }
+        offset += n;
+    }
+
+    int ok = !ferror(f);
+    if (fclose(f) != 0) { ok = 0; }
+    if (!ok) { fprintf(stderr, "error: could not write %s\n", fname); }
+    return ok;
+}
@@ -0,0 +1,64 @@
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include <string>
+#include <vector>
+
+#include "tiny_obj_loader.h"
+#include "rasterize.h"
+
+/*
+ * One simplified copy of a mesh. ratio is the fraction of the original
+ * triangles it was asked to keep.
+ */
+typedef struct lod_level_t {
+    float ratio;
+    size_t num_triangles;
+    std::vector<tinyobj::shape_t> shapes;
+} lod_level_t;
+
+/*
+ * Simplified copies of a mesh, finest first. The full mesh itself is not
+ * kept; full_triangles and the bounding box describe it.
+ */
+typedef struct lod_chain_t {
+    std::vector<lod_level_t> levels;
+    std::vector<tinyobj::material_t> materials;
+    size_t full_triangles;
+    float bbox_min[3], bbox_max[3];
+} lod_chain_t;
+
+/*
+ * Simplifies in to about ratio of its triangles by quadric error metric
+ * edge collapse (Garland and Heckbert 1997). Vertices that share a
+ * position are welded first so seams do not open. Per-face material ids
+ * are kept; normals are recomputed and texture coordinates are dropped.
+ */
+void simplify_shape(const tinyobj::shape_t &in, float ratio, tinyobj::shape_t &out);
+
+/*
+ * Builds chain from shapes, one level per entry of ratios, which should
+ * be decreasing.
+ */
+void build_lod_chain(const std::vector<tinyobj::shape_t> &shapes,
+                     const std::vector<tinyobj::material_t> &materials,
+                     const float *ratios, int num_ratios, lod_chain_t *chain);
+
+/*
+ * Picks the coarsest level that still has one triangle for every
+ * pixels_per_tri pixels the mesh's bounding box covers on a w by h
+ * screen. Returns -1 if even the finest level is too coarse, meaning the
+ * full mesh should be drawn.
+ */
+int lod_select(const lod_chain_t *chain, camera_mat_t *camera, int w, int h,
+               float pixels_per_tri);
+
+/*
+ * Writes shapes as a Wavefront .obj with positions, normals and faces.
+ * If materials is not empty, they are written to the .mtl next to fname
+ * and referenced from it. If the write is unsuccessful, 0 is returned.
+ */
+int write_obj(const char *fname, const std::vector<tinyobj::shape_t> &shapes,
+              const std::vector<tinyobj::material_t> &materials);
+
+#endif
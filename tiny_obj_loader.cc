@@ -5,6 +5,8 @@
 //
 
 //
+// version 0.9.10: Memory-map the file and parse it on several threads.
+//                 Exact fast path for float parsing.
 // version 0.9.9: Replace atof() with custom parser.
 // version 0.9.8: Fix multi-materials(per-face material ID).
 // version 0.9.7: Support multi-materials(per-face material ID) per
@@ -31,8 +33,20 @@
 #include <map>
 #include <fstream>
 #include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "tiny_obj_loader.h"
+#include "trace.h"
 
 namespace tinyobj {
 
@@ -43,17 +57,6 @@ struct vertex_index {
   vertex_index(int vidx, int vtidx, int vnidx)
       : v_idx(vidx), vt_idx(vtidx), vn_idx(vnidx){};
 };
-// for std::map
-static inline bool operator<(const vertex_index &a, const vertex_index &b) {
-  if (a.v_idx != b.v_idx)
-    return (a.v_idx < b.v_idx);
-  if (a.vn_idx != b.vn_idx)
-    return (a.vn_idx < b.vn_idx);
-  if (a.vt_idx != b.vt_idx)
-    return (a.vt_idx < b.vt_idx);
-
-  return false;
-}
 
 struct obj_shape {
   std::vector<float> v;
@@ -91,6 +94,13 @@ static inline int parseInt(const char *&token) {
 }
 
 
+// Powers of ten that are exactly representable as a double.
+static const double kExactPow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static inline bool isDigit(const char c) { return c >= '0' && c <= '9'; }
+
 // Tries to parse a floating point number located at s.
 //
 // s_end should be a location in the string where reading should absolutely
@@ -107,8 +117,10 @@ static inline int parseInt(const char *&token) {
 //  Valid strings are for example:
 //   -0	 +3.1417e+2  -0.0E-3  1.0324  -1.41   11e2
 //
-// If the parsing is a success, result is set to the parsed value and true 
-// is returned.
+// If the parsing is a success, result is set to the parsed value and true
+// is returned. The result is exact whenever the decimal has at most 19
+// significant digits and a decimal exponent within +-22, without calling
+// pow() per number.
 //
 // The function is greedy and will parse until any of the following happens:
 //  - a non-conforming character is encountered.
@@ -118,121 +130,99 @@ static inline int parseInt(const char *&token) {
 //  - s >= s_end.
 //  - parse failure.
 // 
-static bool tryParseDouble(const char *s, const char *s_end, double *result)
-{
-	if (s >= s_end)
-	{
-		return false;
-	}
-
-	double mantissa = 0.0;
-	// This exponent is base 2 rather than 10.
-	// However the exponent we parse is supposed to be one of ten,
-	// thus we must take care to convert the exponent/and or the 
-	// mantissa to a * 2^E, where a is the mantissa and E is the
-	// exponent.
-	// To get the final double we will use ldexp, it requires the
-	// exponent to be in base 2.
-	int exponent = 0;
-
-	// NOTE: THESE MUST BE DECLARED HERE SINCE WE ARE NOT ALLOWED
-	// TO JUMP OVER DEFINITIONS.
-	char sign = '+';
-	char exp_sign = '+';
-	char const *curr = s;
-
-	// How many characters were read in a loop. 
-	int read = 0;
-	// Tells whether a loop terminated due to reaching s_end.
-	bool end_not_reached = false;
-
-	/*
-		BEGIN PARSING.
-	*/
-
-	// Find out what sign we've got.
-	if (*curr == '+' || *curr == '-')
-	{
-		sign = *curr;
-		curr++;
-	}
-	else if (isdigit(*curr)) { /* Pass through. */ }
-	else
-	{
-		goto fail;
-	}
-
-	// Read the integer part.
-	while ((end_not_reached = (curr != s_end)) && isdigit(*curr))
-	{
-		mantissa *= 10;
-		mantissa += static_cast<int>(*curr - 0x30);
-		curr++;	read++;
-	}
-
-	// We must make sure we actually got something.
-	if (read == 0)
-		goto fail;
-	// We allow numbers of form "#", "###" etc.
-	if (!end_not_reached)
-		goto assemble;
-
-	// Read the decimal part.
-	if (*curr == '.')
-	{
-		curr++;
-		read = 1;
-		while ((end_not_reached = (curr != s_end)) && isdigit(*curr))
-		{
-			// NOTE: Don't use powf here, it will absolutely murder precision.
-			mantissa += static_cast<int>(*curr - 0x30) * pow(10, -read);
-			read++; curr++;
-		}
-	}
-	else if (*curr == 'e' || *curr == 'E') {}
-	else
-	{
-		goto assemble;
-	}
-
-	if (!end_not_reached)
-		goto assemble;
-
-	// Read the exponent part.
-	if (*curr == 'e' || *curr == 'E')
-	{
-		curr++;
-		// Figure out if a sign is present and if it is.
-		if ((end_not_reached = (curr != s_end)) && (*curr == '+' || *curr == '-'))
-		{
-			exp_sign = *curr;
-			curr++;
-		}
-		else if (isdigit(*curr)) { /* Pass through. */ }
-		else
-		{
-			// Empty E is not allowed.
-			goto fail;
-		}
-
-		read = 0;
-		while ((end_not_reached = (curr != s_end)) && isdigit(*curr))
-		{
-			exponent *= 10;
-			exponent += static_cast<int>(*curr - 0x30);
-			curr++;	read++;
-		}
-		exponent *= (exp_sign == '+'? 1 : -1);
-		if (read == 0)
-			goto fail;
-	}
-
-assemble:
-	*result = (sign == '+'? 1 : -1) * ldexp(mantissa * pow(5, exponent), exponent);
-	return true;
-fail:
-	return false;
+static bool tryParseDouble(const char *s, const char *s_end, double *result) {
+  if (s >= s_end) {
+    return false;
+  }
+
+  const char *curr = s;
+  bool negative = false;
+  if (*curr == '+' || *curr == '-') {
+    negative = (*curr == '-');
+    curr++;
+  }
+
+  // Up to 19 significant digits fit in the integer mantissa. The value is
+  // mantissa * 10^exponent.
+  unsigned long long mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool truncated = false;
+
+  int read = 0;
+  while (curr != s_end && isDigit(*curr)) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + static_cast<unsigned>(*curr - '0');
+      if (mantissa != 0)
+        digits++;
+    } else {
+      exponent++;
+      truncated = true;
+    }
+    curr++;
+    read++;
+  }
+
+  // We must make sure we actually got something.
+  if (read == 0)
+    return false;
+
+  // Read the decimal part.
+  if (curr != s_end && *curr == '.') {
+    curr++;
+    while (curr != s_end && isDigit(*curr)) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + static_cast<unsigned>(*curr - '0');
+        if (mantissa != 0)
+          digits++;
+        exponent--;
+      } else {
+        truncated = true;
+      }
+      curr++;
+    }
+  }
+
+  // Read the exponent part.
+  if (curr != s_end && (*curr == 'e' || *curr == 'E')) {
+    curr++;
+    bool exp_negative = false;
+    if (curr != s_end && (*curr == '+' || *curr == '-')) {
+      exp_negative = (*curr == '-');
+      curr++;
+    }
+    // Empty E is not allowed.
+    if (curr == s_end || !isDigit(*curr))
+      return false;
+    int e = 0;
+    while (curr != s_end && isDigit(*curr)) {
+      if (e < 100000)
+        e = e * 10 + (*curr - '0');
+      curr++;
+    }
+    exponent += exp_negative ? -e : e;
+  }
+
+  double value;
+  if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 &&
+      exponent <= 22) {
+    // Both operands are exact, so one correctly rounded operation gives the
+    // correctly rounded result. This covers practically every OBJ number.
+    value = static_cast<double>(mantissa);
+    value = exponent < 0 ? value / kExactPow10[-exponent]
+                         : value * kExactPow10[exponent];
+  } else {
+    // Rare: long mantissas or large exponents. Not always the nearest
+    // double, but far more precise than the float we return. strtod is not
+    // used because it follows the locale's decimal point.
+    value = static_cast<double>(static_cast<long double>(mantissa) *
+                                powl(10.0L, exponent));
+  }
+
+  *result = negative ? -value : value;
+  return true;
 }
+
 static inline float parseFloat(const char *&token) {
   token += strspn(token, " \t");
 #ifdef TINY_OBJ_LOADER_OLD_FLOAT_PARSER
@@ -261,12 +251,37 @@ static inline void parseFloat3(float &x, float &y, float &z,
   z = parseFloat(token);
 }
 
+// atoi() without the locale lookups. Skips leading spaces and tabs.
+static inline int parseIndex(const char *token) {
+  token += strspn(token, " \t");
+  bool negative = false;
+  if (*token == '+' || *token == '-') {
+    negative = (*token == '-');
+    token++;
+  }
+  int i = 0;
+  while (isDigit(*token)) {
+    i = i * 10 + (*token - '0');
+    token++;
+  }
+  return negative ? -i : i;
+}
+
+// Relative (negative) indices are resolved against the counts passed in.
+// The components that were relative are flagged in `relative` so callers
+// parsing part of a file can rebase them later.
+enum { kRelativeV = 1, kRelativeVt = 2, kRelativeVn = 4 };
+
 // Parse triples: i, i/j/k, i//k, i/j
 static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
-                                int vtsize) {
+                                int vtsize, int &relative) {
   vertex_index vi(-1);
+  relative = 0;
 
-  vi.v_idx = fixIndex(atoi(token), vsize);
+  int idx = parseIndex(token);
+  vi.v_idx = fixIndex(idx, vsize);
+  if (idx < 0)
+    relative |= kRelativeV;
   token += strcspn(token, "/ \t\r");
   if (token[0] != '/') {
     return vi;
@@ -276,13 +291,19 @@ static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
   // i//k
   if (token[0] == '/') {
     token++;
-    vi.vn_idx = fixIndex(atoi(token), vnsize);
+    idx = parseIndex(token);
+    vi.vn_idx = fixIndex(idx, vnsize);
+    if (idx < 0)
+      relative |= kRelativeVn;
     token += strcspn(token, "/ \t\r");
     return vi;
   }
 
   // i/j/k or i/j
-  vi.vt_idx = fixIndex(atoi(token), vtsize);
+  idx = parseIndex(token);
+  vi.vt_idx = fixIndex(idx, vtsize);
+  if (idx < 0)
+    relative |= kRelativeVt;
   token += strcspn(token, "/ \t\r");
   if (token[0] != '/') {
     return vi;
@@ -290,23 +311,124 @@ static vertex_index parseTriple(const char *&token, int vsize, int vnsize,
 
   // i/j/k
   token++; // skip '/'
-  vi.vn_idx = fixIndex(atoi(token), vnsize);
+  idx = parseIndex(token);
+  vi.vn_idx = fixIndex(idx, vnsize);
+  if (idx < 0)
+    relative |= kRelativeVn;
   token += strcspn(token, "/ \t\r");
   return vi;
 }
 
+// Maps each distinct vertex_index of a face group to its output vertex.
+// Open addressing with linear probing; clear() is O(1) because slots are
+// only valid when their generation matches the table's.
+class VertexCache {
+public:
+  VertexCache() : count(0), mask(0), generation(1) {}
+
+  // Sizes the table for n keys without rehashing.
+  void reserve(size_t n) {
+    size_t capacity = 16;
+    while (capacity * kMaxLoadNum < n * kMaxLoadDen)
+      capacity *= 2;
+    if (capacity > slots.size())
+      rehash(capacity);
+  }
+
+  // Returns the slot value for key, inserting `value` if it is not present.
+  // `inserted` tells which happened.
+  unsigned int findOrInsert(const vertex_index &key, unsigned int value,
+                            bool &inserted) {
+    if ((count + 1) * kMaxLoadDen > slots.size() * kMaxLoadNum)
+      rehash(slots.empty() ? 16 : slots.size() * 2);
+
+    size_t i = hash(key) & mask;
+    for (;;) {
+      slot &s = slots[i];
+      if (s.generation != generation) {
+        s.key = key;
+        s.value = value;
+        s.generation = generation;
+        count++;
+        inserted = true;
+        return value;
+      }
+      if (s.key.v_idx == key.v_idx && s.key.vt_idx == key.vt_idx &&
+          s.key.vn_idx == key.vn_idx) {
+        inserted = false;
+        return s.value;
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+  void clear() {
+    count = 0;
+    if (++generation == 0) {
+      // Wrapped around; stale slots could look current again.
+      for (size_t i = 0; i < slots.size(); i++)
+        slots[i].generation = 0;
+      generation = 1;
+    }
+  }
+
+private:
+  // Keep the load factor at or below 1/2.
+  static const size_t kMaxLoadNum = 1;
+  static const size_t kMaxLoadDen = 2;
+
+  struct slot {
+    vertex_index key;
+    unsigned int value;
+    unsigned int generation;
+  };
+
+  static inline size_t hash(const vertex_index &k) {
+    unsigned long long h = static_cast<unsigned int>(k.v_idx);
+    h = h * 0x9E3779B97F4A7C15ULL ^ static_cast<unsigned int>(k.vt_idx);
+    h = h * 0x9E3779B97F4A7C15ULL ^ static_cast<unsigned int>(k.vn_idx);
+    h *= 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<slot> old;
+    old.swap(slots);
+    slot empty;
+    empty.generation = 0;
+    slots.assign(capacity, empty);
+    mask = capacity - 1;
+    unsigned int old_generation = generation;
+    generation = 1;
+    count = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i].generation == old_generation) {
+        bool inserted;
+        findOrInsert(old[i].key, old[i].value, inserted);
+      }
+    }
+  }
+
+  std::vector<slot> slots;
+  size_t count;
+  size_t mask;
+  unsigned int generation;
+};
+
 static unsigned int
-updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
+updateVertex(VertexCache &vertexCache,
              std::vector<float> &positions, std::vector<float> &normals,
              std::vector<float> &texcoords,
              const std::vector<float> &in_positions,
              const std::vector<float> &in_normals,
              const std::vector<float> &in_texcoords, const vertex_index &i) {
-  const std::map<vertex_index, unsigned int>::iterator it = vertexCache.find(i);
+  bool inserted;
+  unsigned int idx = vertexCache.findOrInsert(
+      i, static_cast<unsigned int>(positions.size() / 3), inserted);
 
-  if (it != vertexCache.end()) {
+  if (!inserted) {
     // found cache
-    return it->second;
+    return idx;
   }
 
   assert(in_positions.size() > (unsigned int)(3 * i.v_idx + 2));
@@ -326,9 +448,6 @@ updateVertex(std::map<vertex_index, unsigned int> &vertexCache,
     texcoords.push_back(in_texcoords[2 * i.vt_idx + 1]);
   }
 
-  unsigned int idx = static_cast<unsigned int>(positions.size() / 3 - 1);
-  vertexCache[i] = idx;
-
   return idx;
 }
 
@@ -352,47 +471,60 @@ void InitMaterial(material_t &material) {
   material.unknown_parameter.clear();
 }
 
+// A run of consecutive faces in the flattened corner array. Face k has
+// num_verts[k] corners, stored one after another starting at corners.
+struct face_run {
+  const vertex_index *corners;
+  const int *num_verts;
+  size_t num_faces;
+};
+
 static bool exportFaceGroupToShape(
-    shape_t &shape, std::map<vertex_index, unsigned int> vertexCache,
+    shape_t &shape, VertexCache &vertexCache,
     const std::vector<float> &in_positions,
     const std::vector<float> &in_normals,
     const std::vector<float> &in_texcoords,
-    const std::vector<std::vector<vertex_index> > &faceGroup,
+    const std::vector<face_run> &faceGroup,
     const int material_id, const std::string &name, bool clearCache) {
   if (faceGroup.empty()) {
     return false;
   }
 
   // Flatten vertices and indices
-  for (size_t i = 0; i < faceGroup.size(); i++) {
-    const std::vector<vertex_index> &face = faceGroup[i];
-
-    vertex_index i0 = face[0];
-    vertex_index i1(-1);
-    vertex_index i2 = face[1];
-
-    size_t npolys = face.size();
-
-    // Polygon -> triangle fan conversion
-    for (size_t k = 2; k < npolys; k++) {
-      i1 = i2;
-      i2 = face[k];
-
-      unsigned int v0 = updateVertex(
-          vertexCache, shape.mesh.positions, shape.mesh.normals,
-          shape.mesh.texcoords, in_positions, in_normals, in_texcoords, i0);
-      unsigned int v1 = updateVertex(
-          vertexCache, shape.mesh.positions, shape.mesh.normals,
-          shape.mesh.texcoords, in_positions, in_normals, in_texcoords, i1);
-      unsigned int v2 = updateVertex(
-          vertexCache, shape.mesh.positions, shape.mesh.normals,
-          shape.mesh.texcoords, in_positions, in_normals, in_texcoords, i2);
-
-      shape.mesh.indices.push_back(v0);
-      shape.mesh.indices.push_back(v1);
-      shape.mesh.indices.push_back(v2);
+  for (size_t r = 0; r < faceGroup.size(); r++) {
+    const face_run &run = faceGroup[r];
+    const vertex_index *face = run.corners;
+
+    for (size_t i = 0; i < run.num_faces; i++) {
+      vertex_index i0 = face[0];
+      vertex_index i1(-1);
+      vertex_index i2 = face[1];
+
+      size_t npolys = static_cast<size_t>(run.num_verts[i]);
+
+      // Polygon -> triangle fan conversion
+      for (size_t k = 2; k < npolys; k++) {
+        i1 = i2;
+        i2 = face[k];
+
+        unsigned int v0 = updateVertex(
+            vertexCache, shape.mesh.positions, shape.mesh.normals,
+            shape.mesh.texcoords, in_positions, in_normals, in_texcoords, i0);
+        unsigned int v1 = updateVertex(
+            vertexCache, shape.mesh.positions, shape.mesh.normals,
+            shape.mesh.texcoords, in_positions, in_normals, in_texcoords, i1);
+        unsigned int v2 = updateVertex(
+            vertexCache, shape.mesh.positions, shape.mesh.normals,
+            shape.mesh.texcoords, in_positions, in_normals, in_texcoords, i2);
+
+        shape.mesh.indices.push_back(v0);
+        shape.mesh.indices.push_back(v1);
+        shape.mesh.indices.push_back(v2);
+
+        shape.mesh.material_ids.push_back(material_id);
+      }
 
-      shape.mesh.material_ids.push_back(material_id);
+      face += npolys;
     }
   }
 
@@ -620,16 +752,77 @@ std::string MaterialFileReader::operator()(const std::string &matId,
   return LoadMtl(matMap, materials, matIStream);
 }
 
+// Read-only view of a whole file: memory-mapped where the platform
+// supports it, otherwise read into memory.
+class MappedFile {
+public:
+  MappedFile() : data(NULL), size(0), base(NULL) {}
+  ~MappedFile() {
+#ifndef _WIN32
+    if (base)
+      munmap(base, size);
+#endif
+  }
+
+  bool open(const char *filename) {
+#ifndef _WIN32
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size > 0) {
+      void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        return false;
+      }
+      base = p;
+      data = static_cast<const char *>(p);
+#ifdef MADV_SEQUENTIAL
+      madvise(p, size, MADV_SEQUENTIAL);
+#endif
+    }
+    close(fd);
+    return true;
+#else
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs)
+      return false;
+    buf.assign(std::istreambuf_iterator<char>(ifs),
+               std::istreambuf_iterator<char>());
+    data = buf.empty() ? NULL : &buf[0];
+    size = buf.size();
+    return true;
+#endif
+  }
+
+  const char *data;
+  size_t size;
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  void *base;
+  std::vector<char> buf;
+};
+
 std::string LoadObj(std::vector<shape_t> &shapes,
                     std::vector<material_t> &materials, // [output]
                     const char *filename, const char *mtl_basepath) {
+  TRACE_SCOPE("io", "LoadObj");
 
   shapes.clear();
 
   std::stringstream err;
 
-  std::ifstream ifs(filename);
-  if (!ifs) {
+  MappedFile file;
+  if (!file.open(filename)) {
     err << "Cannot open file [" << filename << "]" << std::endl;
     return err.str();
   }
@@ -640,54 +833,73 @@ std::string LoadObj(std::vector<shape_t> &shapes,
   }
   MaterialFileReader matFileReader(basePath);
 
-  return LoadObj(shapes, materials, ifs, matFileReader);
+  return LoadObj(shapes, materials, file.data, file.size, matFileReader);
 }
 
 std::string LoadObj(std::vector<shape_t> &shapes,
                     std::vector<material_t> &materials, // [output]
                     std::istream &inStream, MaterialReader &readMatFn) {
-  std::stringstream err;
+  std::string text((std::istreambuf_iterator<char>(inStream)),
+                   std::istreambuf_iterator<char>());
+  return LoadObj(shapes, materials, text.data(), text.size(), readMatFn);
+}
+
+// Everything parsed from one newline-aligned slice of the file. Corner
+// indices are zero-based and absolute, except the components listed in
+// `fixups`: those were relative and are only correct once the number of
+// v/vn/vt lines in the preceding chunks is added.
+struct obj_chunk {
+  enum command_type { FACES, USEMTL, MTLLIB, GROUP, OBJECT };
+
+  struct command {
+    command_type type;
+    size_t face_begin, face_end; // FACES: faces [face_begin, face_end)
+    size_t corner_begin;         // FACES: first corner of face_begin
+    std::string name;            // everything else
+  };
+
+  struct fixup {
+    size_t corner;
+    int relative; // kRelativeV | kRelativeVt | kRelativeVn
+  };
 
   std::vector<float> v;
   std::vector<float> vn;
   std::vector<float> vt;
-  std::vector<std::vector<vertex_index> > faceGroup;
-  std::string name;
+  std::vector<vertex_index> corners;
+  std::vector<int> num_verts;
+  std::vector<command> commands;
+  std::vector<fixup> fixups;
+};
 
-  // material
-  std::map<std::string, int> material_map;
-  std::map<vertex_index, unsigned int> vertexCache;
-  int material = -1;
+// First whitespace-delimited word of token, like sscanf("%s").
+static inline std::string parseName(const char *token) {
+  return parseString(token);
+}
 
-  shape_t shape;
+static void parseChunk(const char *begin, const char *end, obj_chunk &chunk) {
+  TRACE_SCOPE("mesh", "obj parse chunk");
+  std::string linebuf;
+  const char *p = begin;
 
-  int maxchars = 8192;             // Alloc enough size.
-  std::vector<char> buf(maxchars); // Alloc enough size.
-  while (inStream.peek() != -1) {
-    inStream.getline(&buf[0], maxchars);
+  while (p < end) {
+    const char *eol =
+        static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+    if (!eol)
+      eol = end;
 
-    std::string linebuf(&buf[0]);
+    // The parse helpers expect a NUL-terminated line without the newline.
+    linebuf.assign(p, eol);
+    p = eol + 1;
 
-    // Trim newline '\r\n' or '\n'
-    if (linebuf.size() > 0) {
-      if (linebuf[linebuf.size() - 1] == '\n')
-        linebuf.erase(linebuf.size() - 1);
-    }
-    if (linebuf.size() > 0) {
-      if (linebuf[linebuf.size() - 1] == '\r')
-        linebuf.erase(linebuf.size() - 1);
-    }
-
-    // Skip if empty line.
-    if (linebuf.empty()) {
-      continue;
-    }
+    // Trim '\r'
+    if (linebuf.size() > 0 && linebuf[linebuf.size() - 1] == '\r')
+      linebuf.erase(linebuf.size() - 1);
 
     // Skip leading space.
     const char *token = linebuf.c_str();
     token += strspn(token, " \t");
 
-    assert(token);
     if (token[0] == '\0')
       continue; // empty line
 
@@ -699,9 +911,9 @@ std::string LoadObj(std::vector<shape_t> &shapes,
       token += 2;
       float x, y, z;
       parseFloat3(x, y, z, token);
-      v.push_back(x);
-      v.push_back(y);
-      v.push_back(z);
+      chunk.v.push_back(x);
+      chunk.v.push_back(y);
+      chunk.v.push_back(z);
       continue;
     }
 
@@ -710,9 +922,9 @@ std::string LoadObj(std::vector<shape_t> &shapes,
       token += 3;
       float x, y, z;
       parseFloat3(x, y, z, token);
-      vn.push_back(x);
-      vn.push_back(y);
-      vn.push_back(z);
+      chunk.vn.push_back(x);
+      chunk.vn.push_back(y);
+      chunk.vn.push_back(z);
       continue;
     }
 
@@ -721,8 +933,8 @@ std::string LoadObj(std::vector<shape_t> &shapes,
       token += 3;
       float x, y;
       parseFloat2(x, y, token);
-      vt.push_back(x);
-      vt.push_back(y);
+      chunk.vt.push_back(x);
+      chunk.vt.push_back(y);
       continue;
     }
 
@@ -731,129 +943,240 @@ std::string LoadObj(std::vector<shape_t> &shapes,
       token += 2;
       token += strspn(token, " \t");
 
-      std::vector<vertex_index> face;
+      size_t corner_begin = chunk.corners.size();
+      size_t fixup_begin = chunk.fixups.size();
       while (!isNewLine(token[0])) {
-        vertex_index vi =
-            parseTriple(token, static_cast<int>(v.size() / 3), static_cast<int>(vn.size() / 3), static_cast<int>(vt.size() / 2));
-        face.push_back(vi);
+        int relative;
+        vertex_index vi = parseTriple(
+            token, static_cast<int>(chunk.v.size() / 3),
+            static_cast<int>(chunk.vn.size() / 3),
+            static_cast<int>(chunk.vt.size() / 2), relative);
+        if (relative) {
+          obj_chunk::fixup f = {chunk.corners.size(), relative};
+          chunk.fixups.push_back(f);
+        }
+        chunk.corners.push_back(vi);
         size_t n = strspn(token, " \t\r");
         token += n;
       }
 
-      faceGroup.push_back(face);
+      size_t npolys = chunk.corners.size() - corner_begin;
+      if (npolys < 3) {
+        // Nothing to triangulate
+        chunk.corners.resize(corner_begin);
+        chunk.fixups.resize(fixup_begin);
+        continue;
+      }
+
+      if (chunk.commands.empty() ||
+          chunk.commands.back().type != obj_chunk::FACES) {
+        obj_chunk::command c;
+        c.type = obj_chunk::FACES;
+        c.face_begin = c.face_end = chunk.num_verts.size();
+        c.corner_begin = corner_begin;
+        chunk.commands.push_back(c);
+      }
+      chunk.num_verts.push_back(static_cast<int>(npolys));
+      chunk.commands.back().face_end++;
 
       continue;
     }
 
+    obj_chunk::command c;
+    c.face_begin = c.face_end = c.corner_begin = 0;
+
     // use mtl
     if ((0 == strncmp(token, "usemtl", 6)) && isSpace((token[6]))) {
-
-      char namebuf[4096];
-      token += 7;
-#ifdef _MSC_VER
-      sscanf_s(token, "%s", namebuf);
-#else
-      sscanf(token, "%s", namebuf);
-#endif
-
-      // Create face group per material.
-      bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
-      if (ret) {
-        faceGroup.clear();
-      }
-
-      if (material_map.find(namebuf) != material_map.end()) {
-        material = material_map[namebuf];
-      } else {
-        // { error!! material not found }
-        material = -1;
-      }
-
+      c.type = obj_chunk::USEMTL;
+      c.name = parseName(token + 7);
+      chunk.commands.push_back(c);
       continue;
     }
 
     // load mtl
     if ((0 == strncmp(token, "mtllib", 6)) && isSpace((token[6]))) {
-      char namebuf[4096];
-      token += 7;
-#ifdef _MSC_VER
-      sscanf_s(token, "%s", namebuf);
-#else
-      sscanf(token, "%s", namebuf);
-#endif
-
-      std::string err_mtl = readMatFn(namebuf, materials, material_map);
-      if (!err_mtl.empty()) {
-        faceGroup.clear(); // for safety
-        return err_mtl;
-      }
-
+      c.type = obj_chunk::MTLLIB;
+      c.name = parseName(token + 7);
+      chunk.commands.push_back(c);
       continue;
     }
 
     // group name
     if (token[0] == 'g' && isSpace((token[1]))) {
+      // Only the first name is kept; the 'g' itself is skipped.
+      c.type = obj_chunk::GROUP;
+      c.name = parseName(token + 2);
+      chunk.commands.push_back(c);
+      continue;
+    }
 
-      // flush previous face group.
-      bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
-      if (ret) {
-        shapes.push_back(shape);
-      }
+    // object name
+    if (token[0] == 'o' && isSpace((token[1]))) {
+      // @todo { multiple object name? }
+      c.type = obj_chunk::OBJECT;
+      c.name = parseName(token + 2);
+      chunk.commands.push_back(c);
+      continue;
+    }
 
-      shape = shape_t();
+    // Ignore unknown command.
+  }
+}
 
-      // material = -1;
-      faceGroup.clear();
+// Chunks smaller than this are not worth a thread.
+static const size_t kMinChunkSize = 1 << 20;
 
-      std::vector<std::string> names;
-      while (!isNewLine(token[0])) {
-        std::string str = parseString(token);
-        names.push_back(str);
-        token += strspn(token, " \t\r"); // skip tag
-      }
+std::string LoadObj(std::vector<shape_t> &shapes,
+                    std::vector<material_t> &materials, // [output]
+                    const char *buf, size_t len, MaterialReader &readMatFn,
+                    int num_threads) {
+  std::stringstream err;
 
-      assert(names.size() > 0);
+  if (num_threads <= 0)
+    num_threads = static_cast<int>(std::thread::hardware_concurrency());
+  size_t num_chunks = std::min(static_cast<size_t>(std::max(num_threads, 1)),
+                               std::max(len / kMinChunkSize, size_t(1)));
+
+  // Split at newline boundaries, so no line straddles two chunks.
+  std::vector<size_t> bounds(num_chunks + 1, len);
+  bounds[0] = 0;
+  for (size_t i = 1; i < num_chunks; i++) {
+    size_t b = std::max(len / num_chunks * i, bounds[i - 1]);
+    const void *nl = b < len ? memchr(buf + b, '\n', len - b) : NULL;
+    bounds[i] = nl ? static_cast<size_t>(static_cast<const char *>(nl) - buf) + 1
+                   : len;
+  }
 
-      // names[0] must be 'g', so skip the 0th element.
-      if (names.size() > 1) {
-        name = names[1];
-      } else {
-        name = "";
-      }
+  std::vector<obj_chunk> chunks(num_chunks);
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_chunks; i++) {
+    workers.push_back(std::thread([&, i]() {
+      trace_thread_name("obj parser");
+      parseChunk(buf + bounds[i], buf + bounds[i + 1], chunks[i]);
+    }));
+  }
+  parseChunk(buf + bounds[0], buf + bounds[1], chunks[0]);
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
 
-      continue;
+  // Merge the attribute arrays and rebase relative indices.
+  TRACE_SCOPE("mesh", "obj merge");
+  size_t nv = 0, nvn = 0, nvt = 0;
+  for (size_t i = 0; i < num_chunks; i++) {
+    nv += chunks[i].v.size();
+    nvn += chunks[i].vn.size();
+    nvt += chunks[i].vt.size();
+  }
+  std::vector<float> v;
+  std::vector<float> vn;
+  std::vector<float> vt;
+  v.reserve(nv);
+  vn.reserve(nvn);
+  vt.reserve(nvt);
+  for (size_t i = 0; i < num_chunks; i++) {
+    obj_chunk &chunk = chunks[i];
+    int v_off = static_cast<int>(v.size() / 3);
+    int vn_off = static_cast<int>(vn.size() / 3);
+    int vt_off = static_cast<int>(vt.size() / 2);
+    for (size_t k = 0; k < chunk.fixups.size(); k++) {
+      vertex_index &vi = chunk.corners[chunk.fixups[k].corner];
+      int relative = chunk.fixups[k].relative;
+      if (relative & kRelativeV)
+        vi.v_idx += v_off;
+      if (relative & kRelativeVn)
+        vi.vn_idx += vn_off;
+      if (relative & kRelativeVt)
+        vi.vt_idx += vt_off;
     }
+    v.insert(v.end(), chunk.v.begin(), chunk.v.end());
+    vn.insert(vn.end(), chunk.vn.begin(), chunk.vn.end());
+    vt.insert(vt.end(), chunk.vt.begin(), chunk.vt.end());
+    std::vector<float>().swap(chunk.v);
+    std::vector<float>().swap(chunk.vn);
+    std::vector<float>().swap(chunk.vt);
+  }
 
-    // object name
-    if (token[0] == 'o' && isSpace((token[1]))) {
+  VertexCache vertexCache;
+
+  // A closed triangle mesh has about one distinct corner per two faces,
+  // plus seams, so the face count is a comfortable size for the dedup
+  // table. It still grows if a group needs more.
+  size_t nfaces = 0;
+  for (size_t i = 0; i < num_chunks; i++) {
+    nfaces += chunks[i].num_verts.size();
+  }
+  vertexCache.reserve(nfaces);
+
+  // Replay the commands in file order.
+  std::vector<face_run> faceGroup;
+  std::string name;
+
+  // material
+  std::map<std::string, int> material_map;
+  int material = -1;
 
-      // flush previous face group.
-      bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
-                                        faceGroup, material, name, true);
-      if (ret) {
-        shapes.push_back(shape);
+  shape_t shape;
+
+  for (size_t i = 0; i < num_chunks; i++) {
+    const obj_chunk &chunk = chunks[i];
+    for (size_t j = 0; j < chunk.commands.size(); j++) {
+      const obj_chunk::command &c = chunk.commands[j];
+
+      switch (c.type) {
+      case obj_chunk::FACES: {
+        face_run run = {&chunk.corners[c.corner_begin],
+                        &chunk.num_verts[c.face_begin],
+                        c.face_end - c.face_begin};
+        faceGroup.push_back(run);
+        break;
       }
 
-      // material = -1;
-      faceGroup.clear();
-      shape = shape_t();
+      case obj_chunk::USEMTL: {
+        // Create face group per material.
+        bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
+                                          faceGroup, material, name, true);
+        if (ret) {
+          faceGroup.clear();
+        }
+
+        if (material_map.find(c.name) != material_map.end()) {
+          material = material_map[c.name];
+        } else {
+          // { error!! material not found }
+          material = -1;
+        }
+        break;
+      }
 
-      // @todo { multiple object name? }
-      char namebuf[4096];
-      token += 2;
-#ifdef _MSC_VER
-      sscanf_s(token, "%s", namebuf);
-#else
-      sscanf(token, "%s", namebuf);
-#endif
-      name = std::string(namebuf);
+      case obj_chunk::MTLLIB: {
+        std::string err_mtl = readMatFn(c.name, materials, material_map);
+        if (!err_mtl.empty()) {
+          faceGroup.clear(); // for safety
+          return err_mtl;
+        }
+        break;
+      }
 
-      continue;
-    }
+      case obj_chunk::GROUP:
+      case obj_chunk::OBJECT: {
+        // flush previous face group.
+        bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt,
+                                          faceGroup, material, name, true);
+        if (ret) {
+          shapes.push_back(shape);
+        }
 
-    // Ignore unknown command.
+        shape = shape_t();
+
+        // material = -1;
+        faceGroup.clear();
+
+        name = c.name;
+        break;
+      }
+      }
+    }
   }
 
   bool ret = exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup,
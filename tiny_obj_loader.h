@@ -70,6 +70,7 @@ private:
 };
 
 /// Loads .obj from a file.
+/// The file is memory-mapped and parsed on all hardware threads.
 /// 'shapes' will be filled with parsed shape data
 /// The function returns error string.
 /// Returns empty string when loading .obj success.
@@ -85,6 +86,15 @@ std::string LoadObj(std::vector<shape_t> &shapes,       // [output]
                     std::vector<material_t> &materials, // [output]
                     std::istream &inStream, MaterialReader &readMatFn);
 
+/// Loads object from 'len' bytes of .obj text at 'buf'.
+/// The text is split at line boundaries and parsed on 'num_threads'
+/// threads; 0 uses std::thread::hardware_concurrency().
+/// Returns empty string when loading .obj success.
+std::string LoadObj(std::vector<shape_t> &shapes,       // [output]
+                    std::vector<material_t> &materials, // [output]
+                    const char *buf, size_t len, MaterialReader &readMatFn,
+                    int num_threads = 0);
+
 /// Loads materials into std::map
 /// Returns an empty string if successful
 std::string LoadMtl(std::map<std::string, int> &material_map,
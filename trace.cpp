@@ -0,0 +1,201 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+typedef struct {
+    const char *cat;
+    const char *name;
+    long long ts;       // ns since the clock's epoch
+    long long dur;      // ns
+    int tid;
+} trace_event_t;
+
+/*
+ * One thread's events. Only the owning thread writes; head counts every
+ * event ever written, so the ring holds the last
+ * min(head, TRACE_RING_EVENTS) of them. in_use is guarded by
+ * registry_lock.
+ */
+typedef struct {
+    std::atomic<unsigned long long> head;
+    bool in_use;
+    trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+static std::atomic<bool> enabled(false);
+static std::atomic<int> next_tid(0);
+
+// A lane name. Names of exited threads are kept for their events until
+// the next trace_start().
+typedef struct {
+    int tid;
+    std::string name;
+    bool exited;
+} thread_name_t;
+
+// Rings are created on a thread's first event and never freed
+static std::mutex registry_lock;
+static std::vector<trace_ring_t *> rings;
+static std::vector<thread_name_t> thread_names;
+
+// The calling thread's ring, handed back for reuse when the thread exits.
+// The thread's name waits here until the thread gets a ring, so threads
+// that never record an event are never listed.
+struct thread_slot {
+    trace_ring_t *ring;
+    int tid;
+    std::string name;
+
+    thread_slot() : ring(NULL), tid(next_tid++) {}
+    ~thread_slot() {
+        if (!ring) { return; }
+        std::lock_guard<std::mutex> lock(registry_lock);
+        ring->in_use = false;
+        for (size_t i = 0; i < thread_names.size(); i++) {
+            if (thread_names[i].tid == tid) { thread_names[i].exited = true; }
+        }
+    }
+};
+
+static thread_local thread_slot slot;
+
+static trace_ring_t *acquire_ring() {
+    std::lock_guard<std::mutex> lock(registry_lock);
+    if (!slot.name.empty()) {
+        thread_name_t t = { slot.tid, slot.name, false };
+        thread_names.push_back(t);
+    }
+    for (size_t i = 0; i < rings.size(); i++) {
+        if (!rings[i]->in_use) {
+            rings[i]->in_use = true;
+            return rings[i];
+        }
+    }
+    trace_ring_t *ring = new trace_ring_t;
+    ring->head = 0;
+    ring->in_use = true;
+    rings.push_back(ring);
+    return ring;
+}
+
+long long trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool trace_enabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void trace_start() {
+    std::lock_guard<std::mutex> lock(registry_lock);
+    for (size_t i = 0; i < rings.size(); i++) {
+        rings[i]->head.store(0, std::memory_order_relaxed);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < thread_names.size(); i++) {
+        if (!thread_names[i].exited) { thread_names[kept++] = thread_names[i]; }
+    }
+    thread_names.resize(kept);
+    enabled.store(true, std::memory_order_release);
+}
+
+void trace_stop() {
+    enabled.store(false, std::memory_order_release);
+}
+
+void trace_thread_name(const char *name) {
+    slot.name = name;
+    if (!slot.ring) { return; }
+    std::lock_guard<std::mutex> lock(registry_lock);
+    for (size_t i = 0; i < thread_names.size(); i++) {
+        if (thread_names[i].tid == slot.tid) {
+            thread_names[i].name = name;
+            return;
+        }
+    }
+    thread_name_t t = { slot.tid, name, false };
+    thread_names.push_back(t);
+}
+
+void trace_complete(const char *cat, const char *name, long long start, long long dur) {
+    if (!trace_enabled()) { return; }
+    if (!slot.ring) { slot.ring = acquire_ring(); }
+    trace_ring_t *ring = slot.ring;
+    unsigned long long h = ring->head.load(std::memory_order_relaxed);
+    trace_event_t &e = ring->events[h % TRACE_RING_EVENTS];
+    e.cat = cat;
+    e.name = name;
+    e.ts = start;
+    e.dur = dur;
+    e.tid = slot.tid;
+    ring->head.store(h + 1, std::memory_order_release);
+}
+
+static void write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') { fputc('\\', f); }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+int trace_write(const char *file) {
+    trace_stop();
+
+    FILE *f = fopen(file, "w");
+    if (!f) {
+        fprintf(stderr, "error: cannot write trace %s\n", file);
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(registry_lock);
+
+    // Timestamps are written relative to the first event
+    long long t0 = -1;
+    for (size_t i = 0; i < rings.size(); i++) {
+        unsigned long long n = rings[i]->head.load(std::memory_order_acquire);
+        unsigned long long first = n > TRACE_RING_EVENTS ? n - TRACE_RING_EVENTS : 0;
+        for (unsigned long long k = first; k < n; k++) {
+            long long ts = rings[i]->events[k % TRACE_RING_EVENTS].ts;
+            if (t0 < 0 || ts < t0) { t0 = ts; }
+        }
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first_event = true;
+    for (size_t i = 0; i < thread_names.size(); i++) {
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                   "\"args\":{\"name\":", first_event ? "" : ",", thread_names[i].tid);
+        write_string(f, thread_names[i].name.c_str());
+        fprintf(f, "}}");
+        first_event = false;
+    }
+    for (size_t i = 0; i < rings.size(); i++) {
+        unsigned long long n = rings[i]->head.load(std::memory_order_acquire);
+        unsigned long long first = n > TRACE_RING_EVENTS ? n - TRACE_RING_EVENTS : 0;
+        for (unsigned long long k = first; k < n; k++) {
+            const trace_event_t &e = rings[i]->events[k % TRACE_RING_EVENTS];
+            fprintf(f, "%s\n{\"name\":", first_event ? "" : ",");
+            write_string(f, e.name);
+            fprintf(f, ",\"cat\":");
+            write_string(f, e.cat);
+            fprintf(f, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                    (e.ts - t0) / 1000.0, e.dur / 1000.0, e.tid);
+            first_event = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "error: cannot write trace %s\n", file);
+        return 0;
+    }
+    return 1;
+}
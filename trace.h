@@ -0,0 +1,69 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Timeline events in Chrome's trace-event JSON format, which
+ * chrome://tracing and Perfetto (ui.perfetto.dev) open directly. Every
+ * thread gets its own lane, so the OBJ parser's workers show up next to
+ * the thread that started them.
+ *
+ * Recording is off until trace_start(). While off, a TRACE_SCOPE costs
+ * one atomic load. While on, each thread appends to its own ring buffer
+ * of TRACE_RING_EVENTS events without taking a lock; a full ring drops
+ * its oldest events. Rings of threads that have exited are reused by new
+ * threads, and their events are kept until the next trace_start().
+ *
+ * Event names and categories are stored as pointers, so they must be
+ * string literals or otherwise outlive the trace.
+ */
+#define TRACE_RING_EVENTS 16384
+
+/// Clears every ring and starts recording. Call it while no traced work
+/// is running on other threads.
+void trace_start();
+
+/// Stops recording; what was recorded is kept for trace_write()
+void trace_stop();
+
+bool trace_enabled();
+
+/*
+ * Stops recording and writes what the rings hold to file as a JSON
+ * trace. If the file cannot be written, 0 is returned.
+ */
+int trace_write(const char *file);
+
+/// Names the calling thread's lane in the trace. Cheap enough to call on
+/// every thread start: the name is only listed once the thread records
+/// an event.
+void trace_thread_name(const char *name);
+
+/// Nanoseconds on the clock events are stamped with
+long long trace_now();
+
+/// Records an event that started at start (from trace_now()) and lasted
+/// dur nanoseconds on the calling thread
+void trace_complete(const char *cat, const char *name, long long start, long long dur);
+
+/*
+ * Records the time from construction to destruction as one event. Use
+ * TRACE_SCOPE rather than naming one.
+ */
+class trace_scope {
+public:
+    trace_scope(const char *cat, const char *name)
+        : cat(cat), name(name), start(trace_enabled() ? trace_now() : -1) {}
+    ~trace_scope() {
+        if (start >= 0) { trace_complete(cat, name, start, trace_now() - start); }
+    }
+private:
+    const char *cat;
+    const char *name;
+    long long start;
+};
+
+#define TRACE_CAT2(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT2(a, b)
+#define TRACE_SCOPE(cat, name) trace_scope TRACE_CAT(trace_scope_, __LINE__)(cat, name)
+
+#endif
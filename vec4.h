@@ -5,27 +5,55 @@
 #define VEC4_H
 
 #include <iostream>
+#include <cmath>
+#include <assert.h>
+
+// SSE2 is part of x86-64, so every 64-bit x86 build takes the SIMD paths.
+// Other targets fall back to plain scalar code with the same results.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VEC4_SSE 1
+#include <emmintrin.h>
+#endif
+#if defined(VEC4_SSE) && defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#if defined(VEC4_SSE) && (defined(__AVX__) || defined(__FMA__))
+#include <immintrin.h>
+#endif
 
 class vec4 {
  private:
   ///The set of floats representing the coordinates of the vector
-	float data[4];
+  ///Aligned so the whole vector is one SSE load or store. The loads and
+  ///stores are still the unaligned kind: 32-bit heaps (and operator new
+  ///before C++17) may hand out vectors on only an 8-byte boundary.
+	alignas(16) float data[4];
  public:
 	///----------------------------------------------------------------------
 	/// Constructors
 	///----------------------------------------------------------------------
 	vec4(); // initialize the vector to (0, 0, 0, 0)
 	vec4(float x, float y, float z, float w);
-  vec4(const vec4 &v2); // copy constructor, copies values of v2 into this
-	
+
+  // Copying is the implicit member-wise copy, so vec4 (and mat4) are
+  // trivially copyable and move through registers and memcpy.
+
+#ifdef VEC4_SSE
+  /// Wraps the four lanes of an SSE register
+  explicit vec4(__m128 v);
+
+  /// The vector as an SSE register
+  __m128 m128() const;
+#endif
+
 	///----------------------------------------------------------------------
 	/// Getters/Setters
-	///----------------------------------------------------------------------		
+	///----------------------------------------------------------------------
 
 	/// Returns the value at index
   /// Does NOT check the array bound because doing so is slow
 	float operator[](unsigned int index) const;
-	
+
 	/// Returns a reference to the value at index
   /// Does NOT check the array bound because doing so is slow
   float &operator[](unsigned int index);
@@ -33,24 +61,21 @@ class vec4 {
   /// Returns the value at index
   /// DOES check the array bound with assert even though is slow
 	float operator()(unsigned int index) const;
-	
+
 	/// Returns a reference to the value at index
   /// DOES check the array bound with assert even though is slow
   float& operator()(unsigned int index);
 
 	///----------------------------------------------------------------------
 	/// Operator Methods
-	///----------------------------------------------------------------------		
-
-	/// Assign v2 to this and return a reference to this
-  vec4 &operator=(const vec4 &v2);
+	///----------------------------------------------------------------------
 
 	/// Test for equality
 	bool operator==(const vec4 &v2) const;	   //Component-wise comparison
-	
+
 	/// Test for inequality
 	bool operator!=(const vec4 &v2) const;	   //Component-wise comparison
-	
+
 	/// Arithmetic:
 	/// e.g. += adds v2 to this and return this (like regular +=)
 	///      +  returns a new vector that is sum of this and v2
@@ -58,7 +83,7 @@ class vec4 {
   vec4& operator-=(const vec4 &v2);
   vec4& operator*=(float c);                 // multiplication by a scalar
   vec4& operator/=(float c);                 // division by a scalar
-	
+
   vec4  operator+(const vec4 &v2) const;
   vec4  operator-(const vec4 &v2) const;
   vec4  operator*(float c) const;             // multiplication by a scalar
@@ -66,7 +91,7 @@ class vec4 {
 
 	///----------------------------------------------------------------------
 	/// Other Methods
-	///----------------------------------------------------------------------		
+	///----------------------------------------------------------------------
 
   /// Returns the geometric length of the input vector
   float length() const;
@@ -80,7 +105,7 @@ class vec4 {
 
 ///----------------------------------------------------------------------
 /// Other Functions (not part of the vec4 class)
-///----------------------------------------------------------------------		
+///----------------------------------------------------------------------
 
 /// Dot Product
 float dot(const vec4 &v1, const vec4 &v2);
@@ -96,4 +121,171 @@ vec4 operator*(float c, const vec4 &v);
 /// Prints the vector to a stream in a nice format for integration with cout
 std::ostream &operator<<(std::ostream &o, const vec4 &v);
 
+///----------------------------------------------------------------------
+/// Inline definitions
+///
+/// Everything but printing is defined here so calls inline across
+/// translation units; the rasterizer runs these on every vertex.
+///----------------------------------------------------------------------
+
+inline vec4::vec4() {
+#ifdef VEC4_SSE
+    _mm_storeu_ps(data, _mm_setzero_ps());
+#else
+    data[0] = data[1] = data[2] = data[3] = 0;
+#endif
+}
+
+inline vec4::vec4(float x, float y, float z, float w) {
+    data[0] = x;
+    data[1] = y;
+    data[2] = z;
+    data[3] = w;
+}
+
+#ifdef VEC4_SSE
+inline vec4::vec4(__m128 v) {
+    _mm_storeu_ps(data, v);
+}
+
+inline __m128 vec4::m128() const {
+    return _mm_loadu_ps(data);
+}
+#endif
+
+inline float vec4::operator[](unsigned int index) const {
+    return data[index];
+}
+
+inline float &vec4::operator[](unsigned int index) {
+    return data[index];
+}
+
+inline float vec4::operator()(unsigned int index) const {
+    assert(index < 4);
+    return data[index];
+}
+
+inline float &vec4::operator()(unsigned int index) {
+    assert(index < 4);
+    return data[index];
+}
+
+inline bool vec4::operator==(const vec4 &v2) const {
+#ifdef VEC4_SSE
+    return _mm_movemask_ps(_mm_cmpeq_ps(m128(), v2.m128())) == 0xf;
+#else
+    return (data[0] == v2[0] && data[1] == v2[1] &&
+            data[2] == v2[2] && data[3] == v2[3]);
+#endif
+}
+
+inline bool vec4::operator!=(const vec4 &v2) const {
+    return !(*this == v2);
+}
+
+inline vec4 &vec4::operator+=(const vec4 &v2) {
+    return *this = *this + v2;
+}
+
+inline vec4 &vec4::operator-=(const vec4 &v2) {
+    return *this = *this - v2;
+}
+
+inline vec4 &vec4::operator*=(float c) {
+    return *this = *this * c;
+}
+
+inline vec4 &vec4::operator/=(float c) {
+    return *this = *this / c;
+}
+
+inline vec4 vec4::operator+(const vec4 &v2) const {
+#ifdef VEC4_SSE
+    return vec4(_mm_add_ps(m128(), v2.m128()));
+#else
+    return vec4(data[0] + v2[0], data[1] + v2[1],
+                data[2] + v2[2], data[3] + v2[3]);
+#endif
+}
+
+inline vec4 vec4::operator-(const vec4 &v2) const {
+#ifdef VEC4_SSE
+    return vec4(_mm_sub_ps(m128(), v2.m128()));
+#else
+    return vec4(data[0] - v2[0], data[1] - v2[1],
+                data[2] - v2[2], data[3] - v2[3]);
+#endif
+}
+
+inline vec4 vec4::operator*(float c) const {
+#ifdef VEC4_SSE
+    return vec4(_mm_mul_ps(m128(), _mm_set1_ps(c)));
+#else
+    return vec4(data[0] * c, data[1] * c, data[2] * c, data[3] * c);
+#endif
+}
+
+inline vec4 vec4::operator/(float c) const {
+#ifdef VEC4_SSE
+    return vec4(_mm_div_ps(m128(), _mm_set1_ps(c)));
+#else
+    return vec4(data[0] / c, data[1] / c, data[2] / c, data[3] / c);
+#endif
+}
+
+inline float vec4::length() const {
+    return std::sqrt(dot(*this, *this));
+}
+
+inline vec4 vec4::normalize() const {
+    float len = length();
+    if (len == 0) { return vec4(0, 0, 0, 0); }
+    return *this / len;
+}
+
+inline void vec4::norm() {
+    float len = length();
+    if (len == 0) { return; }
+    *this /= len;
+}
+
+inline float dot(const vec4 &v1, const vec4 &v2) {
+#if defined(VEC4_SSE) && defined(__SSE4_1__)
+    return _mm_cvtss_f32(_mm_dp_ps(v1.m128(), v2.m128(), 0xf1));
+#elif defined(VEC4_SSE)
+    // (x y z w) + (y x w z), then the high pair onto the low one
+    __m128 m = _mm_mul_ps(v1.m128(), v2.m128());
+    __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(s, s)));
+#else
+    return (v1[0] * v2[0] + v1[1] * v2[1] +
+            v1[2] * v2[2] + v1[3] * v2[3]);
+#endif
+}
+
+inline vec4 cross(const vec4 &v1, const vec4 &v2) {
+#ifdef VEC4_SSE
+    // v1 * v2.yzx - v1.yzx * v2 is the cross product in zxy order
+    __m128 a = v1.m128();
+    __m128 b = v2.m128();
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+    c = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+    // w is a.w * b.w - a.w * b.w, which is only 0 for finite inputs
+    const __m128 xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    return vec4(_mm_and_ps(c, xyz));
+#else
+    return vec4(v1[1] * v2[2] - v1[2] * v2[1],
+                v1[2] * v2[0] - v1[0] * v2[2],
+                v1[0] * v2[1] - v1[1] * v2[0],
+                0);
+#endif
+}
+
+inline vec4 operator*(float c, const vec4 &v) {
+    return v * c;
+}
+
 #endif /* VEC4_H */